@@ -0,0 +1,741 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _ACL_H
+#define _ACL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/ip6.h>
+
+/*
+ * L2-L4 packet classifier (access control list)
+ *
+ * Rules are compiled by the tickful task into tuple space tables: the rules
+ * are grouped by the set of their field masks (a tuple), and each tuple is an
+ * open-addressing hash table of the masked keys.  Port ranges are expanded
+ * into prefixes.  A packet is classified by one hash probe per tuple instead
+ * of being compared with every rule; the tuples are sorted by the highest
+ * priority of their rules, so that the search terminates once no remaining
+ * tuple has a higher priority rule than the one found.
+ *
+ * A compiled table is a single contiguous block read-only for exclusive
+ * tasks.  The tickful task compiles a new one on changes and swaps the
+ * pointer; the old one is freed after all exclusive tasks have passed a
+ * quiescent state.
+ */
+
+#define ACL_KEY_WORDS           7
+#define ACL_MAX_BULK            32
+#define ACL_PRIORITY_NONE       0x7fffffff
+
+/* Byte offsets of the fields in the key */
+#define ACL_OFF_DMAC            0
+#define ACL_OFF_VID             6
+#define ACL_OFF_SMAC            8
+#define ACL_OFF_PORT            14
+#define ACL_OFF_PROTO           15
+#define ACL_OFF_ETHERTYPE       16
+#define ACL_OFF_SPORT           18
+#define ACL_OFF_DPORT           20
+#define ACL_OFF_SRC             24
+#define ACL_OFF_DST             40
+
+/* Fields to be matched (flags of a rule) */
+#define ACL_F_DMAC              (1 << 0)
+#define ACL_F_SMAC              (1 << 1)
+#define ACL_F_VID               (1 << 2)
+#define ACL_F_PORT              (1 << 3)
+#define ACL_F_PROTO             (1 << 4)
+
+/*
+ * Actions (0 marks an empty entry of a compiled table)
+ */
+enum acl_action {
+    ACL_PERMIT = 1,
+    ACL_DENY,
+};
+
+/*
+ * Rule
+ */
+struct acl_rule {
+    /* Identifier, and the priority (the smaller, the higher) */
+    int id;
+    int priority;
+    enum acl_action action;
+    /* ACL_F_* */
+    int flags;
+    uint8_t dmac[ETHER_ADDR_LEN];
+    uint8_t smac[ETHER_ADDR_LEN];
+    uint16_t vid;
+    /* Ingress port */
+    int port;
+    /* Address family (0 for any, 4, or 6), and the prefixes (in network byte
+       order) */
+    int af;
+    uint8_t src[16];
+    int srclen;
+    uint8_t dst[16];
+    int dstlen;
+    /* IP protocol, and the port ranges of TCP/UDP (0-65535 for any) */
+    uint8_t proto;
+    uint16_t sport_lo;
+    uint16_t sport_hi;
+    uint16_t dport_lo;
+    uint16_t dport_hi;
+};
+
+/*
+ * Key of a packet (or a masked key)
+ */
+struct acl_key {
+    uint64_t w[ACL_KEY_WORDS];
+};
+
+/*
+ * Entry of a compiled table (one cache line)
+ */
+struct acl_entry {
+    uint64_t key[ACL_KEY_WORDS];
+    int32_t priority;
+    uint32_t action;
+} __attribute__ ((aligned(64)));
+
+/*
+ * Tuple
+ */
+struct acl_tuple {
+    uint64_t mask[ACL_KEY_WORDS];
+    /* Highest priority of the rules in this tuple */
+    int32_t best;
+    /* Index of the first entry and the size (power of two) of the table */
+    uint32_t base;
+    uint32_t size;
+    uint32_t nentries;
+};
+
+/*
+ * Compiled table (followed by the tuples and the entries)
+ */
+struct acl_table {
+    struct acl_tuple *tuples;
+    struct acl_entry *entries;
+    int ntuples;
+    int nentries;
+    enum acl_action def;
+};
+
+/*
+ * Rule set managed by the tickful task
+ */
+struct acl {
+    /* Compiled table read by the fast path; NULL if no rule to evaluate */
+    struct acl_table * volatile cur;
+
+    /* Rules sorted by the priority (and the order of addition among the same
+       priority); the index is the priority in the compiled table */
+    struct acl_rule *rules;
+    int nrules;
+    int maxrules;
+    enum acl_action def;
+    /* Non-zero if the rules have been changed since the last compilation */
+    int dirty;
+};
+
+/*
+ * Hash of a masked key
+ */
+static __inline__ uint32_t
+_acl_hash(const uint64_t *key)
+{
+    uint64_t h;
+    int i;
+
+    h = 0;
+    for ( i = 0; i < ACL_KEY_WORDS; i++ ) {
+        h = (h ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    return h ^ (h >> 32);
+}
+
+/*
+ * Build the key of a packet; VLAN ID is given by the VLAN classification
+ */
+static __inline__ void
+acl_key_build(struct acl_key *key, int port, uint16_t vid, const void *pkt,
+              int len)
+{
+    const struct ether_header *eth;
+    const struct ip *ip;
+    const struct ip6_hdr *ip6;
+    const void *l4;
+    uint8_t *k;
+    uint8_t proto;
+    int hl;
+
+    memset(key, 0, sizeof(struct acl_key));
+    k = (uint8_t *)key->w;
+    eth = pkt;
+    memcpy(k + ACL_OFF_DMAC, eth->ether_dhost, ETHER_ADDR_LEN);
+    memcpy(k + ACL_OFF_SMAC, eth->ether_shost, ETHER_ADDR_LEN);
+    vid = htons(vid);
+    memcpy(k + ACL_OFF_VID, &vid, 2);
+    k[ACL_OFF_PORT] = port;
+    memcpy(k + ACL_OFF_ETHERTYPE, &eth->ether_type, 2);
+
+    l4 = NULL;
+    proto = 0;
+    switch ( ntohs(eth->ether_type) ) {
+    case ETHERTYPE_IP:
+        ip = pkt + sizeof(struct ether_header);
+        if ( len < (int)(sizeof(struct ether_header) + sizeof(struct ip)) ) {
+            return;
+        }
+        proto = ip->ip_p;
+        memcpy(k + ACL_OFF_SRC, &ip->ip_src, 4);
+        memcpy(k + ACL_OFF_DST, &ip->ip_dst, 4);
+        hl = IP_VHL_HL(ip->ip_vhl) * 4;
+        if ( 0 == (ntohs(ip->ip_off) & IP_OFFMASK) ) {
+            /* Non-fragmented or the first fragment */
+            l4 = (const void *)ip + hl;
+        }
+        break;
+    case ETHERTYPE_IPV6:
+        ip6 = pkt + sizeof(struct ether_header);
+        if ( len < (int)(sizeof(struct ether_header)
+                         + sizeof(struct ip6_hdr)) ) {
+            return;
+        }
+        /* Extension headers are not parsed */
+        proto = ip6->ip6_nxt;
+        memcpy(k + ACL_OFF_SRC, ip6->ip6_src, 16);
+        memcpy(k + ACL_OFF_DST, ip6->ip6_dst, 16);
+        l4 = (const void *)ip6 + sizeof(struct ip6_hdr);
+        break;
+    default:
+        return;
+    }
+    k[ACL_OFF_PROTO] = proto;
+    if ( NULL != l4 && (IPPROTO_TCP == proto || IPPROTO_UDP == proto)
+         && l4 + 4 <= pkt + len ) {
+        /* Source and destination ports are at the same offsets */
+        memcpy(k + ACL_OFF_SPORT, l4, 4);
+    }
+}
+
+/*
+ * Classify a burst of packets; the tuples are searched one by one for all the
+ * packets, prefetching the buckets of the packets
+ */
+static __inline__ void
+acl_classify_bulk(struct acl_table *tbl, const struct acl_key *keys,
+                  enum acl_action *actions, int n)
+{
+    struct acl_tuple *tp;
+    struct acl_entry *e;
+    uint64_t masked[ACL_MAX_BULK][ACL_KEY_WORDS];
+    uint32_t idx[ACL_MAX_BULK];
+    int32_t best[ACL_MAX_BULK];
+    int32_t maxbest;
+    int i;
+    int j;
+    int k;
+
+    for ( i = 0; i < n; i++ ) {
+        best[i] = ACL_PRIORITY_NONE;
+        actions[i] = tbl->def;
+    }
+    maxbest = ACL_PRIORITY_NONE;
+    for ( j = 0; j < tbl->ntuples; j++ ) {
+        tp = &tbl->tuples[j];
+        if ( tp->best >= maxbest ) {
+            /* No higher priority rule for any packet */
+            break;
+        }
+        for ( i = 0; i < n; i++ ) {
+            for ( k = 0; k < ACL_KEY_WORDS; k++ ) {
+                masked[i][k] = keys[i].w[k] & tp->mask[k];
+            }
+            idx[i] = _acl_hash(masked[i]) & (tp->size - 1);
+            __builtin_prefetch(&tbl->entries[tp->base + idx[i]], 0, 0);
+        }
+        maxbest = 0;
+        for ( i = 0; i < n; i++ ) {
+            if ( tp->best < best[i] ) {
+                /* Linear probing */
+                for ( ;; ) {
+                    e = &tbl->entries[tp->base + idx[i]];
+                    if ( 0 == e->action ) {
+                        break;
+                    }
+                    if ( 0 == memcmp(e->key, masked[i], sizeof(e->key)) ) {
+                        if ( e->priority < best[i] ) {
+                            best[i] = e->priority;
+                            actions[i] = e->action;
+                        }
+                        break;
+                    }
+                    idx[i] = (idx[i] + 1) & (tp->size - 1);
+                }
+            }
+            if ( best[i] > maxbest ) {
+                maxbest = best[i];
+            }
+        }
+    }
+}
+
+/*
+ * Initialize a rule set
+ */
+static __inline__ struct acl *
+acl_init(void)
+{
+    struct acl *acl;
+
+    acl = malloc(sizeof(struct acl));
+    if ( NULL == acl ) {
+        return NULL;
+    }
+    acl->cur = NULL;
+    acl->rules = NULL;
+    acl->nrules = 0;
+    acl->maxrules = 0;
+    acl->def = ACL_PERMIT;
+    acl->dirty = 0;
+
+    return acl;
+}
+
+/*
+ * Delete a rule
+ */
+static __inline__ int
+acl_delete(struct acl *acl, int id)
+{
+    int i;
+
+    for ( i = 0; i < acl->nrules; i++ ) {
+        if ( acl->rules[i].id == id ) {
+            acl->nrules--;
+            memmove(&acl->rules[i], &acl->rules[i + 1],
+                    sizeof(struct acl_rule) * (acl->nrules - i));
+            acl->dirty = 1;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Add (or replace) a rule
+ */
+static __inline__ int
+acl_add(struct acl *acl, const struct acl_rule *rule)
+{
+    struct acl_rule *rules;
+    int i;
+
+    if ( (ACL_PERMIT != rule->action && ACL_DENY != rule->action)
+         || rule->priority < 0 || rule->priority >= ACL_PRIORITY_NONE
+         || rule->sport_lo > rule->sport_hi || rule->dport_lo > rule->dport_hi
+         || (0 != rule->af && 4 != rule->af && 6 != rule->af)
+         || rule->srclen < 0 || rule->srclen > (4 == rule->af ? 32 : 128)
+         || rule->dstlen < 0 || rule->dstlen > (4 == rule->af ? 32 : 128)
+         || (0 == rule->af && (rule->srclen > 0 || rule->dstlen > 0)) ) {
+        return -1;
+    }
+
+    /* Replace */
+    acl_delete(acl, rule->id);
+
+    if ( acl->nrules >= acl->maxrules ) {
+        /* Expand the array */
+        rules = malloc(sizeof(struct acl_rule)
+                       * (acl->maxrules > 0 ? acl->maxrules * 2 : 64));
+        if ( NULL == rules ) {
+            return -1;
+        }
+        if ( NULL != acl->rules ) {
+            memcpy(rules, acl->rules, sizeof(struct acl_rule) * acl->nrules);
+            free(acl->rules);
+        }
+        acl->rules = rules;
+        acl->maxrules = acl->maxrules > 0 ? acl->maxrules * 2 : 64;
+    }
+    /* Insert after the rules of the same or higher priority */
+    for ( i = acl->nrules; i > 0; i-- ) {
+        if ( acl->rules[i - 1].priority <= rule->priority ) {
+            break;
+        }
+    }
+    memmove(&acl->rules[i + 1], &acl->rules[i],
+            sizeof(struct acl_rule) * (acl->nrules - i));
+    memcpy(&acl->rules[i], rule, sizeof(struct acl_rule));
+    acl->nrules++;
+    acl->dirty = 1;
+
+    return 0;
+}
+
+/*
+ * Set the default action
+ */
+static __inline__ void
+acl_set_default(struct acl *acl, enum acl_action action)
+{
+    acl->def = action;
+    acl->dirty = 1;
+}
+
+/*
+ * Expand a port range into prefixes (at most 30); returns the number of
+ * prefixes
+ */
+static __inline__ int
+_acl_range(uint32_t lo, uint32_t hi, uint16_t *vals, int *lens)
+{
+    int n;
+    int b;
+
+    n = 0;
+    while ( lo <= hi ) {
+        /* Largest aligned block starting at lo within the range */
+        for ( b = 0; b < 16; b++ ) {
+            if ( (lo & (1U << b)) || lo + (2U << b) - 1 > hi ) {
+                break;
+            }
+        }
+        vals[n] = lo;
+        lens[n] = 16 - b;
+        n++;
+        lo += 1U << b;
+    }
+
+    return n;
+}
+
+/*
+ * Set the mask of a prefix to a field of a key
+ */
+static __inline__ void
+_acl_mask_prefix(uint8_t *m, int len)
+{
+    while ( len >= 8 ) {
+        *m++ = 0xff;
+        len -= 8;
+    }
+    if ( len > 0 ) {
+        *m = 0xff << (8 - len);
+    }
+}
+
+/*
+ * Build the masks and the masked keys of the expansion of a rule; returns the
+ * number of the entries
+ */
+static __inline__ int
+_acl_expand(const struct acl_rule *r, struct acl_key *keys,
+            struct acl_key *masks, int max)
+{
+    struct acl_key key;
+    struct acl_key mask;
+    uint16_t svals[32];
+    uint16_t dvals[32];
+    int slens[32];
+    int dlens[32];
+    int ns;
+    int nd;
+    int n;
+    int i;
+    int j;
+    int k;
+    uint8_t *kb;
+    uint8_t *mb;
+    uint16_t v;
+
+    memset(&key, 0, sizeof(key));
+    memset(&mask, 0, sizeof(mask));
+    kb = (uint8_t *)key.w;
+    mb = (uint8_t *)mask.w;
+    if ( r->flags & ACL_F_DMAC ) {
+        memcpy(kb + ACL_OFF_DMAC, r->dmac, ETHER_ADDR_LEN);
+        memset(mb + ACL_OFF_DMAC, 0xff, ETHER_ADDR_LEN);
+    }
+    if ( r->flags & ACL_F_SMAC ) {
+        memcpy(kb + ACL_OFF_SMAC, r->smac, ETHER_ADDR_LEN);
+        memset(mb + ACL_OFF_SMAC, 0xff, ETHER_ADDR_LEN);
+    }
+    if ( r->flags & ACL_F_VID ) {
+        v = htons(r->vid);
+        memcpy(kb + ACL_OFF_VID, &v, 2);
+        memset(mb + ACL_OFF_VID, 0xff, 2);
+    }
+    if ( r->flags & ACL_F_PORT ) {
+        kb[ACL_OFF_PORT] = r->port;
+        mb[ACL_OFF_PORT] = 0xff;
+    }
+    if ( r->flags & ACL_F_PROTO ) {
+        kb[ACL_OFF_PROTO] = r->proto;
+        mb[ACL_OFF_PROTO] = 0xff;
+    }
+    if ( 0 != r->af ) {
+        v = htons(4 == r->af ? ETHERTYPE_IP : ETHERTYPE_IPV6);
+        memcpy(kb + ACL_OFF_ETHERTYPE, &v, 2);
+        memset(mb + ACL_OFF_ETHERTYPE, 0xff, 2);
+        _acl_mask_prefix(mb + ACL_OFF_SRC, r->srclen);
+        _acl_mask_prefix(mb + ACL_OFF_DST, r->dstlen);
+        for ( i = 0; i < 16; i++ ) {
+            kb[ACL_OFF_SRC + i] = r->src[i] & mb[ACL_OFF_SRC + i];
+            kb[ACL_OFF_DST + i] = r->dst[i] & mb[ACL_OFF_DST + i];
+        }
+    }
+
+    /* Port ranges */
+    ns = _acl_range(r->sport_lo, r->sport_hi, svals, slens);
+    nd = _acl_range(r->dport_lo, r->dport_hi, dvals, dlens);
+    if ( ns * nd > max ) {
+        return -1;
+    }
+    n = 0;
+    for ( i = 0; i < ns; i++ ) {
+        for ( j = 0; j < nd; j++ ) {
+            keys[n] = key;
+            masks[n] = mask;
+            kb = (uint8_t *)keys[n].w;
+            mb = (uint8_t *)masks[n].w;
+            _acl_mask_prefix(mb + ACL_OFF_SPORT, slens[i]);
+            _acl_mask_prefix(mb + ACL_OFF_DPORT, dlens[j]);
+            v = htons(svals[i]);
+            memcpy(kb + ACL_OFF_SPORT, &v, 2);
+            v = htons(dvals[j]);
+            memcpy(kb + ACL_OFF_DPORT, &v, 2);
+            for ( k = 0; k < 4; k++ ) {
+                kb[ACL_OFF_SPORT + k] &= mb[ACL_OFF_SPORT + k];
+            }
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Compile the rules into a table; *tbl is set to NULL if no rule is to be
+ * evaluated
+ */
+static __inline__ int
+acl_compile(struct acl *acl, struct acl_table **tblp)
+{
+    struct acl_key *keys;
+    struct acl_key *masks;
+    struct acl_key *ekeys;
+    struct acl_key *emasks;
+    int32_t *eprio;
+    struct acl_tuple *tuples;
+    struct acl_tuple tp;
+    struct acl_table *tbl;
+    struct acl_entry *e;
+    size_t sz;
+    uint16_t vals[32];
+    int lens[32];
+    int max;
+    int ntuples;
+    int nentries;
+    int nexp;
+    int i;
+    int j;
+    int r;
+    uint32_t idx;
+    int ret;
+
+    acl->dirty = 0;
+    if ( 0 == acl->nrules && ACL_PERMIT == acl->def ) {
+        *tblp = NULL;
+        return 0;
+    }
+
+    /* Count the entries of the expansion */
+    nexp = 0;
+    for ( r = 0; r < acl->nrules; r++ ) {
+        nexp += _acl_range(acl->rules[r].sport_lo, acl->rules[r].sport_hi,
+                           vals, lens)
+            * _acl_range(acl->rules[r].dport_lo, acl->rules[r].dport_hi,
+                         vals, lens);
+    }
+
+    /* Expand all the rules */
+    max = 30 * 30;
+    ret = -1;
+    keys = malloc(sizeof(struct acl_key) * max);
+    masks = malloc(sizeof(struct acl_key) * max);
+    ekeys = malloc(sizeof(struct acl_key) * (nexp + 1));
+    emasks = malloc(sizeof(struct acl_key) * (nexp + 1));
+    eprio = malloc(sizeof(int32_t) * (nexp + 1) * 2);
+    tuples = malloc(sizeof(struct acl_tuple) * (nexp + 1));
+    if ( NULL == keys || NULL == masks || NULL == ekeys || NULL == emasks
+         || NULL == eprio || NULL == tuples ) {
+        goto out;
+    }
+    nentries = 0;
+    for ( r = 0; r < acl->nrules; r++ ) {
+        nexp = _acl_expand(&acl->rules[r], keys, masks, max);
+        if ( nexp < 0 ) {
+            goto out;
+        }
+        for ( i = 0; i < nexp; i++ ) {
+            ekeys[nentries] = keys[i];
+            emasks[nentries] = masks[i];
+            eprio[nentries * 2] = r;
+            eprio[nentries * 2 + 1] = acl->rules[r].action;
+            nentries++;
+        }
+    }
+
+    /* Group the entries by the masks */
+    ntuples = 0;
+    for ( i = 0; i < nentries; i++ ) {
+        for ( j = 0; j < ntuples; j++ ) {
+            if ( 0 == memcmp(tuples[j].mask, emasks[i].w,
+                             sizeof(tuples[j].mask)) ) {
+                break;
+            }
+        }
+        if ( j == ntuples ) {
+            memcpy(tuples[j].mask, emasks[i].w, sizeof(tuples[j].mask));
+            tuples[j].best = ACL_PRIORITY_NONE;
+            tuples[j].nentries = 0;
+            ntuples++;
+        }
+        tuples[j].nentries++;
+        if ( eprio[i * 2] < tuples[j].best ) {
+            tuples[j].best = eprio[i * 2];
+        }
+    }
+
+    /* Sort the tuples by the highest priority (insertion sort) */
+    for ( i = 1; i < ntuples; i++ ) {
+        tp = tuples[i];
+        for ( j = i; j > 0 && tuples[j - 1].best > tp.best; j-- ) {
+            tuples[j] = tuples[j - 1];
+        }
+        tuples[j] = tp;
+    }
+
+    /* Size the hash tables to the load factor of at most 1/2 */
+    sz = 0;
+    for ( j = 0; j < ntuples; j++ ) {
+        tuples[j].base = sz;
+        tuples[j].size = 2;
+        while ( tuples[j].size < tuples[j].nentries * 2 ) {
+            tuples[j].size <<= 1;
+        }
+        sz += tuples[j].size;
+    }
+
+    /* Allocate the table as a single block */
+    tbl = malloc(sizeof(struct acl_entry) * (sz + 1)
+                 + sizeof(struct acl_tuple) * ntuples
+                 + sizeof(struct acl_table) + 64);
+    if ( NULL == tbl ) {
+        goto out;
+    }
+    tbl->tuples = (void *)tbl + sizeof(struct acl_table);
+    tbl->entries = (void *)(((uint64_t)(tbl->tuples + ntuples) + 63)
+                            & ~63ULL);
+    tbl->ntuples = ntuples;
+    tbl->nentries = sz;
+    tbl->def = acl->def;
+    memcpy(tbl->tuples, tuples, sizeof(struct acl_tuple) * ntuples);
+    memset(tbl->entries, 0, sizeof(struct acl_entry) * sz);
+
+    /* Insert the entries; the highest priority one wins among duplicates */
+    for ( i = 0; i < nentries; i++ ) {
+        for ( j = 0; j < ntuples; j++ ) {
+            if ( 0 == memcmp(tbl->tuples[j].mask, emasks[i].w,
+                             sizeof(tbl->tuples[j].mask)) ) {
+                break;
+            }
+        }
+        idx = _acl_hash(ekeys[i].w) & (tbl->tuples[j].size - 1);
+        for ( ;; ) {
+            e = &tbl->entries[tbl->tuples[j].base + idx];
+            if ( 0 == e->action ) {
+                memcpy(e->key, ekeys[i].w, sizeof(e->key));
+                e->priority = eprio[i * 2];
+                e->action = eprio[i * 2 + 1];
+                break;
+            }
+            if ( 0 == memcmp(e->key, ekeys[i].w, sizeof(e->key)) ) {
+                if ( eprio[i * 2] < e->priority ) {
+                    e->priority = eprio[i * 2];
+                    e->action = eprio[i * 2 + 1];
+                }
+                break;
+            }
+            idx = (idx + 1) & (tbl->tuples[j].size - 1);
+        }
+    }
+    *tblp = tbl;
+    ret = 0;
+
+out:
+    if ( NULL != keys ) {
+        free(keys);
+    }
+    if ( NULL != masks ) {
+        free(masks);
+    }
+    if ( NULL != ekeys ) {
+        free(ekeys);
+    }
+    if ( NULL != emasks ) {
+        free(emasks);
+    }
+    if ( NULL != eprio ) {
+        free(eprio);
+    }
+    if ( NULL != tuples ) {
+        free(tuples);
+    }
+
+    return ret;
+}
+
+#endif /* _ACL_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
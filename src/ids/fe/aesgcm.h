@@ -0,0 +1,548 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _AESGCM_H
+#define _AESGCM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * AES-GCM (NIST SP 800-38D) with the AES-NI and PCLMULQDQ instructions
+ *
+ * The counter blocks are encrypted AESGCM_NPAR at a time so that the
+ * pipelined AES units are kept busy, and GHASH aggregates AESGCM_NPAR blocks
+ * with the precomputed powers of the hash key before a single reduction
+ * (Gueron and Kounavis, "Intel Carry-Less Multiplication Instruction and its
+ * Usage for Computing the GCM Mode").  A burst of operations, each with its
+ * own key, is processed at once; the tag masks of AESGCM_NPAR operations are
+ * encrypted together.
+ *
+ * GHASH is computed on byte-reflected blocks; the 128-bit values are kept in
+ * XMM registers as GCC vectors, and the instructions are issued by inline
+ * assembly (the intrinsics headers are not available in the kernel image).
+ * 96-bit IVs only.
+ */
+
+#define AESGCM_MAX_ROUNDS       14
+#define AESGCM_BLOCK_LEN        16
+#define AESGCM_IV_LEN           12
+#define AESGCM_TAG_LEN          16
+/* # of blocks in flight */
+#define AESGCM_NPAR             4
+
+typedef long long aesgcm_v128 __attribute__ ((vector_size(16)));
+
+/*
+ * Expanded key
+ */
+struct aesgcm_key {
+    aesgcm_v128 rk[AESGCM_MAX_ROUNDS + 1];
+    int nr;
+    /* Powers of the hash key H^1 to H^AESGCM_NPAR (byte-reflected) */
+    aesgcm_v128 h[AESGCM_NPAR];
+};
+
+/*
+ * Operation of a burst; the buffer is encrypted or decrypted in place
+ */
+struct aesgcm_op {
+    const struct aesgcm_key *key;
+    const uint8_t *iv;
+    const uint8_t *aad;
+    int aadlen;
+    uint8_t *buf;
+    int len;
+    /* Tag written by sealing, or verified by opening */
+    uint8_t *tag;
+    /* Result of opening (0 if authenticated, or -1) */
+    int ret;
+};
+
+static __inline__ aesgcm_v128
+_aesgcm_enc(aesgcm_v128 x, aesgcm_v128 k)
+{
+    __asm__ ("aesenc %1,%0" : "+x" (x) : "x" (k));
+    return x;
+}
+
+static __inline__ aesgcm_v128
+_aesgcm_enclast(aesgcm_v128 x, aesgcm_v128 k)
+{
+    __asm__ ("aesenclast %1,%0" : "+x" (x) : "x" (k));
+    return x;
+}
+
+static __inline__ aesgcm_v128
+_aesgcm_clmul00(aesgcm_v128 a, aesgcm_v128 b)
+{
+    __asm__ ("pclmulqdq $0x00,%1,%0" : "+x" (a) : "x" (b));
+    return a;
+}
+
+static __inline__ aesgcm_v128
+_aesgcm_clmul01(aesgcm_v128 a, aesgcm_v128 b)
+{
+    __asm__ ("pclmulqdq $0x01,%1,%0" : "+x" (a) : "x" (b));
+    return a;
+}
+
+static __inline__ aesgcm_v128
+_aesgcm_clmul10(aesgcm_v128 a, aesgcm_v128 b)
+{
+    __asm__ ("pclmulqdq $0x10,%1,%0" : "+x" (a) : "x" (b));
+    return a;
+}
+
+static __inline__ aesgcm_v128
+_aesgcm_clmul11(aesgcm_v128 a, aesgcm_v128 b)
+{
+    __asm__ ("pclmulqdq $0x11,%1,%0" : "+x" (a) : "x" (b));
+    return a;
+}
+
+/*
+ * Reverse the bytes of a block
+ */
+static __inline__ aesgcm_v128
+_aesgcm_bswap(aesgcm_v128 x)
+{
+    const aesgcm_v128 mask = { 0x08090a0b0c0d0e0fLL, 0x0001020304050607LL };
+
+    __asm__ ("pshufb %1,%0" : "+x" (x) : "x" (mask));
+    return x;
+}
+
+static __inline__ aesgcm_v128
+_aesgcm_load(const uint8_t *p)
+{
+    aesgcm_v128 x;
+
+    memcpy(&x, p, AESGCM_BLOCK_LEN);
+    return x;
+}
+
+static __inline__ void
+_aesgcm_store(uint8_t *p, aesgcm_v128 x)
+{
+    memcpy(p, &x, AESGCM_BLOCK_LEN);
+}
+
+/*
+ * Load a partial block padded with zeros
+ */
+static __inline__ aesgcm_v128
+_aesgcm_load_partial(const uint8_t *p, int len)
+{
+    uint8_t b[AESGCM_BLOCK_LEN];
+
+    memset(b, 0, AESGCM_BLOCK_LEN);
+    memcpy(b, p, len);
+    return _aesgcm_load(b);
+}
+
+/*
+ * SubWord() of the key expansion by AESKEYGENASSIST (the S-box applied to
+ * the second double word)
+ */
+static __inline__ uint32_t
+_aesgcm_subword(uint32_t w)
+{
+    aesgcm_v128 x = { (long long)w << 32, 0 };
+
+    __asm__ ("aeskeygenassist $0,%1,%0" : "=x" (x) : "x" (x));
+    return (uint32_t)x[0];
+}
+
+/*
+ * Encrypt a block
+ */
+static __inline__ aesgcm_v128
+_aesgcm_encrypt(const struct aesgcm_key *k, aesgcm_v128 x)
+{
+    int i;
+
+    x ^= k->rk[0];
+    for ( i = 1; i < k->nr; i++ ) {
+        x = _aesgcm_enc(x, k->rk[i]);
+    }
+    return _aesgcm_enclast(x, k->rk[k->nr]);
+}
+
+/*
+ * Encrypt AESGCM_NPAR blocks at once
+ */
+static __inline__ void
+_aesgcm_encrypt_par(const struct aesgcm_key *k, aesgcm_v128 *x)
+{
+    aesgcm_v128 rk;
+    int i;
+    int j;
+
+    for ( j = 0; j < AESGCM_NPAR; j++ ) {
+        x[j] ^= k->rk[0];
+    }
+    for ( i = 1; i < k->nr; i++ ) {
+        rk = k->rk[i];
+        for ( j = 0; j < AESGCM_NPAR; j++ ) {
+            x[j] = _aesgcm_enc(x[j], rk);
+        }
+    }
+    rk = k->rk[k->nr];
+    for ( j = 0; j < AESGCM_NPAR; j++ ) {
+        x[j] = _aesgcm_enclast(x[j], rk);
+    }
+}
+
+/*
+ * Accumulate the unreduced product of two byte-reflected blocks
+ */
+static __inline__ void
+_aesgcm_mul_acc(aesgcm_v128 a, aesgcm_v128 b, aesgcm_v128 *lo,
+                aesgcm_v128 *mid, aesgcm_v128 *hi)
+{
+    *lo ^= _aesgcm_clmul00(a, b);
+    *mid ^= _aesgcm_clmul01(a, b) ^ _aesgcm_clmul10(a, b);
+    *hi ^= _aesgcm_clmul11(a, b);
+}
+
+/*
+ * Reduce a 256-bit product of byte-reflected blocks modulo the GCM
+ * polynomial x^128 + x^7 + x^2 + x + 1
+ */
+static __inline__ aesgcm_v128
+_aesgcm_reduce(aesgcm_v128 lo, aesgcm_v128 mid, aesgcm_v128 hi)
+{
+    uint64_t x0;
+    uint64_t x1;
+    uint64_t x2;
+    uint64_t x3;
+    uint64_t d;
+    aesgcm_v128 r;
+
+    x0 = lo[0];
+    x1 = lo[1] ^ mid[0];
+    x2 = hi[0] ^ mid[1];
+    x3 = hi[1];
+
+    /* Shift left by one for the bit reflection */
+    x3 = (x3 << 1) | (x2 >> 63);
+    x2 = (x2 << 1) | (x1 >> 63);
+    x1 = (x1 << 1) | (x0 >> 63);
+    x0 <<= 1;
+
+    d = x1 ^ (x0 << 63) ^ (x0 << 62) ^ (x0 << 57);
+    r[1] = x3 ^ d ^ (d >> 1) ^ (d >> 2) ^ (d >> 7);
+    r[0] = x2 ^ x0 ^ ((x0 >> 1) | (d << 63)) ^ ((x0 >> 2) | (d << 62))
+        ^ ((x0 >> 7) | (d << 57));
+
+    return r;
+}
+
+static __inline__ aesgcm_v128
+_aesgcm_mul(aesgcm_v128 a, aesgcm_v128 b)
+{
+    aesgcm_v128 lo = { 0, 0 };
+    aesgcm_v128 mid = { 0, 0 };
+    aesgcm_v128 hi = { 0, 0 };
+
+    _aesgcm_mul_acc(a, b, &lo, &mid, &hi);
+
+    return _aesgcm_reduce(lo, mid, hi);
+}
+
+/*
+ * Update the hash with data (zero-padded to a multiple of the block)
+ */
+static __inline__ aesgcm_v128
+_aesgcm_ghash(const struct aesgcm_key *k, aesgcm_v128 x, const uint8_t *p,
+              int len)
+{
+    aesgcm_v128 lo;
+    aesgcm_v128 mid;
+    aesgcm_v128 hi;
+    int j;
+
+    for ( ; len >= AESGCM_BLOCK_LEN * AESGCM_NPAR;
+          len -= AESGCM_BLOCK_LEN * AESGCM_NPAR ) {
+        lo = mid = hi = (aesgcm_v128){ 0, 0 };
+        x ^= _aesgcm_bswap(_aesgcm_load(p));
+        for ( j = 0; j < AESGCM_NPAR; j++ ) {
+            if ( j > 0 ) {
+                x = _aesgcm_bswap(_aesgcm_load(p));
+            }
+            _aesgcm_mul_acc(x, k->h[AESGCM_NPAR - 1 - j], &lo, &mid, &hi);
+            p += AESGCM_BLOCK_LEN;
+        }
+        x = _aesgcm_reduce(lo, mid, hi);
+    }
+    for ( ; len >= AESGCM_BLOCK_LEN; len -= AESGCM_BLOCK_LEN ) {
+        x = _aesgcm_mul(x ^ _aesgcm_bswap(_aesgcm_load(p)), k->h[0]);
+        p += AESGCM_BLOCK_LEN;
+    }
+    if ( len > 0 ) {
+        x = _aesgcm_mul(x ^ _aesgcm_bswap(_aesgcm_load_partial(p, len)),
+                        k->h[0]);
+    }
+
+    return x;
+}
+
+/*
+ * Expand a 128-, 192- or 256-bit key; returns 0 on success, or -1
+ */
+static __inline__ int
+aesgcm_init(struct aesgcm_key *k, const uint8_t *key, int keylen)
+{
+    uint32_t w[4 * (AESGCM_MAX_ROUNDS + 1)];
+    uint32_t t;
+    uint32_t rcon;
+    aesgcm_v128 h;
+    int nk;
+    int i;
+
+    if ( 16 != keylen && 24 != keylen && 32 != keylen ) {
+        return -1;
+    }
+    nk = keylen / 4;
+    k->nr = nk + 6;
+
+    /* FIPS-197 Section 5.2 (the words are little endian) */
+    memcpy(w, key, keylen);
+    rcon = 1;
+    for ( i = nk; i < 4 * (k->nr + 1); i++ ) {
+        t = w[i - 1];
+        if ( 0 == i % nk ) {
+            t = _aesgcm_subword((t >> 8) | (t << 24)) ^ rcon;
+            rcon = (rcon << 1) ^ ((rcon >> 7) * 0x11b);
+        } else if ( nk > 6 && 4 == i % nk ) {
+            t = _aesgcm_subword(t);
+        }
+        w[i] = w[i - nk] ^ t;
+    }
+    for ( i = 0; i <= k->nr; i++ ) {
+        memcpy(&k->rk[i], &w[4 * i], AESGCM_BLOCK_LEN);
+    }
+
+    /* Hash key */
+    h = _aesgcm_bswap(_aesgcm_encrypt(k, (aesgcm_v128){ 0, 0 }));
+    k->h[0] = h;
+    for ( i = 1; i < AESGCM_NPAR; i++ ) {
+        k->h[i] = _aesgcm_mul(k->h[i - 1], h);
+    }
+
+    return 0;
+}
+
+/*
+ * Counter block of an IV
+ */
+static __inline__ aesgcm_v128
+_aesgcm_ctr(const uint8_t *iv, uint32_t ctr)
+{
+    uint8_t b[AESGCM_BLOCK_LEN];
+
+    memcpy(b, iv, AESGCM_IV_LEN);
+    b[12] = ctr >> 24;
+    b[13] = ctr >> 16;
+    b[14] = ctr >> 8;
+    b[15] = ctr;
+
+    return _aesgcm_load(b);
+}
+
+/*
+ * Encrypt or decrypt a buffer in CTR mode from the counter 2, hashing the
+ * ciphertext (after encryption, or before decryption)
+ */
+static __inline__ aesgcm_v128
+_aesgcm_crypt(const struct aesgcm_key *k, const uint8_t *iv, uint8_t *p,
+              int len, aesgcm_v128 x, int enc)
+{
+    aesgcm_v128 cb[AESGCM_NPAR];
+    aesgcm_v128 lo;
+    aesgcm_v128 mid;
+    aesgcm_v128 hi;
+    aesgcm_v128 c;
+    aesgcm_v128 ks;
+    uint8_t b[AESGCM_BLOCK_LEN];
+    uint32_t ctr;
+    int j;
+
+    ctr = 2;
+    for ( ; len >= AESGCM_BLOCK_LEN * AESGCM_NPAR;
+          len -= AESGCM_BLOCK_LEN * AESGCM_NPAR ) {
+        for ( j = 0; j < AESGCM_NPAR; j++ ) {
+            cb[j] = _aesgcm_ctr(iv, ctr++);
+        }
+        _aesgcm_encrypt_par(k, cb);
+        lo = mid = hi = (aesgcm_v128){ 0, 0 };
+        for ( j = 0; j < AESGCM_NPAR; j++ ) {
+            c = _aesgcm_load(p);
+            if ( enc ) {
+                c ^= cb[j];
+                _aesgcm_store(p, c);
+            } else {
+                _aesgcm_store(p, c ^ cb[j]);
+            }
+            c = _aesgcm_bswap(c);
+            if ( 0 == j ) {
+                c ^= x;
+            }
+            _aesgcm_mul_acc(c, k->h[AESGCM_NPAR - 1 - j], &lo, &mid, &hi);
+            p += AESGCM_BLOCK_LEN;
+        }
+        x = _aesgcm_reduce(lo, mid, hi);
+    }
+    while ( len > 0 ) {
+        ks = _aesgcm_encrypt(k, _aesgcm_ctr(iv, ctr++));
+        if ( len >= AESGCM_BLOCK_LEN ) {
+            c = _aesgcm_load(p);
+            if ( enc ) {
+                c ^= ks;
+                _aesgcm_store(p, c);
+            } else {
+                _aesgcm_store(p, c ^ ks);
+            }
+            p += AESGCM_BLOCK_LEN;
+            len -= AESGCM_BLOCK_LEN;
+        } else {
+            /* Partial block (the hash is padded with zeros) */
+            memset(b, 0, AESGCM_BLOCK_LEN);
+            memcpy(b, p, len);
+            c = _aesgcm_load(b);
+            _aesgcm_store(b, c ^ ks);
+            memcpy(p, b, len);
+            if ( enc ) {
+                memset(b + len, 0, AESGCM_BLOCK_LEN - len);
+                c = _aesgcm_load(b);
+            }
+            len = 0;
+        }
+        x = _aesgcm_mul(x ^ _aesgcm_bswap(c), k->h[0]);
+    }
+
+    return x;
+}
+
+/*
+ * Process a burst of operations (sealing if enc is non-zero, otherwise
+ * opening)
+ */
+static __inline__ void
+_aesgcm_burst(struct aesgcm_op *ops, int n, int enc)
+{
+    aesgcm_v128 masks[AESGCM_NPAR];
+    aesgcm_v128 x;
+    aesgcm_v128 rk;
+    struct aesgcm_op *op;
+    const struct aesgcm_key *k;
+    uint8_t tag[AESGCM_TAG_LEN];
+    int nr;
+    int m;
+    int i;
+    int j;
+    int r;
+
+    for ( i = 0; i < n; i += AESGCM_NPAR ) {
+        /* Tag masks E(K, J0) of the operations in flight; the round keys
+           are those of each operation */
+        m = n - i < AESGCM_NPAR ? n - i : AESGCM_NPAR;
+        nr = AESGCM_MAX_ROUNDS;
+        for ( j = 0; j < m; j++ ) {
+            k = ops[i + j].key;
+            masks[j] = _aesgcm_ctr(ops[i + j].iv, 1) ^ k->rk[0];
+            if ( k->nr < nr ) {
+                nr = k->nr;
+            }
+        }
+        for ( r = 1; r < nr; r++ ) {
+            for ( j = 0; j < m; j++ ) {
+                rk = ops[i + j].key->rk[r];
+                masks[j] = _aesgcm_enc(masks[j], rk);
+            }
+        }
+        for ( j = 0; j < m; j++ ) {
+            k = ops[i + j].key;
+            for ( r = nr; r < k->nr; r++ ) {
+                masks[j] = _aesgcm_enc(masks[j], k->rk[r]);
+            }
+            masks[j] = _aesgcm_enclast(masks[j], k->rk[k->nr]);
+        }
+
+        for ( j = 0; j < m; j++ ) {
+            op = &ops[i + j];
+            k = op->key;
+            x = _aesgcm_ghash(k, (aesgcm_v128){ 0, 0 }, op->aad, op->aadlen);
+            x = _aesgcm_crypt(k, op->iv, op->buf, op->len, x, enc);
+            /* Lengths in bits */
+            x ^= (aesgcm_v128){ (long long)op->len << 3,
+                                (long long)op->aadlen << 3 };
+            x = _aesgcm_mul(x, k->h[0]);
+            x = _aesgcm_bswap(x) ^ masks[j];
+            if ( enc ) {
+                _aesgcm_store(op->tag, x);
+                op->ret = 0;
+            } else {
+                /* Constant time */
+                _aesgcm_store(tag, x);
+                r = 0;
+                for ( nr = 0; nr < AESGCM_TAG_LEN; nr++ ) {
+                    r |= tag[nr] ^ op->tag[nr];
+                }
+                op->ret = 0 == r ? 0 : -1;
+            }
+        }
+    }
+}
+
+/*
+ * Encrypt a burst of operations, and write their tags
+ */
+static __inline__ void
+aesgcm_seal_burst(struct aesgcm_op *ops, int n)
+{
+    _aesgcm_burst(ops, n, 1);
+}
+
+/*
+ * Decrypt a burst of operations, and verify their tags (the result in ret
+ * of each); the plaintext of an operation failing the verification is to be
+ * discarded
+ */
+static __inline__ void
+aesgcm_open_burst(struct aesgcm_op *ops, int n)
+{
+    _aesgcm_burst(ops, n, 0);
+}
+
+#endif /* _AESGCM_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
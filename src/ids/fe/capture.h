@@ -0,0 +1,598 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Zero-copy packet capture
+ *
+ * Each exclusive task pushes a descriptor referring to the packet buffer of a
+ * captured packet to its own single-producer, single-consumer ring; the
+ * buffer is not copied but held by a reference until the consumer (a separate
+ * process) advances the head of the ring.  The directory lists the physical
+ * address of each ring and the physical address and the length of each
+ * packet buffer pool, as returned by the allocator; the consumer maps the
+ * directory with driver_mmap() from its physical address, and then maps each
+ * ring and each region by its own address and length, without assuming that
+ * the regions are adjacent to one another.  A packet is not captured when the
+ * ring is full, so that capture never backpressures forwarding.
+ *
+ * Since the buffer is shared rather than copied, the consumer sees the
+ * packet as it is when it reads the buffer, not as it was when captured: the
+ * rewrites the fast path makes in place afterwards (e.g., NAT of the
+ * addresses and ports, or the decrement of the TTL) may already be visible
+ * in a packet captured at Rx.
+ *
+ * Packets are selected by a filter in the classic BPF instruction set (e.g.,
+ * the output of tcpdump -dd); the filter returns the number of bytes to be
+ * captured, or zero to reject the packet.  The 802.1Q tag is stripped at Rx,
+ * so the filter sees untagged frames and the tag is in the descriptor.
+ */
+
+#define CAP_MAGIC               0x50434546U     /* "FECP" */
+#define CAP_VERSION             1
+#define CAP_RING_SIZE           1024
+#define CAP_MAX_RINGS           64
+#define CAP_MAX_REGIONS         16
+#define CAP_DIR_RX              0
+#define CAP_DIR_TX              1
+
+/* Filter */
+#define CAP_FILTER_MAX          512
+#define CAP_FILTER_MEMWORDS     16
+
+/* Instruction classes */
+#define CAP_CLASS(c)            ((c) & 0x07)
+#define CAP_LD                  0x00
+#define CAP_LDX                 0x01
+#define CAP_ST                  0x02
+#define CAP_STX                 0x03
+#define CAP_ALU                 0x04
+#define CAP_JMP                 0x05
+#define CAP_RET                 0x06
+#define CAP_MISC                0x07
+/* Load sizes and modes */
+#define CAP_SIZE(c)             ((c) & 0x18)
+#define CAP_W                   0x00
+#define CAP_H                   0x08
+#define CAP_B                   0x10
+#define CAP_MODE(c)             ((c) & 0xe0)
+#define CAP_IMM                 0x00
+#define CAP_ABS                 0x20
+#define CAP_IND                 0x40
+#define CAP_MEM                 0x60
+#define CAP_LEN                 0x80
+#define CAP_MSH                 0xa0
+/* ALU and jump operations, and the source operand */
+#define CAP_OP(c)               ((c) & 0xf0)
+#define CAP_ADD                 0x00
+#define CAP_SUB                 0x10
+#define CAP_MUL                 0x20
+#define CAP_DIV                 0x30
+#define CAP_OR                  0x40
+#define CAP_AND                 0x50
+#define CAP_LSH                 0x60
+#define CAP_RSH                 0x70
+#define CAP_NEG                 0x80
+#define CAP_MOD                 0x90
+#define CAP_XOR                 0xa0
+#define CAP_JA                  0x00
+#define CAP_JEQ                 0x10
+#define CAP_JGT                 0x20
+#define CAP_JGE                 0x30
+#define CAP_JSET                0x40
+#define CAP_SRC(c)              ((c) & 0x08)
+#define CAP_K                   0x00
+#define CAP_X                   0x08
+/* Return value */
+#define CAP_RVAL(c)             ((c) & 0x18)
+#define CAP_A                   0x10
+/* Register transfer */
+#define CAP_MISCOP(c)           ((c) & 0xf8)
+#define CAP_TAX                 0x00
+#define CAP_TXA                 0x80
+
+/*
+ * Filter instruction (the layout of struct bpf_insn)
+ */
+struct cap_insn {
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+};
+
+/*
+ * Filter program
+ */
+struct cap_filter {
+    int n;
+    struct cap_insn insns[];
+};
+
+/*
+ * Descriptor of a captured packet
+ */
+struct cap_desc {
+    /* Physical address of the packet */
+    uint64_t paddr;
+    /* TSC at the capture */
+    uint64_t tsc;
+    /* Length of the packet, and the number of bytes to be captured */
+    uint16_t len;
+    uint16_t caplen;
+    /* TCI of the 802.1Q tag (0 for untagged) */
+    uint16_t vlan;
+    uint8_t port;
+    uint8_t dir;
+    uint64_t reserved;
+};
+
+/*
+ * Capture ring (shared with the consumer)
+ */
+struct cap_ring {
+    uint32_t magic;
+    /* The number of descriptors (a power of two) */
+    uint32_t len;
+    /* Written by the producer */
+    volatile uint64_t tail __attribute__ ((aligned(64)));
+    /* Captured packets, and the packets not captured as the ring was full */
+    volatile uint64_t packets;
+    volatile uint64_t drops;
+    /* Written by the consumer */
+    volatile uint64_t head __attribute__ ((aligned(64)));
+    struct cap_desc descs[] __attribute__ ((aligned(64)));
+};
+
+/*
+ * Directory of the capture rings (shared with the consumer)
+ */
+struct cap_dir {
+    uint32_t magic;
+    uint32_t version;
+    /* The number of rings, and the size of a ring in bytes */
+    uint32_t nrings;
+    uint32_t ringsize;
+    /* Physical addresses of the rings */
+    uint64_t rings[CAP_MAX_RINGS];
+    /* Regions of the packet buffers (one per buffer pool allocation) */
+    uint32_t nregions;
+    struct {
+        uint64_t paddr;
+        uint64_t len;
+    } regions[CAP_MAX_REGIONS];
+};
+
+/*
+ * pcap file header and record header for the consumer
+ */
+struct cap_pcap_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+struct cap_pcap_rec {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+/*
+ * Validate a filter program; the jumps only go forward and the program ends
+ * with a return, so that it always terminates.  Returns 0 if valid, or -1.
+ */
+static __inline__ int
+cap_filter_validate(const struct cap_insn *insns, int n)
+{
+    const struct cap_insn *in;
+    int i;
+
+    if ( n <= 0 || n > CAP_FILTER_MAX ) {
+        return -1;
+    }
+    for ( i = 0; i < n; i++ ) {
+        in = &insns[i];
+        switch ( CAP_CLASS(in->code) ) {
+        case CAP_LD:
+        case CAP_LDX:
+            switch ( CAP_MODE(in->code) ) {
+            case CAP_IMM:
+            case CAP_LEN:
+                break;
+            case CAP_ABS:
+            case CAP_IND:
+                if ( CAP_LDX == CAP_CLASS(in->code) ) {
+                    return -1;
+                }
+                if ( CAP_SIZE(in->code) > CAP_B ) {
+                    return -1;
+                }
+                break;
+            case CAP_MEM:
+                if ( in->k >= CAP_FILTER_MEMWORDS ) {
+                    return -1;
+                }
+                break;
+            case CAP_MSH:
+                if ( CAP_LDX != CAP_CLASS(in->code) ) {
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+            }
+            break;
+        case CAP_ST:
+        case CAP_STX:
+            if ( in->k >= CAP_FILTER_MEMWORDS ) {
+                return -1;
+            }
+            break;
+        case CAP_ALU:
+            switch ( CAP_OP(in->code) ) {
+            case CAP_DIV:
+            case CAP_MOD:
+                if ( CAP_K == CAP_SRC(in->code) && 0 == in->k ) {
+                    return -1;
+                }
+                break;
+            case CAP_ADD:
+            case CAP_SUB:
+            case CAP_MUL:
+            case CAP_OR:
+            case CAP_AND:
+            case CAP_LSH:
+            case CAP_RSH:
+            case CAP_NEG:
+            case CAP_XOR:
+                break;
+            default:
+                return -1;
+            }
+            break;
+        case CAP_JMP:
+            if ( CAP_JA == CAP_OP(in->code) ) {
+                if ( in->k >= (uint32_t)(n - i - 1) ) {
+                    return -1;
+                }
+            } else if ( CAP_OP(in->code) > CAP_JSET
+                        || in->jt >= n - i - 1 || in->jf >= n - i - 1 ) {
+                return -1;
+            }
+            break;
+        case CAP_RET:
+            if ( CAP_RVAL(in->code) != CAP_K && CAP_RVAL(in->code) != CAP_A ) {
+                return -1;
+            }
+            break;
+        case CAP_MISC:
+            if ( CAP_MISCOP(in->code) != CAP_TAX
+                 && CAP_MISCOP(in->code) != CAP_TXA ) {
+                return -1;
+            }
+            break;
+        }
+    }
+    if ( CAP_RET != CAP_CLASS(insns[n - 1].code) ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Load a word, a half word, or a byte (network byte order) from a packet;
+ * returns -1 if out of the packet
+ */
+static __inline__ int
+_cap_load(const uint8_t *pkt, uint32_t len, int size, uint32_t off,
+          uint32_t *v)
+{
+    switch ( size ) {
+    case CAP_W:
+        if ( off > len || len - off < 4 ) {
+            return -1;
+        }
+        *v = ((uint32_t)pkt[off] << 24) | ((uint32_t)pkt[off + 1] << 16)
+            | ((uint32_t)pkt[off + 2] << 8) | pkt[off + 3];
+        return 0;
+    case CAP_H:
+        if ( off > len || len - off < 2 ) {
+            return -1;
+        }
+        *v = ((uint32_t)pkt[off] << 8) | pkt[off + 1];
+        return 0;
+    default:
+        if ( off >= len ) {
+            return -1;
+        }
+        *v = pkt[off];
+        return 0;
+    }
+}
+
+/*
+ * Run a validated filter program for a packet; returns the number of bytes to
+ * be captured (zero to reject the packet)
+ */
+static __inline__ uint32_t
+cap_filter_run(const struct cap_filter *f, const uint8_t *pkt, uint32_t len)
+{
+    const struct cap_insn *in;
+    uint32_t mem[CAP_FILTER_MEMWORDS];
+    uint32_t a;
+    uint32_t x;
+    uint32_t v;
+    int pc;
+
+    a = 0;
+    x = 0;
+    /* The scratch memory may be loaded before stored */
+    memset(mem, 0, sizeof(mem));
+    for ( pc = 0; pc < f->n; pc++ ) {
+        in = &f->insns[pc];
+        switch ( CAP_CLASS(in->code) ) {
+        case CAP_LD:
+            switch ( CAP_MODE(in->code) ) {
+            case CAP_IMM:
+                a = in->k;
+                break;
+            case CAP_LEN:
+                a = len;
+                break;
+            case CAP_MEM:
+                a = mem[in->k];
+                break;
+            case CAP_ABS:
+                if ( _cap_load(pkt, len, CAP_SIZE(in->code), in->k, &a) < 0 ) {
+                    return 0;
+                }
+                break;
+            default:
+                /* CAP_IND */
+                if ( x + in->k < x
+                     || _cap_load(pkt, len, CAP_SIZE(in->code), x + in->k,
+                                  &a) < 0 ) {
+                    return 0;
+                }
+            }
+            break;
+        case CAP_LDX:
+            switch ( CAP_MODE(in->code) ) {
+            case CAP_IMM:
+                x = in->k;
+                break;
+            case CAP_LEN:
+                x = len;
+                break;
+            case CAP_MEM:
+                x = mem[in->k];
+                break;
+            default:
+                /* CAP_MSH: 4 * (IP header length) */
+                if ( _cap_load(pkt, len, CAP_B, in->k, &v) < 0 ) {
+                    return 0;
+                }
+                x = (v & 0xf) << 2;
+            }
+            break;
+        case CAP_ST:
+            mem[in->k] = a;
+            break;
+        case CAP_STX:
+            mem[in->k] = x;
+            break;
+        case CAP_ALU:
+            v = CAP_X == CAP_SRC(in->code) ? x : in->k;
+            switch ( CAP_OP(in->code) ) {
+            case CAP_ADD:
+                a += v;
+                break;
+            case CAP_SUB:
+                a -= v;
+                break;
+            case CAP_MUL:
+                a *= v;
+                break;
+            case CAP_DIV:
+                if ( 0 == v ) {
+                    return 0;
+                }
+                a /= v;
+                break;
+            case CAP_MOD:
+                if ( 0 == v ) {
+                    return 0;
+                }
+                a %= v;
+                break;
+            case CAP_OR:
+                a |= v;
+                break;
+            case CAP_AND:
+                a &= v;
+                break;
+            case CAP_LSH:
+                a = v < 32 ? a << v : 0;
+                break;
+            case CAP_RSH:
+                a = v < 32 ? a >> v : 0;
+                break;
+            case CAP_NEG:
+                a = -a;
+                break;
+            default:
+                /* CAP_XOR */
+                a ^= v;
+            }
+            break;
+        case CAP_JMP:
+            v = CAP_X == CAP_SRC(in->code) ? x : in->k;
+            switch ( CAP_OP(in->code) ) {
+            case CAP_JA:
+                pc += in->k;
+                break;
+            case CAP_JEQ:
+                pc += a == v ? in->jt : in->jf;
+                break;
+            case CAP_JGT:
+                pc += a > v ? in->jt : in->jf;
+                break;
+            case CAP_JGE:
+                pc += a >= v ? in->jt : in->jf;
+                break;
+            default:
+                /* CAP_JSET */
+                pc += (a & v) ? in->jt : in->jf;
+            }
+            break;
+        case CAP_RET:
+            v = CAP_A == CAP_RVAL(in->code) ? a : in->k;
+            return v < len ? v : len;
+        default:
+            /* CAP_MISC */
+            if ( CAP_TAX == CAP_MISCOP(in->code) ) {
+                x = a;
+            } else {
+                a = x;
+            }
+        }
+    }
+
+    /* Not reached for a validated program */
+    return 0;
+}
+
+/*
+ * Compute the size of a capture ring of len descriptors
+ */
+static __inline__ size_t
+cap_ring_memsize(uint32_t len)
+{
+    return sizeof(struct cap_ring) + sizeof(struct cap_desc) * len;
+}
+
+/*
+ * Initialize a capture ring of len (a power of two) descriptors on mem
+ */
+static __inline__ struct cap_ring *
+cap_ring_init(void *mem, uint32_t len)
+{
+    struct cap_ring *ring;
+
+    ring = (struct cap_ring *)mem;
+    memset(ring, 0, cap_ring_memsize(len));
+    ring->magic = CAP_MAGIC;
+    ring->len = len;
+
+    return ring;
+}
+
+/*
+ * Reserve the descriptor at the tail (producer); collected is the position up
+ * to which the producer has released the buffers.  Returns NULL and counts a
+ * drop if the ring is full.
+ */
+static __inline__ struct cap_desc *
+cap_ring_reserve(struct cap_ring *ring, uint64_t collected)
+{
+    if ( ring->tail - collected >= ring->len ) {
+        ring->drops++;
+        return NULL;
+    }
+
+    return &ring->descs[ring->tail & (ring->len - 1)];
+}
+
+/*
+ * Publish the reserved descriptor to the consumer (producer)
+ */
+static __inline__ void
+cap_ring_commit(struct cap_ring *ring)
+{
+    ring->packets++;
+    __sync_synchronize();
+    ring->tail++;
+}
+
+/*
+ * Get the descriptor at the head (consumer); returns NULL if empty
+ */
+static __inline__ const struct cap_desc *
+cap_ring_peek(struct cap_ring *ring)
+{
+    if ( ring->head == ring->tail ) {
+        return NULL;
+    }
+    __sync_synchronize();
+
+    return &ring->descs[ring->head & (ring->len - 1)];
+}
+
+/*
+ * Return the descriptor at the head to the producer, which then releases the
+ * buffer (consumer); the packet must not be accessed afterward
+ */
+static __inline__ void
+cap_ring_consume(struct cap_ring *ring)
+{
+    __sync_synchronize();
+    ring->head++;
+}
+
+/*
+ * Initialize the pcap file header (Ethernet)
+ */
+static __inline__ void
+cap_pcap_init(struct cap_pcap_hdr *hdr, uint32_t snaplen)
+{
+    hdr->magic = 0xa1b2c3d4U;
+    hdr->version_major = 2;
+    hdr->version_minor = 4;
+    hdr->thiszone = 0;
+    hdr->sigfigs = 0;
+    hdr->snaplen = snaplen;
+    hdr->linktype = 1;
+}
+
+#endif /* _CAPTURE_H */
+
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -26,8 +26,58 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/ip6.h>
+
+/* Checksum status of a received packet reported by the NIC (none if
+   unknown) */
+#define RX_CSUM_IP_GOOD         (1 << 0)
+#define RX_CSUM_IP_BAD          (1 << 1)
+#define RX_CSUM_L4_GOOD         (1 << 2)
+#define RX_CSUM_L4_BAD          (1 << 3)
+
+/* Offloads requested for a packet to be transmitted */
+#define TX_OL_IP_CSUM           (1 << 0)    /* IPv4 header checksum */
+#define TX_OL_TCP_CSUM          (1 << 1)
+#define TX_OL_UDP_CSUM          (1 << 2)
+#define TX_OL_TSO               (1 << 3)    /* With TX_OL_TCP_CSUM */
+#define TX_OL_IPV6              (1 << 4)    /* IPv6 (IPv4 if not set) */
+
+/* Offsets of the checksums in the TCP and UDP headers */
+#define TCP_CSUM_OFF            16
+#define UDP_CSUM_OFF            6
+
+/*
+ * Offload request of a packet to be transmitted
+ */
+struct tx_offload {
+    uint8_t flags;
+    /* Lengths of the headers (the Ethernet header without the 802.1Q tag
+       inserted by the NIC, the IP header, and the TCP header for TSO) */
+    uint8_t l2len;
+    uint8_t l3len;
+    uint8_t l4len;
+    /* Maximum segment size of TSO (excluding the headers) */
+    uint16_t mss;
+};
+
+/*
+ * Population count (with the POPCNT instruction)
+ */
+static __inline__ int
+popcnt(uint64_t x)
+{
+    uint64_t r;
+
+    __asm__ ("popcnt %1,%0" : "=r" (r) : "r" (x));
+
+    return r;
+}
 
 /*
  * Busy-wait for d_usec microseconds
@@ -73,6 +123,103 @@ wr32(void *mmio, uint64_t reg, volatile uint32_t val)
     *(volatile uint32_t *)(mmio + reg) = val;
 }
 
+/*
+ * Add 16-bit words (in network byte order) of a buffer to a one's complement
+ * sum
+ */
+static __inline__ uint32_t
+cksum_add(uint32_t sum, const void *buf, size_t len)
+{
+    const uint8_t *p;
+    size_t i;
+
+    p = buf;
+    for ( i = 0; i + 1 < len; i += 2 ) {
+        sum += ((uint32_t)p[i] << 8) | p[i + 1];
+    }
+    if ( len & 1 ) {
+        sum += (uint32_t)p[len - 1] << 8;
+    }
+
+    return sum;
+}
+
+/*
+ * Fold a one's complement sum to 16 bits (in host byte order)
+ */
+static __inline__ uint16_t
+cksum_fold(uint32_t sum)
+{
+    while ( sum >> 16 ) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return sum;
+}
+
+/*
+ * Sum of the pseudo header of the L4 segment of a packet with an offload
+ * request (without the L4 length if len is 0)
+ */
+static __inline__ uint32_t
+tx_offload_pseudo(const void *pkt, const struct tx_offload *ol, int proto,
+                  uint32_t len)
+{
+    const struct ip *ip;
+    const struct ip6_hdr *ip6;
+    uint32_t sum;
+
+    if ( ol->flags & TX_OL_IPV6 ) {
+        ip6 = pkt + ol->l2len;
+        sum = cksum_add(0, &ip6->ip6_src, 32);
+    } else {
+        ip = pkt + ol->l2len;
+        sum = cksum_add(0, &ip->ip_src, 8);
+    }
+
+    return sum + proto + (len >> 16) + (len & 0xffff);
+}
+
+/*
+ * Compute the checksums requested for a packet in software (TSO is not
+ * supported)
+ */
+static __inline__ int
+tx_offload_sw(void *pkt, size_t len, const struct tx_offload *ol)
+{
+    struct ip *ip;
+    uint8_t *l4;
+    uint32_t l4len;
+    uint16_t sum;
+
+    if ( ol->flags & TX_OL_TSO ) {
+        return -1;
+    }
+    if ( ol->flags & TX_OL_IP_CSUM ) {
+        ip = pkt + ol->l2len;
+        ip->ip_sum = 0;
+        ip->ip_sum = htons(~cksum_fold(cksum_add(0, ip, ol->l3len)));
+    }
+    l4 = pkt + ol->l2len + ol->l3len;
+    l4len = len - ol->l2len - ol->l3len;
+    if ( ol->flags & TX_OL_TCP_CSUM ) {
+        memset(l4 + TCP_CSUM_OFF, 0, 2);
+        sum = ~cksum_fold(cksum_add(tx_offload_pseudo(pkt, ol, IPPROTO_TCP,
+                                                      l4len), l4, l4len));
+        sum = htons(sum);
+        memcpy(l4 + TCP_CSUM_OFF, &sum, 2);
+    } else if ( ol->flags & TX_OL_UDP_CSUM ) {
+        memset(l4 + UDP_CSUM_OFF, 0, 2);
+        sum = ~cksum_fold(cksum_add(tx_offload_pseudo(pkt, ol, IPPROTO_UDP,
+                                                      l4len), l4, l4len));
+        /* Zero is transmitted as all ones (RFC 768) */
+        sum = htons(0 == sum ? 0xffff : sum);
+        memcpy(l4 + UDP_CSUM_OFF, &sum, 2);
+    }
+
+    return 0;
+}
+
 #endif /* _COMMON_H */
 
 /*
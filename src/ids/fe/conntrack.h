@@ -0,0 +1,615 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _CONNTRACK_H
+#define _CONNTRACK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/ip6.h>
+
+/*
+ * Connection tracking (5-tuple flow table)
+ *
+ * Each exclusive task has its own shard, so that the fast path takes no lock.
+ * A shard is an open-addressing table (linear probing) of entries with inline
+ * keys; both directions of a flow share an entry whose key has the endpoints
+ * in a canonical order.  Entries are deleted by backward shifting, so that no
+ * tombstone lengthens the probe sequences.
+ *
+ * Entries expire on a timer wheel.  The fast path only rewrites the expiry
+ * tick of an entry on each packet; an entry found in a wheel slot before its
+ * expiry is relinked to the slot of the new expiry tick.  An entry whose
+ * expiry moves earlier (e.g., on FIN or RST) is relinked immediately.
+ * Counters are pushed as records (deltas since the last record) to a
+ * single-producer, single-consumer ring drained by the tickful task, on
+ * expiry and periodically for long-lived flows.
+ */
+
+#define CT_KEY_SIZE             40
+#define CT_DEFAULT_SIZE         (1 << 16)
+#define CT_MAX_BULK             32
+#define CT_NIL                  0xffffffffU
+/* Timer wheel: a tick is 2^30 TSC (0.3-0.5 seconds) */
+#define CT_TICK_SHIFT           30
+#define CT_WHEEL_SLOTS          1024
+/* Maximum number of slots processed per call of ct_expire() */
+#define CT_WHEEL_BUDGET         4
+/* Export */
+#define CT_EXPORT_QLEN          4096
+#define CT_EXPORT_TICKS         128
+
+/* Timeouts (in ticks) */
+#define CT_TIMEOUT_NEW          64
+#define CT_TIMEOUT_TCP          2048
+#define CT_TIMEOUT_UDP          256
+#define CT_TIMEOUT_CLOSING      32
+
+/* TCP flags */
+#define CT_TCP_FIN              0x01
+#define CT_TCP_SYN              0x02
+#define CT_TCP_RST              0x04
+
+/*
+ * State of an entry (CT_NONE for an empty slot)
+ */
+enum ct_state {
+    CT_NONE = 0,
+    /* Seen only in the originating direction */
+    CT_NEW,
+    CT_ESTABLISHED,
+    /* TCP FIN or RST seen */
+    CT_CLOSING,
+};
+
+/*
+ * Flow key: address family, protocol, and the two endpoints (the smaller
+ * first)
+ */
+struct ct_key {
+    uint8_t af;
+    uint8_t proto;
+    uint16_t port[2];
+    uint8_t rsvd[2];
+    uint8_t addr[2][16];
+} __attribute__ ((packed));
+
+/*
+ * Entry (the first cache line is read by lookups)
+ */
+struct ct_entry {
+    uint8_t key[CT_KEY_SIZE];
+    uint32_t hash;
+    uint8_t state;
+    /* Endpoint that originated the flow */
+    uint8_t orig;
+    uint16_t rsvd;
+    uint32_t expire;
+    /* Timer wheel (doubly linked by index) */
+    uint32_t slot;
+    uint32_t next;
+    uint32_t prev;
+
+    /* Counters per direction (from the endpoint 0 or 1) */
+    uint64_t pkts[2];
+    uint64_t bytes[2];
+    /* Counters at the last export */
+    uint64_t xpkts[2];
+    uint64_t xbytes[2];
+    uint32_t exported;
+} __attribute__ ((aligned(64)));
+
+/*
+ * Record exported to the tickful task
+ */
+struct ct_record {
+    uint8_t key[CT_KEY_SIZE];
+    uint8_t orig;
+    uint8_t state;
+    /* Non-zero if the entry has expired */
+    uint8_t final;
+    uint8_t rsvd;
+    /* Counters since the last record */
+    uint64_t pkts[2];
+    uint64_t bytes[2];
+};
+
+/*
+ * Shard
+ */
+struct ct {
+    struct ct_entry *entries;
+    uint32_t size;
+    uint32_t count;
+    /* Maximum # of entries (3/4 of the size) */
+    uint32_t max;
+    /* Last processed tick */
+    uint32_t tick;
+    /* Heads of the slots, and of the entries being processed */
+    uint32_t wheel[CT_WHEEL_SLOTS + 1];
+
+    /* Export ring */
+    struct ct_record *records;
+    volatile uint32_t rhead;
+    volatile uint32_t rtail;
+
+    /* Statistics */
+    uint64_t overflows;
+    uint64_t rdrops;
+};
+
+/*
+ * Current tick
+ */
+static __inline__ uint32_t
+ct_tick(void)
+{
+    uint64_t a;
+    uint64_t d;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (a), "=d" (d));
+
+    return ((d << 32) | a) >> CT_TICK_SHIFT;
+}
+
+/*
+ * Hash of a key
+ */
+static __inline__ uint32_t
+_ct_hash(const uint8_t *key)
+{
+    uint64_t h;
+    uint64_t w;
+    int i;
+
+    h = 0;
+    for ( i = 0; i < CT_KEY_SIZE; i += 8 ) {
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    return h ^ (h >> 32);
+}
+
+/*
+ * Size of the memory of a shard of the specified # of entries (a power of
+ * two)
+ */
+static __inline__ size_t
+ct_memsize(uint32_t size)
+{
+    return sizeof(struct ct_entry) * size
+        + sizeof(struct ct_record) * CT_EXPORT_QLEN
+        + ((sizeof(struct ct) + 63) & ~63ULL);
+}
+
+/*
+ * Initialize a shard in the memory (64-byte aligned) of ct_memsize(size)
+ */
+static __inline__ struct ct *
+ct_init(void *mem, uint32_t size)
+{
+    struct ct *ct;
+    ssize_t i;
+
+    ct = mem;
+    ct->entries = mem + ((sizeof(struct ct) + 63) & ~63ULL);
+    ct->records = (void *)(ct->entries + size);
+    ct->size = size;
+    ct->count = 0;
+    ct->max = size / 4 * 3;
+    ct->tick = 0;
+    for ( i = 0; i <= CT_WHEEL_SLOTS; i++ ) {
+        ct->wheel[i] = CT_NIL;
+    }
+    memset(ct->entries, 0, sizeof(struct ct_entry) * size);
+    ct->rhead = 0;
+    ct->rtail = 0;
+    ct->overflows = 0;
+    ct->rdrops = 0;
+
+    return ct;
+}
+
+/*
+ * Build the key of a packet; *dir is set to the endpoint of the source.
+ * Returns -1 if the packet is not an IP packet.
+ */
+static __inline__ int
+ct_key_build(struct ct_key *key, const void *pkt, int len, int *dir,
+             uint8_t *tcpflags)
+{
+    const struct ether_header *eth;
+    const struct ip *ip;
+    const struct ip6_hdr *ip6;
+    const uint8_t *l4;
+    const uint8_t *src;
+    const uint8_t *dst;
+    uint16_t sport;
+    uint16_t dport;
+    int alen;
+    int c;
+
+    memset(key, 0, sizeof(struct ct_key));
+    eth = pkt;
+    l4 = NULL;
+    switch ( ntohs(eth->ether_type) ) {
+    case ETHERTYPE_IP:
+        ip = pkt + sizeof(struct ether_header);
+        if ( len < (int)(sizeof(struct ether_header) + sizeof(struct ip)) ) {
+            return -1;
+        }
+        key->af = 4;
+        key->proto = ip->ip_p;
+        src = (const uint8_t *)&ip->ip_src;
+        dst = (const uint8_t *)&ip->ip_dst;
+        alen = 4;
+        if ( 0 == (ntohs(ip->ip_off) & IP_OFFMASK) ) {
+            l4 = (const void *)ip + IP_VHL_HL(ip->ip_vhl) * 4;
+        }
+        break;
+    case ETHERTYPE_IPV6:
+        ip6 = pkt + sizeof(struct ether_header);
+        if ( len < (int)(sizeof(struct ether_header)
+                         + sizeof(struct ip6_hdr)) ) {
+            return -1;
+        }
+        key->af = 6;
+        key->proto = ip6->ip6_nxt;
+        src = ip6->ip6_src;
+        dst = ip6->ip6_dst;
+        alen = 16;
+        l4 = (const void *)ip6 + sizeof(struct ip6_hdr);
+        break;
+    default:
+        return -1;
+    }
+
+    sport = 0;
+    dport = 0;
+    *tcpflags = 0;
+    if ( NULL != l4 && (IPPROTO_TCP == key->proto || IPPROTO_UDP == key->proto)
+         && (const void *)l4 + 4 <= pkt + len ) {
+        memcpy(&sport, l4, 2);
+        memcpy(&dport, l4 + 2, 2);
+        if ( IPPROTO_TCP == key->proto
+             && (const void *)l4 + 14 <= pkt + len ) {
+            *tcpflags = l4[13];
+        }
+    }
+
+    /* Canonical order of the endpoints */
+    c = memcmp(src, dst, alen);
+    if ( c < 0 || (0 == c && ntohs(sport) <= ntohs(dport)) ) {
+        *dir = 0;
+        memcpy(key->addr[0], src, alen);
+        memcpy(key->addr[1], dst, alen);
+        key->port[0] = sport;
+        key->port[1] = dport;
+    } else {
+        *dir = 1;
+        memcpy(key->addr[0], dst, alen);
+        memcpy(key->addr[1], src, alen);
+        key->port[0] = dport;
+        key->port[1] = sport;
+    }
+
+    return 0;
+}
+
+/*
+ * Timeout of an entry
+ */
+static __inline__ uint32_t
+_ct_timeout(struct ct_entry *e)
+{
+    switch ( e->state ) {
+    case CT_NEW:
+        return CT_TIMEOUT_NEW;
+    case CT_CLOSING:
+        return CT_TIMEOUT_CLOSING;
+    default:
+        ;
+    }
+
+    return IPPROTO_TCP == ((struct ct_key *)e->key)->proto
+        ? CT_TIMEOUT_TCP : CT_TIMEOUT_UDP;
+}
+
+/*
+ * Link an entry to a wheel slot
+ */
+static __inline__ void
+_ct_link(struct ct *ct, uint32_t i, uint32_t slot)
+{
+    struct ct_entry *e;
+
+    e = &ct->entries[i];
+    e->slot = slot;
+    e->prev = CT_NIL;
+    e->next = ct->wheel[e->slot];
+    if ( CT_NIL != e->next ) {
+        ct->entries[e->next].prev = i;
+    }
+    ct->wheel[e->slot] = i;
+}
+
+/*
+ * Unlink an entry from the wheel
+ */
+static __inline__ void
+_ct_unlink(struct ct *ct, uint32_t i)
+{
+    struct ct_entry *e;
+
+    e = &ct->entries[i];
+    if ( CT_NIL == e->prev ) {
+        ct->wheel[e->slot] = e->next;
+    } else {
+        ct->entries[e->prev].next = e->next;
+    }
+    if ( CT_NIL != e->next ) {
+        ct->entries[e->next].prev = e->prev;
+    }
+}
+
+/*
+ * Delete an (unlinked) entry by shifting the following entries back
+ */
+static __inline__ void
+_ct_delete(struct ct *ct, uint32_t i)
+{
+    struct ct_entry *e;
+    uint32_t mask;
+    uint32_t j;
+    uint32_t home;
+
+    mask = ct->size - 1;
+    j = i;
+    for ( ;; ) {
+        j = (j + 1) & mask;
+        e = &ct->entries[j];
+        if ( CT_NONE == e->state ) {
+            break;
+        }
+        home = e->hash & mask;
+        /* Keep it if its home is cyclically in (i, j] */
+        if ( ((j - home) & mask) < ((j - i) & mask) ) {
+            continue;
+        }
+        /* Move j to i, and fix the links of the wheel */
+        ct->entries[i] = *e;
+        e = &ct->entries[i];
+        if ( CT_NIL == e->prev ) {
+            ct->wheel[e->slot] = i;
+        } else {
+            ct->entries[e->prev].next = i;
+        }
+        if ( CT_NIL != e->next ) {
+            ct->entries[e->next].prev = i;
+        }
+        i = j;
+    }
+    ct->entries[i].state = CT_NONE;
+    ct->count--;
+}
+
+/*
+ * Push a record of the counters to the export ring
+ */
+static __inline__ void
+_ct_export(struct ct *ct, struct ct_entry *e, uint32_t tick, int final)
+{
+    struct ct_record *r;
+    uint32_t tail;
+    int d;
+
+    e->exported = tick;
+    tail = (ct->rtail + 1) & (CT_EXPORT_QLEN - 1);
+    if ( tail == ct->rhead ) {
+        /* Full; the deltas are carried over to the next record */
+        ct->rdrops++;
+        return;
+    }
+    r = &ct->records[ct->rtail];
+    memcpy(r->key, e->key, CT_KEY_SIZE);
+    r->orig = e->orig;
+    r->state = e->state;
+    r->final = final;
+    for ( d = 0; d < 2; d++ ) {
+        r->pkts[d] = e->pkts[d] - e->xpkts[d];
+        r->bytes[d] = e->bytes[d] - e->xbytes[d];
+        e->xpkts[d] = e->pkts[d];
+        e->xbytes[d] = e->bytes[d];
+    }
+    __sync_synchronize();
+    ct->rtail = tail;
+}
+
+/*
+ * Track a burst of packets; flows[i] is set to the index of the entry of the
+ * packet i, or CT_NIL if it is not tracked (non-IP, or the shard is full)
+ */
+static __inline__ void
+ct_track_bulk(struct ct *ct, void **pkts, const int *lens, uint32_t *flows,
+              int n, uint32_t tick)
+{
+    struct ct_key keys[CT_MAX_BULK];
+    uint32_t hashes[CT_MAX_BULK];
+    uint8_t dirs[CT_MAX_BULK];
+    uint8_t flags[CT_MAX_BULK];
+    struct ct_entry *e;
+    uint32_t expire;
+    uint32_t mask;
+    uint32_t idx;
+    int dir;
+    int i;
+
+    /* Compute the hashes and prefetch the home slots */
+    mask = ct->size - 1;
+    for ( i = 0; i < n; i++ ) {
+        if ( ct_key_build(&keys[i], pkts[i], lens[i], &dir, &flags[i]) < 0 ) {
+            flows[i] = CT_NIL;
+            continue;
+        }
+        dirs[i] = dir;
+        hashes[i] = _ct_hash((uint8_t *)&keys[i]);
+        flows[i] = 0;
+        __builtin_prefetch(&ct->entries[hashes[i] & mask], 1, 0);
+    }
+
+    for ( i = 0; i < n; i++ ) {
+        if ( CT_NIL == flows[i] ) {
+            continue;
+        }
+        /* Look up, or insert at the first empty slot */
+        idx = hashes[i] & mask;
+        for ( ;; ) {
+            e = &ct->entries[idx];
+            if ( CT_NONE == e->state ) {
+                if ( ct->count >= ct->max ) {
+                    ct->overflows++;
+                    e = NULL;
+                    break;
+                }
+                memcpy(e->key, &keys[i], CT_KEY_SIZE);
+                e->hash = hashes[i];
+                e->state = CT_NEW;
+                e->orig = dirs[i];
+                memset(e->pkts, 0, sizeof(e->pkts));
+                memset(e->bytes, 0, sizeof(e->bytes));
+                memset(e->xpkts, 0, sizeof(e->xpkts));
+                memset(e->xbytes, 0, sizeof(e->xbytes));
+                e->exported = tick;
+                e->expire = tick + CT_TIMEOUT_NEW;
+                _ct_link(ct, idx, e->expire % CT_WHEEL_SLOTS);
+                ct->count++;
+                break;
+            }
+            if ( e->hash == hashes[i]
+                 && 0 == memcmp(e->key, &keys[i], CT_KEY_SIZE) ) {
+                break;
+            }
+            idx = (idx + 1) & mask;
+        }
+        if ( NULL == e ) {
+            flows[i] = CT_NIL;
+            continue;
+        }
+        flows[i] = idx;
+
+        /* Update the state and the counters */
+        if ( flags[i] & (CT_TCP_FIN | CT_TCP_RST) ) {
+            e->state = CT_CLOSING;
+        } else if ( CT_NEW == e->state && dirs[i] != e->orig ) {
+            e->state = CT_ESTABLISHED;
+        }
+        e->pkts[dirs[i]]++;
+        e->bytes[dirs[i]] += lens[i];
+        expire = tick + _ct_timeout(e);
+        if ( (int32_t)(expire - e->expire) < 0 ) {
+            /* The timeout shrank (e.g., closing); relink the entry to the
+               earlier slot since the wheel would find it too late */
+            _ct_unlink(ct, idx);
+            _ct_link(ct, idx, expire % CT_WHEEL_SLOTS);
+        }
+        e->expire = expire;
+    }
+}
+
+/*
+ * Advance the timer wheel to the tick
+ */
+static __inline__ void
+ct_expire(struct ct *ct, uint32_t tick)
+{
+    struct ct_entry *e;
+    uint32_t slot;
+    uint32_t i;
+    int budget;
+
+    if ( 0 == ct->tick ) {
+        ct->tick = tick;
+        return;
+    }
+    for ( budget = CT_WHEEL_BUDGET;
+          budget > 0 && (int32_t)(tick - ct->tick) > 0; budget-- ) {
+        ct->tick++;
+
+        /* Detach the entries of the slot to a list whose links are fixed up
+           when deletions move entries */
+        slot = ct->tick % CT_WHEEL_SLOTS;
+        ct->wheel[CT_WHEEL_SLOTS] = ct->wheel[slot];
+        ct->wheel[slot] = CT_NIL;
+        for ( i = ct->wheel[CT_WHEEL_SLOTS]; CT_NIL != i;
+              i = ct->entries[i].next ) {
+            ct->entries[i].slot = CT_WHEEL_SLOTS;
+        }
+
+        while ( CT_NIL != (i = ct->wheel[CT_WHEEL_SLOTS]) ) {
+            e = &ct->entries[i];
+            _ct_unlink(ct, i);
+            if ( (int32_t)(e->expire - ct->tick) <= 0 ) {
+                /* Expired */
+                _ct_export(ct, e, ct->tick, 1);
+                _ct_delete(ct, i);
+                continue;
+            }
+            /* Refreshed; relink to the slot of the new expiry */
+            if ( ct->tick - e->exported >= CT_EXPORT_TICKS ) {
+                _ct_export(ct, e, ct->tick, 0);
+            }
+            _ct_link(ct, i, e->expire % CT_WHEEL_SLOTS);
+        }
+    }
+}
+
+/*
+ * Dequeue a record from the export ring (called from the tickful task)
+ */
+static __inline__ int
+ct_export_dequeue(struct ct *ct, struct ct_record *r)
+{
+    if ( ct->rhead == ct->rtail ) {
+        return 0;
+    }
+    memcpy(r, &ct->records[ct->rhead], sizeof(struct ct_record));
+    __sync_synchronize();
+    ct->rhead = (ct->rhead + 1) & (CT_EXPORT_QLEN - 1);
+
+    return 1;
+}
+
+#endif /* _CONNTRACK_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
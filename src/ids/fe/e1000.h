@@ -75,6 +75,9 @@
 #define E1000_CTRL_RST          (1<<26)
 #define E1000_CTRL_VME          (1<<30)
 
+#define E1000_RXD_STAT_VP       (1<<3)  /* 802.1Q tag stripped */
+#define E1000_TXD_CMD_VLE       (1<<6)  /* VLAN insertion */
+
 #define E1000_CTRL_EXT_LINK_MODE_MASK (3<<22)
 #define E1000_CTRL_EXT_EE_RST   (1<<13)
 
@@ -504,8 +507,9 @@ e1000_rx_commit(struct e1000_rx_ring *rxring)
 }
 
 static __inline__ int
-e1000_rx_dequeue(struct e1000_rx_ring *rxring, void **hdr)
+e1000_rx_dequeue(struct e1000_rx_ring *rxring, void **hdr, uint16_t *vlan)
 {
+    struct e1000_rx_desc *rxdesc;
     uint16_t head;
     int len;
 
@@ -518,12 +522,51 @@ e1000_rx_dequeue(struct e1000_rx_ring *rxring, void **hdr)
     }
     head = rxring->soft_head + 1 < rxring->len ? rxring->soft_head + 1 : 0;
     *hdr = rxring->bufs[rxring->soft_head];
-    len = rxring->descs[rxring->soft_head].length;
+    rxdesc = &rxring->descs[rxring->soft_head];
+    len = rxdesc->length;
+    /* The tag is stripped with CTRL.VME */
+    *vlan = (rxdesc->status & E1000_RXD_STAT_VP) ? rxdesc->special : 0;
     rxring->soft_head = head;
 
     return len;
 }
 
+/*
+ * Prefetch the descriptor of the k-th received packet from the next one to be
+ * dequeued; returns the pointer associated with the packet buffer, or NULL if
+ * it has not been received (as far as known)
+ */
+static __inline__ void *
+e1000_rx_prefetch(struct e1000_rx_ring *rxring, uint16_t k)
+{
+    uint16_t idx;
+    uint16_t avail;
+
+    avail = rxring->head >= rxring->soft_head
+        ? rxring->head - rxring->soft_head
+        : rxring->head + rxring->len - rxring->soft_head;
+    if ( k >= avail ) {
+        return NULL;
+    }
+    idx = rxring->soft_head + k < rxring->len
+        ? rxring->soft_head + k : rxring->soft_head + k - rxring->len;
+    __builtin_prefetch(&rxring->descs[idx]);
+
+    return rxring->bufs[idx];
+}
+
+/*
+ * Get the address of the descriptor to be written back next by the NIC
+ */
+static __inline__ volatile uint64_t *
+e1000_rx_wait_addr(struct e1000_rx_ring *rxring)
+{
+    /* The second quadword (length, checksum, status, errors, and special) is
+       cleared on refill and overwritten by the write-back */
+    return (volatile uint64_t *)((void *)&rxring->descs[rxring->soft_head]
+                                 + sizeof(uint64_t));
+}
+
 /*
  * Setup Tx port
  */
@@ -590,7 +633,7 @@ e1000_setup_tx_ring(struct e1000_device *dev, struct e1000_tx_ring *txring,
 
 static __inline__ int
 e1000_tx_enqueue(struct e1000_tx_ring *txring, void *pkt, void *hdr,
-                 size_t length)
+                 size_t length, uint16_t vlan)
 {
     struct e1000_tx_desc *txdesc;
     uint16_t new_tail;
@@ -608,7 +651,11 @@ e1000_tx_enqueue(struct e1000_tx_ring *txring, void *pkt, void *hdr,
     txdesc->sta = 0;
     txdesc->rsv = 0;
     txdesc->popts = 0;
-    txdesc->special = 0;
+    txdesc->special = vlan;
+    if ( 0 != vlan ) {
+        /* Insert the 802.1Q tag */
+        txdesc->dcmd |= E1000_TXD_CMD_VLE;
+    }
     txring->bufs[txring->tail] = hdr;
     txring->tail = new_tail;
 
@@ -31,6 +31,9 @@
 
 #define FDB_KEY_SIZE    8
 #define FDB_MAX_ENTRIES 4096
+/* Buckets of the hash tables (log2; four times the entries, as hopscotch
+   hashing may fail to insert at a half load) */
+#define FDB_HASH_FACTOR 14
 #define FDB_AGING_TSC   (300ULL * 1000000000)
 
 /*
@@ -103,6 +106,15 @@ fdb_init(void)
         free(fdb);
         return NULL;
     }
+    /* Large enough to hold all the entries */
+    if ( hopscotch_resize(fdb->cur, FDB_HASH_FACTOR - fdb->cur->pfactor) < 0
+         || hopscotch_resize(fdb->update,
+                             FDB_HASH_FACTOR - fdb->update->pfactor) < 0 ) {
+        hopscotch_release(fdb->cur);
+        hopscotch_release(fdb->update);
+        free(fdb);
+        return NULL;
+    }
 
     /* Allocate for entries */
     e = malloc(sizeof(struct fdb_entry) * FDB_MAX_ENTRIES);
@@ -180,6 +192,16 @@ fdb_release(struct fdb *fdb)
     free(fdb);
 }
 
+/*
+ * Build a key from a MAC address and a VLAN ID (VLAN-scoped learning)
+ */
+static __inline__ void
+fdb_key(uint8_t *key, const uint8_t *mac, uint16_t vid)
+{
+    memcpy(key, mac, 6);
+    memcpy(key + 6, &vid, 2);
+}
+
 /*
  * Lookup
  */
@@ -189,6 +211,25 @@ fdb_lookup(struct fdb *fdb, uint8_t *key)
     return hopscotch_lookup(fdb->cur, key);
 }
 
+/*
+ * Return the entry just learned (the head of the list), which is not in the
+ * hash tables, to the pool
+ */
+static __inline__ void
+_fdb_unlearn(struct fdb *fdb, struct fdb_entry *e)
+{
+    fdb->entries = e->next;
+    if ( NULL != e->next ) {
+        e->next->prev = NULL;
+    }
+    e->next = fdb->pool;
+    fdb->pool = e;
+}
+
+/*
+ * Learn or refresh an entry; returns 0 on success, or -1 if no entry is
+ * available or the hash table is full
+ */
 static __inline__ int
 fdb_update(struct fdb *fdb, uint8_t *key, int port)
 {
@@ -221,8 +262,12 @@ fdb_update(struct fdb *fdb, uint8_t *key, int port)
         }
         fdb->entries = found;
 
-        /* Insert this to the hash table */
-        hopscotch_insert(fdb->update, key, found);
+        /* Insert this to the hash table (which refers to the key of the
+           entry, not to that of the caller) */
+        if ( hopscotch_insert(fdb->update, found->key, found) < 0 ) {
+            _fdb_unlearn(fdb, found);
+            return -1;
+        }
 
         /* Replace the current hash table with the updated one */
         h = fdb->cur;
@@ -232,7 +277,12 @@ fdb_update(struct fdb *fdb, uint8_t *key, int port)
         __sync_synchronize();
 
         /* Insert this to the hash table */
-        hopscotch_insert(fdb->update, key, found);
+        if ( hopscotch_insert(fdb->update, found->key, found) < 0 ) {
+            /* Keep the two tables with the same entries */
+            hopscotch_remove(fdb->cur, found->key);
+            _fdb_unlearn(fdb, found);
+            return -1;
+        }
     }
 
     return 0;
@@ -242,13 +292,15 @@ static __inline__ void
 fdb_debug(struct fdb *fdb)
 {
     struct fdb_entry *e;
+    uint16_t vid;
 
     printf("Current FDB:\n");
     e = fdb->entries;
     while ( NULL != e ) {
-        printf("%02x%02x.%02x%02x.%02x%02x => Port #%d\n",
+        memcpy(&vid, e->key + 6, 2);
+        printf("%02x%02x.%02x%02x.%02x%02x VLAN %d => Port #%d\n",
                e->key[0], e->key[1], e->key[2], e->key[3], e->key[4], e->key[5],
-               e->port);
+               vid, e->port);
         e = e->next;
     }
 }
@@ -31,72 +31,539 @@
 #include <sys/pix.h>
 #include <time.h>
 #include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/ip6.h>
+#include <sys/net/udp.h>
+#include <sys/time.h>
+#include <sys/endian.h>
 #include "pci.h"
 #include "fe.h"
+#include "neigh.h"
 
 unsigned long long syscall(int, ...);
 
 /*
- * Population count
+ * 802.1Q tag of a packet of the VLAN forwarded to the specified port; 0 to
+ * transmit it untagged
+ */
+static __inline__ uint16_t
+fe_vlan_egress_tag(struct fe_device *dev, uint16_t vid, uint16_t tci)
+{
+    if ( FE_VLAN_TRUNK == dev->vlan_mode && vid != dev->pvid ) {
+        /* Tagged (with the priority of the received tag) */
+        return (tci & FE_VLAN_PCP_MASK) | vid;
+    }
+
+    return 0;
+}
+
+/*
+ * Select the member link of a LAG to transmit a packet to by the hash of the
+ * headers; returns the port itself if not aggregated, or -1 if no link is
+ * distributing or the port is a member other than the logical port (the LAG
+ * is valid until the next quiescent state of the fast path)
+ */
+static __inline__ int
+fe_lag_select(struct fe *fe, int port, void *pkt, int len)
+{
+    struct fe_lag *lag;
+    struct fe_lag_dist *dist;
+    uint64_t h;
+
+    lag = fe->lags[port];
+    if ( NULL == lag ) {
+        return port;
+    }
+    dist = lag->dist;
+    if ( lag->port != port || 0 == dist->n ) {
+        return -1;
+    }
+    h = lag_hash(pkt, len, lag->hash);
+
+    return dist->ports[(h * dist->n) >> 32];
+}
+
+/*
+ * Slot of a key in the lookup tables of the VXLAN tunnel end point
+ */
+static __inline__ uint32_t
+_vxlan_hash(uint32_t key)
+{
+    return (key * 0x9e3779b1U) >> 16;
+}
+
+/*
+ * VLAN a VNI is bridged to (0 if not bridged)
+ */
+static __inline__ uint16_t
+fe_vxlan_vid(struct fe_vxlan *vx, uint32_t vni)
+{
+    uint32_t i;
+
+    i = _vxlan_hash(vni);
+    for ( ;; ) {
+        i &= FE_VXLAN_VNI_HASH - 1;
+        if ( 0 == vx->vni_hash[i].vid || vni == vx->vni_hash[i].vni ) {
+            return vx->vni_hash[i].vid;
+        }
+        i++;
+    }
+}
+
+/*
+ * Remote VTEP of a source address (network byte order); returns the index, or
+ * -1 if unknown
+ */
+static __inline__ int
+fe_vxlan_vtep(struct fe_vxlan *vx, uint32_t addr)
+{
+    uint32_t i;
+
+    i = _vxlan_hash(addr);
+    for ( ;; ) {
+        i &= FE_VXLAN_VTEP_HASH - 1;
+        if ( 0 == vx->vtep_hash[i].vtep || addr == vx->vtep_hash[i].addr ) {
+            return (int)vx->vtep_hash[i].vtep - 1;
+        }
+        i++;
+    }
+}
+
+/*
+ * Classify a packet to a VLAN; the tag has been stripped by the hardware, and
+ * is inserted by the hardware on transmission.  Returns 0 if the port is not
+ * a member of the VLAN.
+ */
+static __inline__ uint16_t
+fe_fpp_vlan(struct fe_task *t, int port, struct fe_pkt_buf_hdr *hdr)
+{
+    uint16_t vid;
+
+    vid = hdr->vlan & FE_VLAN_VID_MASK;
+    if ( 0 == vid ) {
+        /* Untagged or priority-tagged */
+        vid = t->fe->ports[port]->pvid;
+    }
+    if ( !(t->fe->vlan_members[vid] & (1ULL << port)) ) {
+        return 0;
+    }
+
+    return vid;
+}
+
+/*
+ * Capture a packet to the ring of the task (Fast-path); the buffer is
+ * referenced until the consumer returns the descriptor
+ */
+static __inline__ void
+fe_fpp_capture(struct fe_task *t, struct fe_capture *cap, int dir, int port,
+               struct fe_pkt_buf_hdr *hdr, void *pkt, int len, uint16_t vlan)
+{
+    struct cap_filter *filter;
+    struct cap_desc *desc;
+    uint32_t caplen;
+
+    /* The filter is not freed until the next quiescent state */
+    filter = cap->filter;
+    if ( NULL != filter ) {
+        caplen = cap_filter_run(filter, pkt, len);
+        if ( 0 == caplen ) {
+            return;
+        }
+    } else {
+        caplen = len;
+    }
+
+    /* Not captured if the ring is full */
+    desc = cap_ring_reserve(t->cap.ring, t->cap.collected);
+    if ( NULL == desc ) {
+        return;
+    }
+    desc->paddr = (uint64_t)fe_v2p(hdr, pkt);
+    desc->tsc = fdb_rdtsc();
+    desc->len = len;
+    desc->caplen = caplen;
+    desc->vlan = vlan;
+    desc->port = port;
+    desc->dir = dir;
+    t->cap.bufs[t->cap.ring->tail & (t->cap.ring->len - 1)] = hdr;
+    hdr->refs++;
+    cap_ring_commit(t->cap.ring);
+}
+
+/*
+ * Capture a packet enqueued to the Tx ring of a port if selected (Fast-path)
+ */
+static __inline__ void
+fe_fpp_capture_tx(struct fe_task *t, int port, struct fe_pkt_buf_hdr *hdr,
+                  void *pkt, int len, uint16_t vlan)
+{
+    struct fe_capture *cap;
+
+    cap = t->fe->capture;
+    if ( NULL != cap && (cap->txports & (1ULL << port)) ) {
+        fe_fpp_capture(t, cap, CAP_DIR_TX, port, hdr, pkt, len, vlan);
+    }
+}
+
+/*
+ * Release the buffers of the descriptors returned by the consumer of the
+ * capture ring
+ */
+static __inline__ void
+fe_capture_collect(struct fe_task *t)
+{
+    struct cap_ring *ring;
+    struct fe_pkt_buf_hdr *hdr;
+    uint64_t head;
+
+    ring = t->cap.ring;
+    if ( t->cap.collected == ring->tail ) {
+        /* Nothing outstanding; the line of the consumer is not touched */
+        return;
+    }
+    head = ring->head;
+    __sync_synchronize();
+    while ( t->cap.collected != head ) {
+        hdr = t->cap.bufs[t->cap.collected & (ring->len - 1)];
+        hdr->refs--;
+        if ( hdr->refs <= 0 ) {
+            fe_release_buffer(t, hdr);
+        }
+        t->cap.collected++;
+    }
+}
+
+/*
+ * Transmit a packet to a port through its QoS scheduler if enabled
+ * (Fast-path); the Tx ring (and the scheduler) of the port is run by
+ * fe_fpp_tx_commit().  Returns 0 if the packet is not accepted.
  */
 static __inline__ int
-popcnt(uint64_t x)
+fe_fpp_tx(struct fe_task *t, int port, void *pkt, struct fe_pkt_buf_hdr *hdr,
+          int len, uint16_t tag)
+{
+    struct qos_sched *s;
+    int ret;
+
+    if ( t->qos.enabled & (1ULL << port) ) {
+        s = t->qos.ports[port];
+        ret = qos_enqueue(s, qos_classify(s, pkt, len, hdr->vlan), hdr, pkt,
+                          len, tag);
+        if ( ret > 0 ) {
+            /* Referred to by the scheduler */
+            hdr->refs++;
+            t->qos.backlog |= 1ULL << port;
+        }
+        return ret;
+    }
+
+    return fe_driver_tx_enqueue(t, &t->tx.rings[port], port, pkt, hdr, len,
+                                tag);
+}
+
+/*
+ * Move the packets allowed by the QoS scheduler of a port to its Tx ring
+ * (Fast-path)
+ */
+static void
+fe_fpp_qos_run(struct fe_task *t, int port)
+{
+    struct qos_sched *s;
+    struct qos_pkt *e;
+    struct fe_pkt_buf_hdr *hdr;
+    int cls;
+    int ret;
+
+    s = t->qos.ports[port];
+    qos_refill(s, fdb_rdtsc());
+    while ( NULL != (e = qos_peek(s, &cls)) ) {
+        hdr = e->hdr;
+        ret = fe_driver_tx_enqueue(t, &t->tx.rings[port], port, e->pkt, hdr,
+                                   e->len, e->tag);
+        if ( ret <= 0 ) {
+            /* The Tx ring is full; retried at the next poll */
+            break;
+        }
+        qos_pop(s, cls);
+        /* The reference of the scheduler is passed to the Tx ring */
+        hdr->refs--;
+    }
+    if ( !qos_backlogged(s) ) {
+        t->qos.backlog &= ~(1ULL << port);
+    }
+}
+
+/*
+ * Apply the updated QoS configuration of the ports to the schedulers of a
+ * task (Fast-path); the packets queued in a reconfigured scheduler are
+ * dropped
+ */
+static void
+fe_fpp_qos_update(struct fe_task *t)
+{
+    struct fe_qos *q;
+    struct qos_sched *s;
+    struct qos_pkt *e;
+    struct fe_pkt_buf_hdr *hdr;
+    uint32_t gen;
+    int i;
+
+    gen = t->fe->qos_gen;
+    __sync_synchronize();
+    for ( i = 0; i < (int)t->fe->nports; i++ ) {
+        s = t->qos.ports[i];
+        q = t->fe->qos[i];
+        if ( NULL == s || NULL == q ) {
+            continue;
+        }
+        while ( NULL != (e = qos_drain(s)) ) {
+            hdr = e->hdr;
+            hdr->refs--;
+            fe_discard_buffer(t, hdr);
+        }
+        t->qos.backlog &= ~(1ULL << i);
+        if ( q->enabled ) {
+            qos_sched_init(s, &q->cfg, &q->shaper);
+            t->qos.enabled |= 1ULL << i;
+        } else {
+            t->qos.enabled &= ~(1ULL << i);
+        }
+    }
+    t->qos.gen = gen;
+}
+
+/*
+ * Apply the updated IPsec SAs to the contexts of a task (Fast-path); the
+ * contexts of the unchanged SAs are kept with their sequence numbers and
+ * counters
+ */
+static void
+fe_fpp_ipsec_update(struct fe_task *t)
+{
+    struct fe_ipsec *x;
+    struct fe_sa *sa;
+    uint32_t gen;
+    uint32_t i;
+    int j;
+
+    x = t->ipsec;
+    gen = t->fe->ipsec_gen;
+    __sync_synchronize();
+    memset(x->spis, 0, sizeof(x->spis));
+    for ( j = 0; j < FE_IPSEC_MAX_SAS; j++ ) {
+        sa = t->fe->sas[j];
+        if ( NULL == sa ) {
+            x->gens[j] = 0;
+            continue;
+        }
+        if ( x->gens[j] != sa->gen ) {
+            esp_ctx_init(&x->sas[j], &sa->cfg);
+            x->sas[j].replay = &sa->replay;
+            x->nhs[j] = sa->cfg.nh;
+            x->gens[j] = sa->gen;
+        }
+        if ( ESP_DIR_IN == sa->cfg.dir ) {
+            /* Linear probing (the table is at least half empty) */
+            i = (x->sas[j].spi * 0x9e3779b1U) >> 16;
+            while ( 0 != x->spis[i & (FE_IPSEC_SPI_HASH - 1)].sa ) {
+                i++;
+            }
+            x->spis[i & (FE_IPSEC_SPI_HASH - 1)].spi = x->sas[j].spi;
+            x->spis[i & (FE_IPSEC_SPI_HASH - 1)].sa = j + 1;
+        }
+    }
+    x->gen = gen;
+}
+
+/*
+ * Encapsulate a bridged packet of a VLAN to a remote VTEP in the headroom of
+ * its buffer, and transmit it to the next hop (Fast-path); the Tx ring is
+ * committed by the caller for the ports set in txports.  Returns 0 if the
+ * packet is not accepted (the buffer is not discarded).
+ */
+static int
+fe_fpp_vxlan_encap(struct fe_task *t, struct fe_vxlan *vx, int vtep,
+                   uint16_t vid, struct fe_pkt_buf_hdr *hdr, void *pkt,
+                   int len, uint64_t *txports)
+{
+    struct fe_vtep *v;
+    struct fe_adj *adj;
+    uint8_t *outer;
+    uint16_t tag;
+    int o;
+    int ret;
+
+    v = &vx->vteps[vtep];
+    if ( 0 == v->addr || 0 == vx->vnis[vid] ) {
+        return 0;
+    }
+    /* The UDP source port carries the entropy of the inner flow for the
+       ECMP and the LAGs of the underlay */
+    outer = vxlan_encap(&v->tmpl, pkt, len, vx->vnis[vid],
+                        lag_hash(pkt, len, LAG_HASH_L34));
+    len += VXLAN_ENCAP_LEN;
+
+    /* The adjacency is not freed until the next quiescent state */
+    adj = t->fe->nexthops[v->nh].adj;
+    if ( NULL == adj ) {
+        /* Queued by the tickful task until the next hop is resolved */
+        return fe_kernel_punt_enqueue(t->ktx, FE_KDESC_RESOLVE, v->nh, outer,
+                                      hdr, len, 0);
+    }
+    if ( !t->fe->nexthops[v->nh].used ) {
+        t->fe->nexthops[v->nh].used = 1;
+    }
+    memcpy(outer, adj->mac, ETHER_ADDR_LEN);
+
+    tag = fe_vlan_egress_tag(t->fe->ports[adj->port], adj->vid, hdr->vlan);
+    o = fe_lag_select(t->fe, adj->port, outer, len);
+    ret = o < 0 ? 0 : fe_fpp_tx(t, o, outer, hdr, len, tag);
+    if ( ret > 0 ) {
+        fe_fpp_capture_tx(t, o, hdr, outer, len, tag);
+        *txports |= 1ULL << o;
+    }
+
+    return ret;
+}
+
+/*
+ * Replicate a flooded packet of a VLAN to the remote VTEPs of its VNI
+ * (Fast-path); each copy but the last is encapsulated in a new buffer, and the
+ * last in the headroom of the packet (the inner frame queued to the local
+ * ports is left intact).  The buffer is not discarded.
+ */
+static void
+fe_fpp_vxlan_flood(struct fe_task *t, struct fe_vxlan *vx, uint16_t vid,
+                   struct fe_pkt_buf_hdr *hdr, void *pkt, int len,
+                   uint64_t *txports)
 {
-    x = x - ((x >> 1) & 0x5555555555555555ULL);
-    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
-    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
-    x = x + (x >> 8);
-    x = x + (x >> 16);
-    x = x + (x >> 32);
+    struct fe_pkt_buf_hdr *nhdr;
+    void *npkt;
+    uint64_t vteps;
+    int i;
 
-    return x & 0x7f;
+    vteps = vx->floods[vid];
+    while ( 0 != vteps ) {
+        i = __builtin_ctzll(vteps);
+        vteps &= vteps - 1;
+        if ( 0 == vteps ) {
+            fe_fpp_vxlan_encap(t, vx, i, vid, hdr, pkt, len, txports);
+            break;
+        }
+        nhdr = fe_get_buffer(t);
+        if ( NULL == nhdr ) {
+            continue;
+        }
+        npkt = (void *)nhdr + FE_PKT_HDROFF;
+        memcpy(npkt, pkt, len);
+        nhdr->vlan = hdr->vlan;
+        if ( fe_fpp_vxlan_encap(t, vx, i, vid, nhdr, npkt, len, txports)
+             <= 0 ) {
+            fe_discard_buffer(t, nhdr);
+        }
+    }
 }
 
 /*
- * Forwarding (Fast-path)
+ * Bridging (Fast-path) of a packet received at the port (the logical port of
+ * a LAG, or the port of a remote VTEP for a decapsulated packet) through the
+ * link rxport; the Tx rings are committed by the caller for the ports set in
+ * txports.  Packets from the overlay are not forwarded back to it (split
+ * horizon).
  */
 static int
-fe_fpp_forwarding(struct fe_task *t, int port, struct fe_pkt_buf_hdr *hdr,
-                  void *pkt, int len)
+fe_fpp_bridging(struct fe_task *t, int port, int rxport,
+                struct fe_pkt_buf_hdr *hdr, void *pkt, int len, uint16_t vid,
+                uint64_t *txports)
 {
     struct ether_header *eth;
     uint8_t key[FDB_KEY_SIZE];
     struct fdb_entry *e;
+    struct police *pol;
+    struct fe_vxlan *vx;
+    uint64_t members;
     ssize_t i;
     uint64_t mac;
+    uint16_t tag;
+    int o;
+    int ret;
 
     eth = (struct ether_header *)pkt;
+    members = t->fe->vlan_members[vid];
+    /* The tunnel end point is valid until the next quiescent state */
+    vx = port < FE_MAX_PORTS ? t->fe->vxlan : NULL;
 
-    memcpy(key, eth->ether_dhost, 6);
-    memset(key + 6, 0, 2);
+    fdb_key(key, eth->ether_dhost, vid);
     e = fdb_lookup(t->fe->fdb, key);
-    if ( NULL == e ) {
-        /* No entry found, then flooding */
-        for ( i = 0; i < (ssize_t)t->fe->nports; i++ ) {
-            if ( port != i ) {
-                fe_driver_tx_enqueue(t, &t->tx.rings[i], i, pkt, hdr, len);
+    pol = t->fe->police[rxport];
+    if ( NULL == e && !ETHER_IS_MULTICAST(eth->ether_dhost) && NULL != pol
+         && !police_storm(pol, POLICE_STORM_UNKNOWN) ) {
+        /* Unknown unicast over the storm control rate */
+        fe_discard_buffer(t, hdr);
+    } else if ( NULL == e ) {
+        /* No entry found, then flooding to the member ports of the VLAN
+           (to a link of each LAG) */
+        if ( port < FE_MAX_PORTS ) {
+            members &= ~(1ULL << port);
+        }
+        while ( 0 != members ) {
+            i = __builtin_ctzll(members);
+            members &= members - 1;
+            o = fe_lag_select(t->fe, i, pkt, len);
+            if ( o < 0 ) {
+                continue;
+            }
+            tag = fe_vlan_egress_tag(t->fe->ports[i], vid, hdr->vlan);
+            ret = fe_fpp_tx(t, o, pkt, hdr, len, tag);
+            if ( ret > 0 ) {
+                fe_fpp_capture_tx(t, o, hdr, pkt, len, tag);
+                *txports |= 1ULL << o;
             }
-            fe_driver_tx_commit(&t->tx.rings[i]);
-            fe_collect_buffer(t, &t->tx.rings[i]);
+        }
+        /* Head-end replication to the remote VTEPs of the VNI */
+        if ( NULL != vx ) {
+            fe_fpp_vxlan_flood(t, vx, vid, hdr, pkt, len, txports);
+        }
+        /* Discard unless queued to any port (the Tx rings are not collected
+           until committed) or punted to the tickful task */
+        fe_discard_buffer(t, hdr);
+    } else if ( e->port >= FE_MAX_PORTS ) {
+        /* Unicast to a remote VTEP (the entry may be left after the VTEP is
+           removed) */
+        ret = 0;
+        if ( NULL != vx && e->port < FE_VXLAN_PORT(FE_VXLAN_MAX_VTEPS) ) {
+            ret = fe_fpp_vxlan_encap(t, vx, e->port - FE_MAX_PORTS, vid, hdr,
+                                     pkt, len, txports);
+        }
+        if ( ret <= 0 ) {
+            fe_discard_buffer(t, hdr);
         }
     } else {
         /* Unicast */
-        if ( e->port == port ) {
-            /* Discard */
-            fe_release_buffer(t, hdr);
+        if ( e->port == port || !(members & (1ULL << e->port)) ) {
+            /* Discard (the port may have left the VLAN after learning)
+               unless punted to the tickful task */
+            fe_discard_buffer(t, hdr);
         } else {
-            fe_driver_tx_enqueue(t, &t->tx.rings[e->port], e->port, pkt, hdr,
-                                 len);
-            fe_driver_tx_commit(&t->tx.rings[e->port]);
-            fe_collect_buffer(t, &t->tx.rings[e->port]);
+            tag = fe_vlan_egress_tag(t->fe->ports[e->port], vid, hdr->vlan);
+            o = fe_lag_select(t->fe, e->port, pkt, len);
+            ret = o < 0 ? 0 : fe_fpp_tx(t, o, pkt, hdr, len, tag);
+            if ( ret > 0 ) {
+                fe_fpp_capture_tx(t, o, hdr, pkt, len, tag);
+                *txports |= 1ULL << o;
+            } else {
+                /* Tx ring (or the class queue) is full, or no link of the
+                   LAG is distributing */
+                fe_discard_buffer(t, hdr);
+            }
         }
     }
 
     /* Check the source address to update FDB */
     if ( !ETHER_IS_MULTICAST(eth->ether_shost) ) {
-        /* Unicast, then update the corresonding fdb entry */
-        mac = 0;
-        memcpy(&mac, eth->ether_shost, 6);
+        /* Unicast, then update the corresonding fdb entry in the VLAN */
+        fdb_key((uint8_t *)&mac, eth->ether_shost, vid);
         fe_kernel_cmd_enqueue(t->ktx, mac, port);
     }
 
@@ -104,215 +571,4676 @@ fe_fpp_forwarding(struct fe_task *t, int port, struct fe_pkt_buf_hdr *hdr,
 }
 
 /*
- * Forwarding (Slow-path)
+ * Transmit a routed packet within the MTU to the next hop (Fast-path)
  */
-static int
-fe_spp_forwarding(struct fe_task *t, struct fe_driver_rx *rx,
-                  struct fe_pkt_buf_hdr *hdr, void *pkt, int len)
+static __inline__ void
+fe_fpp_nexthop_xmit(struct fe_task *t, uint16_t idx,
+                    struct fe_pkt_buf_hdr *hdr, void *pkt, int len,
+                    uint64_t *txports)
 {
-    struct fe_pkt_buf_hdr *myhdr;
-    void *mypkt;
+    struct ether_header *eth;
+    struct fe_adj *adj;
+    uint16_t tag;
+    int o;
+    int ret;
 
-    myhdr = fe_get_buffer(t);
-    if ( NULL == myhdr ) {
-        /* No buffer available */
-        printf("Buffer empty\n");
-        return -1;
+    /* The adjacency is not freed until the next quiescent state */
+    adj = t->fe->nexthops[idx].adj;
+    if ( NULL == adj ) {
+        /* Unresolved; hand it over to the tickful task to be queued until
+           the next hop is resolved */
+        ret = fe_kernel_punt_enqueue(t->ktx, FE_KDESC_RESOLVE, idx, pkt, hdr,
+                                     len, 0);
+        if ( ret <= 0 ) {
+            fe_discard_buffer(t, hdr);
+        }
+        return;
+    }
+    /* Written only once per refresh, not to bounce the cache line */
+    if ( !t->fe->nexthops[idx].used ) {
+        t->fe->nexthops[idx].used = 1;
     }
-    /* Copy */
-    memcpy(myhdr, hdr, FE_PKTSZ);
-    mypkt = pkt - (void *)hdr + (void *)myhdr;
-    /* Release */
-    hdr->refs--;
-    rx->u.kernel->head = rx->u.kernel->head + 1 < rx->u.kernel->len
-        ? rx->u.kernel->head + 1 : 0;
 
-    fe_driver_tx_enqueue(t, &t->tx.rings[myhdr->port], myhdr->port, mypkt, hdr,
-                         len);
-    fe_driver_tx_commit(&t->tx.rings[myhdr->port]);
-    fe_collect_buffer(t, &t->tx.rings[myhdr->port]);
+    /* Rewrite the MAC addresses */
+    eth = (struct ether_header *)pkt;
+    memcpy(eth->ether_dhost, adj->mac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, t->fe->router_mac, ETHER_ADDR_LEN);
 
-    return 0;
+    tag = fe_vlan_egress_tag(t->fe->ports[adj->port], adj->vid, hdr->vlan);
+    o = fe_lag_select(t->fe, adj->port, pkt, len);
+    ret = o < 0 ? 0 : fe_fpp_tx(t, o, pkt, hdr, len, tag);
+    if ( ret <= 0 ) {
+        /* Tx ring is full, or no link of the LAG is distributing */
+        fe_discard_buffer(t, hdr);
+        return;
+    }
+    fe_fpp_capture_tx(t, o, hdr, pkt, len, tag);
+    *txports |= 1ULL << o;
 }
 
-
-
-
-
 /*
- * Fast-path process
+ * Fragment an IPv4 packet to the MTU of the next hop, and transmit the
+ * fragments (Fast-path); the fragments following the first one are copied to
+ * new buffers and transmitted first, and the first one is truncated in place
  */
-void *
-fe_fpp_task(void *args)
+static void
+fe_fpp_frag4(struct fe_task *t, uint16_t idx, int mtu,
+             struct fe_pkt_buf_hdr *hdr, void *pkt, int len,
+             uint64_t *txports)
 {
-    struct fe_task *t;
-    int ret;
-    struct fe_pkt_buf_hdr *hdr;
-    void *pkt;
+    struct ipfrag_stats *st;
+    struct fe_pkt_buf_hdr *nhdr;
+    struct ip *ip;
+    struct ip *nip;
+    uint8_t fh[60];
+    uint8_t *payload;
+    void *npkt;
+    uint16_t off;
+    int hlen;
+    int fhlen;
+    int plen;
+    int flen;
+    int nflen;
+    int base;
+    int o;
     int n;
-    int i;
 
-    /* Get the task data structure from the argument */
-    t = (struct fe_task *)args;
+    st = &t->ipfrag->stats;
+    ip = (struct ip *)(pkt + sizeof(struct ether_header));
+    hlen = IP_VHL_HL(ip->ip_vhl) * 4;
+    off = ntohs(ip->ip_off);
+    plen = ntohs(ip->ip_len) - hlen;
+    if ( off & IP_DF ) {
+        /* The tickful task returns an ICMP Fragmentation Needed with the
+           MTU to the source */
+        st->frag_needed++;
+        if ( fe_kernel_punt_enqueue(t->ktx, FE_KDESC_FRAGNEEDED, mtu, pkt,
+                                    hdr, len, 0) <= 0 ) {
+            fe_discard_buffer(t, hdr);
+        }
+        return;
+    }
+    if ( hlen < (int)sizeof(struct ip) || plen <= 0
+         || hlen + plen > len - (int)sizeof(struct ether_header) ) {
+        /* Malformed */
+        st->frag_drops++;
+        fe_discard_buffer(t, hdr);
+        return;
+    }
+    fhlen = ipfrag_header(ip, fh);
+    flen = (mtu - hlen) & ~7;
+    nflen = (mtu - fhlen) & ~7;
+    payload = (uint8_t *)ip + hlen;
+    base = (off & IP_OFFMASK) * 8;
 
-    /* Count the number of ports managed by this task */
-    n = popcnt(t->rx.bitmap);
+    for ( o = flen; o < plen; o += n ) {
+        n = plen - o < nflen ? plen - o : nflen;
+        nhdr = fe_get_buffer(t);
+        if ( NULL == nhdr ) {
+            /* The fragments transmitted are reassembled in vain */
+            st->frag_drops++;
+            fe_discard_buffer(t, hdr);
+            return;
+        }
+        npkt = (void *)nhdr + FE_PKT_HDROFF;
+        memcpy(npkt, pkt, sizeof(struct ether_header));
+        nip = (struct ip *)(npkt + sizeof(struct ether_header));
+        memcpy(nip, fh, fhlen);
+        memcpy((uint8_t *)nip + fhlen, payload + o, n);
+        nip->ip_len = htons(fhlen + n);
+        nip->ip_off = htons(((base + o) >> 3)
+                            | (o + n < plen || (off & IP_MF) ? IP_MF : 0));
+        nip->ip_sum = 0;
+        nip->ip_sum = htons(~cksum_fold(cksum_add(0, nip, fhlen)));
+        nhdr->vlan = hdr->vlan;
+        fe_fpp_nexthop_xmit(t, idx, nhdr, npkt,
+                            sizeof(struct ether_header) + fhlen + n, txports);
+        st->frags_out++;
+    }
 
-    printf("Launch an exclusive task for fast-path processing at CPU %d, "
-           "managing %d ports.\n", t->cpuid, n);
+    ip->ip_len = htons(hlen + flen);
+    ip->ip_off = htons(off | IP_MF);
+    ip->ip_sum = 0;
+    ip->ip_sum = htons(~cksum_fold(cksum_add(0, ip, hlen)));
+    fe_fpp_nexthop_xmit(t, idx, hdr, pkt,
+                        sizeof(struct ether_header) + hlen + flen, txports);
+    st->frags_out++;
+    st->fragmented++;
+}
 
-    for ( ;; ) {
-        for ( i = 0; i < n; i++ ) {
-            ret = fe_driver_rx_dequeue(&t->rx.rings[i], &hdr, &pkt);
-            if ( ret <= 0 ) {
-                continue;
-            }
-            fe_driver_rx_refill(t, &t->rx.rings[i]);
-            fe_fpp_forwarding(t, t->rx.rings[i].port, hdr, pkt, ret);
+/*
+ * Transmit a routed packet to the next hop (Fast-path), fragmented to the
+ * MTU of the interface if IPv4; the Tx ring is committed by the caller for
+ * the ports set in txports
+ */
+static __inline__ void
+fe_fpp_nexthop(struct fe_task *t, uint16_t idx, struct fe_pkt_buf_hdr *hdr,
+               void *pkt, int len, uint64_t *txports)
+{
+    struct ether_header *eth;
+    int mtu;
 
-            fe_driver_rx_commit(&t->rx.rings[i]);
-        }
-        for ( i = 0; i < (ssize_t)t->fe->nports; i++ ) {
-            fe_collect_buffer(t, &t->tx.rings[i]);
+    if ( idx >= FE_MAX_NEXTHOPS ) {
+        fe_discard_buffer(t, hdr);
+        return;
+    }
+    mtu = t->fe->l3if[t->fe->nexthops[idx].vid].mtu;
+    if ( 0 != mtu && len > mtu + (int)sizeof(struct ether_header) ) {
+        eth = (struct ether_header *)pkt;
+        if ( ETHERTYPE_IP == ntohs(eth->ether_type) ) {
+            fe_fpp_frag4(t, idx, mtu, hdr, pkt, len, txports);
+        } else {
+            /* IPv6 is not fragmented by routers (no ICMPv6 error is
+               generated) */
+            t->ipfrag->stats.frag_drops++;
+            fe_discard_buffer(t, hdr);
         }
+        return;
     }
+    fe_fpp_nexthop_xmit(t, idx, hdr, pkt, len, txports);
 }
 
 /*
- * Slow-path process
+ * Commit the Tx rings of the ports once per burst, after running their QoS
+ * schedulers
  */
-int
-fe_process(struct fe *fe)
+static __inline__ void
+fe_fpp_tx_commit(struct fe_task *t, uint64_t txports)
 {
     int i;
-    int ret;
-    struct fe_pkt_buf_hdr *hdr;
-    void *pkt;
-    uint64_t tsc;
-    uint64_t last_tsc;
 
-    last_tsc = 0;
-    for ( ;; ) {
-        /* For all exclusive processors */
-        for ( i = 0; i < fe->nxcpu; i++ ) {
-            ret = fe_driver_rx_dequeue(&fe->tftask->rx.rings[i], &hdr, &pkt);
-            if ( ret < 0 ) {
-                continue;
-            }
-            if ( 0 == ret ) {
-                /* Command (non-packet) */
-                fdb_update(fe->fdb, (uint8_t *)&pkt, (int)(uint64_t)hdr);
-                fe->tftask->rx.rings[i].u.kernel->head
-                    = fe->tftask->rx.rings[i].u.kernel->head + 1
-                    < fe->tftask->rx.rings[i].u.kernel->len
-                    ? fe->tftask->rx.rings[i].u.kernel->head + 1 : 0;
-            } else {
-                fe_driver_rx_refill(fe->tftask, &fe->tftask->rx.rings[i]);
-                fe_spp_forwarding(fe->tftask, &fe->tftask->rx.rings[i], hdr,
-                                  pkt, ret);
-                fe_driver_rx_commit(&fe->tftask->rx.rings[i]);
-            }
+    while ( 0 != txports ) {
+        i = __builtin_ctzll(txports);
+        txports &= txports - 1;
+        if ( t->qos.backlog & (1ULL << i) ) {
+            fe_fpp_qos_run(t, i);
         }
-
-        /* Garbage collection */
-        tsc = fdb_rdtsc();
-        if ( tsc - last_tsc > 10000000000ULL ) {
-            fdb_gc(fe->fdb);
-            /* Print out FDB */
-#if 0
-            fdb_debug(fe->fdb);
-#endif
-            last_tsc = tsc;
+        fe_driver_tx_commit(&t->tx.rings[i]);
+        /* Collect the buffers of all the transmitted packets so that a burst
+           does not fill up the Tx ring */
+        while ( fe_collect_buffer(t, &t->tx.rings[i]) > 0 ) {
+            continue;
         }
     }
-
-    return 0;
 }
 
 /*
- * Create a job at the specified exclusive processor
+ * Process the vector pending at a node of the graph (Fast-path)
  */
-void
-syspix_create_job(int cpuid, void *args)
+static void
+fe_graph_flush(struct fe_task *t, int node)
 {
-    syscall(SYS_pix_create_job, cpuid, fe_fpp_task, args);
+    struct fe_graph *g;
+    struct fe_vec *v;
+
+    g = t->graph;
+    v = &g->vecs[node];
+    g->pending &= ~(1U << node);
+    if ( 0 == v->n ) {
+        return;
+    }
+    g->stats[node].vectors++;
+    g->stats[node].pkts += v->n;
+    g->nodes[node].process(t, v);
+    v->n = 0;
 }
 
 /*
- * Initialize device
+ * Enqueue a packet to a node of the graph (Fast-path); a full vector is
+ * processed ahead of the pass
+ */
+static __inline__ void
+fe_graph_enqueue(struct fe_task *t, int node, struct fe_pkt_buf_hdr *hdr,
+                 void *pkt, int len, uint32_t meta)
+{
+    struct fe_graph *g;
+    struct fe_vec *v;
+    int i;
+
+    g = t->graph;
+    v = &g->vecs[node];
+    if ( FE_VEC_SIZE == v->n ) {
+        fe_graph_flush(t, node);
+    }
+    i = v->n;
+    v->hdrs[i] = hdr;
+    v->pkts[i] = pkt;
+    v->lens[i] = len;
+    v->meta[i] = meta;
+    v->n = i + 1;
+    g->pending |= 1U << node;
+}
+
+/*
+ * Run the graph until no packet is pending (in the order of the nodes), and
+ * commit the Tx rings (Fast-path)
+ */
+static void
+fe_graph_run(struct fe_task *t)
+{
+    struct fe_graph *g;
+
+    g = t->graph;
+    while ( 0 != g->pending ) {
+        fe_graph_flush(t, __builtin_ctz(g->pending));
+    }
+    fe_fpp_tx_commit(t, g->txports);
+    g->txports = 0;
+}
+
+/*
+ * Inbound SA of an SPI (network byte order); returns the index, or -1
+ */
+static __inline__ int
+fe_ipsec_lookup(struct fe_ipsec *x, uint32_t spi)
+{
+    uint32_t i;
+
+    i = (spi * 0x9e3779b1U) >> 16;
+    for ( ;; ) {
+        i &= FE_IPSEC_SPI_HASH - 1;
+        if ( 0 == x->spis[i].sa || spi == x->spis[i].spi ) {
+            return (int)x->spis[i].sa - 1;
+        }
+        i++;
+    }
+}
+
+/*
+ * Encrypt a burst of routed packets to the tunnels of their outbound SAs (the
+ * indices in sas), and enqueue them to the next hops to the peers (Fast-path)
+ */
+static void
+fe_fpp_esp_output(struct fe_task *t, struct fe_pkt_buf_hdr **hdrs, void **pkts,
+                  int *lens, const uint32_t *sas, int n)
+{
+    struct aesgcm_op ops[FE_RX_BURST];
+    uint8_t nonces[FE_RX_BURST][AESGCM_IV_LEN];
+    uint16_t nhs[FE_RX_BURST];
+    struct fe_ipsec *x;
+    struct esp_ctx *c;
+    struct fe_sa *sa;
+    uint8_t *outer;
+    int olen;
+    int m;
+    int i;
+
+    x = t->ipsec;
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        c = &x->sas[sas[i]];
+        if ( 0 == x->gens[sas[i]] || ESP_DIR_OUT != c->dir ) {
+            /* Not applied to the task yet */
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        if ( c->seq == c->seq_end ) {
+            /* Reserve the next block of the sequence numbers (the SA is
+               valid until the next quiescent state) */
+            sa = t->fe->sas[sas[i]];
+            if ( NULL == sa || sa->gen != x->gens[sas[i]] ) {
+                fe_discard_buffer(t, hdrs[i]);
+                continue;
+            }
+            c->seq = __sync_fetch_and_add(&sa->seq, FE_IPSEC_SEQ_BLOCK);
+            c->seq_end = c->seq + FE_IPSEC_SEQ_BLOCK;
+        }
+        if ( c->seq > 0xffffffffULL
+             || (uint8_t *)pkts[i] - (uint8_t *)hdrs[i] + lens[i]
+             + ESP_MAX_TRAILER_LEN > FE_PKTSZ ) {
+            /* The sequence number is exhausted (to be rekeyed), or no room
+               for the trailer */
+            c->stats.errors++;
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        outer = esp_encap(c, pkts[i], lens[i], c->seq, &ops[m], nonces[m],
+                          &olen);
+        if ( NULL == outer ) {
+            c->stats.errors++;
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        c->seq++;
+        c->stats.pkts++;
+        c->stats.bytes += lens[i] - sizeof(struct ether_header);
+        hdrs[m] = hdrs[i];
+        pkts[m] = outer;
+        lens[m] = olen;
+        nhs[m] = x->nhs[sas[i]];
+        m++;
+    }
+
+    /* Encrypt the burst at once, then route the outer packets */
+    aesgcm_seal_burst(ops, m);
+    for ( i = 0; i < m; i++ ) {
+        fe_graph_enqueue(t, FE_NODE_IP_REWRITE, hdrs[i], pkts[i], lens[i],
+                         nhs[i]);
+    }
+}
+
+/*
+ * IPv4 routing of a burst of packets (Fast-path); the packets are enqueued to
+ * their next hops, or to the tunnels
+ */
+static void
+fe_fpp_routing4(struct fe_task *t, struct fe_pkt_buf_hdr **hdrs, void **pkts,
+                int *lens, int n)
+{
+    struct ip *ip;
+    uint32_t addrs[FE_RX_BURST];
+    uint16_t nhs[FE_RX_BURST];
+    uint32_t sum;
+    uint16_t sa;
+    int i;
+
+    /* Look up the FIB for the burst at once */
+    for ( i = 0; i < n; i++ ) {
+        ip = (struct ip *)(pkts[i] + sizeof(struct ether_header));
+        addrs[i] = ntohl(ip->ip_dst);
+    }
+    fib4_lookup_bulk(t->fe->fib4, addrs, nhs, n);
+
+    for ( i = 0; i < n; i++ ) {
+        ip = (struct ip *)(pkts[i] + sizeof(struct ether_header));
+        if ( lens[i] < (int)(sizeof(struct ether_header) + sizeof(struct ip))
+             || IPVERSION != IP_VHL_V(ip->ip_vhl) || IP_VHL_HL(ip->ip_vhl) < 5
+             || ip->ip_ttl <= 1 || 0 == nhs[i] ) {
+            /* Malformed, TTL exceeded, or no route */
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+
+        /* Decrement TTL, and update the checksum incrementally (RFC 1624) */
+        ip->ip_ttl--;
+        sum = (uint32_t)ip->ip_sum + htons(0x0100);
+        ip->ip_sum = sum + (sum >> 16);
+
+        sa = nhs[i] < FE_MAX_NEXTHOPS ? t->fe->nexthops[nhs[i]].sa : 0;
+        if ( 0 != sa ) {
+            /* Into a tunnel */
+            fe_graph_enqueue(t, FE_NODE_ESP4_OUTPUT, hdrs[i], pkts[i],
+                             lens[i], sa - 1);
+            continue;
+        }
+        fe_graph_enqueue(t, FE_NODE_IP_REWRITE, hdrs[i], pkts[i], lens[i],
+                         nhs[i]);
+    }
+}
+
+/*
+ * IPv6 routing of a burst of packets (Fast-path); the packets are enqueued to
+ * their next hops, or to the tunnels
+ */
+static void
+fe_fpp_routing6(struct fe_task *t, struct fe_pkt_buf_hdr **hdrs, void **pkts,
+                int *lens, int n)
+{
+    struct ip6_hdr *ip6;
+    uint64_t addrs[FE_RX_BURST][2];
+    uint16_t nhs[FE_RX_BURST];
+    uint16_t sa;
+    int i;
+
+    /* Look up the FIB for the burst at once; the current table is valid until
+       the next quiescent state */
+    for ( i = 0; i < n; i++ ) {
+        ip6 = (struct ip6_hdr *)(pkts[i] + sizeof(struct ether_header));
+        fib6_addr(addrs[i], ip6->ip6_dst);
+    }
+    fib6_lookup_bulk(t->fe->fib6->cur, (const uint64_t (*)[2])addrs, nhs, n);
+
+    for ( i = 0; i < n; i++ ) {
+        ip6 = (struct ip6_hdr *)(pkts[i] + sizeof(struct ether_header));
+        if ( lens[i] < (int)(sizeof(struct ether_header)
+                             + sizeof(struct ip6_hdr))
+             || IPV6_VERSION != (*(uint8_t *)ip6 & IPV6_VERSION_MASK)
+             || ip6->ip6_hlim <= 1 || 0 == nhs[i] ) {
+            /* Malformed, hop limit exceeded, or no route */
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+
+        /* Decrement the hop limit (no header checksum) */
+        ip6->ip6_hlim--;
+
+        sa = nhs[i] < FE_MAX_NEXTHOPS ? t->fe->nexthops[nhs[i]].sa : 0;
+        if ( 0 != sa ) {
+            /* Into a tunnel */
+            fe_graph_enqueue(t, FE_NODE_ESP4_OUTPUT, hdrs[i], pkts[i],
+                             lens[i], sa - 1);
+            continue;
+        }
+        fe_graph_enqueue(t, FE_NODE_IP_REWRITE, hdrs[i], pkts[i], lens[i],
+                         nhs[i]);
+    }
+}
+
+/*
+ * Transmit the frames of the packet generator due by now to the Tx ports
+ * (Fast-path); returns the number of frames transmitted
+ */
+static int
+fe_fpp_pktgen(struct fe_task *t, struct fe_pktgen *pg)
+{
+    struct pktgen *g;
+    struct fe_pkt_buf_hdr *hdr;
+    void *pkt;
+    uint64_t ports;
+    uint64_t tsc;
+    int hwcsum;
+    int port;
+    int n;
+    int m;
+    int i;
+    int ret;
+
+    g = t->pktgen;
+    if ( g->gen != pg->gen ) {
+        /* New configuration */
+        pktgen_init(g, &pg->cfg, pg->pps, pg->hz, fdb_rdtsc());
+        g->gen = pg->gen;
+    }
+    if ( 0 == pg->cfg.txports ) {
+        return 0;
+    }
+    tsc = fdb_rdtsc();
+    n = pktgen_due(g, tsc, FE_RX_BURST);
+
+    m = 0;
+    ports = pg->cfg.txports;
+    while ( 0 != ports ) {
+        port = __builtin_ctzll(ports);
+        ports &= ports - 1;
+        /* IPv4 header checksum inserted by the NIC if supported */
+        hwcsum = fe_driver_tx_offloads(t->fe->ports[port]) & TX_OL_IP_CSUM;
+        for ( i = 0; i < n; i++ ) {
+            hdr = fe_get_buffer(t);
+            if ( NULL == hdr ) {
+                g->stats.tx_drops += n - i;
+                break;
+            }
+            pkt = (void *)hdr + FE_PKT_HDROFF;
+            pktgen_build(g, pkt, tsc, hwcsum);
+            if ( hwcsum ) {
+                hdr->txol.flags = TX_OL_IP_CSUM;
+                hdr->txol.l2len = sizeof(struct ether_header);
+                hdr->txol.l3len = sizeof(struct ip);
+            }
+            ret = fe_driver_tx_enqueue(t, &t->tx.rings[port], port, pkt, hdr,
+                                       g->size, g->vid);
+            if ( ret <= 0 ) {
+                /* Tx ring is full */
+                fe_release_buffer(t, hdr);
+                g->stats.tx_drops += n - i;
+                break;
+            }
+            g->stats.tx_pkts++;
+            g->stats.tx_bytes += g->size;
+            m++;
+        }
+    }
+    /* Collect the transmitted buffers too, or the Tx rings fill up */
+    fe_fpp_tx_commit(t, pg->cfg.txports);
+
+    return m;
+}
+
+/*
+ * Count a burst of packets received at a port in the packet generator mode
+ * instead of forwarding them (Fast-path)
+ */
+static void
+fe_fpp_pktgen_rx(struct fe_task *t, struct fe_pkt_buf_hdr **hdrs, void **pkts,
+                 int *lens, int n)
+{
+    uint64_t tsc;
+    int i;
+
+    tsc = fdb_rdtsc();
+    for ( i = 0; i < n; i++ ) {
+        pktgen_rx(t->pktgen, pkts[i], lens[i], tsc);
+        fe_discard_buffer(t, hdrs[i]);
+    }
+}
+
+/*
+ * Sample 1-in-N packets of a burst received at a port (Fast-path)
+ */
+static void
+fe_fpp_sample(struct fe_task *t, uint32_t rate, int port, void **pkts,
+              int *lens, uint16_t *vids, int n)
+{
+    int idx[FE_RX_BURST];
+    int m;
+    int i;
+
+    m = sample_select(t->sample, rate, n, idx);
+    for ( i = 0; i < m; i++ ) {
+        sample_add(t->sample, pkts[idx[i]], lens[idx[i]], port, vids[idx[i]]);
+    }
+}
+
+/*
+ * Filter a burst of packets by the ACL (Fast-path); the permitted packets are
+ * packed to the head of the arrays.  Returns the number of them.
+ */
+static int
+fe_fpp_acl(struct fe_task *t, struct acl_table *acl, int port,
+           struct fe_pkt_buf_hdr **hdrs, void **pkts, int *lens,
+           uint16_t *vids, int n)
+{
+    struct acl_key keys[FE_RX_BURST];
+    enum acl_action actions[FE_RX_BURST];
+    int m;
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        acl_key_build(&keys[i], port, vids[i], pkts[i], lens[i]);
+    }
+    acl_classify_bulk(acl, keys, actions, n);
+
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        if ( ACL_PERMIT != actions[i] ) {
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        hdrs[m] = hdrs[i];
+        pkts[m] = pkts[i];
+        lens[m] = lens[i];
+        vids[m] = vids[i];
+        m++;
+    }
+
+    return m;
+}
+
+/*
+ * Police a burst of packets received at a port (Fast-path); broadcast and
+ * multicast frames are limited by storm control, and the others by the meter
+ * of their class.  The packets not to be dropped are packed to the head of
+ * the arrays.  Returns the number of them.
+ */
+static int
+fe_fpp_police(struct fe_task *t, struct police *p,
+              struct fe_pkt_buf_hdr **hdrs, void **pkts, int *lens,
+              uint16_t *vids, int n)
+{
+    struct ether_header *eth;
+    int m;
+    int i;
+
+    /* Refilled once per burst */
+    police_refill(p, fdb_rdtsc());
+
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        eth = (struct ether_header *)pkts[i];
+        if ( ETHER_IS_MULTICAST(eth->ether_dhost)
+             && !police_storm(p, police_storm_type(eth->ether_dhost)) ) {
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        if ( !police_packet(p, pkts[i], lens[i], hdrs[i]->vlan) ) {
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        hdrs[m] = hdrs[i];
+        pkts[m] = pkts[i];
+        lens[m] = lens[i];
+        vids[m] = vids[i];
+        m++;
+    }
+
+    return m;
+}
+
+/*
+ * Track the flows of a burst of routed packets in the shard of the task
+ * (Fast-path)
+ */
+static __inline__ void
+fe_fpp_conntrack(struct fe_task *t, void **pkts, int *lens, int n)
+{
+    uint32_t flows[FE_RX_BURST];
+
+    if ( n > 0 ) {
+        ct_track_bulk(t->ct, pkts, lens, flows, n, ct_tick());
+    }
+}
+
+/*
+ * Translate a burst of IPv4 packets to be routed (Fast-path); packets from the
+ * inside prefix are mapped to a port of the block of this task, and packets
+ * to the external address are mapped back by the mapping of any task.  The
+ * packets not to be dropped are packed to the head of the arrays.  Returns the
+ * number of them.
+ */
+static int
+fe_fpp_nat(struct fe_task *t, struct nat *nat, struct fe_pkt_buf_hdr **hdrs,
+           void **pkts, int *lens, int n)
+{
+    struct ip *ip;
+    uint32_t tick;
+    void *end;
+    int m;
+    int i;
+    int ret;
+
+    tick = ct_tick();
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        ip = (struct ip *)(pkts[i] + sizeof(struct ether_header));
+        end = pkts[i] + lens[i];
+        ret = 0;
+        if ( lens[i] >= (int)(sizeof(struct ether_header) + sizeof(struct ip))
+             && IPVERSION == IP_VHL_V(ip->ip_vhl) ) {
+            if ( ip->ip_dst == nat->eaddr ) {
+                ret = nat_inbound(nat, ip, end, tick);
+            } else if ( (ip->ip_src & nat->mask) == nat->prefix
+                        && (ip->ip_dst & nat->mask) != nat->prefix ) {
+                ret = nat_outbound(nat, t->nat, ip, end, tick);
+            }
+        }
+        if ( ret < 0 ) {
+            /* No mapping, or the port block is exhausted */
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        hdrs[m] = hdrs[i];
+        pkts[m] = pkts[i];
+        lens[m] = lens[i];
+        m++;
+    }
+
+    return m;
+}
+
+/*
+ * Receive a burst of packets at a member port of a LAG; LACPDUs (and the
+ * other slow protocol frames) are handed over to the tickful task, and the
+ * other frames are dropped unless the link is collecting.  Returns the number
+ * of packets left (packed to the head of the arrays).
+ */
+static int
+fe_fpp_lag(struct fe_task *t, struct fe_lag *lag, int port,
+           struct fe_pkt_buf_hdr **hdrs, void **pkts, int *lens, int n)
+{
+    struct ether_header *eth;
+    int collecting;
+    int m;
+    int i;
+    int ret;
+
+    /* The distribution table is valid until the next quiescent state */
+    collecting = (lag->dist->collecting >> port) & 1;
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        eth = (struct ether_header *)pkts[i];
+        if ( LACP_ETHERTYPE == ntohs(eth->ether_type) ) {
+            /* The punt holds a reference until collected */
+            ret = fe_kernel_punt_enqueue(t->ktx, FE_KDESC_LACP, port, pkts[i],
+                                         hdrs[i], lens[i], 0);
+            if ( ret <= 0 ) {
+                fe_discard_buffer(t, hdrs[i]);
+            }
+            continue;
+        }
+        if ( !collecting ) {
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        hdrs[m] = hdrs[i];
+        pkts[m] = pkts[i];
+        lens[m] = lens[i];
+        m++;
+    }
+
+    return m;
+}
+
+/*
+ * Decapsulate a VXLAN packet to the local VTEP received at the port, and
+ * enqueue the inner frame to bridging in the VLAN of its VNI as received from
+ * the remote VTEP (Fast-path).  Returns 0 if the packet is not VXLAN to the
+ * local VTEP (left to routing).
+ */
+static __inline__ int
+fe_fpp_vxlan_decap(struct fe_task *t, struct fe_vxlan *vx, int port,
+                   struct fe_pkt_buf_hdr *hdr, void *pkt, int len)
+{
+    struct ether_header *eth;
+    uint32_t vni;
+    uint32_t raddr;
+    uint16_t vid;
+    int vtep;
+    int off;
+
+    off = vxlan_decap(pkt, len, vx->addr, &vni, &raddr);
+    if ( 0 == off ) {
+        return 0;
+    }
+    vid = off > 0 ? fe_vxlan_vid(vx, vni) : 0;
+    vtep = 0 != vid ? fe_vxlan_vtep(vx, raddr) : -1;
+    eth = (struct ether_header *)(pkt + off);
+    if ( vtep < 0 || ETHERTYPE_VLAN == ntohs(eth->ether_type) ) {
+        /* Malformed, an unknown VNI or remote VTEP, or a tagged inner frame
+           (not allowed unless configured; RFC 7348 Section 6.1) */
+        fe_discard_buffer(t, hdr);
+        return 1;
+    }
+
+    /* The checksum status and the tag belong to the outer headers */
+    hdr->rxcsum = 0;
+    hdr->vlan = 0;
+    fe_graph_enqueue(t, FE_NODE_L2_FORWARD, hdr, pkt + off, len - off,
+                     FE_META(vid, FE_VXLAN_PORT(vtep), port));
+
+    return 1;
+}
+
+/*
+ * Decrypt a burst of ESP packets to the local inbound SAs (Fast-path); the
+ * inner packets replace them as frames to the router, and the packets to the
+ * other SPIs are left as they are (in transit).  The inner packets outside
+ * the traffic selectors of their SA are dropped.  Returns the number of
+ * packets left (packed to the head of the arrays with their meta).
+ */
+static int
+fe_fpp_esp_input(struct fe_task *t, struct fe_ipsec *x,
+                 struct fe_pkt_buf_hdr **hdrs, void **pkts, int *lens,
+                 uint32_t *meta, int n)
+{
+    struct aesgcm_op ops[FE_RX_BURST];
+    uint8_t nonces[FE_RX_BURST][AESGCM_IV_LEN];
+    uint32_t seqs[FE_RX_BURST];
+    uint8_t idx[FE_RX_BURST];
+    uint8_t sas[FE_RX_BURST];
+    struct ether_header *eth;
+    struct esp_ctx *c;
+    struct ip *ip;
+    uint32_t spi;
+    int esplen;
+    int off;
+    int len;
+    int nh;
+    int sa;
+    int k;
+    int m;
+    int i;
+    int j;
+
+    k = 0;
+    for ( i = 0; i < n; i++ ) {
+        off = esp_parse(pkts[i], lens[i], &spi, &seqs[k], &esplen);
+        sa = off < 0 ? -1 : fe_ipsec_lookup(x, spi);
+        if ( sa < 0 ) {
+            continue;
+        }
+        c = &x->sas[sa];
+        ip = (struct ip *)(pkts[i] + sizeof(struct ether_header));
+        if ( 0 != memcmp(&ip->ip_dst, &c->daddr, 4) ) {
+            /* In transit */
+            continue;
+        }
+        if ( esp_replay_check(c->replay, seqs[k]) < 0 ) {
+            c->stats.replays++;
+            fe_discard_buffer(t, hdrs[i]);
+            pkts[i] = NULL;
+            continue;
+        }
+        esp_decap(c, pkts[i] + off, esplen, &ops[k], nonces[k]);
+        idx[k] = i;
+        sas[k] = sa;
+        k++;
+    }
+
+    /* Decrypt the burst at once */
+    aesgcm_open_burst(ops, k);
+    for ( j = 0; j < k; j++ ) {
+        i = idx[j];
+        c = &x->sas[sas[j]];
+        if ( ops[j].ret < 0 ) {
+            c->stats.auth_errors++;
+            fe_discard_buffer(t, hdrs[i]);
+            pkts[i] = NULL;
+            continue;
+        }
+        /* Checked again against the duplicates received meanwhile (in the
+           burst, or by the other tasks), and the window slides only for the
+           authenticated packets */
+        if ( esp_replay_update(c->replay, seqs[j]) < 0 ) {
+            c->stats.replays++;
+            fe_discard_buffer(t, hdrs[i]);
+            pkts[i] = NULL;
+            continue;
+        }
+        len = esp_trailer(&ops[j], &nh);
+        if ( len < 0 || (ESP_NH_IPV4 != nh && ESP_NH_IPV6 != nh) ) {
+            /* Malformed, or a dummy packet */
+            c->stats.errors++;
+            fe_discard_buffer(t, hdrs[i]);
+            pkts[i] = NULL;
+            continue;
+        }
+        if ( esp_sel_check(c, ops[j].buf, len, nh) < 0 ) {
+            /* Not negotiated for the SA */
+            c->stats.policy_errors++;
+            fe_discard_buffer(t, hdrs[i]);
+            pkts[i] = NULL;
+            continue;
+        }
+        c->stats.pkts++;
+        c->stats.bytes += len;
+
+        /* Frame of the inner packet to the router (over the IV) */
+        eth = (struct ether_header *)(ops[j].buf
+                                      - sizeof(struct ether_header));
+        memcpy(eth->ether_dhost, t->fe->router_mac, ETHER_ADDR_LEN);
+        memcpy(eth->ether_shost, t->fe->router_mac, ETHER_ADDR_LEN);
+        eth->ether_type = htons(ESP_NH_IPV4 == nh ? ETHERTYPE_IP
+                                : ETHERTYPE_IPV6);
+        pkts[i] = eth;
+        lens[i] = len + sizeof(struct ether_header);
+        /* The checksum status belongs to the outer packet */
+        hdrs[i]->rxcsum = 0;
+    }
+
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        if ( NULL == pkts[i] ) {
+            continue;
+        }
+        hdrs[m] = hdrs[i];
+        pkts[m] = pkts[i];
+        lens[m] = lens[i];
+        meta[m] = meta[i];
+        m++;
+    }
+
+    return m;
+}
+
+/*
+ * Reassemble an IPv4 fragment destined for the router (the address of the
+ * interface of the VLAN, or of the VTEP) received on a VLAN (Fast-path); the
+ * fragments in transit are routed as they are.  Returns 1 with the packet to
+ * be processed (replaced by the reassembled one if completed), or 0 if held
+ * or dropped.  The table holds a reference to each fragment.
+ */
+static int
+fe_fpp_reass4(struct fe_task *t, struct fe_vxlan *vx, uint16_t vid,
+              struct fe_pkt_buf_hdr **hdr, void **pkt, int *len)
+{
+    struct fe_pkt_buf_hdr *b;
+    struct fe_l3if *l3;
+    struct ip *ip;
+    uint32_t dst;
+    uint8_t *rip;
+    void *rbuf;
+    int ret;
+
+    if ( *len < (int)(sizeof(struct ether_header) + sizeof(struct ip)) ) {
+        return 1;
+    }
+    ip = (struct ip *)(*pkt + sizeof(struct ether_header));
+    if ( !(ip->ip_off & htons(IP_MF | IP_OFFMASK)) ) {
+        return 1;
+    }
+    memcpy(&dst, &ip->ip_dst, 4);
+    l3 = &t->fe->l3if[vid];
+    if ( !(l3->has_addr4 && dst == htonl(l3->addr4))
+         && !(NULL != vx && dst == vx->addr) ) {
+        /* In transit */
+        return 1;
+    }
+
+    (*hdr)->refs++;
+    ret = ipfrag_input(t->ipfrag, *hdr, (uint8_t *)ip,
+                       *len - sizeof(struct ether_header),
+                       FE_PKTSZ - ((uint8_t *)ip - (uint8_t *)*hdr), ct_tick(),
+                       &rbuf, &rip);
+    while ( NULL != (b = ipfrag_drain(t->ipfrag)) ) {
+        b->refs--;
+        fe_discard_buffer(t, b);
+    }
+    if ( ret <= 0 ) {
+        if ( ret < 0 ) {
+            (*hdr)->refs--;
+            fe_discard_buffer(t, *hdr);
+        }
+        return 0;
+    }
+
+    /* Reassembled in the buffer of the first fragment (after its Ethernet
+       header); the checksum status belongs to the fragment */
+    *hdr = rbuf;
+    (*hdr)->refs--;
+    (*hdr)->rxcsum = 0;
+    *pkt = rip - sizeof(struct ether_header);
+    *len = ret + sizeof(struct ether_header);
+
+    return 1;
+}
+
+/*
+ * Input of a burst of packets received at a port (Fast-path); the packets
+ * are enqueued to bridging or to routing per address family
+ */
+static void
+fe_fpp_port_input(struct fe_task *t, int port, struct fe_pkt_buf_hdr **hdrs,
+                  void **pkts, int *lens, int n)
+{
+    struct ether_header *eth;
+    uint16_t vids[FE_RX_BURST];
+    struct acl_table *acl;
+    struct fe_capture *cap;
+    struct fe_pktgen *pg;
+    struct police *pol;
+    struct fe_lag *lag;
+    struct fe_vxlan *vx;
+    struct fe_ipsec *x;
+    struct ip *ip;
+    uint32_t rate;
+    uint16_t vid;
+    uint8_t csumbad;
+    int lport;
+    int m;
+    int i;
+    int ret;
+
+    /* Capture at Rx */
+    cap = t->fe->capture;
+    if ( NULL != cap && (cap->rxports & (1ULL << port)) ) {
+        for ( i = 0; i < n; i++ ) {
+            fe_fpp_capture(t, cap, CAP_DIR_RX, port, hdrs[i], pkts[i], lens[i],
+                           hdrs[i]->vlan);
+        }
+    }
+
+    /* Counted by the packet generator */
+    pg = t->fe->pktgen;
+    if ( NULL != pg && (pg->cfg.rxports & (1ULL << port)) ) {
+        fe_fpp_pktgen_rx(t, hdrs, pkts, lens, n);
+        return;
+    }
+
+    /* Packets received at a member link of a LAG are bridged and routed as
+       received at the logical port, and policed and sampled per link (the
+       LAG is valid until the next quiescent state) */
+    lport = port;
+    lag = t->fe->lags[port];
+    if ( NULL != lag ) {
+        n = fe_fpp_lag(t, lag, port, hdrs, pkts, lens, n);
+        lport = lag->port;
+    }
+
+    /* VLAN classification */
+    m = 0;
+    for ( i = 0; i < n; i++ ) {
+        vid = fe_fpp_vlan(t, lport, hdrs[i]);
+        if ( 0 == vid ) {
+            /* Not a member of the VLAN */
+            fe_discard_buffer(t, hdrs[i]);
+            continue;
+        }
+        hdrs[m] = hdrs[i];
+        pkts[m] = pkts[i];
+        lens[m] = lens[i];
+        vids[m] = vid;
+        m++;
+    }
+    n = m;
+
+    /* Sampling (before filtering) */
+    rate = t->fe->sample_rate;
+    if ( 0 != rate && n > 0 ) {
+        fe_fpp_sample(t, rate, port, pkts, lens, vids, n);
+    }
+
+    /* Ingress policing and storm control (the policer is valid until the
+       next quiescent state) */
+    pol = t->fe->police[port];
+    if ( NULL != pol && n > 0 ) {
+        n = fe_fpp_police(t, pol, hdrs, pkts, lens, vids, n);
+    }
+
+    /* Ingress filtering (the table is valid until the next quiescent
+       state) */
+    acl = t->fe->acl->cur;
+    if ( NULL != acl && n > 0 ) {
+        n = fe_fpp_acl(t, acl, lport, hdrs, pkts, lens, vids, n);
+    }
+
+    /* Routed packets with a bad IPv4 header checksum are dropped (RFC 1812),
+       and those with a bad TCP/UDP checksum too if tracked or translated */
+    csumbad = RX_CSUM_IP_BAD;
+    if ( t->fe->ct_enabled || NULL != t->fe->nat ) {
+        csumbad |= RX_CSUM_L4_BAD;
+    }
+
+    /* IPv4 packets skip the input node unless reassembled, decapsulated, or
+       decrypted there */
+    vx = t->fe->vxlan;
+    x = t->ipsec;
+    if ( NULL != x && 0 == x->gen ) {
+        x = NULL;
+    }
+
+    for ( i = 0; i < n; i++ ) {
+        vid = vids[i];
+        eth = (struct ether_header *)pkts[i];
+        if ( neigh_is_msg(pkts[i], lens[i]) ) {
+            /* ARP or neighbor discovery; handed over to the tickful task,
+               and also bridged unless destined for the router.  The punt
+               holds a reference until collected. */
+            ret = fe_kernel_punt_enqueue(t->ktx, FE_KDESC_NEIGH, lport,
+                                         pkts[i], hdrs[i], lens[i], vid);
+            if ( 0 != memcmp(eth->ether_dhost, t->fe->router_mac,
+                             ETHER_ADDR_LEN) ) {
+                fe_graph_enqueue(t, FE_NODE_L2_FORWARD, hdrs[i], pkts[i],
+                                 lens[i], FE_META(vid, lport, port));
+            } else if ( ret <= 0 ) {
+                fe_discard_buffer(t, hdrs[i]);
+            }
+            continue;
+        }
+        if ( 0 == memcmp(eth->ether_dhost, t->fe->router_mac,
+                         ETHER_ADDR_LEN) ) {
+            /* Destined for the router; routed per address family */
+            if ( hdrs[i]->rxcsum & csumbad ) {
+                /* Bad checksum reported by the NIC */
+                fe_discard_buffer(t, hdrs[i]);
+                continue;
+            }
+            switch ( ntohs(eth->ether_type) ) {
+            case ETHERTYPE_IP:
+                ip = (struct ip *)(pkts[i] + sizeof(struct ether_header));
+                if ( lens[i] < (int)(sizeof(struct ether_header)
+                                     + sizeof(struct ip))
+                     || (!(ip->ip_off & htons(IP_MF | IP_OFFMASK))
+                         && !(NULL != vx && IPPROTO_UDP == ip->ip_p)
+                         && !(NULL != x && ESP_PROTO == ip->ip_p)) ) {
+                    fe_graph_enqueue(t, FE_NODE_IP4_LOOKUP, hdrs[i], pkts[i],
+                                     lens[i], 0);
+                    continue;
+                }
+                fe_graph_enqueue(t, FE_NODE_IP4_INPUT, hdrs[i], pkts[i],
+                                 lens[i], FE_META(vid, lport, port));
+                continue;
+            case ETHERTYPE_IPV6:
+                fe_graph_enqueue(t, FE_NODE_IP6_LOOKUP, hdrs[i], pkts[i],
+                                 lens[i], 0);
+                continue;
+            default:
+                ;
+            }
+        }
+        fe_graph_enqueue(t, FE_NODE_L2_FORWARD, hdrs[i], pkts[i], lens[i],
+                         FE_META(vid, lport, port));
+    }
+}
+
+/*
+ * Node: input of the packets received (the Rx port of each in meta); the
+ * vector is processed in the runs of the packets of a port
+ */
+static void
+fe_node_ethernet_input(struct fe_task *t, struct fe_vec *v)
+{
+    int i;
+    int j;
+
+    for ( i = 0; i < v->n; i = j ) {
+        for ( j = i + 1; j < v->n && j - i < FE_RX_BURST
+                  && v->meta[j] == v->meta[i]; j++ ) {
+            continue;
+        }
+        fe_fpp_port_input(t, v->meta[i], v->hdrs + i, v->pkts + i,
+                          v->lens + i, j - i);
+    }
+}
+
+/*
+ * Node: IPv4 packets to the router (FE_META() in meta); fragments to the
+ * router are reassembled, VXLAN to the local VTEP is bridged, and ESP is
+ * decrypted before routing
+ */
+static void
+fe_node_ip4_input(struct fe_task *t, struct fe_vec *v)
+{
+    struct fe_pkt_buf_hdr *hdr;
+    struct fe_vxlan *vx;
+    struct fe_ipsec *x;
+    struct ip *ip;
+    void *pkt;
+    int len;
+    int i;
+
+    /* The tunnel end point is valid until the next quiescent state, and the
+       SAs are applied to this task */
+    vx = t->fe->vxlan;
+    x = t->ipsec;
+    if ( NULL != x && 0 == x->gen ) {
+        x = NULL;
+    }
+
+    for ( i = 0; i < v->n; i++ ) {
+        hdr = v->hdrs[i];
+        pkt = v->pkts[i];
+        len = v->lens[i];
+        if ( !fe_fpp_reass4(t, vx, FE_META_VID(v->meta[i]), &hdr, &pkt,
+                            &len) ) {
+            /* Held for reassembly, or dropped */
+            continue;
+        }
+        if ( NULL != vx
+             && fe_fpp_vxlan_decap(t, vx, FE_META_RXPORT(v->meta[i]), hdr,
+                                   pkt, len) ) {
+            /* Decapsulated to bridging */
+            continue;
+        }
+        ip = (struct ip *)(pkt + sizeof(struct ether_header));
+        if ( NULL != x
+             && len >= (int)(sizeof(struct ether_header) + sizeof(struct ip))
+             && ESP_PROTO == ip->ip_p ) {
+            fe_graph_enqueue(t, FE_NODE_ESP4_INPUT, hdr, pkt, len,
+                             v->meta[i]);
+            continue;
+        }
+        fe_graph_enqueue(t, FE_NODE_IP4_LOOKUP, hdr, pkt, len, 0);
+    }
+}
+
+/*
+ * Node: ESP packets to the router (FE_META() in meta); the inner packets of
+ * the tunnels, and ESP in transit, are routed with the others.  The ACL ran
+ * only on the outer headers, so the inner packets are filtered again as
+ * received at the port of the outer ones.
+ */
+static void
+fe_node_esp4_input(struct fe_task *t, struct fe_vec *v)
+{
+    uint16_t vids[FE_RX_BURST];
+    struct ether_header *eth;
+    struct acl_table *acl;
+    struct fe_ipsec *x;
+    int port;
+    int o;
+    int n;
+    int m;
+    int k;
+    int i;
+    int j;
+
+    x = t->ipsec;
+    acl = t->fe->acl->cur;
+    for ( o = 0; o < v->n; o += FE_RX_BURST ) {
+        n = v->n - o < FE_RX_BURST ? v->n - o : FE_RX_BURST;
+        n = fe_fpp_esp_input(t, x, v->hdrs + o, v->pkts + o, v->lens + o,
+                             v->meta + o, n);
+        if ( NULL != acl ) {
+            /* In the runs of the packets of a port */
+            m = 0;
+            for ( i = 0; i < n; i = j ) {
+                port = FE_META_PORT(v->meta[o + i]);
+                for ( j = i; j < n && FE_META_PORT(v->meta[o + j]) == port;
+                      j++ ) {
+                    vids[j] = FE_META_VID(v->meta[o + j]);
+                }
+                k = fe_fpp_acl(t, acl, port, v->hdrs + o + i,
+                               v->pkts + o + i, v->lens + o + i, vids + i,
+                               j - i);
+                for ( k += i; i < k; i++, m++ ) {
+                    v->hdrs[o + m] = v->hdrs[o + i];
+                    v->pkts[o + m] = v->pkts[o + i];
+                    v->lens[o + m] = v->lens[o + i];
+                }
+            }
+            n = m;
+        }
+        for ( i = o; i < o + n; i++ ) {
+            eth = (struct ether_header *)v->pkts[i];
+            fe_graph_enqueue(t, ETHERTYPE_IPV6 == ntohs(eth->ether_type)
+                             ? FE_NODE_IP6_LOOKUP : FE_NODE_IP4_LOOKUP,
+                             v->hdrs[i], v->pkts[i], v->lens[i], 0);
+        }
+    }
+}
+
+/*
+ * Node: bridging (FE_META() in meta)
+ */
+static void
+fe_node_l2_forward(struct fe_task *t, struct fe_vec *v)
+{
+    int i;
+
+    for ( i = 0; i < v->n; i++ ) {
+        fe_fpp_bridging(t, FE_META_PORT(v->meta[i]),
+                        FE_META_RXPORT(v->meta[i]), v->hdrs[i], v->pkts[i],
+                        v->lens[i], FE_META_VID(v->meta[i]),
+                        &t->graph->txports);
+    }
+}
+
+/*
+ * Node: IPv4 routing, after connection tracking and NAT
+ */
+static void
+fe_node_ip4_lookup(struct fe_task *t, struct fe_vec *v)
+{
+    struct nat *nat;
+    int o;
+    int n;
+
+    nat = t->fe->nat;
+    for ( o = 0; o < v->n; o += FE_RX_BURST ) {
+        n = v->n - o < FE_RX_BURST ? v->n - o : FE_RX_BURST;
+        if ( t->fe->ct_enabled ) {
+            fe_fpp_conntrack(t, v->pkts + o, v->lens + o, n);
+        }
+        if ( NULL != nat ) {
+            n = fe_fpp_nat(t, nat, v->hdrs + o, v->pkts + o, v->lens + o, n);
+        }
+        if ( n > 0 ) {
+            fe_fpp_routing4(t, v->hdrs + o, v->pkts + o, v->lens + o, n);
+        }
+    }
+}
+
+/*
+ * Node: IPv6 routing, after connection tracking
+ */
+static void
+fe_node_ip6_lookup(struct fe_task *t, struct fe_vec *v)
+{
+    int o;
+    int n;
+
+    for ( o = 0; o < v->n; o += FE_RX_BURST ) {
+        n = v->n - o < FE_RX_BURST ? v->n - o : FE_RX_BURST;
+        if ( t->fe->ct_enabled ) {
+            fe_fpp_conntrack(t, v->pkts + o, v->lens + o, n);
+        }
+        fe_fpp_routing6(t, v->hdrs + o, v->pkts + o, v->lens + o, n);
+    }
+}
+
+/*
+ * Node: encryption of the routed packets to the tunnels (the SA in meta)
+ */
+static void
+fe_node_esp4_output(struct fe_task *t, struct fe_vec *v)
+{
+    int o;
+    int n;
+
+    for ( o = 0; o < v->n; o += FE_RX_BURST ) {
+        n = v->n - o < FE_RX_BURST ? v->n - o : FE_RX_BURST;
+        fe_fpp_esp_output(t, v->hdrs + o, v->pkts + o, v->lens + o,
+                          v->meta + o, n);
+    }
+}
+
+/*
+ * Node: transmission of the routed packets to the next hops (the next hop in
+ * meta)
+ */
+static void
+fe_node_ip_rewrite(struct fe_task *t, struct fe_vec *v)
+{
+    int i;
+
+    for ( i = 0; i < v->n; i++ ) {
+        fe_fpp_nexthop(t, v->meta[i], v->hdrs[i], v->pkts[i], v->lens[i],
+                       &t->graph->txports);
+    }
+}
+
+/*
+ * Nodes of the graph
+ */
+static const struct fe_node fe_nodes[FE_NODE_MAX] = {
+    [FE_NODE_ETHERNET_INPUT] = { "ethernet-input", fe_node_ethernet_input },
+    [FE_NODE_IP4_INPUT] = { "ip4-input", fe_node_ip4_input },
+    [FE_NODE_ESP4_INPUT] = { "esp4-input", fe_node_esp4_input },
+    [FE_NODE_L2_FORWARD] = { "l2-forward", fe_node_l2_forward },
+    [FE_NODE_IP4_LOOKUP] = { "ip4-lookup", fe_node_ip4_lookup },
+    [FE_NODE_IP6_LOOKUP] = { "ip6-lookup", fe_node_ip6_lookup },
+    [FE_NODE_ESP4_OUTPUT] = { "esp4-output", fe_node_esp4_output },
+    [FE_NODE_IP_REWRITE] = { "ip-rewrite", fe_node_ip_rewrite },
+};
+
+/*
+ * Forwarding (Slow-path)
+ */
+static int
+fe_spp_forwarding(struct fe_task *t, struct fe_driver_rx *rx,
+                  struct fe_pkt_buf_hdr *hdr, void *pkt, int len)
+{
+    struct fe_pkt_buf_hdr *myhdr;
+    void *mypkt;
+    uint64_t v2poff;
+
+    myhdr = fe_get_buffer(t);
+    if ( NULL == myhdr ) {
+        /* No buffer available */
+        printf("Buffer empty\n");
+        return -1;
+    }
+    /* Copy (the copy belongs to the pool of this task) */
+    v2poff = myhdr->v2poff;
+    memcpy(myhdr, hdr, FE_PKTSZ);
+    myhdr->refs = 0;
+    myhdr->v2poff = v2poff;
+    mypkt = pkt - (void *)hdr + (void *)myhdr;
+    /* Release */
+    hdr->refs--;
+    rx->u.kernel->head = rx->u.kernel->head + 1 < rx->u.kernel->len
+        ? rx->u.kernel->head + 1 : 0;
+
+    fe_driver_tx_enqueue(t, &t->tx.rings[myhdr->port], myhdr->port, mypkt,
+                         myhdr, len, myhdr->vlan);
+    fe_driver_tx_commit(&t->tx.rings[myhdr->port]);
+    fe_collect_buffer(t, &t->tx.rings[myhdr->port]);
+
+    return 0;
+}
+
+/*
+ * Retire memory referred to by the fast path; freed by fe_reclaim() after all
+ * exclusive tasks have observed the next epoch
+ */
+static void
+fe_retire(struct fe *fe, void *ptr)
+{
+    struct fe_retired *r;
+
+    r = malloc(sizeof(struct fe_retired));
+    if ( NULL == r ) {
+        /* Leak it rather than free memory that may be referred to */
+        return;
+    }
+    r->ptr = ptr;
+    r->epoch = fe->epoch;
+    r->next = NULL;
+    if ( NULL == fe->retired_tail ) {
+        fe->retired = r;
+    } else {
+        fe->retired_tail->next = r;
+    }
+    fe->retired_tail = r;
+
+    __sync_synchronize();
+    fe->epoch++;
+}
+
+/*
+ * Free the retired memory no exclusive task refers to
+ */
+static void
+fe_reclaim(struct fe *fe, uint64_t safe)
+{
+    struct fe_retired *r;
+
+    while ( NULL != fe->retired && fe->retired->epoch < safe ) {
+        r = fe->retired;
+        fe->retired = r->next;
+        free(r->ptr);
+        free(r);
+    }
+    if ( NULL == fe->retired ) {
+        fe->retired_tail = NULL;
+    }
+}
+
+/*
+ * Get a packet buffer of the tickful task
+ */
+static struct fe_pkt_buf_hdr *
+fe_spp_alloc(struct fe *fe, void **pkt)
+{
+    struct fe_pkt_buf_hdr *hdr;
+
+    hdr = fe_get_buffer(fe->tftask);
+    if ( NULL == hdr ) {
+        return NULL;
+    }
+    hdr->refs = 0;
+    *pkt = (void *)hdr + FE_PKT_HDROFF;
+
+    return hdr;
+}
+
+/*
+ * Transmit a packet built by the tickful task to the ports of a VLAN (to a
+ * link of each LAG)
+ */
+static void
+fe_spp_xmit(struct fe *fe, uint64_t ports, uint16_t vid,
+            struct fe_pkt_buf_hdr *hdr, void *pkt, int len)
+{
+    struct fe_task *t;
+    uint64_t txports;
+    int i;
+    int o;
+
+    /* Enqueue to all the ports before any Tx is collected */
+    t = fe->tftask;
+    txports = 0;
+    while ( 0 != ports ) {
+        i = __builtin_ctzll(ports);
+        ports &= ports - 1;
+        o = fe_lag_select(fe, i, pkt, len);
+        if ( o < 0 ) {
+            continue;
+        }
+        if ( fe_driver_tx_enqueue(t, &t->tx.rings[o], o, pkt, hdr, len,
+                                  fe_vlan_egress_tag(fe->ports[i], vid, 0))
+             > 0 ) {
+            txports |= 1ULL << o;
+        }
+    }
+    if ( 0 == txports ) {
+        fe_release_buffer(t, hdr);
+        return;
+    }
+    while ( 0 != txports ) {
+        i = __builtin_ctzll(txports);
+        txports &= txports - 1;
+        fe_driver_tx_commit(&t->tx.rings[i]);
+        /* Collect the buffers of all the transmitted packets so that a burst
+           does not fill up the Tx ring */
+        while ( fe_collect_buffer(t, &t->tx.rings[i]) > 0 ) {
+            continue;
+        }
+    }
+}
+
+/*
+ * Replace the adjacency of a next hop (NULL mac to invalidate it)
+ */
+static int
+fe_nexthop_adj(struct fe *fe, struct fe_nexthop *nh, int port, uint16_t vid,
+               const uint8_t *mac)
+{
+    struct fe_adj *adj;
+    struct fe_adj *old;
+
+    old = nh->adj;
+    if ( NULL != mac && NULL != old && old->port == port && old->vid == vid
+         && 0 == memcmp(old->mac, mac, ETHER_ADDR_LEN) ) {
+        /* Not changed */
+        return 0;
+    }
+    adj = NULL;
+    if ( NULL != mac ) {
+        adj = malloc(sizeof(struct fe_adj));
+        if ( NULL == adj ) {
+            return -1;
+        }
+        adj->port = port;
+        adj->vid = vid;
+        memcpy(adj->mac, mac, ETHER_ADDR_LEN);
+    }
+
+    /* The fast path refers to either the old or the new one */
+    __sync_synchronize();
+    nh->adj = adj;
+    if ( NULL != old ) {
+        fe_retire(fe, old);
+    }
+
+    return 0;
+}
+
+/*
+ * Transmit a routed packet queued in the slow path to the adjacency
+ */
+static void
+fe_nexthop_send(struct fe *fe, struct fe_adj *adj, struct fe_pkt_buf_hdr *hdr,
+                void *pkt, int len)
+{
+    struct ether_header *eth;
+
+    eth = (struct ether_header *)pkt;
+    memcpy(eth->ether_dhost, adj->mac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, fe->router_mac, ETHER_ADDR_LEN);
+    fe_spp_xmit(fe, 1ULL << adj->port, adj->vid, hdr, pkt, len);
+}
+
+/*
+ * Transmit (or discard if unresolved) the packets waiting for a next hop
+ */
+static void
+fe_nexthop_flush(struct fe *fe, struct fe_nexthop *nh)
+{
+    struct fe_pkt_buf_hdr *hdr;
+
+    while ( NULL != nh->pending ) {
+        hdr = nh->pending;
+        nh->pending = hdr->next;
+        if ( NULL == nh->adj ) {
+            fe_release_buffer(fe->tftask, hdr);
+        } else {
+            fe_nexthop_send(fe, nh->adj, hdr, (void *)hdr + FE_PKT_HDROFF,
+                            hdr->len);
+        }
+    }
+    nh->pending_tail = NULL;
+    nh->npending = 0;
+}
+
+/*
+ * Send an ARP request or a neighbor solicitation for a next hop; broadcast
+ * (multicast) to the VLAN if mac is NULL, otherwise unicast to refresh it
+ */
+static void
+fe_nexthop_probe(struct fe *fe, struct fe_nexthop *nh, int port,
+                 const uint8_t *mac)
+{
+    static const uint8_t bcast[ETHER_ADDR_LEN]
+        = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    struct fe_l3if *l3;
+    struct fe_pkt_buf_hdr *hdr;
+    void *pkt;
+    uint32_t addr;
+    uint64_t ports;
+    int len;
+
+    nh->probed = fdb_rdtsc();
+    nh->probes++;
+
+    l3 = &fe->l3if[nh->vid];
+    if ( 6 == nh->af && !l3->has_addr6 ) {
+        /* No source address */
+        return;
+    }
+    hdr = fe_spp_alloc(fe, &pkt);
+    if ( NULL == hdr ) {
+        return;
+    }
+    if ( 4 == nh->af ) {
+        /* Sender address 0.0.0.0 if no address is configured (RFC 5227) */
+        memcpy(&addr, nh->addr, 4);
+        len = neigh_arp_build(pkt, ARPOP_REQUEST, NULL == mac ? bcast : mac,
+                              fe->router_mac,
+                              l3->has_addr4 ? l3->addr4 : 0, NULL,
+                              ntohl(addr));
+    } else {
+        len = neigh_nd_build(pkt, ND_NEIGHBOR_SOLICIT, mac, fe->router_mac,
+                             l3->addr6, nh->addr, nh->addr, 0);
+    }
+    ports = NULL == mac ? fe->vlan_members[nh->vid] : 1ULL << port;
+    fe_spp_xmit(fe, ports, nh->vid, hdr, pkt, len);
+}
+
+/*
+ * Queue a routed packet punted by the fast path until the next hop is
+ * resolved
+ */
+static void
+fe_nexthop_resolve(struct fe *fe, uint16_t idx, void *pkt, int len)
+{
+    struct fe_nexthop *nh;
+    struct fe_pkt_buf_hdr *hdr;
+    struct fe_adj *adj;
+    void *mypkt;
+
+    if ( idx >= FE_MAX_NEXTHOPS ) {
+        return;
+    }
+    nh = &fe->nexthops[idx];
+    adj = nh->adj;
+    if ( NULL == adj && (FE_NH_INCOMPLETE != nh->state
+                         || nh->probes >= FE_NH_MAX_PROBES
+                         || nh->npending >= FE_NH_MAX_PENDING) ) {
+        /* Not resolvable, given up, or too many packets waiting */
+        return;
+    }
+
+    /* Copy (the punted buffer belongs to the exclusive task) */
+    hdr = fe_spp_alloc(fe, &mypkt);
+    if ( NULL == hdr ) {
+        return;
+    }
+    memcpy(mypkt, pkt, len);
+    if ( NULL != adj ) {
+        /* Resolved after punted */
+        fe_nexthop_send(fe, adj, hdr, mypkt, len);
+        return;
+    }
+    hdr->len = len;
+    hdr->next = NULL;
+    if ( NULL == nh->pending_tail ) {
+        nh->pending = hdr;
+    } else {
+        nh->pending_tail->next = hdr;
+    }
+    nh->pending_tail = hdr;
+    nh->npending++;
+
+    /* Rate-limited */
+    if ( fdb_rdtsc() - nh->probed >= FE_NH_PROBE_TSC ) {
+        fe_nexthop_probe(fe, nh, -1, NULL);
+    }
+}
+
+/*
+ * Key of the address of a next hop on a VLAN
+ */
+static void
+_nexthop_key(uint8_t *key, int af, uint16_t vid, const uint8_t *addr)
+{
+    memset(key, 0, FE_NH_KEY_SIZE);
+    key[0] = af;
+    key[1] = vid >> 8;
+    key[2] = vid;
+    memcpy(key + 4, addr, 4 == af ? 4 : 16);
+}
+
+/*
+ * Update the next hops of the sender of a neighbor resolution message
+ */
+static void
+fe_neigh_learn(struct fe *fe, int port, uint16_t vid, struct neigh_msg *msg)
+{
+    struct fe_nexthop *nh;
+    uint8_t key[FE_NH_KEY_SIZE];
+
+    _nexthop_key(key, msg->af, vid, msg->sender);
+    nh = hopscotch_lookup(fe->nhaddrs, key);
+    for ( ; NULL != nh;
+          nh = 0 != nh->next ? &fe->nexthops[nh->next] : NULL ) {
+        if ( fe_nexthop_adj(fe, nh, port, vid, msg->sender_mac) < 0 ) {
+            continue;
+        }
+        nh->state = FE_NH_REACHABLE;
+        nh->confirmed = fdb_rdtsc();
+        nh->probes = 0;
+        fe_nexthop_flush(fe, nh);
+    }
+}
+
+/*
+ * Process an ARP or neighbor discovery message punted by the fast path
+ */
+static void
+fe_neigh_input(struct fe *fe, int port, uint16_t vid, void *pkt, int len)
+{
+    struct neigh_msg msg;
+    struct fe_l3if *l3;
+    struct fe_pkt_buf_hdr *hdr;
+    void *mypkt;
+    uint32_t addr;
+    uint32_t sender;
+
+    if ( port >= (int)fe->nports || vid >= FE_VLAN_MAX
+         || neigh_parse(pkt, len, &msg) < 0 ) {
+        return;
+    }
+    if ( msg.has_sender_mac ) {
+        fe_neigh_learn(fe, port, vid, &msg);
+    }
+    if ( !msg.solicit || !msg.has_sender_mac ) {
+        return;
+    }
+
+    /* Answer the solicitation for the address of the interface */
+    l3 = &fe->l3if[vid];
+    if ( 4 == msg.af ) {
+        addr = htonl(l3->addr4);
+        if ( !l3->has_addr4 || 0 != memcmp(msg.target, &addr, 4) ) {
+            return;
+        }
+        hdr = fe_spp_alloc(fe, &mypkt);
+        if ( NULL == hdr ) {
+            return;
+        }
+        memcpy(&sender, msg.sender, 4);
+        len = neigh_arp_build(mypkt, ARPOP_REPLY, msg.sender_mac,
+                              fe->router_mac, l3->addr4, msg.sender_mac,
+                              ntohl(sender));
+    } else {
+        if ( !l3->has_addr6 || 0 != memcmp(msg.target, l3->addr6, 16) ) {
+            return;
+        }
+        hdr = fe_spp_alloc(fe, &mypkt);
+        if ( NULL == hdr ) {
+            return;
+        }
+        len = neigh_nd_build(mypkt, ND_NEIGHBOR_ADVERT, msg.sender_mac,
+                             fe->router_mac, l3->addr6, msg.sender, l3->addr6,
+                             ND_NA_FLAG_ROUTER | ND_NA_FLAG_SOLICITED
+                             | ND_NA_FLAG_OVERRIDE);
+    }
+    fe_spp_xmit(fe, 1ULL << port, vid, hdr, mypkt, len);
+}
+
+/*
+ * Refresh the adjacencies in use in the background, and expire unresolvable
+ * ones; the adjacencies not in use go stale, and are refreshed once used
+ * again
+ */
+static void
+fe_neigh_timer(struct fe *fe, uint64_t tsc)
+{
+    struct fe_nexthop *nh;
+    struct fe_adj *adj;
+    ssize_t i;
+
+    for ( i = 1; i < FE_MAX_NEXTHOPS; i++ ) {
+        nh = &fe->nexthops[i];
+        switch ( nh->state ) {
+        case FE_NH_REACHABLE:
+            if ( tsc - nh->confirmed < FE_NH_REACHABLE_TSC ) {
+                break;
+            }
+            /* Keep forwarding with the adjacency while refreshing it */
+            nh->state = FE_NH_STALE;
+            nh->probes = 0;
+            if ( nh->used ) {
+                nh->used = 0;
+                adj = nh->adj;
+                fe_nexthop_probe(fe, nh, adj->port, adj->mac);
+            }
+            break;
+
+        case FE_NH_STALE:
+            if ( 0 == nh->probes ) {
+                /* Not in use since it went stale */
+                if ( nh->used ) {
+                    nh->used = 0;
+                    adj = nh->adj;
+                    fe_nexthop_probe(fe, nh, adj->port, adj->mac);
+                }
+                break;
+            }
+            if ( tsc - nh->probed < FE_NH_PROBE_TSC ) {
+                break;
+            }
+            if ( nh->probes < FE_NH_MAX_PROBES ) {
+                adj = nh->adj;
+                fe_nexthop_probe(fe, nh, adj->port, adj->mac);
+                break;
+            }
+            /* No response; resolved again on demand */
+            fe_nexthop_adj(fe, nh, 0, 0, NULL);
+            nh->state = FE_NH_INCOMPLETE;
+            nh->probes = 0;
+            break;
+
+        case FE_NH_INCOMPLETE:
+            if ( nh->probes < FE_NH_MAX_PROBES ) {
+                if ( nh->npending > 0
+                     && tsc - nh->probed >= FE_NH_PROBE_TSC ) {
+                    fe_nexthop_probe(fe, nh, -1, NULL);
+                }
+                break;
+            }
+            if ( tsc - nh->probed >= FE_NH_PROBE_TSC ) {
+                /* Unreachable */
+                fe_nexthop_flush(fe, nh);
+            }
+            if ( tsc - nh->probed >= FE_NH_RETRY_TSC ) {
+                nh->probes = 0;
+            }
+            break;
+
+        default:
+            ;
+        }
+    }
+}
+
+/*
+ * Transmit a frame built by the tickful task to a link as is (untagged, and
+ * not distributed)
+ */
+static void
+fe_spp_xmit_link(struct fe *fe, int port, struct fe_pkt_buf_hdr *hdr,
+                 void *pkt, int len)
+{
+    struct fe_task *t;
+
+    t = fe->tftask;
+    if ( fe_driver_tx_enqueue(t, &t->tx.rings[port], port, pkt, hdr, len, 0)
+         <= 0 ) {
+        fe_release_buffer(t, hdr);
+        return;
+    }
+    fe_driver_tx_commit(&t->tx.rings[port]);
+    /* Collect all the transmitted buffers so that the ring does not fill up */
+    while ( fe_collect_buffer(t, &t->tx.rings[port]) > 0 ) {
+        continue;
+    }
+}
+
+/*
+ * Transmit an LACPDU to a member link of a LAG
+ */
+static void
+fe_lacp_send(struct fe *fe, struct fe_lag *lag, int port, uint64_t tsc)
+{
+    struct fe_pkt_buf_hdr *hdr;
+    void *pkt;
+    int len;
+
+    hdr = fe_spp_alloc(fe, &pkt);
+    if ( NULL == hdr ) {
+        return;
+    }
+    len = lacp_build(&lag->links[port], pkt, fe->router_mac);
+    lag->links[port].tx_tsc = tsc;
+    fe_spp_xmit_link(fe, port, hdr, pkt, len);
+}
+
+/*
+ * Select the links of a LAG attached to the aggregator, and publish the links
+ * collecting and distributing to the fast path; an LACPDU is transmitted to
+ * each link whose partner needs to be told
+ */
+static int
+fe_lag_update(struct fe *fe, struct fe_lag *lag, uint64_t tsc)
+{
+    struct lacp_port *lp;
+    struct lacp_info *agg;
+    struct fe_lag_dist *dist;
+    struct fe_lag_dist *old;
+    uint64_t collecting;
+    uint64_t distributing;
+    uint64_t ports;
+    int i;
+
+    if ( lag->lacp ) {
+        /* The aggregator is attached to the partner of the lowest link that
+           has an aggregatable one; the links to the others are left
+           unselected */
+        agg = NULL;
+        collecting = 0;
+        distributing = 0;
+        ports = lag->members;
+        while ( 0 != ports ) {
+            i = __builtin_ctzll(ports);
+            ports &= ports - 1;
+            lp = &lag->links[i];
+            if ( (lp->actor.state & LACP_STATE_DEFAULTED)
+                 || !(lp->partner.state & LACP_STATE_AGGREGATION) ) {
+                lacp_mux(lp, 0);
+            } else {
+                if ( NULL == agg ) {
+                    agg = &lp->partner;
+                }
+                lacp_mux(lp, lacp_same_partner(agg, &lp->partner));
+            }
+            if ( lacp_collecting(lp) ) {
+                collecting |= 1ULL << i;
+            }
+            if ( lacp_distributing(lp) ) {
+                distributing |= 1ULL << i;
+            }
+            if ( lp->ntt ) {
+                fe_lacp_send(fe, lag, i, tsc);
+            }
+        }
+    } else {
+        /* Static */
+        collecting = lag->members;
+        distributing = lag->members;
+    }
+
+    old = lag->dist;
+    if ( NULL != old && old->collecting == collecting
+         && old->distributing == distributing ) {
+        return 0;
+    }
+    dist = malloc(sizeof(struct fe_lag_dist));
+    if ( NULL == dist ) {
+        return -1;
+    }
+    dist->collecting = collecting;
+    dist->distributing = distributing;
+    dist->n = 0;
+    ports = distributing;
+    while ( 0 != ports ) {
+        i = __builtin_ctzll(ports);
+        ports &= ports - 1;
+        dist->ports[dist->n++] = i;
+    }
+
+    /* The fast path refers to either the old or the new one */
+    __sync_synchronize();
+    lag->dist = dist;
+    if ( NULL != old ) {
+        fe_retire(fe, old);
+    }
+
+    return 0;
+}
+
+/*
+ * Process an LACPDU or a marker PDU received at a member link of a LAG
+ */
+static void
+fe_lacp_input(struct fe *fe, int port, void *pkt, int len)
+{
+    struct fe_lag *lag;
+    struct fe_pkt_buf_hdr *hdr;
+    void *mypkt;
+    uint64_t tsc;
+
+    lag = fe->lags[port];
+    if ( NULL == lag || !lag->lacp
+         || len <= (int)sizeof(struct ether_header) ) {
+        return;
+    }
+    if ( LACP_SUBTYPE_MARKER
+         == *(uint8_t *)(pkt + sizeof(struct ether_header)) ) {
+        /* Respond with a copy (the punted buffer belongs to the exclusive
+           task) */
+        hdr = fe_spp_alloc(fe, &mypkt);
+        if ( NULL == hdr ) {
+            return;
+        }
+        memcpy(mypkt, pkt, len);
+        len = lacp_marker_response(mypkt, len, fe->router_mac);
+        if ( len < 0 ) {
+            fe_release_buffer(fe->tftask, hdr);
+            return;
+        }
+        fe_spp_xmit_link(fe, port, hdr, mypkt, len);
+        return;
+    }
+
+    tsc = fdb_rdtsc();
+    if ( lacp_input(&lag->links[port], pkt, len, tsc) < 0 ) {
+        return;
+    }
+    fe_lag_update(fe, lag, tsc);
+}
+
+/*
+ * Run the LACP timers of the links of the LAGs
+ */
+static void
+fe_lacp_timer(struct fe *fe, uint64_t tsc)
+{
+    struct fe_lag *lag;
+    uint64_t ports;
+    ssize_t i;
+    int j;
+
+    for ( i = 0; i < (ssize_t)fe->nports; i++ ) {
+        lag = fe->lags[i];
+        if ( NULL == lag || lag->port != i || !lag->lacp ) {
+            continue;
+        }
+        ports = lag->members;
+        while ( 0 != ports ) {
+            j = __builtin_ctzll(ports);
+            ports &= ports - 1;
+            lacp_timer(&lag->links[j], tsc, fe->tsc_hz);
+        }
+        fe_lag_update(fe, lag, tsc);
+    }
+}
+
+
+
+
+
+/*
+ * Back off an idle exclusive processor (adaptive polling)
+ */
+static void
+fe_fpp_idle(struct fe_task *t, int n)
+{
+    volatile uint64_t *addr;
+    uint64_t val;
+    int i;
+
+    t->idle.polls++;
+    if ( t->idle.polls < FE_IDLE_SPIN_POLLS ) {
+        /* Keep busy polling */
+        return;
+    }
+    if ( t->idle.polls < FE_IDLE_PAUSE_POLLS ) {
+        /* Back off */
+        for ( i = 0; i < FE_IDLE_PAUSE_LOOP; i++ ) {
+            __asm__ __volatile__ ("pause");
+        }
+        return;
+    }
+
+    /* Sleep until the NIC writes back the next Rx descriptor if this task
+       handles only one Rx ring, otherwise until the timer expires */
+    addr = NULL;
+    val = 0;
+    if ( 1 == n ) {
+        addr = fe_driver_rx_wait_addr(t->rx.rings[0], &val);
+    }
+    syscall(SYS_xpsleep, addr, val, FE_IDLE_SLEEP_USEC);
+    t->idle.sleeps++;
+}
+
+/*
+ * Process the Rx ring handover requested by the tickful task; the buffers
+ * posted to a ring acquired are released into the pool of this task, so as
+ * many buffers are given back to the pool of the source task
+ */
+static void
+fe_fpp_handover(struct fe_task *t)
+{
+    struct fe_pkt_buf_hdr *hdr;
+    struct fe_pkt_buf_hdr *refund;
+    struct fe_driver_rx *rx;
+    int i;
+    int n;
+
+    /* Release */
+    rx = t->handover.release;
+    if ( NULL != rx ) {
+        for ( i = 0; i < t->rx.n; i++ ) {
+            if ( t->rx.rings[i] == rx ) {
+                /* Replace it with the last one */
+                t->rx.n--;
+                t->rx.rings[i] = t->rx.rings[t->rx.n];
+                t->rx.bitmap &= ~(1ULL << rx->port);
+                break;
+            }
+        }
+        __sync_synchronize();
+        t->handover.release = NULL;
+    }
+
+    /* Acquire */
+    rx = t->handover.acquire;
+    if ( NULL != rx ) {
+        refund = NULL;
+        for ( n = fe_driver_rx_nbufs(rx); n > 0; n-- ) {
+            hdr = fe_get_buffer(t);
+            if ( NULL == hdr ) {
+                break;
+            }
+            hdr->next = refund;
+            refund = hdr;
+        }
+        t->fe->rebalance.refund = refund;
+        /* The write-backs follow the ring to this processor */
+        fe_driver_rx_set_dca(rx, t->cpuid);
+        t->rx.rings[t->rx.n] = rx;
+        t->rx.n++;
+        t->rx.bitmap |= (1ULL << rx->port);
+        __sync_synchronize();
+        t->handover.acquire = NULL;
+    }
+
+    /* Buffers given back for a ring released */
+    refund = t->handover.refund;
+    if ( NULL != refund ) {
+        while ( NULL != refund ) {
+            hdr = refund;
+            refund = refund->next;
+            fe_release_buffer(t, hdr);
+        }
+        __sync_synchronize();
+        t->handover.refund = NULL;
+    }
+}
+
+/*
+ * Poll the Rx rings of an exclusive task once, and process the received
+ * packets and the background work of the fast path; returns the number of
+ * packets received (or generated)
+ */
+static int
+fe_fpp_poll(struct fe_task *t)
+{
+    struct fe_pktgen *pg;
+    struct fe_pkt_buf_hdr *hdr;
+    struct fe_vec *v;
+    int ret;
+    int n;
+    int nb;
+    int nrx;
+    int i;
+    int j;
+
+    /* Quiescent state */
+    t->qsbr = t->fe->epoch;
+
+    /* Rx rings may be migrated between tasks */
+    if ( NULL != t->handover.release || NULL != t->handover.acquire
+         || NULL != t->handover.refund ) {
+        fe_fpp_handover(t);
+    }
+    /* QoS configuration and IPsec SAs updated; applied before any packet
+       is processed, as the schedulers refer to the shapers and the contexts
+       to the anti-replay windows of the configurations retired at the epoch
+       observed above */
+    if ( t->qos.gen != t->fe->qos_gen ) {
+        fe_fpp_qos_update(t);
+    }
+    if ( NULL != t->ipsec && t->ipsec->gen != t->fe->ipsec_gen ) {
+        fe_fpp_ipsec_update(t);
+    }
+    n = t->rx.n;
+
+    /* The bursts of the Rx rings are gathered into the vector of the input
+       node, and the graph is run once the vector is full */
+    v = &t->graph->vecs[FE_NODE_ETHERNET_INPUT];
+    nrx = 0;
+    for ( i = 0; i < n; i++ ) {
+        if ( v->n + FE_RX_BURST > FE_VEC_SIZE ) {
+            fe_graph_run(t);
+        }
+        /* Receive a burst of packets */
+        for ( nb = 0; nb < FE_RX_BURST; nb++ ) {
+            ret = fe_driver_rx_dequeue(t->rx.rings[i], &v->hdrs[v->n + nb],
+                                       &v->pkts[v->n + nb]);
+            if ( ret <= 0 ) {
+                break;
+            }
+            /* Prefetch FE_RX_PREFETCH packets ahead of this one so that the
+               burst does not stall on cold descriptors and headers */
+            if ( 0 == nb ) {
+                for ( j = 0; j < FE_RX_PREFETCH; j++ ) {
+                    fe_driver_rx_prefetch(t->rx.rings[i], j);
+                }
+            } else {
+                fe_driver_rx_prefetch(t->rx.rings[i], FE_RX_PREFETCH - 1);
+            }
+            v->lens[v->n + nb] = ret;
+            v->meta[v->n + nb] = t->rx.rings[i]->port;
+            fe_driver_rx_refill(t, t->rx.rings[i]);
+        }
+        if ( 0 == nb ) {
+            continue;
+        }
+        fe_driver_rx_commit(t->rx.rings[i]);
+        v->n += nb;
+        t->graph->pending |= 1U << FE_NODE_ETHERNET_INPUT;
+
+        t->rx.rings[i]->npkts += nb;
+        nrx += nb;
+    }
+    fe_graph_run(t);
+    /* Packet generator (keeps the task busy) */
+    pg = t->fe->pktgen;
+    if ( NULL != pg ) {
+        nrx += fe_fpp_pktgen(t, pg);
+    }
+    /* Packets held back by the QoS schedulers (shaped, or the Tx ring was
+       full) */
+    if ( 0 != t->qos.backlog ) {
+        fe_fpp_tx_commit(t, t->qos.backlog);
+    }
+    for ( i = 0; i < (ssize_t)t->fe->nports; i++ ) {
+        fe_collect_buffer(t, &t->tx.rings[i]);
+    }
+    /* FDB updates and punted packets processed by the tickful task */
+    fe_kernel_collect(t);
+
+    /* Expire flows */
+    if ( t->fe->ct_enabled ) {
+        ct_expire(t->ct, ct_tick());
+    }
+    /* Release the fragments of the datagrams timed out */
+    if ( NULL != t->ipfrag ) {
+        ipfrag_expire(t->ipfrag, ct_tick());
+        while ( NULL != (hdr = ipfrag_drain(t->ipfrag)) ) {
+            hdr->refs--;
+            fe_discard_buffer(t, hdr);
+        }
+    }
+    /* Buffers returned from the consumer of the capture ring */
+    if ( NULL != t->cap.ring ) {
+        fe_capture_collect(t);
+    }
+
+    /* Flush the sampled flows */
+    if ( NULL != t->sample ) {
+        sample_flush(t->sample, ct_tick());
+    }
+
+    /* Expire NAT mappings of the port block */
+    if ( NULL != t->nat && NULL != t->fe->nat ) {
+        nat_expire(t->nat, ct_tick());
+    }
+
+    return nrx;
+}
+
+/*
+ * Fast-path process
+ */
+void *
+fe_fpp_task(void *args)
+{
+    struct fe_task *t;
+    int nrx;
+
+    /* Get the task data structure from the argument */
+    t = (struct fe_task *)args;
+
+    printf("Launch an exclusive task for fast-path processing at CPU %d, "
+           "managing %d ports.\n", t->cpuid, popcnt(t->rx.bitmap));
+
+    for ( ;; ) {
+        nrx = fe_fpp_poll(t);
+        if ( nrx > 0 || 0 != t->qos.backlog ) {
+            t->idle.polls = 0;
+        } else if ( FE_POLL_ADAPTIVE == t->fe->poll_mode ) {
+            fe_fpp_idle(t, t->rx.n);
+        }
+    }
+}
+
+/*
+ * Migrate an Rx ring from the most loaded exclusive task to the least loaded
+ * one in the same NUMA domain (called from the tickful task)
+ */
+static void
+fe_rebalance(struct fe *fe)
+{
+    struct fe_task *t;
+    struct fe_task *max;
+    struct fe_task *min;
+    struct fe_driver_rx *rx;
+    struct fe_driver_rx *cand;
+    uint64_t tsc;
+    uint64_t diff;
+    uint64_t d;
+    uint64_t best;
+    int i;
+
+    /* Handover in progress */
+    switch ( fe->rebalance.state ) {
+    case FE_REBALANCE_RELEASE:
+        if ( NULL != fe->rebalance.src->handover.release ) {
+            /* Not yet released by the source task */
+            return;
+        }
+        fe->rebalance.ring->owner = fe->rebalance.dst;
+        fe->rebalance.dst->handover.acquire = fe->rebalance.ring;
+        fe->rebalance.state = FE_REBALANCE_ACQUIRE;
+        return;
+
+    case FE_REBALANCE_ACQUIRE:
+        if ( NULL != fe->rebalance.dst->handover.acquire ) {
+            /* Not yet acquired by the destination task */
+            return;
+        }
+        fe->rebalance.ring = NULL;
+        if ( NULL == fe->rebalance.refund ) {
+            fe->rebalance.state = FE_REBALANCE_IDLE;
+            return;
+        }
+        fe->rebalance.src->handover.refund = fe->rebalance.refund;
+        fe->rebalance.refund = NULL;
+        fe->rebalance.state = FE_REBALANCE_REFUND;
+        return;
+
+    case FE_REBALANCE_REFUND:
+        if ( NULL != fe->rebalance.src->handover.refund ) {
+            /* Not yet taken by the source task */
+            return;
+        }
+        fe->rebalance.state = FE_REBALANCE_IDLE;
+        return;
+
+    default:
+        ;
+    }
+
+    tsc = fdb_rdtsc();
+    if ( tsc - fe->rebalance.last_tsc < FE_REBALANCE_TSC ) {
+        return;
+    }
+    fe->rebalance.last_tsc = tsc;
+
+    /* Compute the packet rate of each ring and the load of each task.  The
+       ring arrays are stable while no handover is in progress. */
+    max = NULL;
+    t = fe->extasks;
+    while ( NULL != t ) {
+        t->rx.load = 0;
+        for ( i = 0; i < t->rx.n; i++ ) {
+            rx = t->rx.rings[i];
+            rx->rate = rx->npkts - rx->last_npkts;
+            rx->last_npkts += rx->rate;
+            t->rx.load += rx->rate;
+        }
+        if ( NULL == max || t->rx.load > max->rx.load ) {
+            max = t;
+        }
+        t = t->next;
+    }
+    if ( NULL == max ) {
+        return;
+    }
+    /* The least loaded task in the same NUMA domain; a ring is not migrated
+       across the domains, where its buffers and its descriptors would be
+       remote */
+    min = NULL;
+    t = fe->extasks;
+    while ( NULL != t ) {
+        if ( t != max && t->domain == max->domain
+             && (NULL == min || t->rx.load < min->rx.load) ) {
+            min = t;
+        }
+        t = t->next;
+    }
+    if ( NULL == min || min->rx.load > max->rx.load ) {
+        return;
+    }
+    diff = max->rx.load - min->rx.load;
+    if ( diff < FE_REBALANCE_MIN_PKTS ) {
+        return;
+    }
+
+    /* Find the ring that minimizes the imbalance after the migration, i.e.,
+       whose rate is the closest to the half of the difference */
+    cand = NULL;
+    best = diff;
+    for ( i = 0; i < max->rx.n; i++ ) {
+        rx = max->rx.rings[i];
+        if ( 0 == rx->rate || rx->rate >= diff ) {
+            /* Does not improve the balance */
+            continue;
+        }
+        d = diff > 2 * rx->rate ? diff - 2 * rx->rate : 2 * rx->rate - diff;
+        if ( d < best ) {
+            best = d;
+            cand = rx;
+        }
+    }
+    if ( NULL == cand ) {
+        return;
+    }
+
+    /* Request the source task to release the ring */
+    fe->rebalance.ring = cand;
+    fe->rebalance.src = max;
+    fe->rebalance.dst = min;
+    fe->rebalance.state = FE_REBALANCE_RELEASE;
+    __sync_synchronize();
+    max->handover.release = cand;
+}
+
+/*
+ * The oldest epoch observed by exclusive tasks
+ */
+static uint64_t
+fe_qsbr_epoch(struct fe *fe)
+{
+    struct fe_task *t;
+    uint64_t epoch;
+
+    epoch = fe->epoch;
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( t->qsbr < epoch ) {
+            epoch = t->qsbr;
+        }
+    }
+
+    return epoch;
+}
+
+/*
+ * Publish the ACL recompiled with the updated rules
+ */
+static void
+fe_acl_commit(struct fe *fe)
+{
+    struct acl_table *tbl;
+    struct acl_table *old;
+
+    if ( !fe->acl->dirty ) {
+        return;
+    }
+    if ( acl_compile(fe->acl, &tbl) < 0 ) {
+        /* Keep the current table */
+        printf("Failed to compile ACL.\n");
+        return;
+    }
+    old = fe->acl->cur;
+    __sync_synchronize();
+    fe->acl->cur = tbl;
+    if ( NULL != old ) {
+        fe_retire(fe, old);
+    }
+}
+
+/*
+ * Aggregate the flow records exported by the shards of exclusive tasks
+ */
+static void
+fe_ct_collect(struct fe *fe)
+{
+    struct fe_task *t;
+    struct ct_record r;
+    struct fe_ct_flow *f;
+    int d;
+
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        while ( ct_export_dequeue(t->ct, &r) ) {
+            f = hopscotch_lookup(fe->ct_flows, r.key);
+            if ( NULL == f ) {
+                f = malloc(sizeof(struct fe_ct_flow));
+                if ( NULL == f ) {
+                    continue;
+                }
+                memcpy(f->key, r.key, CT_KEY_SIZE);
+                f->orig = r.orig;
+                memset(f->pkts, 0, sizeof(f->pkts));
+                memset(f->bytes, 0, sizeof(f->bytes));
+                while ( hopscotch_insert(fe->ct_flows, f->key, f) < 0 ) {
+                    /* Expand the table */
+                    if ( hopscotch_resize(fe->ct_flows, 1) < 0 ) {
+                        free(f);
+                        f = NULL;
+                        break;
+                    }
+                }
+                if ( NULL == f ) {
+                    continue;
+                }
+            }
+            /* A flow may be tracked by multiple shards */
+            for ( d = 0; d < 2; d++ ) {
+                f->pkts[d] += r.pkts[d];
+                f->bytes[d] += r.bytes[d];
+            }
+            f->state = r.state;
+            f->final = r.final;
+            f->last = fdb_rdtsc();
+        }
+    }
+}
+
+/*
+ * Remove the aggregated flows that have expired or been idle
+ */
+static void
+fe_ct_gc(struct fe *fe, uint64_t tsc)
+{
+    struct fe_ct_flow *f;
+    ssize_t i;
+
+    for ( i = 0; i < (1LL << fe->ct_flows->pfactor); i++ ) {
+        if ( NULL == fe->ct_flows->buckets[i].key ) {
+            continue;
+        }
+        f = fe->ct_flows->buckets[i].data;
+        if ( (f->final && tsc - f->last > FE_CT_FLOW_LINGER_TSC)
+             || tsc - f->last > ((uint64_t)CT_TIMEOUT_TCP << CT_TICK_SHIFT)
+             + FE_CT_FLOW_LINGER_TSC ) {
+            hopscotch_remove(fe->ct_flows, f->key);
+            free(f);
+        }
+    }
+}
+
+/*
+ * Aggregate the records of the sampled flows from the exclusive tasks
+ */
+static void
+fe_sample_collect(struct fe *fe)
+{
+    struct fe_task *t;
+    struct sample_entry r;
+    struct fe_sample_flow *f;
+    uint64_t rate;
+
+    rate = fe->sample_rate ? fe->sample_rate : 1;
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL == t->sample ) {
+            continue;
+        }
+        while ( sample_export_dequeue(t->sample, &r) ) {
+            f = hopscotch_lookup(fe->sample_flows, r.key);
+            if ( NULL == f ) {
+                f = malloc(sizeof(struct fe_sample_flow));
+                if ( NULL == f ) {
+                    continue;
+                }
+                memcpy(f->key, r.key, SAMPLE_KEY_SIZE);
+                f->samples = 0;
+                f->pkts = 0;
+                f->bytes = 0;
+                while ( hopscotch_insert(fe->sample_flows, f->key, f) < 0 ) {
+                    /* Expand the table */
+                    if ( hopscotch_resize(fe->sample_flows, 1) < 0 ) {
+                        free(f);
+                        f = NULL;
+                        break;
+                    }
+                }
+                if ( NULL == f ) {
+                    continue;
+                }
+            }
+            /* Estimated by scaling with the rate */
+            f->samples += r.pkts;
+            f->pkts += r.pkts * rate;
+            f->bytes += r.bytes * rate;
+        }
+    }
+}
+
+/*
+ * Checksum of an IPv4 header
+ */
+static uint16_t
+_ip_cksum(const void *hdr, int len)
+{
+    const uint16_t *p;
+    uint32_t sum;
+
+    p = hdr;
+    sum = 0;
+    for ( ; len > 1; len -= 2 ) {
+        sum += *p++;
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/*
+ * Return an ICMP Destination Unreachable (Fragmentation Needed) with the
+ * next-hop MTU to the source of a packet with DF set exceeding the MTU
+ * (RFC 1191); sent from the interface routed to the source
+ */
+static void
+fe_icmp_frag_needed(struct fe *fe, int mtu, void *pkt, int len)
+{
+    uint8_t frame[sizeof(struct ether_header) + sizeof(struct ip)
+                  + FE_ICMP_HDR_LEN + 60 + 8];
+    struct ip *oip;
+    struct ip *ip;
+    uint8_t *icmp;
+    uint32_t src;
+    uint16_t nh;
+    int qlen;
+    int hlen;
+
+    if ( len < (int)(sizeof(struct ether_header) + sizeof(struct ip)) ) {
+        return;
+    }
+    oip = (struct ip *)(pkt + sizeof(struct ether_header));
+    hlen = IP_VHL_HL(oip->ip_vhl) * 4;
+    src = ntohl(oip->ip_src);
+    if ( hlen < (int)sizeof(struct ip)
+         || (ntohs(oip->ip_off) & IP_OFFMASK)
+         || 0 == src || src >= 0xe0000000 ) {
+        /* Not for a non-initial fragment, or a multicast, class E, or
+           broadcast source (RFC 1812) */
+        return;
+    }
+    nh = fib4_lookup(fe->fib4, src);
+    if ( 0 == nh || 0 == fe->l3if[fe->nexthops[nh].vid].addr4 ) {
+        return;
+    }
+
+    /* The IP header and the first 8 bytes of the data of the packet */
+    qlen = hlen + 8;
+    if ( qlen > ntohs(oip->ip_len) ) {
+        qlen = ntohs(oip->ip_len);
+    }
+    if ( qlen > len - (int)sizeof(struct ether_header) ) {
+        qlen = len - sizeof(struct ether_header);
+    }
+    memset(frame, 0, sizeof(frame));
+    ip = (struct ip *)(frame + sizeof(struct ether_header));
+    icmp = (uint8_t *)(ip + 1);
+    icmp[0] = FE_ICMP_UNREACH;
+    icmp[1] = FE_ICMP_UNREACH_NEEDFRAG;
+    icmp[6] = mtu >> 8;
+    icmp[7] = mtu;
+    memcpy(icmp + FE_ICMP_HDR_LEN, oip, qlen);
+    /* Zero-padded to 16 bits */
+    *(uint16_t *)(icmp + 2)
+        = _ip_cksum(icmp, (FE_ICMP_HDR_LEN + qlen + 1) & ~1);
+
+    ((struct ether_header *)frame)->ether_type = htons(ETHERTYPE_IP);
+    ip->ip_vhl = (IPVERSION << 4) | (sizeof(struct ip) >> 2);
+    ip->ip_len = htons(sizeof(struct ip) + FE_ICMP_HDR_LEN + qlen);
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_ICMP;
+    ip->ip_src = htonl(fe->l3if[fe->nexthops[nh].vid].addr4);
+    ip->ip_dst = oip->ip_src;
+    ip->ip_sum = _ip_cksum(ip, sizeof(struct ip));
+
+    /* Queued until the next hop is resolved */
+    fe_nexthop_resolve(fe, nh, frame, sizeof(struct ether_header)
+                       + sizeof(struct ip) + FE_ICMP_HDR_LEN + qlen);
+}
+
+/*
+ * Send an IPFIX message to the collector over UDP
+ */
+static void
+fe_sample_send(struct fe *fe, uint8_t *frame, int len)
+{
+    struct ether_header *eth;
+    struct ip *ip;
+    struct udphdr *udp;
+    struct fe_l3if *l3;
+
+    l3 = &fe->l3if[fe->nexthops[fe->collector.nh].vid];
+    eth = (struct ether_header *)frame;
+    ip = (struct ip *)(frame + sizeof(struct ether_header));
+    udp = (struct udphdr *)(ip + 1);
+
+    eth->ether_type = htons(ETHERTYPE_IP);
+    ip->ip_vhl = (IPVERSION << 4) | (sizeof(struct ip) >> 2);
+    ip->ip_tos = 0;
+    ip->ip_len = htons(len - sizeof(struct ether_header));
+    ip->ip_id = htons(fe->collector.seq);
+    ip->ip_off = htons(IP_DF);
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_UDP;
+    ip->ip_sum = 0;
+    ip->ip_src = htonl(l3->addr4);
+    ip->ip_dst = htonl(fe->collector.addr);
+    ip->ip_sum = _ip_cksum(ip, sizeof(struct ip));
+    udp->uh_sport = htons(fe->collector.port);
+    udp->uh_dport = htons(fe->collector.port);
+    udp->uh_ulen = htons(len - sizeof(struct ether_header)
+                         - sizeof(struct ip));
+    /* No checksum */
+    udp->uh_sum = 0;
+
+    /* Queued until the next hop is resolved */
+    fe_nexthop_resolve(fe, fe->collector.nh, frame, len);
+}
+
+/*
+ * Export the sampled flows to the collector (if configured) as IPFIX
+ * messages, and start the next interval
+ */
+static void
+fe_sample_export(struct fe *fe)
+{
+    uint8_t frame[FE_SAMPLE_MTU + sizeof(struct ether_header)];
+    struct sample_ipfix x;
+    struct fe_sample_flow *f;
+    struct timeval tv;
+    uint8_t *msg;
+    int hlen;
+    int send;
+    ssize_t i;
+
+    hlen = sizeof(struct ether_header) + sizeof(struct ip)
+        + sizeof(struct udphdr);
+    msg = frame + hlen;
+    send = 0 != fe->collector.addr
+        && fe->l3if[fe->nexthops[fe->collector.nh].vid].has_addr4;
+    if ( send ) {
+        gettimeofday(&tv, NULL);
+        sample_ipfix_init(&x, msg, sizeof(frame) - hlen, FE_SAMPLE_DOMAIN,
+                          fe->collector.seq, tv.tv_sec);
+    }
+
+    for ( i = 0; i < (1LL << fe->sample_flows->pfactor); i++ ) {
+        if ( NULL == fe->sample_flows->buckets[i].key ) {
+            continue;
+        }
+        f = fe->sample_flows->buckets[i].data;
+        if ( send ) {
+            if ( sample_ipfix_add(&x, (struct sample_key *)f->key, f->pkts,
+                                  f->bytes, fe->sample_rate) < 0 ) {
+                /* Full; send it and start the next message */
+                fe_sample_send(fe, frame, hlen + sample_ipfix_finish(&x));
+                fe->collector.seq += x.nrecs;
+                sample_ipfix_init(&x, msg, sizeof(frame) - hlen,
+                                  FE_SAMPLE_DOMAIN, fe->collector.seq,
+                                  tv.tv_sec);
+                sample_ipfix_add(&x, (struct sample_key *)f->key, f->pkts,
+                                 f->bytes, fe->sample_rate);
+            }
+        }
+        hopscotch_remove(fe->sample_flows, f->key);
+        free(f);
+    }
+    if ( send && x.nrecs > 0 ) {
+        fe_sample_send(fe, frame, hlen + sample_ipfix_finish(&x));
+        fe->collector.seq += x.nrecs;
+    }
+}
+
+/*
+ * Slow-path process
+ */
+int
+fe_process(struct fe *fe)
+{
+    int i;
+    int ret;
+    struct fe_pkt_buf_hdr *hdr;
+    struct fe_kernel_ring *kring;
+    struct fe_kernel_desc desc;
+    void *pkt;
+    uint64_t tsc;
+    uint64_t last_tsc;
+    uint64_t neigh_tsc;
+    uint64_t lacp_tsc;
+    uint64_t sample_tsc;
+    uint64_t safe;
+
+    last_tsc = 0;
+    neigh_tsc = 0;
+    lacp_tsc = 0;
+    sample_tsc = 0;
+    for ( ;; ) {
+        /* For all exclusive processors */
+        for ( i = 0; i < fe->nxcpu; i++ ) {
+            kring = fe->tftask->rx.rings[i]->u.kernel;
+            ret = fe_kernel_rx_dequeue(kring, &hdr, &pkt, &desc);
+            if ( ret < 0 ) {
+                continue;
+            }
+            switch ( desc.mode ) {
+            case FE_KDESC_FDB:
+                /* Command (non-packet) */
+                fdb_update(fe->fdb, (uint8_t *)&pkt, (int)(uint64_t)hdr);
+                fe_kernel_rx_release(kring);
+                break;
+            case FE_KDESC_RESOLVE:
+                /* Routed packet to an unresolved next hop */
+                fe_nexthop_resolve(fe, desc.port, pkt, ret);
+                fe_kernel_rx_release(kring);
+                break;
+            case FE_KDESC_NEIGH:
+                /* ARP or neighbor discovery message */
+                fe_neigh_input(fe, desc.port, desc.vlan, pkt, ret);
+                fe_kernel_rx_release(kring);
+                break;
+            case FE_KDESC_LACP:
+                /* LACPDU or marker PDU at a member link of a LAG */
+                fe_lacp_input(fe, desc.port, pkt, ret);
+                fe_kernel_rx_release(kring);
+                break;
+            case FE_KDESC_FRAGNEEDED:
+                /* Routed packet with DF set exceeding the MTU */
+                fe_icmp_frag_needed(fe, desc.port, pkt, ret);
+                fe_kernel_rx_release(kring);
+                break;
+            default:
+                fe_driver_rx_refill(fe->tftask, fe->tftask->rx.rings[i]);
+                fe_spp_forwarding(fe->tftask, fe->tftask->rx.rings[i], hdr,
+                                  pkt, ret);
+                fe_driver_rx_commit(fe->tftask->rx.rings[i]);
+            }
+        }
+
+        /* Rebalance Rx rings among exclusive tasks */
+        fe_rebalance(fe);
+
+        /* Reuse the FIB memory no exclusive task refers to */
+        safe = fe_qsbr_epoch(fe);
+        fib4_reclaim(fe->fib4, safe);
+        fe_reclaim(fe, safe);
+
+        /* Publish the ACL compiled with the updated rules */
+        fe_acl_commit(fe);
+
+        /* Aggregate the flow counters */
+        if ( fe->ct_enabled ) {
+            fe_ct_collect(fe);
+        }
+        if ( NULL != fe->sample_flows ) {
+            fe_sample_collect(fe);
+        }
+
+        /* Publish the IPv6 FIB rebuilt with the updated routes (retried at
+           the next tick if it failed) */
+        if ( 0 == fib6_commit(fe->fib6, fe->epoch, safe) ) {
+            __sync_synchronize();
+            fe->epoch++;
+        }
+
+        /* Refresh the adjacencies of the next hops */
+        tsc = fdb_rdtsc();
+        if ( tsc - neigh_tsc >= FE_NH_PROBE_TSC / 4 ) {
+            fe_neigh_timer(fe, tsc);
+            neigh_tsc = tsc;
+        }
+
+        /* Periodic LACPDUs and the expiry of the partners */
+        if ( tsc - lacp_tsc >= FE_LACP_TIMER_TSC ) {
+            fe_lacp_timer(fe, tsc);
+            lacp_tsc = tsc;
+        }
+
+        /* Export the sampled flows */
+        if ( NULL != fe->sample_flows
+             && tsc - sample_tsc >= FE_SAMPLE_EXPORT_TSC ) {
+            fe_sample_export(fe);
+            sample_tsc = tsc;
+        }
+
+        /* Garbage collection */
+        if ( tsc - last_tsc > 10000000000ULL ) {
+            fdb_gc(fe->fdb);
+            fe_ct_gc(fe, tsc);
+            /* Print out FDB */
+#if 0
+            fdb_debug(fe->fdb);
+#endif
+            last_tsc = tsc;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Enable (or disable) connection tracking of routed packets
+ */
+int
+fe_conntrack_enable(struct fe *fe, int on)
+{
+    fe->ct_enabled = on ? 1 : 0;
+
+    return 0;
+}
+
+/*
+ * Enable NAPT of the inside prefix (prefix/len) to the external address eaddr
+ * with the ports from port_lo to port_hi (host byte order).  The port range is
+ * split into a block per exclusive task so that each task allocates mappings
+ * without synchronization.  It can be set only once.
+ */
+int
+fe_nat_set(struct fe *fe, uint32_t eaddr, uint32_t prefix, int len,
+           uint16_t port_lo, uint16_t port_hi)
+{
+    struct nat *nat;
+    struct fe_task *t;
+    uint32_t mask;
+    uint32_t blk;
+    void *pa;
+    void *va;
+    int i;
+    int ret;
+
+    if ( NULL != fe->nat || len < 0 || len > 32 || port_lo > port_hi
+         || fe->nxcpu <= 0 ) {
+        return -1;
+    }
+    blk = ((uint32_t)port_hi - port_lo + 1) / fe->nxcpu;
+    if ( 0 == blk ) {
+        return -1;
+    }
+    mask = len ? 0xffffffffU << (32 - len) : 0;
+
+    nat = malloc(sizeof(struct nat));
+    if ( NULL == nat ) {
+        return -1;
+    }
+    nat->shards = malloc(sizeof(struct nat_shard *) * fe->nxcpu);
+    if ( NULL == nat->shards ) {
+        free(nat);
+        return -1;
+    }
+    nat->eaddr = htonl(eaddr);
+    nat->prefix = htonl(prefix & mask);
+    nat->mask = htonl(mask);
+    nat->port_lo = port_lo;
+    nat->blk = blk;
+    nat->nshards = fe->nxcpu;
+
+    /* Port block of each exclusive task in its NUMA domain.  The tasks are
+       not attached until every block is allocated, so that a failure leaves
+       the previous configuration intact.  Note that the memory of the
+       domains cannot be returned to the kernel. */
+    i = 0;
+    for ( t = fe->extasks; NULL != t && i < fe->nxcpu; t = t->next ) {
+        ret = syscall(SYS_pix_malloc, nat_shard_memsize(blk), &pa, &va,
+                      t->domain);
+        if ( ret < 0 ) {
+            free(nat->shards);
+            free(nat);
+            return -1;
+        }
+        nat->shards[i] = nat_shard_init(va, port_lo + i * blk, blk);
+        i++;
+    }
+    if ( i != fe->nxcpu ) {
+        free(nat->shards);
+        free(nat);
+        return -1;
+    }
+    i = 0;
+    for ( t = fe->extasks; NULL != t && i < fe->nxcpu; t = t->next ) {
+        t->nat = nat->shards[i];
+        i++;
+    }
+
+    /* Publish to the fast path */
+    __sync_synchronize();
+    fe->nat = nat;
+
+    return 0;
+}
+
+/*
+ * Calibrate the TSC frequency against the wall clock
+ */
+static uint64_t
+_tsc_hz(void)
+{
+    struct timeval tv0;
+    struct timeval tv1;
+    struct timespec tm;
+    uint64_t tsc0;
+    uint64_t tsc1;
+    uint64_t us;
+
+    tm.tv_sec = 0;
+    tm.tv_nsec = 100000000;
+    gettimeofday(&tv0, NULL);
+    tsc0 = fdb_rdtsc();
+    nanosleep(&tm, NULL);
+    gettimeofday(&tv1, NULL);
+    tsc1 = fdb_rdtsc();
+    us = (tv1.tv_sec - tv0.tv_sec) * 1000000ULL + tv1.tv_usec - tv0.tv_usec;
+    if ( 0 == us ) {
+        return 0;
+    }
+
+    return (tsc1 - tsc0) * 1000000ULL / us;
+}
+
+/*
+ * Start the packet generator mode; the exclusive tasks transmit the frames
+ * to the Tx ports at cfg->pps per port (0 for line rate), and count the
+ * frames received at the Rx ports instead of forwarding them
+ */
+int
+fe_pktgen_start(struct fe *fe, const struct pktgen_config *cfg)
+{
+    struct fe_pktgen *pg;
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int ret;
+
+    if ( NULL != fe->pktgen || pktgen_config_validate(cfg) < 0
+         || fe->nxcpu <= 0 ) {
+        return -1;
+    }
+    if ( (cfg->txports | cfg->rxports) >> fe->nports ) {
+        return -1;
+    }
+    if ( 0 == fe->tsc_hz ) {
+        fe->tsc_hz = _tsc_hz();
+        if ( 0 == fe->tsc_hz ) {
+            return -1;
+        }
+    }
+
+    /* Generators of the exclusive tasks in their NUMA domains */
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL != t->pktgen ) {
+            continue;
+        }
+        ret = syscall(SYS_pix_malloc, sizeof(struct pktgen), &pa, &va,
+                      t->domain);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        t->pktgen = va;
+        t->pktgen->gen = 0;
+    }
+
+    pg = malloc(sizeof(struct fe_pktgen));
+    if ( NULL == pg ) {
+        return -1;
+    }
+    memcpy(&pg->cfg, cfg, sizeof(struct pktgen_config));
+    pg->gen = ++fe->pktgen_gen;
+    pg->pps = (cfg->pps + fe->nxcpu - 1) / fe->nxcpu;
+    pg->hz = fe->tsc_hz;
+    fe->pktgen_start = fdb_rdtsc();
+    fe->pktgen_stop = 0;
+
+    /* Publish to the fast path */
+    __sync_synchronize();
+    fe->pktgen = pg;
+
+    return 0;
+}
+
+/*
+ * Stop the packet generator mode; the statistics are kept until the next
+ * start
+ */
+int
+fe_pktgen_stop(struct fe *fe)
+{
+    struct fe_pktgen *pg;
+
+    pg = fe->pktgen;
+    if ( NULL == pg ) {
+        return -1;
+    }
+    fe->pktgen = NULL;
+    fe->pktgen_stop = fdb_rdtsc();
+    fe_retire(fe, pg);
+
+    return 0;
+}
+
+/*
+ * Sum the statistics of the packet generators of the exclusive tasks
+ */
+void
+fe_pktgen_stats(struct fe *fe, struct pktgen_stats *stats)
+{
+    struct fe_task *t;
+
+    memset(stats, 0, sizeof(struct pktgen_stats));
+    stats->lat_min = ~0ULL;
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL != t->pktgen && 0 != t->pktgen->gen ) {
+            pktgen_stats_add(stats, &t->pktgen->stats);
+        }
+    }
+}
+
+/*
+ * Print out the throughput and the latency (in nanoseconds; the median and
+ * the 99th percentile are the upper bounds of the histogram buckets) of the
+ * running generator, or of the last run once stopped
+ */
+void
+fe_pktgen_print(struct fe *fe)
+{
+    struct pktgen_stats st;
+    uint64_t elapsed;
+    uint64_t hz;
+    uint64_t cum;
+    uint64_t p50;
+    uint64_t p99;
+    int i;
+
+    hz = fe->tsc_hz;
+    if ( 0 == fe->pktgen_gen || 0 == hz ) {
+        /* Never started */
+        return;
+    }
+    if ( NULL != fe->pktgen ) {
+        elapsed = fdb_rdtsc() - fe->pktgen_start;
+    } else {
+        elapsed = fe->pktgen_stop - fe->pktgen_start;
+    }
+    if ( 0 == elapsed ) {
+        return;
+    }
+    fe_pktgen_stats(fe, &st);
+
+    printf("pktgen: tx %lld pkts (%lld pps, %lld Mbps), %lld drops\n",
+           (long long)st.tx_pkts, (long long)(st.tx_pkts * hz / elapsed),
+           (long long)(st.tx_bytes * 8 / 1000000 * hz / elapsed),
+           (long long)st.tx_drops);
+    printf("pktgen: rx %lld pkts (%lld pps, %lld Mbps)\n",
+           (long long)st.rx_pkts, (long long)(st.rx_pkts * hz / elapsed),
+           (long long)(st.rx_bytes * 8 / 1000000 * hz / elapsed));
+    if ( 0 == st.rx_stamped ) {
+        return;
+    }
+    p50 = 0;
+    p99 = 0;
+    cum = 0;
+    for ( i = 0; i < PKTGEN_LAT_BUCKETS; i++ ) {
+        cum += st.lat_hist[i];
+        if ( 0 == p50 && cum * 2 >= st.rx_stamped ) {
+            p50 = 1ULL << i;
+        }
+        if ( 0 == p99 && cum * 100 >= st.rx_stamped * 99 ) {
+            p99 = 1ULL << i;
+        }
+    }
+    printf("pktgen: latency avg %lld min %lld max %lld p50 %lld p99 %lld "
+           "(ns)\n",
+           (long long)(st.lat_sum / st.rx_stamped * 1000000000ULL / hz),
+           (long long)(st.lat_min * 1000000000ULL / hz),
+           (long long)(st.lat_max * 1000000000ULL / hz),
+           (long long)(p50 * 1000000000ULL / hz),
+           (long long)(p99 * 1000000000ULL / hz));
+}
+
+/*
+ * Configure (cfg) or disable (NULL) the QoS Tx scheduler of a port; the
+ * packets queued in the schedulers of the port are dropped
+ */
+int
+fe_qos_set(struct fe *fe, int port, const struct qos_config *cfg)
+{
+    struct fe_qos *q;
+    struct fe_qos *old;
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int ret;
+    int i;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    if ( NULL != cfg ) {
+        for ( i = 0; i < QOS_NCLASSES; i++ ) {
+            if ( QOS_STRICT != cfg->classes[i].mode
+                 && QOS_DRR != cfg->classes[i].mode ) {
+                return -1;
+            }
+        }
+        if ( 0 == fe->tsc_hz ) {
+            fe->tsc_hz = _tsc_hz();
+            if ( 0 == fe->tsc_hz ) {
+                return -1;
+            }
+        }
+    }
+
+    /* Schedulers of the exclusive tasks in their NUMA domains */
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL != t->qos.ports[port] ) {
+            continue;
+        }
+        ret = syscall(SYS_pix_malloc, sizeof(struct qos_sched), &pa, &va,
+                      t->domain);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        memset(va, 0, sizeof(struct qos_sched));
+        t->qos.ports[port] = va;
+    }
+
+    q = malloc(sizeof(struct fe_qos));
+    if ( NULL == q ) {
+        return -1;
+    }
+    memset(q, 0, sizeof(struct fe_qos));
+    if ( NULL != cfg ) {
+        memcpy(&q->cfg, cfg, sizeof(struct qos_config));
+        q->enabled = 1;
+        qos_shaper_init(&q->shaper, cfg, fe->tsc_hz, fdb_rdtsc());
+    }
+    q->hz = fe->tsc_hz;
+
+    /* Publish to the fast path; the previous configuration is read by the
+       tasks until their next quiescent state */
+    old = fe->qos[port];
+    fe->qos[port] = q;
+    __sync_synchronize();
+    fe->qos_gen++;
+    if ( NULL != old ) {
+        fe_retire(fe, old);
+    }
+
+    return 0;
+}
+
+/*
+ * Sum up the tail drops of each class of the QoS Tx scheduler of a port
+ * (approximate while the exclusive tasks are running)
+ */
+int
+fe_qos_drops(struct fe *fe, int port, uint64_t *drops)
+{
+    struct fe_task *t;
+    int i;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    memset(drops, 0, sizeof(uint64_t) * QOS_NCLASSES);
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL == t->qos.ports[port] ) {
+            continue;
+        }
+        for ( i = 0; i < QOS_NCLASSES; i++ ) {
+            drops[i] += t->qos.ports[port]->classes[i].drops;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Configure (cfg) or disable (NULL) the ingress policer and storm control of
+ * a port; the buckets start full, and the counters are carried over
+ */
+int
+fe_police_set(struct fe *fe, int port, const struct police_config *cfg)
+{
+    const struct police_meter_config *mc;
+    struct police *p;
+    struct police *old;
+    int i;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    p = NULL;
+    if ( NULL != cfg ) {
+        for ( i = 0; i < POLICE_NCLASSES; i++ ) {
+            mc = &cfg->classes[i];
+            switch ( mc->mode ) {
+            case POLICE_NONE:
+                break;
+            case POLICE_SRTCM:
+                if ( 0 == mc->cir || 0 == mc->cbs ) {
+                    return -1;
+                }
+                break;
+            case POLICE_TRTCM:
+                if ( 0 == mc->cir || 0 == mc->cbs || mc->pir < mc->cir
+                     || 0 == mc->pbs ) {
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+            }
+        }
+        for ( i = 0; i < POLICE_NSTORMS; i++ ) {
+            if ( 0 != cfg->storm[i].pps && 0 == cfg->storm[i].burst ) {
+                return -1;
+            }
+        }
+        if ( 0 == fe->tsc_hz ) {
+            fe->tsc_hz = _tsc_hz();
+            if ( 0 == fe->tsc_hz ) {
+                return -1;
+            }
+        }
+        p = malloc(sizeof(struct police));
+        if ( NULL == p ) {
+            return -1;
+        }
+        police_init(p, cfg, fe->tsc_hz, fdb_rdtsc());
+    }
+
+    /* Publish to the fast path; the previous policer may be updated by the
+       task polling the port until its next quiescent state */
+    old = fe->police[port];
+    if ( NULL != p && NULL != old ) {
+        memcpy(&p->stats, &old->stats, sizeof(struct police_stats));
+    }
+    __sync_synchronize();
+    fe->police[port] = p;
+    if ( NULL != old ) {
+        fe_retire(fe, old);
+    }
+
+    return 0;
+}
+
+/*
+ * Counters of the ingress policer of a port (approximate while the exclusive
+ * tasks are running)
+ */
+int
+fe_police_stats(struct fe *fe, int port, struct police_stats *st)
+{
+    struct police *p;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    p = fe->police[port];
+    if ( NULL == p ) {
+        return -1;
+    }
+    memcpy(st, &p->stats, sizeof(struct police_stats));
+
+    return 0;
+}
+
+/*
+ * Sample 1-in-rate packets received at the ports (0 to disable; at most
+ * SAMPLE_MAX_RATE); the samplers of the exclusive tasks are allocated at the
+ * first call
+ */
+int
+fe_sample_set(struct fe *fe, uint32_t rate)
+{
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int ret;
+
+    if ( rate > SAMPLE_MAX_RATE ) {
+        return -1;
+    }
+    if ( NULL == fe->sample_flows && 0 != rate ) {
+        for ( t = fe->extasks; NULL != t; t = t->next ) {
+            ret = syscall(SYS_pix_malloc, sample_memsize(), &pa, &va,
+                          t->domain);
+            if ( ret < 0 ) {
+                return -1;
+            }
+            t->sample = sample_init(va, fdb_rdtsc() ^ (t->cpuid * 0x9e3779b9));
+        }
+        fe->sample_flows = hopscotch_init(NULL, SAMPLE_KEY_SIZE);
+        if ( NULL == fe->sample_flows ) {
+            return -1;
+        }
+    }
+
+    /* Publish to the fast path */
+    __sync_synchronize();
+    fe->sample_rate = rate;
+
+    return 0;
+}
+
+/*
+ * Export the sampled flows as IPFIX messages over UDP to the collector at
+ * addr (host byte order; 0 to disable) and port, reached through the next hop
+ * nh
+ */
+int
+fe_sample_set_collector(struct fe *fe, uint32_t addr, uint16_t port,
+                        uint16_t nh)
+{
+    if ( 0 != addr && (0 == nh || nh >= FE_MAX_NEXTHOPS) ) {
+        return -1;
+    }
+    fe->collector.addr = addr;
+    fe->collector.port = port;
+    fe->collector.nh = nh;
+
+    return 0;
+}
+
+/*
+ * Call fn for each sampled flow aggregated since the last export
+ */
+void
+fe_sample_foreach(struct fe *fe,
+                  void (*fn)(const struct fe_sample_flow *, void *), void *arg)
+{
+    ssize_t i;
+
+    if ( NULL == fe->sample_flows ) {
+        return;
+    }
+    for ( i = 0; i < (1LL << fe->sample_flows->pfactor); i++ ) {
+        if ( NULL != fe->sample_flows->buckets[i].key ) {
+            fn(fe->sample_flows->buckets[i].data, arg);
+        }
+    }
+}
+
+/*
+ * Set up the directory and the capture rings of the exclusive tasks; on
+ * failure, no task is left with a ring (the memory of the domains cannot be
+ * returned to the kernel, but the rest is freed)
+ */
+static struct fe_capture *
+_capture_init(struct fe *fe)
+{
+    struct fe_pkt_buf_hdr **bufs[CAP_MAX_RINGS];
+    struct cap_ring *rings[CAP_MAX_RINGS];
+    struct fe_capture *cap;
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int d;
+    int i;
+    int ret;
+
+    if ( fe->nxcpu > CAP_MAX_RINGS ) {
+        return NULL;
+    }
+    cap = malloc(sizeof(struct fe_capture));
+    if ( NULL == cap ) {
+        return NULL;
+    }
+    cap->rxports = 0;
+    cap->txports = 0;
+    cap->filter = NULL;
+
+    /* Directory (in the low memory) */
+    ret = syscall(SYS_pix_malloc, sizeof(struct cap_dir), &pa, &va, -1);
+    if ( ret < 0 ) {
+        free(cap);
+        return NULL;
+    }
+    cap->dir = va;
+    cap->dirpa = pa;
+    memset(cap->dir, 0, sizeof(struct cap_dir));
+    cap->dir->magic = CAP_MAGIC;
+    cap->dir->version = CAP_VERSION;
+    cap->dir->ringsize = cap_ring_memsize(CAP_RING_SIZE);
+    for ( d = 0; d < PIX_MAX_DOMAINS && d < CAP_MAX_REGIONS; d++ ) {
+        if ( 0 == fe->bufpool[d].len ) {
+            continue;
+        }
+        cap->dir->regions[cap->dir->nregions].paddr
+            = (uint64_t)fe->bufpool[d].paddr;
+        cap->dir->regions[cap->dir->nregions].len = fe->bufpool[d].len;
+        cap->dir->nregions++;
+    }
+
+    /* Ring of each exclusive task in its NUMA domain; the tasks are not
+       attached until all the rings are allocated */
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        i = cap->dir->nrings;
+        if ( i >= CAP_MAX_RINGS ) {
+            goto error;
+        }
+        bufs[i] = malloc(sizeof(struct fe_pkt_buf_hdr *) * CAP_RING_SIZE);
+        if ( NULL == bufs[i] ) {
+            goto error;
+        }
+        ret = syscall(SYS_pix_malloc, cap_ring_memsize(CAP_RING_SIZE), &pa,
+                      &va, t->domain);
+        if ( ret < 0 ) {
+            free(bufs[i]);
+            goto error;
+        }
+        rings[i] = cap_ring_init(va, CAP_RING_SIZE);
+        cap->dir->rings[i] = (uint64_t)pa;
+        cap->dir->nrings++;
+    }
+    for ( i = 0, t = fe->extasks; NULL != t; i++, t = t->next ) {
+        t->cap.collected = 0;
+        t->cap.bufs = bufs[i];
+        __sync_synchronize();
+        t->cap.ring = rings[i];
+    }
+
+    return cap;
+
+error:
+    for ( i = 0; i < (int)cap->dir->nrings; i++ ) {
+        free(bufs[i]);
+    }
+    free(cap);
+    return NULL;
+}
+
+/*
+ * Capture the packets received at the ports in rxports and transmitted to the
+ * ports in txports (bitmaps) that pass the filter prog of n instructions
+ * (NULL to capture all); capture stops with empty bitmaps.  The physical
+ * address of the directory of the capture rings, to be mapped by the
+ * consumer, is returned to dirpa.
+ */
+int
+fe_capture_set(struct fe *fe, uint64_t rxports, uint64_t txports,
+               const struct cap_insn *prog, int n, void **dirpa)
+{
+    struct fe_capture *cap;
+    struct cap_filter *filter;
+    struct cap_filter *old;
+
+    filter = NULL;
+    if ( NULL != prog ) {
+        if ( cap_filter_validate(prog, n) < 0 ) {
+            return -1;
+        }
+        filter = malloc(sizeof(struct cap_filter)
+                        + sizeof(struct cap_insn) * n);
+        if ( NULL == filter ) {
+            return -1;
+        }
+        filter->n = n;
+        memcpy(filter->insns, prog, sizeof(struct cap_insn) * n);
+    }
+
+    cap = fe->capture;
+    if ( NULL == cap ) {
+        cap = _capture_init(fe);
+        if ( NULL == cap ) {
+            if ( NULL != filter ) {
+                free(filter);
+            }
+            return -1;
+        }
+        cap->filter = filter;
+        cap->rxports = rxports;
+        cap->txports = txports;
+
+        /* Publish to the fast path */
+        __sync_synchronize();
+        fe->capture = cap;
+    } else {
+        /* The old filter is freed after the exclusive tasks have passed a
+           quiescent state */
+        old = cap->filter;
+        cap->filter = filter;
+        cap->rxports = rxports;
+        cap->txports = txports;
+        if ( NULL != old ) {
+            fe_retire(fe, old);
+        }
+    }
+    *dirpa = cap->dirpa;
+
+    return 0;
+}
+
+/*
+ * Add (or replace) an ACL rule; applied to the fast path by the tickful task
+ */
+int
+fe_acl_add(struct fe *fe, const struct acl_rule *rule)
+{
+    if ( (rule->flags & ACL_F_PORT)
+         && (rule->port < 0 || rule->port >= (int)fe->nports) ) {
+        return -1;
+    }
+
+    return acl_add(fe->acl, rule);
+}
+
+/*
+ * Delete an ACL rule
+ */
+int
+fe_acl_delete(struct fe *fe, int id)
+{
+    return acl_delete(fe->acl, id);
+}
+
+/*
+ * Set the action for packets matching no ACL rule
+ */
+int
+fe_acl_set_default(struct fe *fe, enum acl_action action)
+{
+    if ( ACL_PERMIT != action && ACL_DENY != action ) {
+        return -1;
+    }
+    acl_set_default(fe->acl, action);
+
+    return 0;
+}
+
+/*
+ * Add a next hop resolved on demand to the table of the addresses
+ */
+static int
+_nexthop_link(struct fe *fe, struct fe_nexthop *nh)
+{
+    struct fe_nexthop *head;
+
+    _nexthop_key(nh->key, nh->af, nh->vid, nh->addr);
+    nh->next = 0;
+    head = hopscotch_lookup(fe->nhaddrs, nh->key);
+    if ( NULL != head ) {
+        /* Another next hop of the same address */
+        nh->next = head->next;
+        head->next = nh - fe->nexthops;
+        return 0;
+    }
+    while ( hopscotch_insert(fe->nhaddrs, nh->key, nh) < 0 ) {
+        /* Grow the hash table */
+        if ( hopscotch_resize(fe->nhaddrs, 1) < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Remove a next hop resolved on demand from the table of the addresses
+ */
+static void
+_nexthop_unlink(struct fe *fe, struct fe_nexthop *nh)
+{
+    struct fe_nexthop *head;
+    struct fe_nexthop *prev;
+
+    head = hopscotch_lookup(fe->nhaddrs, nh->key);
+    if ( head == nh ) {
+        /* The next one of the same address (if any) takes over the key */
+        hopscotch_remove(fe->nhaddrs, nh->key);
+        if ( 0 != nh->next ) {
+            hopscotch_insert(fe->nhaddrs, fe->nexthops[nh->next].key,
+                             &fe->nexthops[nh->next]);
+        }
+    } else {
+        for ( prev = head; NULL != prev && 0 != prev->next;
+              prev = &fe->nexthops[prev->next] ) {
+            if ( &fe->nexthops[prev->next] == nh ) {
+                prev->next = nh->next;
+                break;
+            }
+        }
+    }
+    nh->next = 0;
+}
+
+/*
+ * Reset a next hop to be reconfigured
+ */
+static struct fe_nexthop *
+_nexthop_reset(struct fe *fe, uint16_t idx)
+{
+    struct fe_nexthop *nh;
+
+    if ( 0 == idx || idx >= FE_MAX_NEXTHOPS ) {
+        return NULL;
+    }
+    nh = &fe->nexthops[idx];
+    if ( fe_nexthop_adj(fe, nh, 0, 0, NULL) < 0 ) {
+        return NULL;
+    }
+    fe_nexthop_flush(fe, nh);
+    if ( FE_NH_NONE != nh->state && FE_NH_PERMANENT != nh->state ) {
+        _nexthop_unlink(fe, nh);
+    }
+    nh->used = 0;
+    nh->sa = 0;
+    nh->state = FE_NH_NONE;
+    nh->probes = 0;
+    nh->probed = 0;
+    nh->confirmed = 0;
+
+    return nh;
+}
+
+/*
+ * Add (or replace) a next hop with a static adjacency
+ */
+int
+fe_nexthop_set(struct fe *fe, uint16_t idx, int port, uint16_t vid,
+               const uint8_t *mac)
+{
+    struct fe_nexthop *nh;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    if ( vid >= FE_VLAN_MAX || !(fe->vlan_members[vid] & (1ULL << port)) ) {
+        return -1;
+    }
+    nh = _nexthop_reset(fe, idx);
+    if ( NULL == nh ) {
+        return -1;
+    }
+    nh->vid = vid;
+    nh->af = 0;
+    if ( fe_nexthop_adj(fe, nh, port, vid, mac) < 0 ) {
+        return -1;
+    }
+    nh->state = FE_NH_PERMANENT;
+
+    return 0;
+}
+
+/*
+ * Add (or replace) a next hop of an IPv4 address (in host byte order) on a
+ * VLAN; resolved by ARP on demand
+ */
+int
+fe_nexthop_set4(struct fe *fe, uint16_t idx, uint16_t vid, uint32_t addr)
+{
+    struct fe_nexthop *nh;
+
+    if ( vid < 1 || vid >= FE_VLAN_MAX - 1 ) {
+        return -1;
+    }
+    nh = _nexthop_reset(fe, idx);
+    if ( NULL == nh ) {
+        return -1;
+    }
+    nh->vid = vid;
+    nh->af = 4;
+    addr = htonl(addr);
+    memset(nh->addr, 0, sizeof(nh->addr));
+    memcpy(nh->addr, &addr, 4);
+    if ( _nexthop_link(fe, nh) < 0 ) {
+        return -1;
+    }
+    nh->state = FE_NH_INCOMPLETE;
+
+    return 0;
+}
+
+/*
+ * Add (or replace) a next hop of an IPv6 address on a VLAN; resolved by
+ * neighbor discovery on demand
+ */
+int
+fe_nexthop_set6(struct fe *fe, uint16_t idx, uint16_t vid,
+                const uint8_t *addr)
+{
+    struct fe_nexthop *nh;
+
+    if ( vid < 1 || vid >= FE_VLAN_MAX - 1 ) {
+        return -1;
+    }
+    nh = _nexthop_reset(fe, idx);
+    if ( NULL == nh ) {
+        return -1;
+    }
+    nh->vid = vid;
+    nh->af = 6;
+    memcpy(nh->addr, addr, 16);
+    if ( _nexthop_link(fe, nh) < 0 ) {
+        return -1;
+    }
+    nh->state = FE_NH_INCOMPLETE;
+
+    return 0;
+}
+
+/*
+ * Delete a next hop
+ */
+int
+fe_nexthop_delete(struct fe *fe, uint16_t idx)
+{
+    if ( NULL == _nexthop_reset(fe, idx) ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Assign an IPv4 address (in host byte order) to the interface of a VLAN
+ */
+int
+fe_l3if_set4(struct fe *fe, uint16_t vid, uint32_t addr)
+{
+    if ( vid < 1 || vid >= FE_VLAN_MAX - 1 ) {
+        return -1;
+    }
+    fe->l3if[vid].addr4 = addr;
+    fe->l3if[vid].has_addr4 = 1;
+
+    return 0;
+}
+
+/*
+ * Assign an IPv6 address to the interface of a VLAN
+ */
+int
+fe_l3if_set6(struct fe *fe, uint16_t vid, const uint8_t *addr)
+{
+    if ( vid < 1 || vid >= FE_VLAN_MAX - 1 ) {
+        return -1;
+    }
+    memcpy(fe->l3if[vid].addr6, addr, 16);
+    fe->l3if[vid].has_addr6 = 1;
+
+    return 0;
+}
+
+/*
+ * Set the MTU of the interface of a VLAN (0 for the maximum frame size of
+ * the ports); IPv4 packets routed to it are fragmented, or answered with an
+ * ICMP Fragmentation Needed if DF is set, while IPv6 packets are dropped
+ * without an ICMPv6 Packet Too Big
+ */
+int
+fe_l3if_set_mtu(struct fe *fe, uint16_t vid, int mtu)
+{
+    if ( vid < 1 || vid >= FE_VLAN_MAX - 1 ) {
+        return -1;
+    }
+    if ( 0 != mtu
+         && (mtu < FE_MIN_MTU
+             || mtu > FE_PKTSZ - FE_PKT_HDROFF
+             - (int)sizeof(struct ether_header)) ) {
+        return -1;
+    }
+    fe->l3if[vid].mtu = mtu;
+
+    return 0;
+}
+
+/*
+ * Sum up the counters of the IPv4 fragmentation and reassembly over the
+ * exclusive tasks (approximate while they are running)
+ */
+int
+fe_ipfrag_stats(struct fe *fe, struct ipfrag_stats *stats)
+{
+    struct fe_task *t;
+    struct ipfrag_stats *s;
+
+    memset(stats, 0, sizeof(struct ipfrag_stats));
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL == t->ipfrag ) {
+            continue;
+        }
+        s = &t->ipfrag->stats;
+        stats->reassembled += s->reassembled;
+        stats->evictions += s->evictions;
+        stats->timeouts += s->timeouts;
+        stats->drops += s->drops;
+        stats->fragmented += s->fragmented;
+        stats->frags_out += s->frags_out;
+        stats->frag_drops += s->frag_drops;
+        stats->frag_needed += s->frag_needed;
+    }
+
+    return 0;
+}
+
+/*
+ * Sum up the vectors and the packets processed by a node of the graph over
+ * the exclusive tasks (the mean vector size is pkts / vectors), and return
+ * its name (NULL if not a node)
+ */
+const char *
+fe_graph_stats(struct fe *fe, int node, uint64_t *vectors, uint64_t *pkts)
+{
+    struct fe_task *t;
+
+    if ( node < 0 || node >= FE_NODE_MAX ) {
+        return NULL;
+    }
+    *vectors = 0;
+    *pkts = 0;
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL == t->graph ) {
+            continue;
+        }
+        *vectors += t->graph->stats[node].vectors;
+        *pkts += t->graph->stats[node].pkts;
+    }
+
+    return fe_nodes[node].name;
+}
+
+/*
+ * Add an IPv4 route (prefix in host byte order) to a next hop
+ */
+int
+fe_route4_add(struct fe *fe, uint32_t prefix, int len, uint16_t nh)
+{
+    if ( 0 == nh || nh >= FE_MAX_NEXTHOPS ) {
+        return -1;
+    }
+
+    return fib4_add(fe->fib4, prefix, len, nh);
+}
+
+/*
+ * Delete an IPv4 route
+ */
+int
+fe_route4_delete(struct fe *fe, uint32_t prefix, int len)
+{
+    int ret;
+
+    ret = fib4_delete(fe->fib4, prefix, len, fe->epoch);
+    /* Memory released at this epoch is reused after all exclusive tasks have
+       observed the next one */
+    __sync_synchronize();
+    fe->epoch++;
+
+    return ret;
+}
+
+/*
+ * Add an IPv6 route (prefix of the upper and lower 64 bits in host byte order)
+ * to a next hop; routes are applied to the fast path in a batch by the
+ * tickful task.  Returns -1 if the FIB would exceed its memory budget.
+ */
+int
+fe_route6_add(struct fe *fe, const uint64_t *prefix, int len, uint16_t nh)
+{
+    if ( 0 == nh || nh >= FE_MAX_NEXTHOPS ) {
+        return -1;
+    }
+
+    return fib6_add(fe->fib6, prefix, len, nh);
+}
+
+/*
+ * Delete an IPv6 route
+ */
+int
+fe_route6_delete(struct fe *fe, const uint64_t *prefix, int len)
+{
+    return fib6_delete(fe->fib6, prefix, len);
+}
+
+/*
+ * Create a job at the specified exclusive processor
+ */
+void
+syspix_create_job(int cpuid, void *args)
+{
+    syscall(SYS_pix_create_job, cpuid, fe_fpp_task, args);
+}
+
+/*
+ * Initialize device
  */
 static struct fe_device *
 _init_device(struct pci_dev_conf *conf)
 {
-    struct fe_device dev;
-    struct fe_device *devp;
+    struct fe_device dev;
+    struct fe_device *devp;
+
+    /* Check the driver type and initialize the hardware */
+    dev.driver = FE_DRIVER_INVALID;
+    if ( e1000_is_e1000(conf->vendor_id, conf->device_id) ) {
+        /* e1000 */
+        dev.driver = FE_DRIVER_E1000;
+        dev.u.e1000
+            = e1000_init(conf->device_id, conf->bus, conf->slot, conf->func);
+        dev.u.e1000->pirq = (((conf->intr_pin -1) + conf->slot) % 4) + 0x10;
+        e1000_init_hw(dev.u.e1000);
+        e1000_setup_rx(dev.u.e1000);
+        e1000_setup_tx(dev.u.e1000);
+        dev.rxq_last = -1;
+        dev.txq_last = -1;
+        dev.fastpath = 0;
+    } else if ( ixgbe_is_ixgbe(conf->vendor_id, conf->device_id) ) {
+        /* ixgbe */
+        dev.driver = FE_DRIVER_IXGBE;
+        dev.u.ixgbe
+            = ixgbe_init(conf->device_id, conf->bus, conf->slot, conf->func);
+        ixgbe_init_hw(dev.u.ixgbe);
+        ixgbe_setup_rx(dev.u.ixgbe);
+        ixgbe_setup_tx(dev.u.ixgbe);
+        ixgbe_enable_rx(dev.u.ixgbe);
+        ixgbe_enable_tx(dev.u.ixgbe);
+        ixgbe_enable_dca(dev.u.ixgbe);
+        dev.rxq_last = -1;
+        dev.txq_last = -1;
+        dev.fastpath = 0;
+    } else if ( memdrv_is_memdrv(conf->vendor_id, conf->device_id) ) {
+        /* Memory-backed device (host-side harnesses) */
+        dev.driver = FE_DRIVER_MEMORY;
+        dev.u.mem = memdrv_init(conf->bus, conf->slot, conf->func);
+        if ( NULL == dev.u.mem ) {
+            return NULL;
+        }
+        dev.rxq_last = -1;
+        dev.txq_last = -1;
+        dev.fastpath = 0;
+    }
+
+    if ( FE_DRIVER_INVALID != dev.driver ) {
+        /* NUMA domain of the device */
+        dev.domain = pix_pci_domain(conf->bus, conf->slot, conf->func);
+        if ( dev.domain >= PIX_MAX_DOMAINS ) {
+            dev.domain = -1;
+        }
+
+        devp = malloc(sizeof(struct fe_device));
+        if ( NULL == devp ) {
+            return NULL;
+        }
+        memcpy(devp, &dev, sizeof(struct fe_device));
+        return devp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Initialize network devices
+ */
+int
+fe_init_devices(struct fe *fe, struct pci_dev *pci)
+{
+    struct fe_device *dev;
+
+    fe->nports = 0;
+    while ( NULL != pci ) {
+        dev = _init_device(pci->device);
+        if ( NULL != dev ) {
+            /* Device found */
+            dev->port = fe->nports;
+            fe->ports[fe->nports] = dev;
+            fe->nports++;
+        }
+        pci = pci->next;
+    }
+
+    return 0;
+}
+
+/*
+ * Add (remove) a port to (from) the member set of a VLAN
+ */
+static void
+_vlan_filter(struct fe *fe, int port, uint16_t vid, int on)
+{
+    uint64_t ports;
+    int i;
+
+    /* The VLANs of a LAG are accepted by all the links */
+    ports = NULL != fe->lags[port] ? fe->lags[port]->members : 1ULL << port;
+    while ( 0 != ports ) {
+        i = __builtin_ctzll(ports);
+        ports &= ports - 1;
+        fe_driver_set_vlan_filter(fe->ports[i], vid, on);
+    }
+}
+static void
+_vlan_join(struct fe *fe, int port, uint16_t vid)
+{
+    fe->vlan_members[vid] |= 1ULL << port;
+    _vlan_filter(fe, port, vid, 1);
+}
+static void
+_vlan_leave(struct fe *fe, int port, uint16_t vid)
+{
+    fe->vlan_members[vid] &= ~(1ULL << port);
+    _vlan_filter(fe, port, vid, 0);
+}
+
+/*
+ * Check the port number (the logical port of a LAG) and the VLAN ID (0 and
+ * 4095 are reserved)
+ */
+static int
+_vlan_check(struct fe *fe, int port, uint16_t vid)
+{
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    if ( NULL != fe->lags[port] && fe->lags[port]->port != port ) {
+        return -1;
+    }
+    if ( vid < 1 || vid >= FE_VLAN_MAX - 1 ) {
+        return -1;
+    }
 
-    /* Check the driver type and initialize the hardware */
-    dev.driver = FE_DRIVER_INVALID;
-    if ( e1000_is_e1000(conf->vendor_id, conf->device_id) ) {
-        /* e1000 */
-        dev.driver = FE_DRIVER_E1000;
-        dev.u.e1000
-            = e1000_init(conf->device_id, conf->bus, conf->slot, conf->func);
-        dev.u.e1000->pirq = (((conf->intr_pin -1) + conf->slot) % 4) + 0x10;
-        e1000_init_hw(dev.u.e1000);
-        e1000_setup_rx(dev.u.e1000);
-        e1000_setup_tx(dev.u.e1000);
-        dev.domain = 0;
-        dev.rxq_last = -1;
-        dev.txq_last = -1;
-        dev.fastpath = 0;
-    } else if ( ixgbe_is_ixgbe(conf->vendor_id, conf->device_id) ) {
-        /* ixgbe */
-        dev.driver = FE_DRIVER_IXGBE;
-        dev.u.ixgbe
-            = ixgbe_init(conf->device_id, conf->bus, conf->slot, conf->func);
-        ixgbe_init_hw(dev.u.ixgbe);
-        ixgbe_setup_rx(dev.u.ixgbe);
-        ixgbe_setup_tx(dev.u.ixgbe);
-        ixgbe_enable_rx(dev.u.ixgbe);
-        ixgbe_enable_tx(dev.u.ixgbe);
-        dev.domain = 0;
-        dev.rxq_last = -1;
-        dev.txq_last = -1;
-        dev.fastpath = 0;
+    return 0;
+}
+
+/*
+ * Configure a port as an access port of the VLAN
+ */
+int
+fe_vlan_set_access(struct fe *fe, int port, uint16_t vid)
+{
+    ssize_t i;
+
+    if ( _vlan_check(fe, port, vid) < 0 ) {
+        return -1;
+    }
+
+    /* Leave all the other VLANs */
+    for ( i = 1; i < FE_VLAN_MAX; i++ ) {
+        if ( (fe->vlan_members[i] & (1ULL << port)) && i != vid ) {
+            _vlan_leave(fe, port, i);
+        }
+    }
+    fe->ports[port]->vlan_mode = FE_VLAN_ACCESS;
+    fe->ports[port]->pvid = vid;
+    _vlan_join(fe, port, vid);
+
+    return 0;
+}
+
+/*
+ * Configure a port as a trunk port with the native (untagged) VLAN
+ */
+int
+fe_vlan_set_trunk(struct fe *fe, int port, uint16_t native)
+{
+    if ( _vlan_check(fe, port, native) < 0 ) {
+        return -1;
+    }
+
+    fe->ports[port]->vlan_mode = FE_VLAN_TRUNK;
+    fe->ports[port]->pvid = native;
+    _vlan_join(fe, port, native);
+
+    return 0;
+}
+
+/*
+ * Add a tagged VLAN to a trunk port
+ */
+int
+fe_vlan_add(struct fe *fe, int port, uint16_t vid)
+{
+    if ( _vlan_check(fe, port, vid) < 0 ) {
+        return -1;
+    }
+    if ( FE_VLAN_TRUNK != fe->ports[port]->vlan_mode ) {
+        return -1;
+    }
+    _vlan_join(fe, port, vid);
+
+    return 0;
+}
+
+/*
+ * Delete a tagged VLAN from a trunk port
+ */
+int
+fe_vlan_delete(struct fe *fe, int port, uint16_t vid)
+{
+    if ( _vlan_check(fe, port, vid) < 0 ) {
+        return -1;
+    }
+    if ( FE_VLAN_TRUNK != fe->ports[port]->vlan_mode
+         || vid == fe->ports[port]->pvid ) {
+        return -1;
+    }
+    _vlan_leave(fe, port, vid);
+
+    return 0;
+}
+
+/*
+ * Aggregate the ports (a bitmap of fast-path ports) into a LAG behind the
+ * lowest one (the logical port), distributing the packets to the links by the
+ * hash policy (LAG_HASH_*); the links are negotiated by LACP if lacp is
+ * non-zero, or are all distributing otherwise.  The LAG takes over the VLAN
+ * configuration of the logical port.  Returns the logical port.
+ */
+int
+fe_lag_create(struct fe *fe, uint64_t ports, int hash, int lacp)
+{
+    struct fe_lag *lag;
+    uint64_t m;
+    ssize_t vid;
+    int i;
+
+    if ( 0 == ports || hash < LAG_HASH_L2 || hash > LAG_HASH_L34 ) {
+        return -1;
+    }
+    if ( fe->nports < FE_MAX_PORTS && (ports >> fe->nports) ) {
+        return -1;
+    }
+    m = ports;
+    while ( 0 != m ) {
+        i = __builtin_ctzll(m);
+        m &= m - 1;
+        if ( !fe->ports[i]->fastpath || NULL != fe->lags[i] ) {
+            return -1;
+        }
+    }
+    if ( lacp && 0 == fe->tsc_hz ) {
+        fe->tsc_hz = _tsc_hz();
+        if ( 0 == fe->tsc_hz ) {
+            return -1;
+        }
+    }
+
+    lag = malloc(sizeof(struct fe_lag));
+    if ( NULL == lag ) {
+        return -1;
+    }
+    lag->port = __builtin_ctzll(ports);
+    lag->hash = hash;
+    lag->dist = NULL;
+    lag->members = ports;
+    lag->lacp = lacp ? 1 : 0;
+    m = ports;
+    while ( 0 != m ) {
+        i = __builtin_ctzll(m);
+        m &= m - 1;
+        /* The key identifies the LAG, and the port numbers are non-zero */
+        lacp_port_init(&lag->links[i], fe->router_mac, lag->port + 1, i + 1);
+    }
+    if ( fe_lag_update(fe, lag, fdb_rdtsc()) < 0 ) {
+        free(lag);
+        return -1;
+    }
+
+    /* The links accept the VLANs of the logical port */
+    for ( vid = 1; vid < FE_VLAN_MAX - 1; vid++ ) {
+        if ( !(fe->vlan_members[vid] & (1ULL << lag->port)) ) {
+            continue;
+        }
+        m = ports;
+        while ( 0 != m ) {
+            i = __builtin_ctzll(m);
+            m &= m - 1;
+            fe_driver_set_vlan_filter(fe->ports[i], vid, 1);
+        }
+    }
+
+    /* Publish to the fast path */
+    __sync_synchronize();
+    m = ports;
+    while ( 0 != m ) {
+        i = __builtin_ctzll(m);
+        m &= m - 1;
+        fe->lags[i] = lag;
+    }
+
+    return lag->port;
+}
+
+/*
+ * Delete the LAG of the logical port; the links are back to independent
+ * ports with their own VLAN configurations
+ */
+int
+fe_lag_delete(struct fe *fe, int port)
+{
+    struct fe_lag *lag;
+    uint64_t m;
+    ssize_t vid;
+    int i;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    lag = fe->lags[port];
+    if ( NULL == lag || lag->port != port ) {
+        return -1;
+    }
+    m = lag->members;
+    while ( 0 != m ) {
+        i = __builtin_ctzll(m);
+        m &= m - 1;
+        fe->lags[i] = NULL;
+    }
+
+    /* The links stop accepting the VLANs of the logical port that are not
+       their own */
+    for ( vid = 1; vid < FE_VLAN_MAX - 1; vid++ ) {
+        if ( !(fe->vlan_members[vid] & (1ULL << lag->port)) ) {
+            continue;
+        }
+        m = lag->members & ~fe->vlan_members[vid];
+        while ( 0 != m ) {
+            i = __builtin_ctzll(m);
+            m &= m - 1;
+            fe_driver_set_vlan_filter(fe->ports[i], vid, 0);
+        }
+    }
+
+    /* The fast path may refer to the LAG until its next quiescent state */
+    fe_retire(fe, lag->dist);
+    fe_retire(fe, lag);
+
+    return 0;
+}
+
+/*
+ * Member links of the LAG of the logical port, and those distributing
+ */
+int
+fe_lag_status(struct fe *fe, int port, uint64_t *members,
+              uint64_t *distributing)
+{
+    struct fe_lag *lag;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    lag = fe->lags[port];
+    if ( NULL == lag || lag->port != port ) {
+        return -1;
+    }
+    *members = lag->members;
+    *distributing = lag->dist->distributing;
+
+    return 0;
+}
+
+/*
+ * LACP counters of a member link of a LAG
+ */
+int
+fe_lag_link_stats(struct fe *fe, int port, struct lacp_stats *st)
+{
+    struct fe_lag *lag;
+
+    if ( port < 0 || port >= (int)fe->nports ) {
+        return -1;
+    }
+    lag = fe->lags[port];
+    if ( NULL == lag ) {
+        return -1;
+    }
+    memcpy(st, &lag->links[port].stats, sizeof(struct lacp_stats));
+
+    return 0;
+}
+
+/*
+ * Copy of the VXLAN tunnel end point to be updated (a cleared one if
+ * disabled)
+ */
+static struct fe_vxlan *
+_vxlan_copy(struct fe *fe)
+{
+    struct fe_vxlan *vx;
+
+    vx = malloc(sizeof(struct fe_vxlan));
+    if ( NULL == vx ) {
+        return NULL;
+    }
+    if ( NULL != fe->vxlan ) {
+        memcpy(vx, fe->vxlan, sizeof(struct fe_vxlan));
+    } else {
+        memset(vx, 0, sizeof(struct fe_vxlan));
+    }
+
+    return vx;
+}
+
+/*
+ * Rebuild the lookup tables and the outer headers of an updated VXLAN tunnel
+ * end point, and replace the current one with it
+ */
+static void
+_vxlan_commit(struct fe *fe, struct fe_vxlan *vx)
+{
+    struct fe_vxlan *old;
+    struct fe_vtep *v;
+    uint32_t h;
+    int i;
+
+    memset(vx->vni_hash, 0, sizeof(vx->vni_hash));
+    for ( i = 1; i < FE_VLAN_MAX; i++ ) {
+        if ( 0 == vx->vnis[i] ) {
+            continue;
+        }
+        h = _vxlan_hash(vx->vnis[i]) & (FE_VXLAN_VNI_HASH - 1);
+        while ( 0 != vx->vni_hash[h].vid ) {
+            h = (h + 1) & (FE_VXLAN_VNI_HASH - 1);
+        }
+        vx->vni_hash[h].vni = vx->vnis[i];
+        vx->vni_hash[h].vid = i;
+    }
+    memset(vx->vtep_hash, 0, sizeof(vx->vtep_hash));
+    for ( i = 0; i < FE_VXLAN_MAX_VTEPS; i++ ) {
+        v = &vx->vteps[i];
+        if ( 0 == v->addr ) {
+            continue;
+        }
+        vxlan_tmpl_build(&v->tmpl, fe->router_mac, vx->addr, v->addr);
+        h = _vxlan_hash(v->addr) & (FE_VXLAN_VTEP_HASH - 1);
+        while ( 0 != vx->vtep_hash[h].vtep ) {
+            h = (h + 1) & (FE_VXLAN_VTEP_HASH - 1);
+        }
+        vx->vtep_hash[h].addr = v->addr;
+        vx->vtep_hash[h].vtep = i + 1;
+    }
+
+    /* The fast path refers to either the old or the new one */
+    old = fe->vxlan;
+    __sync_synchronize();
+    fe->vxlan = vx;
+    if ( NULL != old ) {
+        fe_retire(fe, old);
+    }
+}
+
+/*
+ * Enable the VXLAN tunnel end point at the local address addr (host byte
+ * order; the address of a layer-3 interface so that the next hops in the
+ * underlay resolve it), or disable it if addr is zero
+ */
+int
+fe_vxlan_set(struct fe *fe, uint32_t addr)
+{
+    struct fe_vxlan *vx;
+    struct fe_vxlan *old;
+
+    if ( 0 == addr ) {
+        old = fe->vxlan;
+        fe->vxlan = NULL;
+        if ( NULL != old ) {
+            fe_retire(fe, old);
+        }
+        return 0;
+    }
+    vx = _vxlan_copy(fe);
+    if ( NULL == vx ) {
+        return -1;
+    }
+    vx->addr = htonl(addr);
+    _vxlan_commit(fe, vx);
+
+    return 0;
+}
+
+/*
+ * Configure the remote VTEP of the index at addr (host byte order; 0 to
+ * remove it) reached through the next hop nh; the frames learned from it are
+ * forwarded to the port FE_VXLAN_PORT(idx)
+ */
+int
+fe_vxlan_vtep_set(struct fe *fe, int idx, uint32_t addr, uint16_t nh)
+{
+    struct fe_vxlan *vx;
+    uint32_t naddr;
+    int i;
+
+    if ( NULL == fe->vxlan || idx < 0 || idx >= FE_VXLAN_MAX_VTEPS
+         || (0 != addr && (0 == nh || nh >= FE_MAX_NEXTHOPS)) ) {
+        return -1;
+    }
+    naddr = htonl(addr);
+    for ( i = 0; 0 != addr && i < FE_VXLAN_MAX_VTEPS; i++ ) {
+        if ( i != idx && naddr == fe->vxlan->vteps[i].addr ) {
+            /* Duplicate */
+            return -1;
+        }
+    }
+    vx = _vxlan_copy(fe);
+    if ( NULL == vx ) {
+        return -1;
+    }
+    vx->vteps[idx].addr = naddr;
+    vx->vteps[idx].nh = nh;
+    if ( 0 == addr ) {
+        /* Not replicated to anymore */
+        for ( i = 0; i < FE_VLAN_MAX; i++ ) {
+            vx->floods[i] &= ~(1ULL << idx);
+        }
+    }
+    _vxlan_commit(fe, vx);
+
+    return 0;
+}
+
+/*
+ * Bridge a VLAN to the VNI (0 to detach it from the overlay); the broadcasts
+ * and unknown unicasts of the VLAN are replicated to the remote VTEPs in
+ * vteps (a bitmap of the indices)
+ */
+int
+fe_vxlan_vni_set(struct fe *fe, uint16_t vid, uint32_t vni, uint64_t vteps)
+{
+    struct fe_vxlan *vx;
+    int i;
+
+    if ( NULL == fe->vxlan || 0 == vid || vid >= FE_VLAN_MAX
+         || vni > VXLAN_VNI_MAX ) {
+        return -1;
+    }
+    for ( i = 0; i < FE_VXLAN_MAX_VTEPS; i++ ) {
+        if ( (vteps & (1ULL << i)) && 0 == fe->vxlan->vteps[i].addr ) {
+            return -1;
+        }
+    }
+    for ( i = 1; 0 != vni && i < FE_VLAN_MAX; i++ ) {
+        if ( i != vid && vni == fe->vxlan->vnis[i] ) {
+            /* Bridged to another VLAN */
+            return -1;
+        }
+    }
+    vx = _vxlan_copy(fe);
+    if ( NULL == vx ) {
+        return -1;
+    }
+    vx->vnis[vid] = vni;
+    vx->floods[vid] = 0 != vni ? vteps : 0;
+    _vxlan_commit(fe, vx);
+
+    return 0;
+}
+
+/*
+ * Configure (cfg) or delete (NULL) an IPsec SA; an outbound SA is bound to
+ * its tunnel next hop (tnh, reset to carry the routes into the tunnel), and
+ * its ESP packets are routed to the next hop to the peer (nh).  The contexts
+ * of the replaced SA are discarded with its counters.
+ */
+int
+fe_ipsec_sa_set(struct fe *fe, int idx, const struct esp_sa_config *cfg)
+{
+    struct fe_sa *sa;
+    struct fe_sa *old;
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int ret;
+    int i;
+
+    if ( idx < 0 || idx >= FE_IPSEC_MAX_SAS ) {
+        return -1;
+    }
+    if ( NULL != cfg ) {
+        if ( (16 != cfg->keylen && 32 != cfg->keylen)
+             || (ESP_DIR_IN != cfg->dir && ESP_DIR_OUT != cfg->dir) ) {
+            return -1;
+        }
+        /* SPIs 1-255 are reserved (RFC 4303) */
+        if ( cfg->spi < 256 ) {
+            return -1;
+        }
+        if ( cfg->sel_src4len < 0 || cfg->sel_src4len > 32
+             || cfg->sel_dst4len < 0 || cfg->sel_dst4len > 32
+             || cfg->sel_src6len < 0 || cfg->sel_src6len > 128
+             || cfg->sel_dst6len < 0 || cfg->sel_dst6len > 128 ) {
+            return -1;
+        }
+        if ( ESP_DIR_OUT == cfg->dir
+             && (0 == cfg->nh || cfg->nh >= FE_MAX_NEXTHOPS
+                 || 0 == cfg->tnh || cfg->tnh >= FE_MAX_NEXTHOPS
+                 || cfg->nh == cfg->tnh) ) {
+            return -1;
+        }
+        for ( i = 0; i < FE_IPSEC_MAX_SAS; i++ ) {
+            if ( i == idx || NULL == fe->sas[i]
+                 || cfg->dir != fe->sas[i]->cfg.dir ) {
+                continue;
+            }
+            if ( ESP_DIR_OUT == cfg->dir
+                 && cfg->tnh == fe->sas[i]->cfg.tnh ) {
+                /* The tunnel is bound to another SA */
+                return -1;
+            }
+            if ( ESP_DIR_IN == cfg->dir && cfg->spi == fe->sas[i]->cfg.spi ) {
+                return -1;
+            }
+        }
     }
 
-    if ( FE_DRIVER_INVALID != dev.driver ) {
-        devp = malloc(sizeof(struct fe_device));
-        if ( NULL == devp ) {
-            return NULL;
+    /* Contexts of the exclusive tasks in their NUMA domains */
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL != t->ipsec ) {
+            continue;
         }
-        memcpy(devp, &dev, sizeof(struct fe_device));
-        return devp;
+        ret = syscall(SYS_pix_malloc, sizeof(struct fe_ipsec), &pa, &va,
+                      t->domain);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        memset(va, 0, sizeof(struct fe_ipsec));
+        __sync_synchronize();
+        t->ipsec = va;
     }
 
-    return NULL;
+    sa = NULL;
+    if ( NULL != cfg ) {
+        sa = malloc(sizeof(struct fe_sa));
+        if ( NULL == sa ) {
+            return -1;
+        }
+        memcpy(&sa->cfg, cfg, sizeof(struct esp_sa_config));
+        sa->gen = fe->ipsec_gen + 1;
+        sa->seq = 1;
+        memset((void *)&sa->replay, 0, sizeof(struct esp_replay));
+    }
+
+    /* Unbind the tunnel of the previous SA, and bind the new one */
+    old = fe->sas[idx];
+    if ( NULL != old && ESP_DIR_OUT == old->cfg.dir
+         && fe->nexthops[old->cfg.tnh].sa == idx + 1 ) {
+        fe->nexthops[old->cfg.tnh].sa = 0;
+    }
+    fe->sas[idx] = sa;
+    if ( NULL != sa && ESP_DIR_OUT == sa->cfg.dir ) {
+        _nexthop_reset(fe, sa->cfg.tnh);
+        fe->nexthops[sa->cfg.tnh].sa = idx + 1;
+    }
+
+    /* Publish to the fast path; the previous SA is read by the tasks until
+       their next quiescent state */
+    __sync_synchronize();
+    fe->ipsec_gen++;
+    if ( NULL != old ) {
+        fe_retire(fe, old);
+    }
+
+    return 0;
 }
 
 /*
- * Initialize network devices
+ * Sum up the counters of an IPsec SA over the exclusive tasks (approximate
+ * while they are running)
  */
 int
-fe_init_devices(struct fe *fe, struct pci_dev *pci)
+fe_ipsec_sa_stats(struct fe *fe, int idx, struct esp_stats *stats)
 {
-    struct fe_device *dev;
+    struct fe_task *t;
+    struct esp_stats *s;
+    struct fe_sa *sa;
 
-    fe->nports = 0;
-    while ( NULL != pci ) {
-        dev = _init_device(pci->device);
-        if ( NULL != dev ) {
-            /* Device found */
-            dev->port = fe->nports;
-            fe->ports[fe->nports] = dev;
-            fe->nports++;
+    if ( idx < 0 || idx >= FE_IPSEC_MAX_SAS || NULL == fe->sas[idx] ) {
+        return -1;
+    }
+    sa = fe->sas[idx];
+    memset(stats, 0, sizeof(struct esp_stats));
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        if ( NULL == t->ipsec || sa->gen != t->ipsec->gens[idx] ) {
+            continue;
         }
-        pci = pci->next;
+        s = &t->ipsec->sas[idx].stats;
+        stats->pkts += s->pkts;
+        stats->bytes += s->bytes;
+        stats->auth_errors += s->auth_errors;
+        stats->replays += s->replays;
+        stats->policy_errors += s->policy_errors;
+        stats->errors += s->errors;
     }
 
     return 0;
 }
 
+/*
+ * Resolve the NUMA domain of a processor
+ */
+static int
+_cpu_domain(struct syspix_cpu_config *cpu)
+{
+    if ( cpu->domain < 0 || cpu->domain >= PIX_MAX_DOMAINS ) {
+        /* Unknown */
+        return 0;
+    }
+
+    return cpu->domain;
+}
+
 /*
  * Initialize processors
  */
@@ -322,6 +5250,7 @@ fe_init_cpu(struct fe *fe)
     struct syspix_cpu_table cputable;
     int n;
     int nex;
+    int tdomain;
     ssize_t i;
     struct fe_task *t;
     struct fe_task **tp;
@@ -341,12 +5270,34 @@ fe_init_cpu(struct fe *fe)
     }
     t->fe = fe;
     t->cpuid = -1;
+    t->domain = 0;
     t->pool.head = NULL;
-    t->pool.v2poff = 0;
     t->rx.bitmap = 0;
     t->rx.rings = NULL;
+    t->rx.n = 0;
+    t->rx.load = 0;
+    t->handover.release = NULL;
+    t->handover.acquire = NULL;
+    t->handover.refund = NULL;
     t->tx.rings = NULL;
     t->ktx = NULL;
+    t->ct = NULL;
+    t->ipfrag = NULL;
+    t->graph = NULL;
+    t->nat = NULL;
+    t->cap.ring = NULL;
+    t->cap.bufs = NULL;
+    t->cap.collected = 0;
+    t->sample = NULL;
+    t->pktgen = NULL;
+    t->ipsec = NULL;
+    memset(t->qos.ports, 0, sizeof(t->qos.ports));
+    t->qos.enabled = 0;
+    t->qos.backlog = 0;
+    t->qos.gen = 0;
+    t->idle.polls = 0;
+    t->idle.sleeps = 0;
+    t->qsbr = 0;
     t->next = NULL;
 
     /* Add */
@@ -355,12 +5306,16 @@ fe_init_cpu(struct fe *fe)
 
     /* Find out the (number of) exclusive CPUs */
     nex = 0;
+    tdomain = -1;
     for ( i = 0; i < PIX_MAX_CPU; i++ ) {
         if ( cputable.cpus[i].present ) {
             /* CPU is present */
             switch ( cputable.cpus[i].type ) {
             case SYSPIX_CPU_TICKFUL:
                 /* Tickful (application) */
+                if ( -1 == tdomain ) {
+                    tdomain = _cpu_domain(&cputable.cpus[i]);
+                }
                 break;
             case SYSPIX_CPU_EXCLUSIVE:
                 /* Exclusive: Fast-path task */
@@ -370,12 +5325,34 @@ fe_init_cpu(struct fe *fe)
                 }
                 t->fe = fe;
                 t->cpuid = i;
+                t->domain = _cpu_domain(&cputable.cpus[i]);
                 t->pool.head = NULL;
-                t->pool.v2poff = 0;
                 t->rx.bitmap = 0;
                 t->rx.rings = NULL;
+                t->rx.n = 0;
+                t->rx.load = 0;
+                t->handover.release = NULL;
+                t->handover.acquire = NULL;
+                t->handover.refund = NULL;
                 t->tx.rings = NULL;
                 t->ktx = NULL;
+                t->ct = NULL;
+                t->ipfrag = NULL;
+                t->graph = NULL;
+                t->nat = NULL;
+                t->cap.ring = NULL;
+                t->cap.bufs = NULL;
+                t->cap.collected = 0;
+                t->sample = NULL;
+                t->pktgen = NULL;
+                t->ipsec = NULL;
+                memset(t->qos.ports, 0, sizeof(t->qos.ports));
+                t->qos.enabled = 0;
+                t->qos.backlog = 0;
+                t->qos.gen = 0;
+                t->idle.polls = 0;
+                t->idle.sleeps = 0;
+                t->qsbr = 0;
                 t->next = NULL;
 
                 /* Append it to the tail */
@@ -396,9 +5373,37 @@ fe_init_cpu(struct fe *fe)
     /* # of exlusive CPUs */
     fe->nxcpu = nex;
 
+    /* The tickful task runs on the first tickful CPU */
+    if ( tdomain >= 0 ) {
+        fe->tftask->domain = tdomain;
+    }
+
     return 0;
 }
 
+/*
+ * Create the buffer pool of a task from *pkt
+ */
+static void
+_init_buffer_pool(struct fe_task *t, void **pkt, uint64_t voff)
+{
+    ssize_t i;
+    struct fe_pkt_buf_hdr *hdr;
+    struct fe_pkt_buf_hdr *prev;
+
+    prev = NULL;
+    hdr = NULL;
+    for ( i = 0; i < FE_BUFFER_POOL_SIZE; i++ ) {
+        hdr = (struct fe_pkt_buf_hdr *)*pkt;
+        hdr->next = prev;
+        hdr->refs = 0;
+        hdr->v2poff = voff;
+        prev = hdr;
+        *pkt += FE_PKTSZ;
+    }
+    t->pool.head = hdr;
+}
+
 /*
  * Initialize the buffer pool
  */
@@ -412,51 +5417,129 @@ fe_init_buffer_pool(struct fe *fe)
     struct fe_task *t;
     uint64_t voff;
     void *pkt;
-    ssize_t i;
-    struct fe_pkt_buf_hdr *hdr;
-    struct fe_pkt_buf_hdr *prev;
+    int n[PIX_MAX_DOMAINS];
+    int d;
 
-    /* Allocate packet buffer */
-    len = (size_t)FE_PKTSZ * FE_BUFFER_POOL_SIZE * (fe->nxcpu + 1);
-    ret = syscall(SYS_pix_malloc, len, &pa, &va);
-    if ( ret < 0 ) {
+    /* Count the number of tasks in each NUMA domain */
+    memset(n, 0, sizeof(n));
+    n[fe->tftask->domain]++;
+    t = fe->extasks;
+    while ( NULL != t ) {
+        n[t->domain]++;
+        t = t->next;
+    }
+
+    /* Allocate packet buffers local to the processors of each domain */
+    for ( d = 0; d < PIX_MAX_DOMAINS; d++ ) {
+        fe->bufpool[d].paddr = NULL;
+        fe->bufpool[d].len = 0;
+        if ( 0 == n[d] ) {
+            continue;
+        }
+        len = (size_t)FE_PKTSZ * FE_BUFFER_POOL_SIZE * n[d];
+        ret = syscall(SYS_pix_malloc, len, &pa, &va, d);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        voff = pa - va;
+        fe->bufpool[d].paddr = pa;
+        fe->bufpool[d].len = len;
+
+        /* Start from here */
+        pkt = va;
+
+        /* Tickful task */
+        if ( fe->tftask->domain == d ) {
+            _init_buffer_pool(fe->tftask, &pkt, voff);
+        }
+
+        /* Exclusive CPUs */
+        t = fe->extasks;
+        while ( NULL != t ) {
+            if ( t->domain == d ) {
+                _init_buffer_pool(t, &pkt, voff);
+            }
+            /* Next task */
+            t = t->next;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Initialize the connection tracking shard of each exclusive task in its
+ * NUMA domain
+ */
+int
+fe_init_conntrack(struct fe *fe)
+{
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int ret;
+
+    fe->ct_enabled = 0;
+    fe->ct_flows = hopscotch_init(NULL, CT_KEY_SIZE);
+    if ( NULL == fe->ct_flows ) {
         return -1;
     }
-    voff = pa - va;
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        ret = syscall(SYS_pix_malloc, ct_memsize(CT_DEFAULT_SIZE), &pa, &va,
+                      t->domain);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        t->ct = ct_init(va, CT_DEFAULT_SIZE);
+    }
 
-    /* Start from here */
-    pkt = va;
+    return 0;
+}
 
-    /* Tickful task */
-    t = fe->tftask;
-    /* Create a buffer pool for the tickful task */
-    prev = NULL;
-    for ( i = 0; i < FE_BUFFER_POOL_SIZE; i++ ) {
-        hdr = (struct fe_pkt_buf_hdr *)pkt;
-        hdr->next = prev;
-        hdr->refs = 0;
-        prev = hdr;
-        pkt += FE_PKTSZ;
+/*
+ * Initialize the IPv4 reassembly tables
+ */
+int
+fe_init_ipfrag(struct fe *fe)
+{
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int ret;
+
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        ret = syscall(SYS_pix_malloc, sizeof(struct ipfrag), &pa, &va,
+                      t->domain);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        t->ipfrag = va;
+        ipfrag_init(t->ipfrag, FE_IPFRAG_TIMEOUT);
     }
-    t->pool.head = hdr;
-    t->pool.v2poff = voff;
 
-    /* Exclusive CPUs */
-    t = fe->extasks;
-    while ( NULL != t ) {
-        /* Create a buffer pool for each task */
-        prev = NULL;
-        for ( i = 0; i < FE_BUFFER_POOL_SIZE; i++ ) {
-            hdr = (struct fe_pkt_buf_hdr *)pkt;
-            hdr->next = prev;
-            hdr->refs = 0;
-            prev = hdr;
-            pkt += FE_PKTSZ;
-        }
-        t->pool.head = hdr;
-        t->pool.v2poff = voff;
-        /* Next task */
-        t = t->next;
+    return 0;
+}
+
+/*
+ * Initialize the packet processing graphs
+ */
+int
+fe_init_graph(struct fe *fe)
+{
+    struct fe_task *t;
+    void *pa;
+    void *va;
+    int ret;
+
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        ret = syscall(SYS_pix_malloc, sizeof(struct fe_graph), &pa, &va,
+                      t->domain);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        memset(va, 0, sizeof(struct fe_graph));
+        t->graph = va;
+        t->graph->nodes = fe_nodes;
     }
 
     return 0;
@@ -489,21 +5572,37 @@ fe_init_device_type(struct fe *fe)
 }
 
 /*
- * Allocate
+ * Allocate from the memory space of the NUMA domain
  */
 static void *
-_fe_alloc(struct fe *fe, size_t len)
+_fe_alloc(struct fe *fe, int domain, size_t len)
 {
     void *a;
+    void *pa;
+    void *va;
+    int ret;
+
+    /* Allocate the memory space of this domain on the first use */
+    if ( NULL == fe->mem[domain].vaddr ) {
+        ret = syscall(SYS_pix_malloc, FE_MEMSIZE_FOR_DESCS, &pa, &va, domain);
+        if ( ret < 0 ) {
+            return NULL;
+        }
+        fe->mem[domain].vaddr = va;
+        fe->mem[domain].len = FE_MEMSIZE_FOR_DESCS;
+        fe->mem[domain].v2poff = pa - va;
+        fe->mem[domain].free = va;
+    }
 
     /* 64 byte alignment */
     len = (len + 128 - 1) / 128 * 128;
 
-    a = fe->mem.free;
-    if ( fe->mem.free + len > fe->mem.vaddr + fe->mem.len ) {
+    a = fe->mem[domain].free;
+    if ( fe->mem[domain].free + len
+         > fe->mem[domain].vaddr + fe->mem[domain].len ) {
         return NULL;
     }
-    fe->mem.free += len;
+    fe->mem[domain].free += len;
 
     return a;
 }
@@ -512,7 +5611,7 @@ _fe_alloc(struct fe *fe, size_t len)
  * Initialize the ring buffers of am exclusive task
  */
 static int
-_init_extask_ring(struct fe *fe, struct fe_task *t, int n, int *port)
+_init_extask_ring(struct fe *fe, struct fe_task *t)
 {
     ssize_t i;
     struct fe_kernel_ring *ring;
@@ -521,7 +5620,7 @@ _init_extask_ring(struct fe *fe, struct fe_task *t, int n, int *port)
     int ret;
 
     /* Kernel Tx */
-    t->ktx = _fe_alloc(fe, sizeof(struct fe_kernel_ring));
+    t->ktx = _fe_alloc(fe, t->domain, sizeof(struct fe_kernel_ring));
     if ( NULL == t->ktx ) {
         return -1;
     }
@@ -531,57 +5630,30 @@ _init_extask_ring(struct fe *fe, struct fe_task *t, int n, int *port)
     ring->tail = 0;
     ring->rx_head = 0;
     ring->tx_head = 0;
-    ring->descs = _fe_alloc(fe, sizeof(struct fe_kernel_desc) * ring->len);
+    ring->descs = _fe_alloc(fe, t->domain,
+                            sizeof(struct fe_kernel_desc) * ring->len);
     if ( NULL == ring->descs ) {
         return -1;
     }
-    ring->bufs = _fe_alloc(fe, sizeof(struct fe_pkt_buf_hdr *) * ring->len);
+    ring->bufs = _fe_alloc(fe, t->domain,
+                           sizeof(struct fe_pkt_buf_hdr *) * ring->len);
     if ( NULL == ring->bufs ) {
         return -1;
     }
 
-    /* Rx queues handled by this task */
-    if ( (size_t)*port + n >= fe->nports ) {
-        n = fe->nports - *port;
-    }
-    t->rx.rings = _fe_alloc(fe, sizeof(struct fe_driver_rx) * n);
+    /* Rx queues handled by this task; assigned by fe_assign_task() and can be
+       migrated to this task later on */
+    t->rx.rings = _fe_alloc(fe, t->domain,
+                            sizeof(struct fe_driver_rx *) * FE_MAX_PORTS);
     if ( NULL == t->rx.rings ) {
         return -1;
     }
     t->rx.bitmap = 0;
-    for ( i = 0; i < n; i++ ) {
-        t->rx.bitmap |= (1ULL << *port);
-        /* Set driver */
-        t->rx.rings[i].driver = fe->ports[*port]->driver;
-        /* Set port # */
-        t->rx.rings[i].port = *port;
-        /* Calculate the required memory space */
-        sz = fe_driver_calc_rx_ring_memsize(&t->rx.rings[i], FE_QLEN);
-        if ( sz < 0 ) {
-            return -1;
-        }
-        /* Allocate memory space for the ring */
-        m = _fe_alloc(fe, sz);
-        if ( NULL == m ) {
-            return -1;
-        }
-        /* Setup an Rx queue */
-        ret = fe_driver_setup_rx_ring(fe->ports[*port], &t->rx.rings[i], m,
-                                      fe->mem.v2poff, FE_QLEN);
-        if ( ret < 0 ) {
-            return -1;
-        }
-
-        /* Fill the Rx queue */
-        fe_driver_rx_fill_all(t, &t->rx.rings[i]);
-        fe_driver_rx_commit(&t->rx.rings[i]);
-
-        /* Next port */
-        (*port)++;
-    }
+    t->rx.n = 0;
 
     /* Tx */
-    t->tx.rings = _fe_alloc(fe, sizeof(struct fe_driver_tx) * fe->nports);
+    t->tx.rings = _fe_alloc(fe, t->domain,
+                            sizeof(struct fe_driver_tx) * fe->nports);
     if ( NULL == t->tx.rings ) {
         return -1;
     }
@@ -596,15 +5668,16 @@ _init_extask_ring(struct fe *fe, struct fe_task *t, int n, int *port)
             if ( sz < 0 ) {
                 return -1;
             }
-            m = _fe_alloc(fe, sz);
+            m = _fe_alloc(fe, t->domain, sz);
             if ( NULL == m ) {
                 return -1;
             }
             ret = fe_driver_setup_tx_ring(fe->ports[i], &t->tx.rings[i], m,
-                                          fe->mem.v2poff, FE_QLEN);
+                                          fe->mem[t->domain].v2poff, FE_QLEN);
             if ( ret < 0 ) {
                 return -1;
             }
+            fe_driver_tx_set_dca(&t->tx.rings[i], t->cpuid);
         } else {
             /* Slow-path */
             t->tx.rings[i].driver = FE_DRIVER_KERNEL;
@@ -615,6 +5688,60 @@ _init_extask_ring(struct fe *fe, struct fe_task *t, int n, int *port)
     return 0;
 }
 
+/*
+ * Initialize the Rx ring of a port in an exclusive task
+ */
+static int
+_init_extask_rx_ring(struct fe *fe, struct fe_task *t, int port)
+{
+    struct fe_driver_rx *rx;
+    int sz;
+    void *m;
+    int ret;
+
+    rx = _fe_alloc(fe, t->domain, sizeof(struct fe_driver_rx));
+    if ( NULL == rx ) {
+        return -1;
+    }
+    /* Set driver */
+    rx->driver = fe->ports[port]->driver;
+    /* Set port # */
+    rx->port = port;
+    /* Statistics */
+    rx->npkts = 0;
+    rx->owner = t;
+    rx->last_npkts = 0;
+    rx->rate = 0;
+
+    /* Calculate the required memory space */
+    sz = fe_driver_calc_rx_ring_memsize(rx, FE_QLEN);
+    if ( sz < 0 ) {
+        return -1;
+    }
+    /* Allocate memory space for the ring local to the polling processor */
+    m = _fe_alloc(fe, t->domain, sz);
+    if ( NULL == m ) {
+        return -1;
+    }
+    /* Setup an Rx queue */
+    ret = fe_driver_setup_rx_ring(fe->ports[port], rx, m,
+                                  fe->mem[t->domain].v2poff, FE_QLEN);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    fe_driver_rx_set_dca(rx, t->cpuid);
+
+    /* Fill the Rx queue */
+    fe_driver_rx_fill_all(t, rx);
+    fe_driver_rx_commit(rx);
+
+    t->rx.rings[t->rx.n] = rx;
+    t->rx.n++;
+    t->rx.bitmap |= (1ULL << port);
+
+    return 0;
+}
+
 
 /*
  * Assign each device to a task
@@ -623,21 +5750,17 @@ int
 fe_assign_task(struct fe *fe)
 {
     struct fe_task *t;
-    int n;
+    struct fe_task *sel;
     int ret;
-    int port;
     ssize_t i;
     int sz;
     void *m;
+    struct fe_task *tf;
 
-    /* # of ports (Rx queues) per task of an exclusive processor */
-    n = ((fe->nports - 1) / fe->nxcpu) + 1;
-    port = 0;
-
-    /* Assign ports to each exclusive task */
+    /* Initialize the rings of each exclusive task */
     t = fe->extasks;
     while ( NULL != t ) {
-        ret = _init_extask_ring(fe, t, n, &port);
+        ret = _init_extask_ring(fe, t);
         if ( ret < 0 ) {
             return -1;
         }
@@ -646,44 +5769,86 @@ fe_assign_task(struct fe *fe)
         t = t->next;
     }
 
+    /* Assign each port (Rx queue) to the exclusive task with the fewest ports
+       in the NUMA domain of the port, or in any domain if there is none */
+    for ( i = 0; i < (ssize_t)fe->nports; i++ ) {
+        sel = NULL;
+        t = fe->extasks;
+        while ( NULL != t ) {
+            if ( (t->domain == fe->ports[i]->domain
+                  || fe->ports[i]->domain < 0)
+                 && (NULL == sel || t->rx.n < sel->rx.n) ) {
+                sel = t;
+            }
+            t = t->next;
+        }
+        if ( NULL == sel ) {
+            t = fe->extasks;
+            while ( NULL != t ) {
+                if ( NULL == sel || t->rx.n < sel->rx.n ) {
+                    sel = t;
+                }
+                t = t->next;
+            }
+        }
+        if ( NULL == sel ) {
+            /* No exclusive processor */
+            return -1;
+        }
+        ret = _init_extask_rx_ring(fe, sel, i);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+
     /* Tickful task */
+    tf = fe->tftask;
     /* Rx from exclusive processors */
-    fe->tftask->rx.bitmap = (1ULL << fe->nxcpu) - 1;
-    fe->tftask->rx.rings
-        = _fe_alloc(fe, sizeof(struct fe_driver_rx) * fe->nxcpu);
-    if ( NULL == fe->tftask->rx.rings ) {
+    tf->rx.bitmap = (1ULL << fe->nxcpu) - 1;
+    tf->rx.rings
+        = _fe_alloc(fe, tf->domain, sizeof(struct fe_driver_rx *) * fe->nxcpu);
+    if ( NULL == tf->rx.rings ) {
         return -1;
     }
+    tf->rx.n = fe->nxcpu;
     t = fe->extasks;
     i = 0;
     while ( NULL != t ) {
-        fe->tftask->rx.rings[i].driver = FE_DRIVER_KERNEL;
-        fe->tftask->rx.rings[i].u.kernel = t->ktx;
+        tf->rx.rings[i] = _fe_alloc(fe, tf->domain,
+                                    sizeof(struct fe_driver_rx));
+        if ( NULL == tf->rx.rings[i] ) {
+            return -1;
+        }
+        tf->rx.rings[i]->driver = FE_DRIVER_KERNEL;
+        tf->rx.rings[i]->port = -1;
+        tf->rx.rings[i]->npkts = 0;
+        tf->rx.rings[i]->owner = tf;
+        tf->rx.rings[i]->u.kernel = t->ktx;
         /* Next task */
         t = t->next;
         i++;
     }
 
     /* Tx */
-    fe->tftask->tx.rings
-        = _fe_alloc(fe, sizeof(struct fe_driver_tx) * fe->nports);
-    if ( NULL == fe->tftask->tx.rings ) {
+    tf->tx.rings
+        = _fe_alloc(fe, tf->domain, sizeof(struct fe_driver_tx) * fe->nports);
+    if ( NULL == tf->tx.rings ) {
         return -1;
     }
     /* Physical ports */
     for ( i = 0; i < (ssize_t)fe->nports; i++ ) {
-        fe->tftask->tx.rings[i].driver = fe->ports[i]->driver;
+        tf->tx.rings[i].driver = fe->ports[i]->driver;
 
-        sz = fe_driver_calc_tx_ring_memsize(&fe->tftask->tx.rings[i], FE_QLEN);
+        sz = fe_driver_calc_tx_ring_memsize(&tf->tx.rings[i], FE_QLEN);
         if ( sz < 0 ) {
             return -1;
         }
-        m = _fe_alloc(fe, sz);
+        m = _fe_alloc(fe, tf->domain, sz);
         if ( NULL == m ) {
             return -1;
         }
-        ret = fe_driver_setup_tx_ring(fe->ports[i], &fe->tftask->tx.rings[i], m,
-                                      fe->mem.v2poff, FE_QLEN);
+        ret = fe_driver_setup_tx_ring(fe->ports[i], &tf->tx.rings[i], m,
+                                      fe->mem[tf->domain].v2poff, FE_QLEN);
         if ( ret < 0 ) {
             return -1;
         }
@@ -699,11 +5864,8 @@ int
 fe_init(struct fe *fe)
 {
     struct pci_dev *pci;
+    ssize_t i;
     int ret;
-    size_t len;
-    void *pa;
-    void *va;
-    uint64_t voff;
 
     /* Check all PCI devices */
     pci = pci_init();
@@ -714,10 +5876,38 @@ fe_init(struct fe *fe)
     /* Reset */
     fe->ncpus = 0;
     fe->nxcpu = 0;
+    fe->poll_mode = FE_POLL_ADAPTIVE;
     fe->nports = 0;
     memset(fe->ports, 0, sizeof(struct fe_device *) * FE_MAX_PORTS);
     fe->tftask = NULL;
     fe->extasks = NULL;
+    fe->rebalance.state = FE_REBALANCE_IDLE;
+    fe->rebalance.last_tsc = 0;
+    fe->rebalance.ring = NULL;
+    fe->rebalance.src = NULL;
+    fe->rebalance.dst = NULL;
+    fe->rebalance.refund = NULL;
+    memset(fe->vlan_members, 0, sizeof(fe->vlan_members));
+    fe->nat = NULL;
+    fe->capture = NULL;
+    fe->sample_rate = 0;
+    fe->sample_flows = NULL;
+    fe->collector.addr = 0;
+    fe->collector.port = 0;
+    fe->collector.nh = 0;
+    fe->collector.seq = 0;
+    fe->pktgen = NULL;
+    fe->pktgen_gen = 0;
+    fe->pktgen_start = 0;
+    fe->pktgen_stop = 0;
+    fe->tsc_hz = 0;
+    memset(fe->qos, 0, sizeof(fe->qos));
+    fe->qos_gen = 0;
+    memset((void *)fe->police, 0, sizeof(fe->police));
+    memset((void *)fe->lags, 0, sizeof(fe->lags));
+    fe->vxlan = NULL;
+    memset((void *)fe->sas, 0, sizeof(fe->sas));
+    fe->ipsec_gen = 0;
 
     /* Initialize the forwarding database */
     fe->fdb = fdb_init();
@@ -726,18 +5916,47 @@ fe_init(struct fe *fe)
         return -1;
     }
 
-    /* Allocate memory for descriptors */
-    len = (size_t)FE_MEMSIZE_FOR_DESCS;
-    ret = syscall(SYS_pix_malloc, len, &pa, &va);
-    if ( ret < 0 ) {
-        printf("Failed to allocate memory.\n");
+    /* Initialize the forwarding information base */
+    fe->epoch = 0;
+    fe->fib4 = fib4_init();
+    if ( NULL == fe->fib4 ) {
+        printf("Failed to initilize FIB.\n");
+        return -1;
+    }
+    fe->fib6 = fib6_init(FIB6_DEFAULT_MAX_NODES, FIB6_DEFAULT_MAX_LEAVES);
+    if ( NULL == fe->fib6 ) {
+        printf("Failed to initilize IPv6 FIB.\n");
+        return -1;
+    }
+    fe->nexthops = malloc(sizeof(struct fe_nexthop) * FE_MAX_NEXTHOPS);
+    if ( NULL == fe->nexthops ) {
+        printf("Failed to initilize next hops.\n");
+        return -1;
+    }
+    memset(fe->nexthops, 0, sizeof(struct fe_nexthop) * FE_MAX_NEXTHOPS);
+    fe->nhaddrs = hopscotch_init(NULL, FE_NH_KEY_SIZE);
+    if ( NULL == fe->nhaddrs ) {
+        printf("Failed to initilize next hops.\n");
+        return -1;
+    }
+    fe->l3if = malloc(sizeof(struct fe_l3if) * FE_VLAN_MAX);
+    if ( NULL == fe->l3if ) {
+        printf("Failed to initilize interfaces.\n");
+        return -1;
+    }
+    memset(fe->l3if, 0, sizeof(struct fe_l3if) * FE_VLAN_MAX);
+    fe->retired = NULL;
+    fe->retired_tail = NULL;
+
+    /* Initialize the ACL */
+    fe->acl = acl_init();
+    if ( NULL == fe->acl ) {
+        printf("Failed to initilize ACL.\n");
         return -1;
     }
-    voff = pa - va;
-    fe->mem.vaddr = va;
-    fe->mem.len = len;
-    fe->mem.v2poff = voff;
-    fe->mem.free = va;
+
+    /* Memory for descriptors is allocated from each NUMA domain on demand */
+    memset(fe->mem, 0, sizeof(fe->mem));
 
     /* Initialize processor (as a list of tasks) */
     ret = fe_init_cpu(fe);
@@ -753,6 +5972,27 @@ fe_init(struct fe *fe)
         goto error;
     }
 
+    /* Initialize connection tracking */
+    ret = fe_init_conntrack(fe);
+    if ( ret < 0 ) {
+        printf("Failed to initialize connection tracking.\n");
+        goto error;
+    }
+
+    /* Initialize IPv4 reassembly */
+    ret = fe_init_ipfrag(fe);
+    if ( ret < 0 ) {
+        printf("Failed to initialize IPv4 reassembly.\n");
+        goto error;
+    }
+
+    /* Initialize the packet processing graphs */
+    ret = fe_init_graph(fe);
+    if ( ret < 0 ) {
+        printf("Failed to initialize the packet processing graph.\n");
+        goto error;
+    }
+
     /* Initialize devices (hw) */
     ret = fe_init_devices(fe, pci);
     if ( ret < 0 ) {
@@ -763,6 +6003,18 @@ fe_init(struct fe *fe)
     /* Release PCI memory */
     pci_release(pci);
 
+    /* All ports are access ports of the default VLAN */
+    for ( i = 0; i < (ssize_t)fe->nports; i++ ) {
+        fe_vlan_set_access(fe, i, FE_VLAN_DEFAULT);
+    }
+
+    /* The router uses the MAC address of the first port */
+    memset(fe->router_mac, 0, ETHER_ADDR_LEN);
+    if ( fe->nports > 0 && NULL != fe_driver_macaddr(fe->ports[0]) ) {
+        memcpy(fe->router_mac, fe_driver_macaddr(fe->ports[0]),
+               ETHER_ADDR_LEN);
+    }
+
     /* Check the number of exclusive CPUs and the number of ports whether each
        port supports fast-path */
     ret = fe_init_device_type(fe);
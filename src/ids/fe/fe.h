@@ -25,23 +25,129 @@
 #define _FE_H
 
 #include <sys/pix.h>
+#include <sys/net/ethernet.h>
 #include "e1000.h"
 #include "e1000e.h"
 #include "igb.h"
 #include "ixgbe.h"
 #include "i40e.h"
+#include "memdrv.h"
 #include "fdb.h"
+#include "fib4.h"
+#include "fib6.h"
+#include "acl.h"
+#include "conntrack.h"
+#include "nat.h"
+#include "capture.h"
+#include "sample.h"
+#include "pktgen.h"
+#include "qos.h"
+#include "police.h"
+#include "lag.h"
+#include "vxlan.h"
+#include "ipsec.h"
+#include "ipfrag.h"
 
 #define FE_MAX_PORTS            64
 
 #define FE_PKTSZ                (10240 + 128)
-#define FE_PKT_HDROFF           512
+#define FE_PKT_HDROFF           512     /* > header + IXGBE_RX_HDRSZ
+                                           + VXLAN_ENCAP_LEN */
 #define FE_BUFFER_POOL_SIZE     4096
 
 #define FE_QLEN                 512
 
+/* Maximum # of packets received from an Rx ring at once */
+#define FE_RX_BURST             32
+/* # of packets whose descriptors and headers are prefetched ahead at Rx */
+#define FE_RX_PREFETCH          4
+/* Maximum # of packets of a vector processed by a node of the graph at once
+   (the bulk lookups of a node are run in chunks of FE_RX_BURST) */
+#define FE_VEC_SIZE             256
+
 #define FE_MEMSIZE_FOR_DESCS    (1ULL << 24)
 
+/* Adaptive polling: # of consecutive empty polls before backing off with the
+   pause instruction, and before sleeping the exclusive processor */
+#define FE_IDLE_SPIN_POLLS      1024
+#define FE_IDLE_PAUSE_POLLS     16384
+#define FE_IDLE_PAUSE_LOOP      64
+/* Upper bound of a sleep (in microseconds) */
+#define FE_IDLE_SLEEP_USEC      20
+
+/* Load-aware rebalancing of Rx rings: interval (in TSC) and the minimum
+   imbalance (in packets per interval) to migrate an Rx ring */
+#define FE_REBALANCE_TSC        2000000000ULL
+#define FE_REBALANCE_MIN_PKTS   100000
+
+/* 802.1Q VLAN */
+#define FE_VLAN_MAX             4096
+#define FE_VLAN_VID_MASK        0x0fff
+#define FE_VLAN_PCP_MASK        0xf000
+/* VLAN of all ports at initialization */
+#define FE_VLAN_DEFAULT         1
+
+/* # of next hops referred to from the FIB (index 0 is reserved) */
+#define FE_MAX_NEXTHOPS         4096
+
+/* Next-hop resolution: lifetime of a confirmed adjacency, interval of probes
+   (in TSC), # of probes before giving up, interval of probes after giving up,
+   and # of packets queued per next hop while resolving */
+#define FE_NH_REACHABLE_TSC     (30ULL * 1000000000)
+#define FE_NH_PROBE_TSC         1000000000ULL
+#define FE_NH_MAX_PROBES        3
+#define FE_NH_RETRY_TSC         (10ULL * 1000000000)
+#define FE_NH_MAX_PENDING       16
+/* Key of the address of a next hop: the address family, the VLAN ID, and
+   the address */
+#define FE_NH_KEY_SIZE          20
+
+/* Time for which an aggregated flow is kept after it expires (in TSC) */
+#define FE_CT_FLOW_LINGER_TSC   (60ULL * 1000000000)
+
+/* Export interval of the sampled flows (in TSC), the maximum size of an
+   export packet, and the IPFIX observation domain */
+#define FE_SAMPLE_EXPORT_TSC    (10ULL * 1000000000)
+#define FE_SAMPLE_MTU           1500
+#define FE_SAMPLE_DOMAIN        1
+
+/* Interval of the LACP timers (in TSC) */
+#define FE_LACP_TIMER_TSC       100000000ULL
+
+/* VXLAN: # of remote VTEPs (referred to by the FDB as the ports following
+   the physical ones), and the sizes of the lookup tables of the VNIs and the
+   remote addresses (powers of 2, kept at most half full) */
+#define FE_VXLAN_MAX_VTEPS      64
+#define FE_VXLAN_PORT(i)        (FE_MAX_PORTS + (i))
+#define FE_VXLAN_VNI_HASH       8192
+#define FE_VXLAN_VTEP_HASH      128
+
+/* IPsec: # of SAs, outbound sequence numbers reserved by a task at once, and
+   the size of the lookup table of the inbound SPIs (a power of 2, kept at
+   most half full) */
+#define FE_IPSEC_MAX_SAS        64
+#define FE_IPSEC_SEQ_BLOCK      64
+#define FE_IPSEC_SPI_HASH       128
+
+/* Timeout of the IPv4 reassembly (in ticks of ct_tick()), and the minimum
+   MTU of an interface (RFC 791) */
+#define FE_IPFRAG_TIMEOUT       16
+#define FE_MIN_MTU              68
+
+/* ICMP Destination Unreachable (Fragmentation Needed), and the length of the
+   ICMP header */
+#define FE_ICMP_UNREACH         3
+#define FE_ICMP_UNREACH_NEEDFRAG 4
+#define FE_ICMP_HDR_LEN         8
+
+/* Modes of kernel ring descriptors */
+#define FE_KDESC_PKT            0   /* Packet forwarded to a port */
+#define FE_KDESC_FDB            1   /* FDB update */
+#define FE_KDESC_RESOLVE        2   /* Packet waiting for a next hop */
+#define FE_KDESC_NEIGH          3   /* ARP/neighbor discovery message */
+#define FE_KDESC_LACP           4   /* LACPDU/marker PDU at a LAG member */
+#define FE_KDESC_FRAGNEEDED     5   /* DF set packet exceeding the MTU */
+
 
 /*
  * Driver type
@@ -52,6 +158,275 @@ enum fe_driver_type {
     FE_DRIVER_E1000,
     FE_DRIVER_IXGBE,
     FE_DRIVER_I40E,
+    FE_DRIVER_MEMORY,
+};
+
+/*
+ * Polling mode of exclusive processors
+ */
+enum fe_poll_mode {
+    FE_POLL_BUSY,
+    FE_POLL_ADAPTIVE,
+};
+
+/*
+ * 802.1Q port mode
+ */
+enum fe_vlan_mode {
+    /* Untagged member of the port VLAN only */
+    FE_VLAN_ACCESS,
+    /* Tagged member of multiple VLANs; untagged in the port VLAN (native) */
+    FE_VLAN_TRUNK,
+};
+
+/*
+ * Resolved adjacency of a next hop; read by the fast path, and replaced as a
+ * whole by the tickful task
+ */
+struct fe_adj {
+    /* Outgoing port and VLAN */
+    int port;
+    uint16_t vid;
+    /* MAC address */
+    uint8_t mac[ETHER_ADDR_LEN];
+};
+
+/*
+ * State of a next hop
+ */
+enum fe_nexthop_state {
+    FE_NH_NONE,
+    /* Resolving; packets are queued */
+    FE_NH_INCOMPLETE,
+    FE_NH_REACHABLE,
+    /* Being refreshed in the background; the adjacency is still used */
+    FE_NH_STALE,
+    /* Statically configured adjacency */
+    FE_NH_PERMANENT,
+};
+
+/*
+ * Next hop of routes
+ */
+struct fe_nexthop {
+    /* Adjacency read by the fast path; NULL if unresolved */
+    struct fe_adj * volatile adj;
+    /* Outbound SA (index + 1) of the tunnel routed into; 0 if not a
+       tunnel */
+    volatile uint16_t sa;
+    /* Set by the fast path when it forwards to the adjacency, and cleared by
+       the tickful task when it refreshes the adjacency */
+    volatile uint8_t used;
+
+    /* The followings are managed by the tickful task */
+    enum fe_nexthop_state state;
+    /* VLAN of the next hop (the port is learned) */
+    uint16_t vid;
+    /* Address (4 for IPv4 or 6 for IPv6) */
+    int af;
+    uint8_t addr[16];
+    /* Key in the table of the addresses, and the next one of the same
+       address (0 if none) */
+    uint8_t key[FE_NH_KEY_SIZE];
+    uint16_t next;
+    /* TSC of the last confirmation and the last probe, and # of probes */
+    uint64_t confirmed;
+    uint64_t probed;
+    int probes;
+    /* Packets waiting for the resolution */
+    struct fe_pkt_buf_hdr *pending;
+    struct fe_pkt_buf_hdr *pending_tail;
+    int npending;
+};
+
+/*
+ * Links of a LAG collecting, and those distributing in the order of the
+ * selection by the hash; read by the fast path, and replaced as a whole by the
+ * tickful task
+ */
+struct fe_lag_dist {
+    uint64_t collecting;
+    uint64_t distributing;
+    int n;
+    uint8_t ports[FE_MAX_PORTS];
+};
+
+/*
+ * Link aggregation group; the member ports are bundled behind the lowest one
+ * (the logical port), which is referred to by the FDB, the adjacencies, and
+ * the VLAN configuration
+ */
+struct fe_lag {
+    /* Logical port, and the hash policy (LAG_HASH_*) */
+    int port;
+    int hash;
+    struct fe_lag_dist *volatile dist;
+    /* Member ports, and the LACP state of each member (updated only by the
+       tickful task; static if lacp is zero) */
+    uint64_t members;
+    int lacp;
+    struct lacp_port links[FE_MAX_PORTS];
+};
+
+/*
+ * Remote VTEP of the VXLAN overlay, reached through a next hop
+ */
+struct fe_vtep {
+    /* Address (network byte order; 0 if not configured) */
+    uint32_t addr;
+    uint16_t nh;
+    /* Outer headers */
+    struct vxlan_tmpl tmpl;
+};
+
+/*
+ * VXLAN tunnel end point; read by the fast path, and replaced as a whole on
+ * every update
+ */
+struct fe_vxlan {
+    /* Local address (network byte order) */
+    uint32_t addr;
+    /* VNI bridged to each VLAN (0 if not bridged to the overlay), and the
+       remote VTEPs its broadcasts and unknown unicasts are replicated to */
+    uint32_t vnis[FE_VLAN_MAX];
+    uint64_t floods[FE_VLAN_MAX];
+    struct fe_vtep vteps[FE_VXLAN_MAX_VTEPS];
+    /* Open addressing tables of the decapsulation from the VNI to the VLAN,
+       and from the source address to the remote VTEP (index + 1); zero for
+       the empty slots */
+    struct {
+        uint32_t vni;
+        uint16_t vid;
+    } vni_hash[FE_VXLAN_VNI_HASH];
+    struct {
+        uint32_t addr;
+        uint16_t vtep;
+    } vtep_hash[FE_VXLAN_VTEP_HASH];
+};
+
+/*
+ * IPsec SA; read by the fast path (which updates only the anti-replay
+ * window), and replaced as a whole on every update
+ */
+struct fe_sa {
+    struct esp_sa_config cfg;
+    /* Generation of the configuration (unique per SA) */
+    uint32_t gen;
+    /* Next outbound sequence number to be reserved by a task */
+    volatile uint64_t seq;
+    /* Anti-replay window (inbound), shared by the tasks */
+    struct esp_replay replay;
+};
+
+/*
+ * Contexts of the SAs of an exclusive task (in its NUMA domain; allocated by
+ * the tickful task, and updated only by the exclusive task)
+ */
+struct fe_ipsec {
+    struct esp_ctx sas[FE_IPSEC_MAX_SAS];
+    /* Generation of the SA each context was initialized from (0 if the SA
+       is not configured), and the next hop to the peer */
+    uint32_t gens[FE_IPSEC_MAX_SAS];
+    uint16_t nhs[FE_IPSEC_MAX_SAS];
+    /* Inbound SAs by the SPI (index + 1; 0 for the empty slots) */
+    struct {
+        uint32_t spi;
+        uint16_t sa;
+    } spis[FE_IPSEC_SPI_HASH];
+    /* Generation of the configuration applied */
+    uint32_t gen;
+};
+
+/*
+ * Layer-3 interface (per VLAN)
+ */
+struct fe_l3if {
+    /* IPv4 address in host byte order, and IPv6 address */
+    int has_addr4;
+    uint32_t addr4;
+    int has_addr6;
+    uint8_t addr6[16];
+    /* MTU of the routed packets (0 for the maximum frame size of the
+       ports); IPv4 packets are fragmented to it */
+    uint16_t mtu;
+};
+
+/*
+ * Flow counters aggregated by the tickful task from the shards
+ */
+struct fe_ct_flow {
+    uint8_t key[CT_KEY_SIZE];
+    /* Endpoint that originated the flow, and the last state */
+    int orig;
+    int state;
+    /* Non-zero if the flow has expired */
+    int final;
+    /* Counters per direction (from the endpoint 0 or 1 of the key) */
+    uint64_t pkts[2];
+    uint64_t bytes[2];
+    /* TSC of the last record */
+    uint64_t last;
+};
+
+/*
+ * Packet generator mode; the rate of the configuration is per Tx port, paced
+ * by each exclusive task at its share
+ */
+struct fe_pktgen {
+    struct pktgen_config cfg;
+    /* Generation (the generators are reset by the tasks on a new one) */
+    uint32_t gen;
+    /* Rate per task, and the TSC frequency */
+    uint64_t pps;
+    uint64_t hz;
+};
+
+/*
+ * QoS scheduler configuration of a port; the schedulers are reinitialized by
+ * the tasks on a new generation of fe->qos_gen
+ */
+struct fe_qos {
+    struct qos_config cfg;
+    /* Enabled, and the TSC frequency */
+    int enabled;
+    uint64_t hz;
+    /* Shapers shared by the schedulers of the tasks */
+    struct qos_shaper shaper;
+};
+
+/*
+ * Sampled flow aggregated by the tickful task (counters estimated from the
+ * samples since the last export)
+ */
+struct fe_sample_flow {
+    uint8_t key[SAMPLE_KEY_SIZE];
+    uint64_t samples;
+    uint64_t pkts;
+    uint64_t bytes;
+};
+
+/*
+ * Memory released by the tickful task, freed after all exclusive tasks have
+ * passed a quiescent state
+ */
+struct fe_retired {
+    void *ptr;
+    uint64_t epoch;
+    struct fe_retired *next;
+};
+
+/*
+ * Packet capture
+ */
+struct fe_capture {
+    /* Ports captured at Rx and Tx (bitmaps) */
+    volatile uint64_t rxports;
+    volatile uint64_t txports;
+    /* Filter (NULL to capture all the packets) */
+    struct cap_filter *volatile filter;
+    /* Directory of the rings shared with the consumer */
+    struct cap_dir *dir;
+    void *dirpa;
 };
 
 /*
@@ -62,6 +437,19 @@ struct fe_pkt_buf_hdr {
     int refs;
     /* Inheritted from fpp */
     int port;
+    /* TCI of the 802.1Q tag stripped at Rx (0 for untagged), or the tag to be
+       inserted at Tx of the slow path */
+    uint16_t vlan;
+    /* Length of the packet queued in the slow path */
+    uint16_t len;
+    /* Checksum status reported by the NIC at Rx (RX_CSUM_*) */
+    uint8_t rxcsum;
+    /* Offloads requested at Tx (cleared on release; a packet with offloads
+       is to be transmitted to a single port) */
+    struct tx_offload txol;
+    /* Offset to calculate the physical address from the virtual address;
+       buffer pools in different NUMA domains have different offsets */
+    uint64_t v2poff;
 };
 
 /*
@@ -70,8 +458,6 @@ struct fe_pkt_buf_hdr {
 struct fe_buffer_pool {
     /* Linked list */
     struct fe_pkt_buf_hdr *head;
-    /* Offset to calculate the physical address from the virtual address */
-    uint64_t v2poff;
 } __attribute__ ((aligned(128)));
 
 /*
@@ -81,8 +467,8 @@ struct fe_kernel_desc {
     void *pkt;
     uint16_t length;
     uint16_t port;              /* Outgoing port */
-    uint16_t mode;              /* 0: pkt forwarding, 1: control */
-    uint16_t rsvd[1];
+    uint16_t mode;              /* FE_KDESC_* */
+    uint16_t vlan;              /* 802.1Q tag to be inserted (or VLAN ID) */
 } __attribute__ ((packed));
 
 /*
@@ -110,10 +496,17 @@ struct fe_driver_rx {
     enum fe_driver_type driver;
     /* Port # */
     int port;
+    /* # of received packets (written only by the owner task) */
+    volatile uint64_t npkts;
+    /* Owner task and the packet rate (managed by the tickful task) */
+    struct fe_task *owner;
+    uint64_t last_npkts;
+    uint64_t rate;
     union {
         struct fe_kernel_ring *kernel;
         struct e1000_rx_ring e1000;
         struct ixgbe_rx_ring ixgbe;
+        struct memdrv_rx_ring mem;
     } u;
 };
 struct fe_driver_tx {
@@ -123,15 +516,90 @@ struct fe_driver_tx {
         struct fe_kernel_ring *kernel;
         struct e1000_tx_ring e1000;
         struct ixgbe_tx_ring ixgbe;
+        struct memdrv_tx_ring mem;
     } u;
 };
 
+/*
+ * Nodes of the packet processing graph of the fast path; a node only enqueues
+ * packets to the nodes following it, so that the graph is run in a single
+ * pass in this order
+ */
+enum fe_node_id {
+    /* Capture, LAG, VLAN classification, sampling, policing, ACL, and the
+       classification to bridging or routing */
+    FE_NODE_ETHERNET_INPUT = 0,
+    /* Reassembly, and demultiplexing of VXLAN and ESP to the router */
+    FE_NODE_IP4_INPUT,
+    /* ESP decryption, and filtering of the inner packets */
+    FE_NODE_ESP4_INPUT,
+    /* FDB lookup and flooding */
+    FE_NODE_L2_FORWARD,
+    /* Connection tracking, NAT, FIB lookup, and TTL */
+    FE_NODE_IP4_LOOKUP,
+    FE_NODE_IP6_LOOKUP,
+    /* ESP encryption */
+    FE_NODE_ESP4_OUTPUT,
+    /* Fragmentation, MAC rewrite, LAG selection, and Tx */
+    FE_NODE_IP_REWRITE,
+    FE_NODE_MAX
+};
+
+/* Argument of a packet to a node: the VLAN ID, the (logical or VTEP) port,
+   and the port received at */
+#define FE_META(vid, port, rxport)                                      \
+    ((uint32_t)(vid) | ((uint32_t)(port) << 12) | ((uint32_t)(rxport) << 20))
+#define FE_META_VID(m)          ((m) & 0xfff)
+#define FE_META_PORT(m)         (((m) >> 12) & 0xff)
+#define FE_META_RXPORT(m)       ((m) >> 20)
+
+/*
+ * Vector of packets pending at a node, with the argument of each packet (the
+ * Rx port, the next hop, the SA, or FE_META())
+ */
+struct fe_vec {
+    int n;
+    struct fe_pkt_buf_hdr *hdrs[FE_VEC_SIZE];
+    void *pkts[FE_VEC_SIZE];
+    int lens[FE_VEC_SIZE];
+    uint32_t meta[FE_VEC_SIZE];
+};
+
+struct fe_task;
+
+/*
+ * Node of the graph; processes (or discards) all the packets of a vector
+ */
+struct fe_node {
+    const char *name;
+    void (*process)(struct fe_task *, struct fe_vec *);
+};
+
+/*
+ * Packet processing graph of an exclusive task (in its NUMA domain)
+ */
+struct fe_graph {
+    const struct fe_node *nodes;
+    struct fe_vec vecs[FE_NODE_MAX];
+    /* Nodes with packets pending (a bitmap) */
+    uint32_t pending;
+    /* Tx rings to be committed at the end of the pass */
+    uint64_t txports;
+    /* Vectors and packets processed by each node */
+    struct {
+        uint64_t vectors;
+        uint64_t pkts;
+    } stats[FE_NODE_MAX];
+};
+
 /*
  * Data per task
  */
 struct fe_task {
     /* CPU ID (for exclusive processor), or -1 for kernel */
     int cpuid;
+    /* NUMA domain of the processor */
+    int domain;
 
     /* Back-link */
     struct fe *fe;
@@ -142,29 +610,96 @@ struct fe_task {
     /* Kernel Tx */
     struct fe_kernel_ring *ktx;
 
+    /* Connection tracking shard (exclusive tasks) */
+    struct ct *ct;
+    /* IPv4 reassembly table (exclusive tasks) */
+    struct ipfrag *ipfrag;
+    /* Packet processing graph (exclusive tasks) */
+    struct fe_graph *graph;
+    /* NAT port block (exclusive tasks) */
+    struct nat_shard *nat;
+    /* Capture ring (exclusive tasks), the buffers referenced by its
+       descriptors, and the position up to which they are released */
+    struct {
+        struct cap_ring *ring;
+        struct fe_pkt_buf_hdr **bufs;
+        uint64_t collected;
+    } cap;
+    /* Flow sampler (exclusive tasks) */
+    struct sample *sample;
+    /* Packet generator (exclusive tasks) */
+    struct pktgen *pktgen;
+    /* IPsec SA contexts (NULL until an SA is configured) */
+    struct fe_ipsec *volatile ipsec;
+    /* QoS schedulers of the ports (exclusive tasks; allocated by the tickful
+       task), the ports of the enabled ones and of those with queued packets,
+       and the generation of the configuration applied */
+    struct {
+        struct qos_sched *ports[FE_MAX_PORTS];
+        uint64_t enabled;
+        uint64_t backlog;
+        uint32_t gen;
+    } qos;
+
     /* Handling Rx queues */
     struct {
         uint64_t bitmap;
-        struct fe_driver_rx *rings;
+        /* Array of up to FE_MAX_PORTS rings */
+        struct fe_driver_rx **rings;
+        int n;
+        /* Sum of the packet rates (managed by the tickful task) */
+        uint64_t load;
     } rx;
 
+    /* Rx ring handover requested by the tickful task; the task clears each
+       request once it has been processed */
+    struct {
+        struct fe_driver_rx * volatile release;
+        struct fe_driver_rx * volatile acquire;
+        /* Buffers given back by the destination of a ring released, as many
+           as those posted to the ring from the pool of this task */
+        struct fe_pkt_buf_hdr * volatile refund;
+    } handover;
+
     /* Handling Tx queues */
     struct {
         /* # of ports */
         struct fe_driver_tx *rings;
     } tx;
 
+    /* The epoch observed at the last quiescent state, where the task holds
+       no reference to the FIB */
+    volatile uint64_t qsbr;
+
+    /* Adaptive polling */
+    struct {
+        /* # of consecutive empty polls */
+        uint64_t polls;
+        /* # of sleeps (statistics) */
+        uint64_t sleeps;
+    } idle;
+
     /* Pointer to the next task */
     struct fe_task *next;
 };
 
+/*
+ * State of the Rx ring handover
+ */
+enum fe_rebalance_state {
+    FE_REBALANCE_IDLE,
+    FE_REBALANCE_RELEASE,
+    FE_REBALANCE_ACQUIRE,
+    FE_REBALANCE_REFUND,
+};
+
 /*
  * Physical port
  */
 struct fe_device {
     /* Port # */
     int port;
-    /* NUMA domain */
+    /* NUMA domain; -1 for unknown */
     int domain;
     /* Last allocated queue # */
     int rxq_last;
@@ -175,9 +710,13 @@ struct fe_device {
     union {
         struct e1000_device *e1000;
         struct ixgbe_device *ixgbe;
+        struct memdrv_device *mem;
     } u;
     /* Type; exclusive or kernel */
     int fastpath;
+    /* 802.1Q port mode and port VLAN ID (the VLAN of untagged packets) */
+    enum fe_vlan_mode vlan_mode;
+    uint16_t pvid;
 };
 
 /*
@@ -187,12 +726,69 @@ struct fe {
     /* Forwarding/Action database */
     struct fdb *fdb;
 
+    /* IPv4/IPv6 forwarding information bases and next hops (routing) */
+    struct fib4 *fib4;
+    struct fib6 *fib6;
+    /* Ingress ACL */
+    struct acl *acl;
+    /* Connection tracking, and the flows aggregated from the shards */
+    int ct_enabled;
+    struct hopscotch_hash_table *ct_flows;
+    /* NAPT of the inside prefix to the external address (NULL if
+       disabled) */
+    struct nat *volatile nat;
+    /* Packet capture (NULL if never enabled) */
+    struct fe_capture *volatile capture;
+    /* Sampling rate (1-in-N; 0 if disabled), the sampled flows aggregated
+       from the tasks, and the IPFIX collector (the address in host byte
+       order, and the next hop to it; disabled if the address is zero) */
+    volatile uint32_t sample_rate;
+    struct hopscotch_hash_table *sample_flows;
+    struct {
+        uint32_t addr;
+        uint16_t port;
+        uint16_t nh;
+        uint32_t seq;
+    } collector;
+    /* Packet generator mode (NULL if not running), the last generation, the
+       TSC at the start and the stop of the last run (0 while running), and
+       the calibrated TSC frequency (0 until calibrated) */
+    struct fe_pktgen *volatile pktgen;
+    uint32_t pktgen_gen;
+    uint64_t pktgen_start;
+    uint64_t pktgen_stop;
+    uint64_t tsc_hz;
+    /* QoS scheduler configuration of each port (NULL if never configured),
+       and its generation incremented on every update */
+    struct fe_qos *qos[FE_MAX_PORTS];
+    volatile uint32_t qos_gen;
+    /* Ingress policer and storm control of each port (NULL if disabled);
+       updated by the task polling the port */
+    struct police *volatile police[FE_MAX_PORTS];
+    struct fe_nexthop *nexthops;
+    /* Next hops resolved by ARP or neighbor discovery by the address (the
+       first one of each address) */
+    struct hopscotch_hash_table *nhaddrs;
+    /* Layer-3 interfaces (FE_VLAN_MAX entries) */
+    struct fe_l3if *l3if;
+    /* MAC address of the router; packets to this address are routed */
+    uint8_t router_mac[ETHER_ADDR_LEN];
+    /* Epoch for the reclamation of the FIB memory; incremented by the
+       tickful task on every update */
+    volatile uint64_t epoch;
+    /* Memory to be freed (FIFO) */
+    struct fe_retired *retired;
+    struct fe_retired *retired_tail;
+
     /* Processors */
     int ncpus;
 
     /* Exclusive processors */
     int nxcpu;
 
+    /* Polling mode of exclusive processors */
+    enum fe_poll_mode poll_mode;
+
     /* Ports */
     size_t nports;
     struct fe_device *ports[FE_MAX_PORTS];
@@ -202,13 +798,46 @@ struct fe {
     /* Exclusive CPU tasks (linked list) */
     struct fe_task *extasks;
 
-    /* Memory space for descriptors */
+    /* Member ports of each VLAN (the flooding domain) */
+    uint64_t vlan_members[FE_VLAN_MAX];
+
+    /* LAG of each member port (NULL if not aggregated) */
+    struct fe_lag *volatile lags[FE_MAX_PORTS];
+
+    /* VXLAN tunnel end point (NULL if disabled) */
+    struct fe_vxlan *volatile vxlan;
+
+    /* IPsec SAs (NULL if not configured), and the generation of the
+       configuration incremented on every update */
+    struct fe_sa *volatile sas[FE_IPSEC_MAX_SAS];
+    volatile uint32_t ipsec_gen;
+
+    /* Load-aware rebalancing of Rx rings */
+    struct {
+        enum fe_rebalance_state state;
+        uint64_t last_tsc;
+        /* Rx ring being migrated from src to dst (in the same NUMA domain),
+           and the buffers of dst to be given back to src for those posted to
+           the ring */
+        struct fe_driver_rx *ring;
+        struct fe_task *src;
+        struct fe_task *dst;
+        struct fe_pkt_buf_hdr *refund;
+    } rebalance;
+
+    /* Packet buffers (per NUMA domain; zero length if not allocated) */
+    struct {
+        void *paddr;
+        size_t len;
+    } bufpool[PIX_MAX_DOMAINS];
+
+    /* Memory space for descriptors (per NUMA domain) */
     struct {
         void *vaddr;
         size_t len;
         uint64_t v2poff;
         void *free;
-    } mem;
+    } mem[PIX_MAX_DOMAINS];
 };
 
 /*
@@ -231,9 +860,9 @@ fe_get_buffer(struct fe_task *fet)
  * Resolve physical address of the packet buffer
  */
 static __inline__ void *
-fe_v2p(struct fe_task *fet, void *pkt)
+fe_v2p(struct fe_pkt_buf_hdr *hdr, void *pkt)
 {
-    return pkt + fet->pool.v2poff;
+    return pkt + hdr->v2poff;
 }
 
 /*
@@ -243,9 +872,22 @@ static __inline__ void
 fe_release_buffer(struct fe_task *fet, struct fe_pkt_buf_hdr *pkt)
 {
     pkt->next = fet->pool.head;
+    pkt->txol.flags = 0;
     fet->pool.head = pkt;
 }
 
+/*
+ * Discard a packet; the buffer is released unless still referenced (by a Tx
+ * ring, the kernel ring, or the capture ring)
+ */
+static __inline__ void
+fe_discard_buffer(struct fe_task *fet, struct fe_pkt_buf_hdr *pkt)
+{
+    if ( pkt->refs <= 0 ) {
+        fe_release_buffer(fet, pkt);
+    }
+}
+
 
 /*
  * Abstracted API for each driver
@@ -268,7 +910,27 @@ fe_kernel_collect_buffer(struct fe_kernel_ring *ring, void **hdr)
 }
 
 /*
- * Collect buffer from Tx
+ * Collect all the buffers processed by the tickful task from the kernel ring
+ * of a task
+ */
+static __inline__ void
+fe_kernel_collect(struct fe_task *t)
+{
+    struct fe_pkt_buf_hdr *hdr;
+
+    while ( fe_kernel_collect_buffer(t->ktx, (void **)&hdr) > 0 ) {
+        if ( NULL != hdr ) {
+            hdr->refs--;
+            if ( hdr->refs <= 0 ) {
+                fe_release_buffer(t, hdr);
+            }
+        }
+    }
+}
+
+/*
+ * Collect buffer from Tx; returns 1 if a buffer of a transmitted packet is
+ * collected, or 0 if none
  */
 static __inline__ int
 fe_collect_buffer(struct fe_task *t, struct fe_driver_tx *tx)
@@ -287,7 +949,7 @@ fe_collect_buffer(struct fe_task *t, struct fe_driver_tx *tx)
                 }
             }
         }
-        return 0;
+        return ret > 0 ? 1 : 0;
 
     case FE_DRIVER_E1000:
         ret = e1000_collect_buffer(&tx->u.e1000, (void **)&hdr);
@@ -297,17 +959,28 @@ fe_collect_buffer(struct fe_task *t, struct fe_driver_tx *tx)
                 fe_release_buffer(t, hdr);
             }
         }
-        return 0;
+        return ret > 0 ? 1 : 0;
 
     case FE_DRIVER_IXGBE:
         ret = ixgbe_collect_buffer(&tx->u.ixgbe, (void **)&hdr);
+        if ( ret > 0 && NULL != hdr ) {
+            /* No buffer for context descriptors */
+            hdr->refs--;
+            if ( hdr->refs <= 0 ) {
+                fe_release_buffer(t, hdr);
+            }
+        }
+        return ret > 0 ? 1 : 0;
+
+    case FE_DRIVER_MEMORY:
+        ret = memdrv_collect_buffer(&tx->u.mem, (void **)&hdr);
         if ( ret > 0 ) {
             hdr->refs--;
             if ( hdr->refs <= 0 ) {
                 fe_release_buffer(t, hdr);
             }
         }
-        return 0;
+        return ret > 0 ? 1 : 0;
 
     default:
         ;
@@ -327,6 +1000,8 @@ fe_driver_max_tx_queues(struct fe_device *dev)
         return e1000_max_tx_queues(dev->u.e1000);
     case FE_DRIVER_IXGBE:
         return ixgbe_max_tx_queues(dev->u.ixgbe);
+    case FE_DRIVER_MEMORY:
+        return memdrv_max_tx_queues(dev->u.mem);
     default:
         ;
     }
@@ -334,6 +1009,42 @@ fe_driver_max_tx_queues(struct fe_device *dev)
     return 0;
 }
 
+/*
+ * MAC address of a device
+ */
+static __inline__ uint8_t *
+fe_driver_macaddr(struct fe_device *dev)
+{
+    switch ( dev->driver ) {
+    case FE_DRIVER_E1000:
+        return dev->u.e1000->macaddr;
+    case FE_DRIVER_IXGBE:
+        return dev->u.ixgbe->macaddr;
+    case FE_DRIVER_MEMORY:
+        return dev->u.mem->macaddr;
+    default:
+        ;
+    }
+
+    return NULL;
+}
+
+/*
+ * Add (or remove) a VLAN to (from) the hardware VLAN filter
+ */
+static __inline__ void
+fe_driver_set_vlan_filter(struct fe_device *dev, uint16_t vid, int on)
+{
+    switch ( dev->driver ) {
+    case FE_DRIVER_IXGBE:
+        ixgbe_set_vlan_filter(dev->u.ixgbe, vid, on);
+        break;
+    default:
+        /* Filtered by software */
+        ;
+    }
+}
+
 /*
  * Setup an Rx ring
  */
@@ -360,6 +1071,13 @@ fe_driver_setup_rx_ring(struct fe_device *dev, struct fe_driver_rx *rx, void *m,
         ret = ixgbe_setup_rx_ring(dev->u.ixgbe, &rx->u.ixgbe, dev->rxq_last, m,
                                   v2poff, qlen);
         break;
+
+    case FE_DRIVER_MEMORY:
+        /* Accessed with virtual addresses */
+        dev->rxq_last++;
+        ret = memdrv_setup_rx_ring(dev->u.mem, &rx->u.mem, dev->rxq_last, m,
+                                   qlen);
+        break;
     default:
         ret = -1;
     }
@@ -394,6 +1112,12 @@ fe_driver_setup_tx_ring(struct fe_device *dev, struct fe_driver_tx *tx, void *m,
                                   v2poff, qlen);
         break;
 
+    case FE_DRIVER_MEMORY:
+        dev->txq_last++;
+        ret = memdrv_setup_tx_ring(dev->u.mem, &tx->u.mem, dev->txq_last, m,
+                                   qlen);
+        break;
+
     default:
         ret = -1;
     }
@@ -423,6 +1147,10 @@ fe_driver_calc_rx_ring_memsize(struct fe_driver_rx *rx, uint16_t qlen)
         ret = ixgbe_calc_rx_ring_memsize(&rx->u.ixgbe, qlen);
         break;
 
+    case FE_DRIVER_MEMORY:
+        ret = memdrv_calc_rx_ring_memsize(&rx->u.mem, qlen);
+        break;
+
     default:
         ret = -1;
     }
@@ -452,6 +1180,10 @@ fe_driver_calc_tx_ring_memsize(struct fe_driver_tx *tx, uint16_t qlen)
         ret = ixgbe_calc_tx_ring_memsize(&tx->u.ixgbe, qlen);
         break;
 
+    case FE_DRIVER_MEMORY:
+        ret = memdrv_calc_tx_ring_memsize(&tx->u.mem, qlen);
+        break;
+
     default:
         ret = -1;
     }
@@ -474,7 +1206,7 @@ fe_driver_rx_refill(struct fe_task *t, struct fe_driver_rx *rx)
         return -1;
     }
     /* Resolve physical address */
-    pa = fe_v2p(t, pkt);
+    pa = fe_v2p(pkt, pkt);
 
     switch ( rx->driver ) {
     case FE_DRIVER_KERNEL:
@@ -486,6 +1218,10 @@ fe_driver_rx_refill(struct fe_task *t, struct fe_driver_rx *rx)
     case FE_DRIVER_IXGBE:
         return ixgbe_rx_refill(&rx->u.ixgbe, pa + FE_PKT_HDROFF, pkt);
 
+    case FE_DRIVER_MEMORY:
+        /* Written by the processor */
+        return memdrv_rx_refill(&rx->u.mem, (void *)pkt + FE_PKT_HDROFF, pkt);
+
     default:
         ;
     }
@@ -530,21 +1266,140 @@ fe_driver_rx_commit(struct fe_driver_rx *rx)
         ixgbe_rx_commit(&rx->u.ixgbe);
         break;
 
+    case FE_DRIVER_MEMORY:
+        /* Attached buffers are immediately available */
+        break;
+
+    default:
+        ;
+    }
+}
+
+/*
+ * Prefetch the descriptor, the buffer header, and the packet headers of the
+ * k-th received packet from the next one to be dequeued
+ */
+static __inline__ void
+fe_driver_rx_prefetch(struct fe_driver_rx *rx, int k)
+{
+    void *hdr;
+
+    switch ( rx->driver ) {
+    case FE_DRIVER_E1000:
+        hdr = e1000_rx_prefetch(&rx->u.e1000, k);
+        if ( NULL != hdr ) {
+            __builtin_prefetch(hdr, 1);
+            __builtin_prefetch(hdr + FE_PKT_HDROFF);
+        }
+        break;
+
+    case FE_DRIVER_IXGBE:
+        /* The split headers are copied right before the payload */
+        hdr = ixgbe_rx_prefetch(&rx->u.ixgbe, k);
+        if ( NULL != hdr ) {
+            __builtin_prefetch(hdr, 1);
+            __builtin_prefetch(hdr + FE_PKT_HDROFF - 64, 1);
+        }
+        break;
+
+    default:
+        /* The kernel and memory-backed rings are written by the processor */
+        ;
+    }
+}
+
+/*
+ * Direct the write-backs of an Rx ring to the cache of the processor
+ */
+static __inline__ void
+fe_driver_rx_set_dca(struct fe_driver_rx *rx, int cpu)
+{
+    switch ( rx->driver ) {
+    case FE_DRIVER_IXGBE:
+        ixgbe_rx_set_dca(&rx->u.ixgbe, cpu);
+        break;
+
+    default:
+        ;
+    }
+}
+
+/*
+ * Direct the write-backs of a Tx ring to the cache of the processor
+ */
+static __inline__ void
+fe_driver_tx_set_dca(struct fe_driver_tx *tx, int cpu)
+{
+    switch ( tx->driver ) {
+    case FE_DRIVER_IXGBE:
+        ixgbe_tx_set_dca(&tx->u.ixgbe, cpu);
+        break;
+
+    default:
+        ;
+    }
+}
+
+/*
+ * Number of the buffers posted to an Rx ring
+ */
+static __inline__ int
+fe_driver_rx_nbufs(struct fe_driver_rx *rx)
+{
+    switch ( rx->driver ) {
+    case FE_DRIVER_E1000:
+        return (rx->u.e1000.tail + rx->u.e1000.len - rx->u.e1000.soft_head)
+            % rx->u.e1000.len;
+
+    case FE_DRIVER_IXGBE:
+        return (rx->u.ixgbe.tail + rx->u.ixgbe.len - rx->u.ixgbe.soft_head)
+            % rx->u.ixgbe.len;
+
+    case FE_DRIVER_MEMORY:
+        return (rx->u.mem.tail + rx->u.mem.len - rx->u.mem.head)
+            % rx->u.mem.len;
+
+    default:
+        /* Buffers of the kernel ring are not from the pool */
+        return 0;
+    }
+}
+
+/*
+ * Get the address to be monitored for the arrival at an Rx ring buffer, and
+ * the value it holds until the arrival
+ */
+static __inline__ volatile uint64_t *
+fe_driver_rx_wait_addr(struct fe_driver_rx *rx, uint64_t *val)
+{
+    *val = 0;
+    switch ( rx->driver ) {
+    case FE_DRIVER_E1000:
+        return e1000_rx_wait_addr(&rx->u.e1000);
+
+    case FE_DRIVER_IXGBE:
+        return ixgbe_rx_wait_addr(&rx->u.ixgbe, val);
+
     default:
         ;
     }
+
+    return NULL;
 }
 
 /*
- * Dequeue a packet from an Rx ring buffer (kernel ring buffer)
+ * Dequeue a packet from an Rx ring buffer (kernel ring buffer); the descriptor
+ * is copied to desc
  */
 static __inline__ int
 fe_kernel_rx_dequeue(struct fe_kernel_ring *ring, struct fe_pkt_buf_hdr **hdr,
-                     void **pkt)
+                     void **pkt, struct fe_kernel_desc *desc)
 {
     uint16_t head;
     int len;
     int port;
+    uint16_t vlan;
+    int mode;
 
     if ( ring->rx_head == ring->tail ) {
         /* No more buffer available */
@@ -556,20 +1411,34 @@ fe_kernel_rx_dequeue(struct fe_kernel_ring *ring, struct fe_pkt_buf_hdr **hdr,
     *pkt = ring->descs[ring->head].pkt;
     len = ring->descs[ring->head].length;
     port = ring->descs[ring->head].port;
-    if ( 1 == ring->descs[ring->head].mode ) {
+    vlan = ring->descs[ring->head].vlan;
+    mode = ring->descs[ring->head].mode;
+    *desc = ring->descs[ring->head];
+    if ( FE_KDESC_FDB == mode ) {
         *hdr = (void *)(uint64_t)port;
         len = 0;
     }
     __sync_synchronize();
     ring->rx_head = head;
 
-    if ( len > 0 ) {
+    if ( len > 0 && FE_KDESC_PKT == mode ) {
+        /* Punted packets are still referred to by the fast path */
         (*hdr)->port = port;
+        (*hdr)->vlan = vlan;
     }
 
     return len;
 }
 
+/*
+ * Release the descriptor dequeued from a kernel ring buffer
+ */
+static __inline__ void
+fe_kernel_rx_release(struct fe_kernel_ring *ring)
+{
+    ring->head = ring->head + 1 < ring->len ? ring->head + 1 : 0;
+}
+
 /*
  * Dequeue a packet from an Rx ring buffer
  */
@@ -578,22 +1447,46 @@ fe_driver_rx_dequeue(struct fe_driver_rx *rx, struct fe_pkt_buf_hdr **hdr,
                      void **pkt)
 {
     int ret;
+    uint16_t vlan;
+    uint8_t csum;
+    void *hbuf;
+    uint16_t hlen;
+    struct fe_kernel_desc desc;
 
     switch ( rx->driver ) {
     case FE_DRIVER_KERNEL:
-        return fe_kernel_rx_dequeue(rx->u.kernel, hdr, pkt);
+        return fe_kernel_rx_dequeue(rx->u.kernel, hdr, pkt, &desc);
 
     case FE_DRIVER_E1000:
-        ret = e1000_rx_dequeue(&rx->u.e1000, (void **)hdr);
+        ret = e1000_rx_dequeue(&rx->u.e1000, (void **)hdr, &vlan);
         if ( ret > 0 ) {
             *pkt = (void *)*hdr + FE_PKT_HDROFF;
+            (*hdr)->vlan = vlan;
+            (*hdr)->rxcsum = 0;
         }
         return ret;
 
     case FE_DRIVER_IXGBE:
-        ret = ixgbe_rx_dequeue(&rx->u.ixgbe, (void **)hdr);
+        ret = ixgbe_rx_dequeue(&rx->u.ixgbe, (void **)hdr, &vlan, &csum,
+                               &hbuf, &hlen);
+        if ( ret > 0 ) {
+            /* Place the split headers in the headroom right before the
+               payload; the payload is not touched by the processor */
+            *pkt = (void *)*hdr + FE_PKT_HDROFF - hlen;
+            if ( hlen > 0 ) {
+                memcpy(*pkt, hbuf, hlen);
+            }
+            (*hdr)->vlan = vlan;
+            (*hdr)->rxcsum = csum;
+        }
+        return ret;
+
+    case FE_DRIVER_MEMORY:
+        ret = memdrv_rx_dequeue(&rx->u.mem, (void **)hdr, &vlan);
         if ( ret > 0 ) {
             *pkt = (void *)*hdr + FE_PKT_HDROFF;
+            (*hdr)->vlan = vlan;
+            (*hdr)->rxcsum = 0;
         }
         return ret;
 
@@ -609,7 +1502,7 @@ fe_driver_rx_dequeue(struct fe_driver_rx *rx, struct fe_pkt_buf_hdr **hdr,
  */
 static __inline__ int
 fe_kernel_tx_enqueue(struct fe_kernel_ring *ring, int port, void *pkt,
-                     void *hdr, size_t length)
+                     void *hdr, size_t length, uint16_t vlan)
 {
     struct fe_kernel_desc *desc;
     uint16_t tail;
@@ -623,7 +1516,8 @@ fe_kernel_tx_enqueue(struct fe_kernel_ring *ring, int port, void *pkt,
     desc->pkt = pkt;
     desc->length = length;
     desc->port = port;
-    desc->mode = 0;
+    desc->mode = FE_KDESC_PKT;
+    desc->vlan = vlan;
     ring->bufs[ring->tail] = hdr;
     ring->tail = tail;
 
@@ -648,7 +1542,8 @@ fe_kernel_cmd_enqueue(struct fe_kernel_ring *ring, uint64_t mac, int port)
     desc->pkt = (void *)mac;
     desc->length = 0;
     desc->port = port;
-    desc->mode = 1;
+    desc->mode = FE_KDESC_FDB;
+    desc->vlan = 0;
     ring->bufs[ring->tail] = NULL;
 
     __sync_synchronize();
@@ -659,17 +1554,73 @@ fe_kernel_cmd_enqueue(struct fe_kernel_ring *ring, uint64_t mac, int port)
 }
 
 /*
- * Enqueue a packet to a Tx ring buffer
+ * Punt a packet to the tickful task (mode: FE_KDESC_RESOLVE with the index of
+ * the next hop for arg, or FE_KDESC_NEIGH with the ingress port for arg and
+ * the VLAN ID for vlan); the buffer is released when collected
+ */
+static __inline__ int
+fe_kernel_punt_enqueue(struct fe_kernel_ring *ring, int mode, int arg,
+                       void *pkt, struct fe_pkt_buf_hdr *hdr, size_t length,
+                       uint16_t vlan)
+{
+    struct fe_kernel_desc *desc;
+    uint16_t tail;
+
+    tail = ring->tail + 1 < ring->len ? ring->tail + 1 : 0;
+    if ( tail == ring->tx_head ) {
+        /* Buffer is full */
+        return 0;
+    }
+    desc = &ring->descs[ring->tail];
+    desc->pkt = pkt;
+    desc->length = length;
+    desc->port = arg;
+    desc->mode = mode;
+    desc->vlan = vlan;
+    ring->bufs[ring->tail] = hdr;
+    hdr->refs++;
+
+    __sync_synchronize();
+
+    ring->tail = tail;
+
+    return 1;
+}
+
+/*
+ * Offloads (TX_OL_*) supported by the hardware of a port
+ */
+static __inline__ int
+fe_driver_tx_offloads(struct fe_device *dev)
+{
+    switch ( dev->driver ) {
+    case FE_DRIVER_IXGBE:
+        return TX_OL_IP_CSUM | TX_OL_TCP_CSUM | TX_OL_UDP_CSUM | TX_OL_TSO
+            | TX_OL_IPV6;
+    default:
+        ;
+    }
+
+    return 0;
+}
+
+/*
+ * Enqueue a packet to a Tx ring buffer; a non-zero vlan is the TCI of the
+ * 802.1Q tag inserted on transmission (offloaded to the hardware).  The
+ * checksums requested in hdr->txol are computed in software unless offloaded
+ * (TSO is rejected then).
  */
 static __inline__ int
 fe_driver_tx_enqueue(struct fe_task *t, struct fe_driver_tx *tx, int port,
-                     void *pkt, struct fe_pkt_buf_hdr *hdr, size_t length)
+                     void *pkt, struct fe_pkt_buf_hdr *hdr, size_t length,
+                     uint16_t vlan)
 {
     int ret;
 
     switch ( tx->driver ) {
     case FE_DRIVER_KERNEL:
-        ret = fe_kernel_tx_enqueue(tx->u.kernel, port, pkt, hdr, length);
+        ret = fe_kernel_tx_enqueue(tx->u.kernel, port, pkt, hdr, length,
+                                   vlan);
         if ( ret > 0 ) {
             /* Increment the reference counter */
             hdr->refs++;
@@ -677,8 +1628,13 @@ fe_driver_tx_enqueue(struct fe_task *t, struct fe_driver_tx *tx, int port,
         return ret;
 
     case FE_DRIVER_E1000:
-        pkt = fe_v2p(t, pkt);
-        ret = e1000_tx_enqueue(&tx->u.e1000, pkt, hdr, length);
+        /* No offload supported */
+        if ( 0 != hdr->txol.flags
+             && tx_offload_sw(pkt, length, &hdr->txol) < 0 ) {
+            return 0;
+        }
+        pkt = fe_v2p(hdr, pkt);
+        ret = e1000_tx_enqueue(&tx->u.e1000, pkt, hdr, length, vlan);
         if ( ret > 0 ) {
             /* Increment the reference counter */
             hdr->refs++;
@@ -686,8 +1642,34 @@ fe_driver_tx_enqueue(struct fe_task *t, struct fe_driver_tx *tx, int port,
         return ret;
 
     case FE_DRIVER_IXGBE:
-        pkt = fe_v2p(t, pkt);
-        ret = ixgbe_tx_enqueue(&tx->u.ixgbe, pkt, hdr, length);
+        if ( 0 != hdr->txol.flags ) {
+            /* Check the room for a context and a data descriptor first, since
+               the preparation rewrites the packet */
+            if ( ixgbe_tx_avail(&tx->u.ixgbe) < 2 ) {
+                return 0;
+            }
+            ixgbe_tx_prepare(pkt, length, &hdr->txol);
+            pkt = fe_v2p(hdr, pkt);
+            ret = ixgbe_tx_enqueue(&tx->u.ixgbe, pkt, hdr, length, vlan,
+                                   &hdr->txol);
+        } else {
+            pkt = fe_v2p(hdr, pkt);
+            ret = ixgbe_tx_enqueue(&tx->u.ixgbe, pkt, hdr, length, vlan,
+                                   NULL);
+        }
+        if ( ret > 0 ) {
+            /* Increment the reference counter */
+            hdr->refs++;
+        }
+        return ret;
+
+    case FE_DRIVER_MEMORY:
+        /* No offload supported */
+        if ( 0 != hdr->txol.flags
+             && tx_offload_sw(pkt, length, &hdr->txol) < 0 ) {
+            return 0;
+        }
+        ret = memdrv_tx_enqueue(&tx->u.mem, pkt, hdr, length, vlan);
         if ( ret > 0 ) {
             /* Increment the reference counter */
             hdr->refs++;
@@ -717,6 +1699,9 @@ fe_driver_tx_commit(struct fe_driver_tx *tx)
     case FE_DRIVER_IXGBE:
         ixgbe_tx_commit(&tx->u.ixgbe);
         break;
+    case FE_DRIVER_MEMORY:
+        memdrv_tx_commit(&tx->u.mem);
+        break;
     default:
         ;
     }
@@ -0,0 +1,459 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _FIB4_H
+#define _FIB4_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+
+/*
+ * IPv4 forwarding information base (DIR-24-8)
+ *
+ * The upper 24 bits of the destination address index tbl24, and an entry of
+ * tbl24 holds either a next-hop index or, for /24 blocks containing prefixes
+ * longer than 24 bits, the index of a 256-entry tbl8 group indexed by the
+ * lower 8 bits.  A lookup thus takes at most two memory accesses.
+ *
+ * Exclusive tasks only read tbl24 and tbl8.  The tables are updated only by
+ * the tickful task; each entry is a 16-bit word so that a lookup never sees a
+ * torn entry, a tbl8 group is filled before it is published, and a released
+ * tbl8 group is not reused until all exclusive tasks have passed a quiescent
+ * state (see fib4_reclaim()).
+ */
+
+#define FIB4_TBL24_SIZE         (1 << 24)
+#define FIB4_TBL8_GROUPS        8192
+#define FIB4_TBL8_SIZE          256
+/* Extended entry (the lower 15 bits are the index of the tbl8 group) */
+#define FIB4_EXT                0x8000
+/* Next-hop index: 0 for no route */
+#define FIB4_MAX_NEXTHOPS       FIB4_EXT
+
+/*
+ * Route (prefix) managed in the slow path
+ */
+struct fib4_rule {
+    /* Key: prefix (host byte order) and prefix length */
+    uint8_t key[8];
+    uint32_t prefix;
+    int len;
+    /* Next-hop index */
+    uint16_t nh;
+};
+
+/*
+ * tbl8 group waiting for the exclusive tasks to leave
+ */
+struct fib4_retired {
+    int group;
+    uint64_t epoch;
+};
+
+/*
+ * Forwarding information base
+ */
+struct fib4 {
+    /* Read by the fast path */
+    uint16_t *tbl24;
+    uint16_t *tbl8;
+
+    /* Prefix lengths of the entries (slow path only) */
+    uint8_t *depth24;
+    uint8_t *depth8;
+
+    /* Free tbl8 groups (stack) */
+    int *tbl8_free;
+    int ntbl8_free;
+    /* Released tbl8 groups (FIFO) */
+    struct fib4_retired *retired;
+    int retired_head;
+    int retired_tail;
+
+    /* Routes */
+    struct hopscotch_hash_table *rules;
+    size_t nrules;
+};
+
+/*
+ * Build the key of a route
+ */
+static __inline__ void
+fib4_key(uint8_t *key, uint32_t prefix, int len)
+{
+    memcpy(key, &prefix, 4);
+    key[4] = len;
+    memset(key + 5, 0, 3);
+}
+
+/*
+ * Mask of a prefix length
+ */
+static __inline__ uint32_t
+fib4_mask(int len)
+{
+    return len > 0 ? 0xffffffffUL << (32 - len) : 0;
+}
+
+/*
+ * Initialize the FIB
+ */
+static __inline__ struct fib4 *
+fib4_init(void)
+{
+    struct fib4 *fib;
+    ssize_t i;
+
+    fib = malloc(sizeof(struct fib4));
+    if ( NULL == fib ) {
+        return NULL;
+    }
+    memset(fib, 0, sizeof(struct fib4));
+
+    fib->tbl24 = malloc(sizeof(uint16_t) * FIB4_TBL24_SIZE);
+    fib->tbl8 = malloc(sizeof(uint16_t) * FIB4_TBL8_GROUPS * FIB4_TBL8_SIZE);
+    fib->depth24 = malloc(sizeof(uint8_t) * FIB4_TBL24_SIZE);
+    fib->depth8 = malloc(sizeof(uint8_t) * FIB4_TBL8_GROUPS * FIB4_TBL8_SIZE);
+    fib->tbl8_free = malloc(sizeof(int) * FIB4_TBL8_GROUPS);
+    fib->retired = malloc(sizeof(struct fib4_retired) * FIB4_TBL8_GROUPS);
+    fib->rules = hopscotch_init(NULL, sizeof(((struct fib4_rule *)0)->key));
+    if ( NULL == fib->tbl24 || NULL == fib->tbl8 || NULL == fib->depth24
+         || NULL == fib->depth8 || NULL == fib->tbl8_free
+         || NULL == fib->retired || NULL == fib->rules ) {
+        free(fib->tbl24);
+        free(fib->tbl8);
+        free(fib->depth24);
+        free(fib->depth8);
+        free(fib->tbl8_free);
+        free(fib->retired);
+        if ( NULL != fib->rules ) {
+            hopscotch_release(fib->rules);
+        }
+        free(fib);
+        return NULL;
+    }
+    memset(fib->tbl24, 0, sizeof(uint16_t) * FIB4_TBL24_SIZE);
+    memset(fib->depth24, 0, sizeof(uint8_t) * FIB4_TBL24_SIZE);
+
+    /* All tbl8 groups are free */
+    for ( i = 0; i < FIB4_TBL8_GROUPS; i++ ) {
+        fib->tbl8_free[i] = FIB4_TBL8_GROUPS - 1 - i;
+    }
+    fib->ntbl8_free = FIB4_TBL8_GROUPS;
+    fib->retired_head = 0;
+    fib->retired_tail = 0;
+    fib->nrules = 0;
+
+    return fib;
+}
+
+/*
+ * Lookup; addr is in host byte order
+ */
+static __inline__ uint16_t
+fib4_lookup(struct fib4 *fib, uint32_t addr)
+{
+    uint16_t e;
+
+    e = fib->tbl24[addr >> 8];
+    if ( e & FIB4_EXT ) {
+        e = fib->tbl8[((uint32_t)(e & ~FIB4_EXT) << 8) | (addr & 0xff)];
+    }
+
+    return e;
+}
+
+/*
+ * Lookup a burst of addresses; all the tbl24 (and then tbl8) entries are
+ * prefetched first to overlap the cache misses of the burst
+ */
+static __inline__ void
+fib4_lookup_bulk(struct fib4 *fib, const uint32_t *addrs, uint16_t *nhs,
+                 int n)
+{
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        __builtin_prefetch(&fib->tbl24[addrs[i] >> 8]);
+    }
+    for ( i = 0; i < n; i++ ) {
+        nhs[i] = fib->tbl24[addrs[i] >> 8];
+        if ( nhs[i] & FIB4_EXT ) {
+            __builtin_prefetch(&fib->tbl8[((uint32_t)(nhs[i] & ~FIB4_EXT) << 8)
+                                          | (addrs[i] & 0xff)]);
+        }
+    }
+    for ( i = 0; i < n; i++ ) {
+        if ( nhs[i] & FIB4_EXT ) {
+            nhs[i] = fib->tbl8[((uint32_t)(nhs[i] & ~FIB4_EXT) << 8)
+                               | (addrs[i] & 0xff)];
+        }
+    }
+}
+
+/*
+ * Reuse the tbl8 groups released before the specified epoch, i.e., those no
+ * exclusive task can still be referring to
+ */
+static __inline__ void
+fib4_reclaim(struct fib4 *fib, uint64_t epoch)
+{
+    while ( fib->retired_head != fib->retired_tail ) {
+        if ( fib->retired[fib->retired_head].epoch >= epoch ) {
+            break;
+        }
+        fib->tbl8_free[fib->ntbl8_free++]
+            = fib->retired[fib->retired_head].group;
+        fib->retired_head = fib->retired_head + 1 < FIB4_TBL8_GROUPS
+            ? fib->retired_head + 1 : 0;
+    }
+}
+
+/*
+ * Set an entry if it is not covered by a longer prefix
+ */
+static __inline__ void
+_fib4_set(uint16_t *tbl, uint8_t *depth, int len, uint16_t nh)
+{
+    if ( *depth <= len ) {
+        *tbl = nh;
+        *depth = len;
+    }
+}
+
+/*
+ * Replace an entry of the prefix with its parent
+ */
+static __inline__ void
+_fib4_unset(uint16_t *tbl, uint8_t *depth, int len, uint16_t pnh, int plen)
+{
+    if ( *depth == len ) {
+        *tbl = pnh;
+        *depth = plen;
+    }
+}
+
+/*
+ * Add a route (or replace its next hop); the prefix is in host byte order
+ */
+static __inline__ int
+fib4_add(struct fib4 *fib, uint32_t prefix, int len, uint16_t nh)
+{
+    struct fib4_rule *r;
+    uint8_t key[8];
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+    uint32_t g;
+    int grp;
+
+    if ( len < 0 || len > 32 || 0 == nh || nh >= FIB4_MAX_NEXTHOPS ) {
+        return -1;
+    }
+    prefix &= fib4_mask(len);
+    if ( len > 24 && !(fib->tbl24[prefix >> 8] & FIB4_EXT)
+         && fib->ntbl8_free <= 0 ) {
+        /* No tbl8 group available */
+        return -1;
+    }
+
+    /* Route */
+    fib4_key(key, prefix, len);
+    r = hopscotch_lookup(fib->rules, key);
+    if ( NULL == r ) {
+        r = malloc(sizeof(struct fib4_rule));
+        if ( NULL == r ) {
+            return -1;
+        }
+        memcpy(r->key, key, sizeof(r->key));
+        r->prefix = prefix;
+        r->len = len;
+        while ( hopscotch_insert(fib->rules, r->key, r) < 0 ) {
+            /* Grow the hash table */
+            if ( hopscotch_resize(fib->rules, 1) < 0 ) {
+                free(r);
+                return -1;
+            }
+        }
+        fib->nrules++;
+    }
+    r->nh = nh;
+
+    if ( len <= 24 ) {
+        n = 1 << (24 - len);
+        for ( i = prefix >> 8; i < (prefix >> 8) + n; i++ ) {
+            if ( fib->tbl24[i] & FIB4_EXT ) {
+                g = (uint32_t)(fib->tbl24[i] & ~FIB4_EXT) << 8;
+                for ( j = 0; j < FIB4_TBL8_SIZE; j++ ) {
+                    _fib4_set(&fib->tbl8[g + j], &fib->depth8[g + j], len, nh);
+                }
+            } else {
+                _fib4_set(&fib->tbl24[i], &fib->depth24[i], len, nh);
+            }
+        }
+    } else {
+        i = prefix >> 8;
+        if ( !(fib->tbl24[i] & FIB4_EXT) ) {
+            /* Extend the /24 block with a tbl8 group */
+            grp = fib->tbl8_free[--fib->ntbl8_free];
+            g = (uint32_t)grp << 8;
+            for ( j = 0; j < FIB4_TBL8_SIZE; j++ ) {
+                fib->tbl8[g + j] = fib->tbl24[i];
+                fib->depth8[g + j] = fib->depth24[i];
+            }
+            /* Publish the group after it is filled */
+            __sync_synchronize();
+            fib->tbl24[i] = FIB4_EXT | grp;
+        }
+        g = (uint32_t)(fib->tbl24[i] & ~FIB4_EXT) << 8;
+        n = 1 << (32 - len);
+        for ( j = prefix & 0xff; j < (prefix & 0xff) + n; j++ ) {
+            _fib4_set(&fib->tbl8[g + j], &fib->depth8[g + j], len, nh);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Delete a route; the entries of the route are replaced with the longest
+ * shorter prefix covering it.  A tbl8 group left without prefixes longer than
+ * 24 bits is collapsed and retired at the specified epoch.
+ */
+static __inline__ int
+fib4_delete(struct fib4 *fib, uint32_t prefix, int len, uint64_t epoch)
+{
+    struct fib4_rule *r;
+    struct fib4_rule *p;
+    uint8_t key[8];
+    uint16_t pnh;
+    int plen;
+    int l;
+    uint32_t i;
+    uint32_t j;
+    uint32_t n;
+    uint32_t g;
+
+    if ( len < 0 || len > 32 ) {
+        return -1;
+    }
+    prefix &= fib4_mask(len);
+
+    fib4_key(key, prefix, len);
+    r = hopscotch_remove(fib->rules, key);
+    if ( NULL == r ) {
+        return -1;
+    }
+    free(r);
+    fib->nrules--;
+
+    /* Find the parent route */
+    pnh = 0;
+    plen = 0;
+    for ( l = len - 1; l >= 0; l-- ) {
+        fib4_key(key, prefix & fib4_mask(l), l);
+        p = hopscotch_lookup(fib->rules, key);
+        if ( NULL != p ) {
+            pnh = p->nh;
+            plen = l;
+            break;
+        }
+    }
+
+    if ( len <= 24 ) {
+        n = 1 << (24 - len);
+        for ( i = prefix >> 8; i < (prefix >> 8) + n; i++ ) {
+            if ( fib->tbl24[i] & FIB4_EXT ) {
+                g = (uint32_t)(fib->tbl24[i] & ~FIB4_EXT) << 8;
+                for ( j = 0; j < FIB4_TBL8_SIZE; j++ ) {
+                    _fib4_unset(&fib->tbl8[g + j], &fib->depth8[g + j], len,
+                                pnh, plen);
+                }
+            } else {
+                _fib4_unset(&fib->tbl24[i], &fib->depth24[i], len, pnh, plen);
+            }
+        }
+    } else {
+        i = prefix >> 8;
+        g = (uint32_t)(fib->tbl24[i] & ~FIB4_EXT) << 8;
+        n = 1 << (32 - len);
+        for ( j = prefix & 0xff; j < (prefix & 0xff) + n; j++ ) {
+            _fib4_unset(&fib->tbl8[g + j], &fib->depth8[g + j], len, pnh,
+                        plen);
+        }
+
+        /* Collapse the group if all the entries are covered by the same
+           prefix of 24 bits or shorter */
+        for ( j = 0; j < FIB4_TBL8_SIZE; j++ ) {
+            if ( fib->depth8[g + j] > 24 ) {
+                break;
+            }
+        }
+        if ( j >= FIB4_TBL8_SIZE ) {
+            fib->depth24[i] = fib->depth8[g];
+            fib->tbl24[i] = fib->tbl8[g];
+            fib->retired[fib->retired_tail].group = g >> 8;
+            fib->retired[fib->retired_tail].epoch = epoch;
+            fib->retired_tail = fib->retired_tail + 1 < FIB4_TBL8_GROUPS
+                ? fib->retired_tail + 1 : 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Release the FIB
+ */
+static __inline__ void
+fib4_release(struct fib4 *fib)
+{
+    ssize_t i;
+
+    for ( i = 0; i < (1LL << fib->rules->pfactor); i++ ) {
+        if ( NULL != fib->rules->buckets[i].key ) {
+            free(fib->rules->buckets[i].data);
+        }
+    }
+    hopscotch_release(fib->rules);
+    free(fib->tbl24);
+    free(fib->tbl8);
+    free(fib->depth24);
+    free(fib->depth8);
+    free(fib->tbl8_free);
+    free(fib->retired);
+    free(fib);
+}
+
+#endif /* _FIB4_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
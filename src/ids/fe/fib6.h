@@ -0,0 +1,827 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _FIB6_H
+#define _FIB6_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "hashtable.h"
+
+/*
+ * IPv6 forwarding information base (compressed multibit trie)
+ *
+ * Each node consumes 6 bits of the destination address.  The 64 slots of a
+ * node are compressed into two bitmaps as in Poptrie: `vector' marks the
+ * slots having a child node, and `leafvec' marks the first slot of each run
+ * of the same next hop among the other slots.  Children and leaves of a node
+ * are stored contiguously, and are indexed by the population count of the
+ * bitmaps below the slot.  A node is 32 bytes, so that no node straddles a
+ * cache line.
+ *
+ * The trie is read-only for exclusive tasks.  The tickful task rebuilds the
+ * whole trie from the routes into the standby table, which grows on demand
+ * within a memory budget, and swaps the pointer to the current table.  The
+ * old table is rebuilt only after all exclusive tasks have passed a quiescent
+ * state.  A route is refused when it is added if the table would exceed the
+ * budget, so that the trie does not diverge from the routes.
+ */
+
+#define FIB6_STRIDE             6
+#define FIB6_MAX_BULK           32
+/* Memory budget of a table, and the initial size */
+#define FIB6_DEFAULT_MAX_NODES  (1 << 20)
+#define FIB6_DEFAULT_MAX_LEAVES (1 << 22)
+#define FIB6_INIT_NODES         256
+#define FIB6_INIT_LEAVES        1024
+
+/*
+ * Internal node
+ */
+struct fib6_node {
+    uint64_t vector;
+    uint64_t leafvec;
+    /* Index of the first leaf and the first child */
+    uint32_t base0;
+    uint32_t base1;
+} __attribute__ ((aligned(32)));
+
+/*
+ * Table (the trie)
+ */
+struct fib6_table {
+    struct fib6_node *nodes;
+    uint16_t *leaves;
+    size_t nnodes;
+    size_t nleaves;
+    /* Allocated sizes */
+    size_t cnodes;
+    size_t cleaves;
+};
+
+/*
+ * Route managed in the slow path
+ */
+struct fib6_rule {
+    /* Key: prefix (the upper and lower 64 bits in host byte order) and the
+       prefix length */
+    uint8_t key[24];
+    uint64_t prefix[2];
+    int len;
+    /* Next-hop index */
+    uint16_t nh;
+};
+
+/*
+ * Forwarding information base
+ */
+struct fib6 {
+    /* Current table read by the fast path, and the standby table */
+    struct fib6_table * volatile cur;
+    struct fib6_table *update;
+    struct fib6_table tables[2];
+    /* Epoch at which the standby table was replaced, if pending is set */
+    uint64_t retired;
+    int pending;
+
+    /* Memory budget */
+    size_t max_nodes;
+    size_t max_leaves;
+
+    /* Routes */
+    struct hopscotch_hash_table *rules;
+    size_t nrules;
+    /* Non-zero if the routes have been changed since the last build */
+    int dirty;
+    /* Upper bounds of the numbers of the nodes and the leaves of the table
+       built from the routes (exact when counted at the budget) */
+    size_t est_nodes;
+    size_t est_leaves;
+};
+
+/*
+ * 6-bit index of an address at the specified depth (the address is padded
+ * with zeros beyond 128 bits)
+ */
+static __inline__ int
+_fib6_index(const uint64_t *addr, int depth)
+{
+    if ( depth + FIB6_STRIDE <= 64 ) {
+        return (addr[0] >> (64 - FIB6_STRIDE - depth)) & 0x3f;
+    } else if ( depth >= 64 ) {
+        if ( depth + FIB6_STRIDE <= 128 ) {
+            return (addr[1] >> (128 - FIB6_STRIDE - depth)) & 0x3f;
+        }
+        return (addr[1] << (depth + FIB6_STRIDE - 128)) & 0x3f;
+    }
+
+    return ((addr[0] << (depth + FIB6_STRIDE - 64))
+            | (addr[1] >> (128 - FIB6_STRIDE - depth))) & 0x3f;
+}
+
+/*
+ * Mask an address with a prefix length
+ */
+static __inline__ void
+_fib6_mask(uint64_t *dst, const uint64_t *addr, int len)
+{
+    dst[0] = len <= 0 ? 0 : (len >= 64 ? addr[0]
+                             : addr[0] & (~0ULL << (64 - len)));
+    dst[1] = len <= 64 ? 0 : (len >= 128 ? addr[1]
+                              : addr[1] & (~0ULL << (128 - len)));
+}
+
+/*
+ * Build the key of a route
+ */
+static __inline__ void
+fib6_key(uint8_t *key, const uint64_t *prefix, int len)
+{
+    memcpy(key, prefix, 16);
+    key[16] = len;
+    memset(key + 17, 0, 7);
+}
+
+/*
+ * Convert an address in network byte order to the host byte order
+ */
+static __inline__ void
+fib6_addr(uint64_t *addr, const uint8_t *a)
+{
+    uint64_t x;
+
+    memcpy(&x, a, 8);
+    addr[0] = __builtin_bswap64(x);
+    memcpy(&x, a + 8, 8);
+    addr[1] = __builtin_bswap64(x);
+}
+
+/*
+ * Initialize a table with the empty trie
+ */
+static __inline__ int
+_fib6_table_init(struct fib6_table *tbl, size_t max_nodes, size_t max_leaves)
+{
+    tbl->cnodes = max_nodes < FIB6_INIT_NODES ? max_nodes : FIB6_INIT_NODES;
+    tbl->cleaves = max_leaves < FIB6_INIT_LEAVES
+        ? max_leaves : FIB6_INIT_LEAVES;
+    tbl->nodes = malloc(sizeof(struct fib6_node) * tbl->cnodes);
+    if ( NULL == tbl->nodes ) {
+        return -1;
+    }
+    tbl->leaves = malloc(sizeof(uint16_t) * tbl->cleaves);
+    if ( NULL == tbl->leaves ) {
+        free(tbl->nodes);
+        return -1;
+    }
+    tbl->nodes[0].vector = 0;
+    tbl->nodes[0].leafvec = 1;
+    tbl->nodes[0].base0 = 0;
+    tbl->nodes[0].base1 = 0;
+    tbl->leaves[0] = 0;
+    tbl->nnodes = 1;
+    tbl->nleaves = 1;
+
+    return 0;
+}
+
+/*
+ * Grow the arrays of a table (not referred to by the fast path) to hold the
+ * specified numbers of nodes and leaves, doubling them within the budget
+ */
+static __inline__ int
+_fib6_table_grow(struct fib6 *fib, struct fib6_table *tbl, size_t nnodes,
+                 size_t nleaves)
+{
+    struct fib6_node *nodes;
+    uint16_t *leaves;
+    size_t n;
+
+    if ( nnodes > fib->max_nodes || nleaves > fib->max_leaves ) {
+        /* Exceeds the memory budget */
+        return -1;
+    }
+    if ( nnodes > tbl->cnodes ) {
+        for ( n = tbl->cnodes; n < nnodes; n <<= 1 ) {
+            continue;
+        }
+        if ( n > fib->max_nodes ) {
+            n = fib->max_nodes;
+        }
+        nodes = malloc(sizeof(struct fib6_node) * n);
+        if ( NULL == nodes ) {
+            return -1;
+        }
+        memcpy(nodes, tbl->nodes, sizeof(struct fib6_node) * tbl->nnodes);
+        free(tbl->nodes);
+        tbl->nodes = nodes;
+        tbl->cnodes = n;
+    }
+    if ( nleaves > tbl->cleaves ) {
+        for ( n = tbl->cleaves; n < nleaves; n <<= 1 ) {
+            continue;
+        }
+        if ( n > fib->max_leaves ) {
+            n = fib->max_leaves;
+        }
+        leaves = malloc(sizeof(uint16_t) * n);
+        if ( NULL == leaves ) {
+            return -1;
+        }
+        memcpy(leaves, tbl->leaves, sizeof(uint16_t) * tbl->nleaves);
+        free(tbl->leaves);
+        tbl->leaves = leaves;
+        tbl->cleaves = n;
+    }
+
+    return 0;
+}
+
+/*
+ * Initialize the FIB
+ */
+static __inline__ struct fib6 *
+fib6_init(size_t max_nodes, size_t max_leaves)
+{
+    struct fib6 *fib;
+
+    fib = malloc(sizeof(struct fib6));
+    if ( NULL == fib ) {
+        return NULL;
+    }
+    fib->max_nodes = max_nodes;
+    fib->max_leaves = max_leaves;
+    if ( _fib6_table_init(&fib->tables[0], max_nodes, max_leaves) < 0 ) {
+        free(fib);
+        return NULL;
+    }
+    if ( _fib6_table_init(&fib->tables[1], max_nodes, max_leaves) < 0 ) {
+        free(fib->tables[0].nodes);
+        free(fib->tables[0].leaves);
+        free(fib);
+        return NULL;
+    }
+    fib->rules = hopscotch_init(NULL, sizeof(((struct fib6_rule *)0)->key));
+    if ( NULL == fib->rules ) {
+        free(fib->tables[0].nodes);
+        free(fib->tables[0].leaves);
+        free(fib->tables[1].nodes);
+        free(fib->tables[1].leaves);
+        free(fib);
+        return NULL;
+    }
+    fib->cur = &fib->tables[0];
+    fib->update = &fib->tables[1];
+    fib->retired = 0;
+    fib->pending = 0;
+    fib->nrules = 0;
+    fib->dirty = 0;
+    fib->est_nodes = 1;
+    fib->est_leaves = 1;
+
+    return fib;
+}
+
+/*
+ * Lookup; addr is the upper and lower 64 bits in host byte order
+ */
+static __inline__ uint16_t
+fib6_lookup(struct fib6_table *tbl, const uint64_t *addr)
+{
+    struct fib6_node *node;
+    uint64_t bit;
+    int depth;
+
+    node = &tbl->nodes[0];
+    for ( depth = 0; ; depth += FIB6_STRIDE ) {
+        bit = 1ULL << _fib6_index(addr, depth);
+        if ( !(node->vector & bit) ) {
+            break;
+        }
+        node = &tbl->nodes[node->base1
+                           + popcnt(node->vector & ((bit << 1) - 1)) - 1];
+    }
+
+    return tbl->leaves[node->base0
+                       + popcnt(node->leafvec & ((bit << 1) - 1)) - 1];
+}
+
+/*
+ * Lookup a burst of addresses; the traversals are interleaved level by level
+ * so that the next node of each address is prefetched while the others are
+ * processed
+ */
+static __inline__ void
+fib6_lookup_bulk(struct fib6_table *tbl, const uint64_t (*addrs)[2],
+                 uint16_t *nhs, int n)
+{
+    struct fib6_node *nodes[FIB6_MAX_BULK];
+    uint64_t bit;
+    int depth;
+    int rem;
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        nodes[i] = &tbl->nodes[0];
+    }
+    rem = n;
+    for ( depth = 0; rem > 0; depth += FIB6_STRIDE ) {
+        for ( i = 0; i < n; i++ ) {
+            if ( NULL == nodes[i] ) {
+                continue;
+            }
+            bit = 1ULL << _fib6_index(addrs[i], depth);
+            if ( nodes[i]->vector & bit ) {
+                nodes[i] = &tbl->nodes[nodes[i]->base1
+                                       + popcnt(nodes[i]->vector
+                                                & ((bit << 1) - 1)) - 1];
+                __builtin_prefetch(nodes[i]);
+            } else {
+                nhs[i] = tbl->leaves[nodes[i]->base0
+                                     + popcnt(nodes[i]->leafvec
+                                              & ((bit << 1) - 1)) - 1];
+                nodes[i] = NULL;
+                rem--;
+            }
+        }
+    }
+}
+
+/*
+ * Compare routes by the prefix, then by the length
+ */
+static __inline__ int
+_fib6_cmp(const struct fib6_rule *a, const struct fib6_rule *b)
+{
+    if ( a->prefix[0] != b->prefix[0] ) {
+        return a->prefix[0] < b->prefix[0] ? -1 : 1;
+    }
+    if ( a->prefix[1] != b->prefix[1] ) {
+        return a->prefix[1] < b->prefix[1] ? -1 : 1;
+    }
+
+    return a->len - b->len;
+}
+
+/*
+ * Sort routes (heapsort)
+ */
+static __inline__ void
+_fib6_sort(struct fib6_rule **rules, ssize_t n)
+{
+    struct fib6_rule *tmp;
+    ssize_t i;
+    ssize_t j;
+    ssize_t k;
+    ssize_t end;
+
+    for ( end = n, i = n / 2 - 1; end > 1; ) {
+        if ( i >= 0 ) {
+            /* Build the heap */
+            k = i--;
+        } else {
+            /* Move the maximum to the end */
+            end--;
+            tmp = rules[0];
+            rules[0] = rules[end];
+            rules[end] = tmp;
+            k = 0;
+        }
+        /* Sift down */
+        while ( (j = 2 * k + 1) < end ) {
+            if ( j + 1 < end && _fib6_cmp(rules[j], rules[j + 1]) < 0 ) {
+                j++;
+            }
+            if ( _fib6_cmp(rules[k], rules[j]) >= 0 ) {
+                break;
+            }
+            tmp = rules[k];
+            rules[k] = rules[j];
+            rules[j] = tmp;
+            k = j;
+        }
+    }
+}
+
+/*
+ * Expand the sorted routes of the region of a node at the depth into its
+ * slots: the next hop of each slot (val) and the length of the route of it
+ * (dep), and the range of the routes of each child ([lo, hi), or -1 if the
+ * slot is a leaf); the routes not longer than the depth are covered by the
+ * ancestors, of which the longest match is def.
+ */
+static __inline__ void
+_fib6_expand(struct fib6_rule **rules, ssize_t n, int depth, uint16_t def,
+             uint16_t *val, int *dep, ssize_t *lo, ssize_t *hi)
+{
+    ssize_t i;
+    int s;
+    int s0;
+    int cnt;
+
+    for ( s = 0; s < (1 << FIB6_STRIDE); s++ ) {
+        val[s] = def;
+        dep[s] = depth;
+        lo[s] = -1;
+        hi[s] = -1;
+    }
+    for ( i = 0; i < n; i++ ) {
+        if ( rules[i]->len <= depth ) {
+            continue;
+        }
+        s0 = _fib6_index(rules[i]->prefix, depth);
+        if ( rules[i]->len <= depth + FIB6_STRIDE ) {
+            cnt = 1 << (depth + FIB6_STRIDE - rules[i]->len);
+            for ( s = s0; s < s0 + cnt; s++ ) {
+                if ( rules[i]->len >= dep[s] ) {
+                    val[s] = rules[i]->nh;
+                    dep[s] = rules[i]->len;
+                }
+            }
+        } else {
+            if ( lo[s0] < 0 ) {
+                lo[s0] = i;
+            }
+            hi[s0] = i + 1;
+        }
+    }
+}
+
+/*
+ * Count the children and the leaves of a node at the depth and of its
+ * descendants, as built by _fib6_build() from the sorted routes of its region
+ */
+static __inline__ void
+_fib6_count(struct fib6_rule **rules, ssize_t n, int depth, uint16_t def,
+            size_t *nnodes, size_t *nleaves)
+{
+    uint16_t val[1 << FIB6_STRIDE];
+    int dep[1 << FIB6_STRIDE];
+    ssize_t lo[1 << FIB6_STRIDE];
+    ssize_t hi[1 << FIB6_STRIDE];
+    uint16_t prev;
+    int nleaf;
+    int s;
+
+    _fib6_expand(rules, n, depth, def, val, dep, lo, hi);
+    nleaf = 0;
+    prev = 0;
+    for ( s = 0; s < (1 << FIB6_STRIDE); s++ ) {
+        if ( lo[s] >= 0 ) {
+            (*nnodes)++;
+        } else if ( 0 == nleaf || val[s] != prev ) {
+            nleaf++;
+            prev = val[s];
+        }
+    }
+    *nleaves += nleaf;
+    for ( s = 0; s < (1 << FIB6_STRIDE); s++ ) {
+        if ( lo[s] >= 0 ) {
+            _fib6_count(rules + lo[s], hi[s] - lo[s], depth + FIB6_STRIDE,
+                        val[s], nnodes, nleaves);
+        }
+    }
+}
+
+/*
+ * Build a node at the depth from the sorted routes of its region; the
+ * routes not longer than the depth are covered by the ancestors, of which
+ * the longest match is def.
+ */
+static __inline__ int
+_fib6_build(struct fib6 *fib, struct fib6_table *tbl, size_t idx, int depth,
+            struct fib6_rule **rules, ssize_t n, uint16_t def)
+{
+    struct fib6_node *node;
+    uint16_t val[1 << FIB6_STRIDE];
+    int dep[1 << FIB6_STRIDE];
+    ssize_t lo[1 << FIB6_STRIDE];
+    ssize_t hi[1 << FIB6_STRIDE];
+    uint16_t prev;
+    int s;
+    int nchild;
+    int nleaf;
+    int ret;
+
+    _fib6_expand(rules, n, depth, def, val, dep, lo, hi);
+
+    /* Allocate the children and the leaves contiguously */
+    node = &tbl->nodes[idx];
+    node->vector = 0;
+    node->leafvec = 0;
+    nchild = 0;
+    nleaf = 0;
+    prev = 0;
+    for ( s = 0; s < (1 << FIB6_STRIDE); s++ ) {
+        if ( lo[s] >= 0 ) {
+            node->vector |= 1ULL << s;
+            nchild++;
+        } else if ( 0 == nleaf || val[s] != prev ) {
+            node->leafvec |= 1ULL << s;
+            nleaf++;
+            prev = val[s];
+        }
+    }
+    if ( _fib6_table_grow(fib, tbl, tbl->nnodes + nchild,
+                          tbl->nleaves + nleaf) < 0 ) {
+        return -1;
+    }
+    /* The nodes may have been moved */
+    node = &tbl->nodes[idx];
+    node->base0 = tbl->nleaves;
+    node->base1 = tbl->nnodes;
+    tbl->nnodes += nchild;
+    tbl->nleaves += nleaf;
+    for ( s = 0; s < (1 << FIB6_STRIDE); s++ ) {
+        if ( node->leafvec & (1ULL << s) ) {
+            tbl->leaves[node->base0
+                        + popcnt(node->leafvec & ((2ULL << s) - 1)) - 1]
+                = val[s];
+        }
+    }
+
+    /* Build the children */
+    for ( s = 0; s < (1 << FIB6_STRIDE); s++ ) {
+        if ( lo[s] < 0 ) {
+            continue;
+        }
+        node = &tbl->nodes[idx];
+        ret = _fib6_build(fib, tbl, node->base1
+                          + popcnt(node->vector & ((2ULL << s) - 1)) - 1,
+                          depth + FIB6_STRIDE, rules + lo[s], hi[s] - lo[s],
+                          val[s]);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sort the routes, and find the default route (0 if none); returns the
+ * array of them (to be freed by the caller), or NULL on failure
+ */
+static __inline__ struct fib6_rule **
+_fib6_rules(struct fib6 *fib, ssize_t *n, uint16_t *def)
+{
+    struct fib6_rule **rules;
+    struct fib6_rule *r;
+    ssize_t i;
+
+    rules = malloc(sizeof(struct fib6_rule *) * (fib->nrules + 1));
+    if ( NULL == rules ) {
+        return NULL;
+    }
+    *n = 0;
+    *def = 0;
+    for ( i = 0; i < (1LL << fib->rules->pfactor); i++ ) {
+        if ( NULL == fib->rules->buckets[i].key ) {
+            continue;
+        }
+        r = fib->rules->buckets[i].data;
+        if ( 0 == r->len ) {
+            /* Default route */
+            *def = r->nh;
+        }
+        rules[(*n)++] = r;
+    }
+    _fib6_sort(rules, *n);
+
+    return rules;
+}
+
+/*
+ * Whether the table built from the routes fits in the memory budget; the
+ * estimate is replaced with the exact numbers if so.  Returns 0 if it fits,
+ * or -1.
+ */
+static __inline__ int
+_fib6_fit(struct fib6 *fib)
+{
+    struct fib6_rule **rules;
+    uint16_t def;
+    size_t nnodes;
+    size_t nleaves;
+    ssize_t n;
+
+    rules = _fib6_rules(fib, &n, &def);
+    if ( NULL == rules ) {
+        return -1;
+    }
+    nnodes = 1;
+    nleaves = 0;
+    _fib6_count(rules, n, 0, def, &nnodes, &nleaves);
+    free(rules);
+    if ( nnodes > fib->max_nodes || nleaves > fib->max_leaves ) {
+        return -1;
+    }
+    fib->est_nodes = nnodes;
+    fib->est_leaves = nleaves;
+
+    return 0;
+}
+
+/*
+ * Add a route (or replace its next hop); applied at the next fib6_commit().
+ * Returns 0 on success, or -1 on failure (including when the table would
+ * exceed the memory budget).
+ */
+static __inline__ int
+fib6_add(struct fib6 *fib, const uint64_t *prefix, int len, uint16_t nh)
+{
+    struct fib6_rule *r;
+    uint8_t key[24];
+    uint64_t p[2];
+    uint16_t onh;
+    size_t d;
+
+    if ( len < 0 || len > 128 || 0 == nh ) {
+        return -1;
+    }
+    _fib6_mask(p, prefix, len);
+
+    fib6_key(key, p, len);
+    r = hopscotch_lookup(fib->rules, key);
+    onh = 0;
+    if ( NULL == r ) {
+        r = malloc(sizeof(struct fib6_rule));
+        if ( NULL == r ) {
+            return -1;
+        }
+        memcpy(r->key, key, sizeof(r->key));
+        r->prefix[0] = p[0];
+        r->prefix[1] = p[1];
+        r->len = len;
+        while ( hopscotch_insert(fib->rules, r->key, r) < 0 ) {
+            /* Grow the hash table */
+            if ( hopscotch_resize(fib->rules, 1) < 0 ) {
+                free(r);
+                return -1;
+            }
+        }
+        fib->nrules++;
+    } else {
+        onh = r->nh;
+    }
+    r->nh = nh;
+
+    /* A route adds at most a node per stride of its length, and three
+       leaves to each node on its path plus two to the last one; the table
+       is counted exactly only when the bound exceeds the budget */
+    d = len / FIB6_STRIDE + 1;
+    if ( fib->est_nodes + d > fib->max_nodes
+         || fib->est_leaves + 3 * d + 2 > fib->max_leaves ) {
+        if ( _fib6_fit(fib) < 0 ) {
+            /* Undo */
+            if ( 0 != onh ) {
+                r->nh = onh;
+            } else {
+                hopscotch_remove(fib->rules, key);
+                free(r);
+                fib->nrules--;
+            }
+            return -1;
+        }
+    } else {
+        fib->est_nodes += d;
+        fib->est_leaves += 3 * d + 2;
+    }
+    fib->dirty = 1;
+
+    return 0;
+}
+
+/*
+ * Delete a route; applied at the next fib6_commit() (the table does not
+ * grow by a deletion)
+ */
+static __inline__ int
+fib6_delete(struct fib6 *fib, const uint64_t *prefix, int len)
+{
+    struct fib6_rule *r;
+    uint8_t key[24];
+    uint64_t p[2];
+
+    if ( len < 0 || len > 128 ) {
+        return -1;
+    }
+    _fib6_mask(p, prefix, len);
+
+    fib6_key(key, p, len);
+    r = hopscotch_remove(fib->rules, key);
+    if ( NULL == r ) {
+        return -1;
+    }
+    free(r);
+    fib->nrules--;
+    fib->dirty = 1;
+
+    return 0;
+}
+
+/*
+ * Rebuild the trie from the routes into the standby table, and publish it if
+ * the routes have been changed.  The standby table is the one replaced at the
+ * last commit, and is rebuilt only if no exclusive task refers to it, i.e.,
+ * all tasks have observed an epoch after the replacement (safe).  Returns 0
+ * if a new table is published at the specified epoch, 1 if nothing is done,
+ * or -1 on failure (the routes are kept to be built at the next commit).
+ */
+static __inline__ int
+fib6_commit(struct fib6 *fib, uint64_t epoch, uint64_t safe)
+{
+    struct fib6_table *tbl;
+    struct fib6_rule **rules;
+    uint16_t def;
+    ssize_t n;
+    int ret;
+
+    if ( !fib->dirty ) {
+        return 1;
+    }
+    if ( fib->pending && fib->retired >= safe ) {
+        /* The standby table may still be referred to */
+        return 1;
+    }
+
+    rules = _fib6_rules(fib, &n, &def);
+    if ( NULL == rules ) {
+        return -1;
+    }
+
+    /* Build */
+    tbl = fib->update;
+    tbl->nnodes = 1;
+    tbl->nleaves = 0;
+    ret = _fib6_build(fib, tbl, 0, 0, rules, n, def);
+    free(rules);
+    if ( ret < 0 ) {
+        /* Keep the current table, and retry at the next commit */
+        return -1;
+    }
+    fib->dirty = 0;
+
+    /* Publish */
+    __sync_synchronize();
+    fib->update = fib->cur;
+    fib->cur = tbl;
+    fib->retired = epoch;
+    fib->pending = 1;
+
+    return 0;
+}
+
+/*
+ * Release the FIB
+ */
+static __inline__ void
+fib6_release(struct fib6 *fib)
+{
+    ssize_t i;
+
+    for ( i = 0; i < (1LL << fib->rules->pfactor); i++ ) {
+        if ( NULL != fib->rules->buckets[i].key ) {
+            free(fib->rules->buckets[i].data);
+        }
+    }
+    hopscotch_release(fib->rules);
+    for ( i = 0; i < 2; i++ ) {
+        free(fib->tables[i].nodes);
+        free(fib->tables[i].leaves);
+    }
+    free(fib);
+}
+
+#endif /* _FIB6_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,495 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _IPFRAG_H
+#define _IPFRAG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ip.h>
+#include "common.h"
+
+/*
+ * IPv4 fragmentation and reassembly (RFC 791, RFC 815)
+ *
+ * A reassembly table is exclusive per task, and its memory is fixed: at most
+ * IPFRAG_MAX_DGRAMS datagrams are reassembled at once from at most
+ * IPFRAG_MAX_FRAGS fragments.  The fragments are held in their own buffers,
+ * chained in the order of their offsets, and gathered into the buffer of the
+ * first fragment only once the datagram is complete.  When the table is
+ * full, the oldest datagram is evicted, so that a flood of fragments holds
+ * no more buffers than the budget and ages out in a timeout.  Overlapping
+ * fragments drop the whole datagram (RFC 5722 for IPv6, applied to IPv4).
+ *
+ * The buffers are opaque to the table; those released by a call (evicted,
+ * expired, or gathered) are drained by the caller with ipfrag_drain() before
+ * the next call.
+ */
+
+#define IPFRAG_MAX_DGRAMS       64
+#define IPFRAG_MAX_FRAGS        256
+#define IPFRAG_MAX_FRAGS_DGRAM  64
+#define IPFRAG_HASH             128
+#define IPFRAG_NIL              0xffff
+
+/* Options: the end of the list, no operation, and the flag of the types
+   copied into all the fragments */
+#define IPFRAG_OPT_EOL          0
+#define IPFRAG_OPT_NOP          1
+#define IPFRAG_OPT_COPIED       0x80
+
+/*
+ * Counters
+ */
+struct ipfrag_stats {
+    /* Reassembly: datagrams reassembled, evicted, and expired, and the
+       fragments dropped (malformed, overlapping, or too large to gather) */
+    uint64_t reassembled;
+    uint64_t evictions;
+    uint64_t timeouts;
+    uint64_t drops;
+    /* Fragmentation: datagrams fragmented, fragments transmitted, the
+       datagrams dropped (malformed, or no buffer), and the datagrams with DF
+       set punted for an ICMP Fragmentation Needed */
+    uint64_t fragmented;
+    uint64_t frags_out;
+    uint64_t frag_drops;
+    uint64_t frag_needed;
+};
+
+/*
+ * Fragment held in the table
+ */
+struct ipfrag_frag {
+    /* Buffer and the IP header in it, and the bytes available from the IP
+       header to the end of the buffer */
+    void *buf;
+    uint8_t *ip;
+    uint16_t room;
+    uint16_t hlen;
+    /* Payload (offset in the datagram and length) */
+    uint16_t off;
+    uint16_t len;
+    /* Next fragment of the datagram, or in the free list */
+    uint16_t next;
+};
+
+/*
+ * Datagram being reassembled
+ */
+struct ipfrag_dgram {
+    /* Key (network byte order) */
+    uint32_t src;
+    uint32_t dst;
+    uint16_t id;
+    uint8_t proto;
+    uint8_t nfrags;
+    /* Fragments by offset */
+    uint16_t frags;
+    /* Payload length (known from the last fragment; 0 until then), and the
+       bytes received */
+    uint16_t total;
+    uint16_t have;
+    uint32_t expire;
+    /* Next in the hash bucket, or in the free list */
+    uint16_t hnext;
+    /* Age list (the oldest first) */
+    uint16_t prev;
+    uint16_t next;
+};
+
+/*
+ * Reassembly table
+ */
+struct ipfrag {
+    struct ipfrag_dgram dgrams[IPFRAG_MAX_DGRAMS];
+    struct ipfrag_frag frags[IPFRAG_MAX_FRAGS];
+    uint16_t hash[IPFRAG_HASH];
+    uint16_t free_dgrams;
+    uint16_t free_frags;
+    uint16_t oldest;
+    uint16_t newest;
+    /* Timeout of a datagram (in ticks of the caller) */
+    uint32_t timeout;
+    /* Buffers released to the caller */
+    void *released[IPFRAG_MAX_FRAGS];
+    int nreleased;
+    struct ipfrag_stats stats;
+};
+
+/*
+ * Initialize a reassembly table
+ */
+static __inline__ void
+ipfrag_init(struct ipfrag *r, uint32_t timeout)
+{
+    int i;
+
+    memset(r, 0, sizeof(struct ipfrag));
+    for ( i = 0; i < IPFRAG_HASH; i++ ) {
+        r->hash[i] = IPFRAG_NIL;
+    }
+    for ( i = 0; i < IPFRAG_MAX_DGRAMS; i++ ) {
+        r->dgrams[i].hnext = i + 1 < IPFRAG_MAX_DGRAMS ? i + 1 : IPFRAG_NIL;
+    }
+    for ( i = 0; i < IPFRAG_MAX_FRAGS; i++ ) {
+        r->frags[i].next = i + 1 < IPFRAG_MAX_FRAGS ? i + 1 : IPFRAG_NIL;
+    }
+    r->free_dgrams = 0;
+    r->free_frags = 0;
+    r->oldest = IPFRAG_NIL;
+    r->newest = IPFRAG_NIL;
+    r->timeout = timeout;
+}
+
+/*
+ * Buffer released by the last call, or NULL if none
+ */
+static __inline__ void *
+ipfrag_drain(struct ipfrag *r)
+{
+    if ( r->nreleased <= 0 ) {
+        return NULL;
+    }
+
+    return r->released[--r->nreleased];
+}
+
+/*
+ * Bucket of a datagram
+ */
+static __inline__ uint32_t
+_ipfrag_hash(uint32_t src, uint32_t dst, uint16_t id, uint8_t proto)
+{
+    uint32_t h;
+
+    h = (src ^ (dst * 0x9e3779b1U)) + ((uint32_t)id << 8) + proto;
+    h *= 0x85ebca6bU;
+
+    return (h >> 16) & (IPFRAG_HASH - 1);
+}
+
+/*
+ * Free a datagram, and release the buffers of its fragments (except the one
+ * of the fragment keep, if not IPFRAG_NIL)
+ */
+static __inline__ void
+_ipfrag_free(struct ipfrag *r, uint16_t d, uint16_t keep)
+{
+    struct ipfrag_dgram *dg;
+    uint16_t *p;
+    uint16_t f;
+    uint16_t next;
+
+    dg = &r->dgrams[d];
+    for ( f = dg->frags; IPFRAG_NIL != f; f = next ) {
+        next = r->frags[f].next;
+        if ( f != keep ) {
+            r->released[r->nreleased++] = r->frags[f].buf;
+        }
+        r->frags[f].next = r->free_frags;
+        r->free_frags = f;
+    }
+
+    /* Unlink from the bucket and the age list */
+    p = &r->hash[_ipfrag_hash(dg->src, dg->dst, dg->id, dg->proto)];
+    while ( *p != d ) {
+        p = &r->dgrams[*p].hnext;
+    }
+    *p = dg->hnext;
+    if ( IPFRAG_NIL != dg->prev ) {
+        r->dgrams[dg->prev].next = dg->next;
+    } else {
+        r->oldest = dg->next;
+    }
+    if ( IPFRAG_NIL != dg->next ) {
+        r->dgrams[dg->next].prev = dg->prev;
+    } else {
+        r->newest = dg->prev;
+    }
+
+    dg->hnext = r->free_dgrams;
+    r->free_dgrams = d;
+}
+
+/*
+ * Release the datagrams whose timeout has expired at now (in O(1) if none,
+ * as they expire in the order of their creation)
+ */
+static __inline__ void
+ipfrag_expire(struct ipfrag *r, uint32_t now)
+{
+    while ( IPFRAG_NIL != r->oldest
+            && (int32_t)(now - r->dgrams[r->oldest].expire) >= 0 ) {
+        _ipfrag_free(r, r->oldest, IPFRAG_NIL);
+        r->stats.timeouts++;
+    }
+}
+
+/*
+ * Gather the payloads of a complete datagram into the buffer of its first
+ * fragment; returns the length of the reassembled IPv4 packet, or -1 if it
+ * does not fit in the buffer
+ */
+static __inline__ int
+_ipfrag_gather(struct ipfrag *r, struct ipfrag_dgram *dg)
+{
+    struct ipfrag_frag *f0;
+    struct ipfrag_frag *f;
+    struct ip *ip;
+    uint16_t i;
+    int len;
+
+    f0 = &r->frags[dg->frags];
+    len = f0->hlen + dg->total;
+    if ( len > f0->room ) {
+        return -1;
+    }
+    for ( i = f0->next; IPFRAG_NIL != i; i = f->next ) {
+        f = &r->frags[i];
+        memcpy(f0->ip + f0->hlen + f->off, f->ip + f->hlen, f->len);
+    }
+    ip = (struct ip *)f0->ip;
+    ip->ip_len = htons(len);
+    ip->ip_off &= htons(IP_DF);
+    ip->ip_sum = 0;
+    ip->ip_sum = htons(~cksum_fold(cksum_add(0, ip, f0->hlen)));
+
+    return len;
+}
+
+/*
+ * Add a fragment (in the buffer buf, with room bytes available from the IP
+ * header ip to the end of the buffer) to the table at now.  Returns the
+ * length of the reassembled packet with its buffer and IP header in bufp and
+ * ipp if complete, 0 if the fragment is held, or -1 if it is dropped (the
+ * buffer is left to the caller).
+ */
+static __inline__ int
+ipfrag_input(struct ipfrag *r, void *buf, uint8_t *ip, int len, int room,
+             uint32_t now, void **bufp, uint8_t **ipp)
+{
+    struct ipfrag_dgram *dg;
+    struct ipfrag_frag *fr;
+    struct ip *iph;
+    uint32_t src;
+    uint32_t dst;
+    uint16_t *p;
+    uint16_t d;
+    uint16_t f;
+    uint16_t prev;
+    uint16_t next;
+    int hlen;
+    int off;
+    int plen;
+    int mf;
+    int ret;
+
+    ipfrag_expire(r, now);
+
+    /* Fragment */
+    iph = (struct ip *)ip;
+    hlen = IP_VHL_HL(iph->ip_vhl) * 4;
+    if ( hlen < (int)sizeof(struct ip) || len < ntohs(iph->ip_len)
+         || ntohs(iph->ip_len) <= hlen || room > 0xffff ) {
+        r->stats.drops++;
+        return -1;
+    }
+    off = (ntohs(iph->ip_off) & IP_OFFMASK) * 8;
+    mf = ntohs(iph->ip_off) & IP_MF;
+    plen = ntohs(iph->ip_len) - hlen;
+    if ( (mf && (plen & 7)) || off + plen > 0xffff - hlen ) {
+        /* Only the last fragment may end off the 8-byte boundary */
+        r->stats.drops++;
+        return -1;
+    }
+    memcpy(&src, &iph->ip_src, 4);
+    memcpy(&dst, &iph->ip_dst, 4);
+
+    /* Datagram */
+    p = &r->hash[_ipfrag_hash(src, dst, iph->ip_id, iph->ip_p)];
+    for ( d = *p; IPFRAG_NIL != d; d = r->dgrams[d].hnext ) {
+        dg = &r->dgrams[d];
+        if ( src == dg->src && dst == dg->dst && iph->ip_id == dg->id
+             && iph->ip_p == dg->proto ) {
+            break;
+        }
+    }
+    if ( IPFRAG_NIL == d ) {
+        if ( IPFRAG_NIL == r->free_dgrams ) {
+            _ipfrag_free(r, r->oldest, IPFRAG_NIL);
+            r->stats.evictions++;
+        }
+        d = r->free_dgrams;
+        dg = &r->dgrams[d];
+        r->free_dgrams = dg->hnext;
+        dg->src = src;
+        dg->dst = dst;
+        dg->id = iph->ip_id;
+        dg->proto = iph->ip_p;
+        dg->nfrags = 0;
+        dg->frags = IPFRAG_NIL;
+        dg->total = 0;
+        dg->have = 0;
+        dg->expire = now + r->timeout;
+        dg->hnext = *p;
+        *p = d;
+        dg->prev = r->newest;
+        dg->next = IPFRAG_NIL;
+        if ( IPFRAG_NIL != r->newest ) {
+            r->dgrams[r->newest].next = d;
+        } else {
+            r->oldest = d;
+        }
+        r->newest = d;
+    }
+    dg = &r->dgrams[d];
+
+    /* Position by the offset */
+    prev = IPFRAG_NIL;
+    for ( next = dg->frags; IPFRAG_NIL != next; next = r->frags[next].next ) {
+        if ( r->frags[next].off >= off ) {
+            break;
+        }
+        prev = next;
+    }
+    if ( IPFRAG_NIL != next && off == r->frags[next].off
+         && plen == r->frags[next].len ) {
+        /* Duplicate */
+        r->stats.drops++;
+        return -1;
+    }
+    if ( (IPFRAG_NIL != prev
+          && r->frags[prev].off + r->frags[prev].len > off)
+         || (IPFRAG_NIL != next && off + plen > r->frags[next].off)
+         || (!mf && 0 != dg->total)
+         || (0 != dg->total && off + plen > dg->total)
+         || (!mf && IPFRAG_NIL != next)
+         || dg->nfrags >= IPFRAG_MAX_FRAGS_DGRAM ) {
+        /* Overlapping, inconsistent, or too many fragments */
+        _ipfrag_free(r, d, IPFRAG_NIL);
+        r->stats.drops++;
+        return -1;
+    }
+
+    /* Hold the fragment; the oldest datagrams are evicted for room */
+    while ( IPFRAG_NIL == r->free_frags ) {
+        f = r->oldest != d ? r->oldest : r->dgrams[d].next;
+        _ipfrag_free(r, f, IPFRAG_NIL);
+        r->stats.evictions++;
+    }
+    f = r->free_frags;
+    fr = &r->frags[f];
+    r->free_frags = fr->next;
+    fr->buf = buf;
+    fr->ip = ip;
+    fr->room = room;
+    fr->hlen = hlen;
+    fr->off = off;
+    fr->len = plen;
+    fr->next = next;
+    if ( IPFRAG_NIL != prev ) {
+        r->frags[prev].next = f;
+    } else {
+        dg->frags = f;
+    }
+    dg->nfrags++;
+    dg->have += plen;
+    if ( !mf ) {
+        dg->total = off + plen;
+    }
+    if ( 0 == dg->total || dg->have != dg->total ) {
+        return 0;
+    }
+
+    /* Complete (without overlaps, the fragments cover the payload) */
+    ret = _ipfrag_gather(r, dg);
+    if ( ret < 0 ) {
+        _ipfrag_free(r, d, f);
+        r->stats.drops++;
+        return -1;
+    }
+    *bufp = r->frags[dg->frags].buf;
+    *ipp = r->frags[dg->frags].ip;
+    _ipfrag_free(r, d, dg->frags);
+    r->stats.reassembled++;
+
+    return ret;
+}
+
+/*
+ * Build the IPv4 header of the fragments following the first one (with the
+ * options to be copied into all the fragments) in hdr from the header of a
+ * datagram; returns its length
+ */
+static __inline__ int
+ipfrag_header(const struct ip *ip, uint8_t *hdr)
+{
+    const uint8_t *opts;
+    int hlen;
+    int olen;
+    int len;
+    int i;
+
+    hlen = IP_VHL_HL(ip->ip_vhl) * 4;
+    memcpy(hdr, ip, sizeof(struct ip));
+    opts = (const uint8_t *)ip + sizeof(struct ip);
+    len = sizeof(struct ip);
+    for ( i = 0; i < hlen - (int)sizeof(struct ip); i += olen ) {
+        if ( IPFRAG_OPT_EOL == opts[i] ) {
+            break;
+        }
+        if ( IPFRAG_OPT_NOP == opts[i] ) {
+            olen = 1;
+            continue;
+        }
+        if ( i + 1 >= hlen - (int)sizeof(struct ip) || opts[i + 1] < 2
+             || i + opts[i + 1] > hlen - (int)sizeof(struct ip) ) {
+            /* Malformed */
+            break;
+        }
+        olen = opts[i + 1];
+        if ( opts[i] & IPFRAG_OPT_COPIED ) {
+            memcpy(hdr + len, opts + i, olen);
+            len += olen;
+        }
+    }
+    /* Padded to 32 bits with the end of the option list */
+    while ( len & 3 ) {
+        hdr[len++] = IPFRAG_OPT_EOL;
+    }
+    ((struct ip *)hdr)->ip_vhl = (IPVERSION << 4) | (len >> 2);
+
+    return len;
+}
+
+#endif /* _IPFRAG_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
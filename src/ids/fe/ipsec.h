@@ -0,0 +1,544 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _IPSEC_H
+#define _IPSEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/ip6.h>
+#include "aesgcm.h"
+
+/*
+ * IPsec ESP in the tunnel mode (RFC 4301, RFC 4303) with AES-GCM (RFC 4106)
+ *
+ * An SA is instantiated in a context per exclusive task: the expanded key
+ * and the outbound sequence numbers reserved by the task are private to the
+ * task, so that the crypto needs no lock.  The anti-replay window is one per
+ * SA, shared by all the tasks, since the inbound packets of an SA may be
+ * received by any of them (the Rx queues are handed over between the tasks,
+ * and the members of a LAG are polled by different ones); it is updated
+ * lock-free by compare-and-swap.  Outbound sequence numbers are reserved from
+ * the SA in blocks, so the packets of an SA sent by different tasks may
+ * arrive out of order within the window.
+ *
+ * The inner packets of an inbound SA are dropped unless their addresses are
+ * within the traffic selectors of the SA (RFC 4301 Section 5.2), so that a
+ * peer holding the SA cannot inject traffic other than that negotiated.
+ *
+ * The 64-bit IV is the sequence number (unique per SA), and the nonce is the
+ * salt of the key followed by the IV.  The identification of the outer IPv4
+ * header is the low-order 16 bits of the sequence number too, so that the
+ * fragments of the packets of an SA sent by different tasks do not share an
+ * identification (within 65536 packets) when the outer packet is fragmented
+ * on the way to the peer.  Extended sequence numbers are not
+ * supported; the SA is to be rekeyed before the sequence number wraps.
+ */
+
+#define ESP_PROTO               50
+/* Next header of the inner packet (IP-in-IP) */
+#define ESP_NH_IPV4             4
+#define ESP_NH_IPV6             41
+
+#define ESP_HDR_LEN             8       /* SPI and sequence number */
+#define ESP_IV_LEN              8
+#define ESP_ICV_LEN             AESGCM_TAG_LEN
+#define ESP_SALT_LEN            4
+#define ESP_MAX_KEY_LEN         32
+/* Outer headers in front of the inner packet (Ethernet, IPv4, ESP, and IV),
+   and the trailer behind it (padding, pad length, next header, and ICV) */
+#define ESP_ENCAP_LEN           (sizeof(struct ether_header) \
+                                 + sizeof(struct ip) + ESP_HDR_LEN \
+                                 + ESP_IV_LEN)
+#define ESP_MAX_TRAILER_LEN     (3 + 2 + ESP_ICV_LEN)
+
+/* Anti-replay window (in sequence numbers; a multiple of 32) */
+#define ESP_REPLAY_WINDOW       1024
+
+/* Direction of an SA */
+#define ESP_DIR_IN              0
+#define ESP_DIR_OUT             1
+
+/*
+ * Configuration of an SA (addresses in host byte order); the next hop to the
+ * peer and the next hop routing into the tunnel are those of the forwarding
+ * engine (outbound only)
+ */
+struct esp_sa_config {
+    int dir;
+    uint32_t spi;
+    uint8_t key[ESP_MAX_KEY_LEN];
+    int keylen;
+    uint8_t salt[ESP_SALT_LEN];
+    /* Tunnel end points */
+    uint32_t src;
+    uint32_t dst;
+    uint16_t nh;
+    uint16_t tnh;
+    /* Traffic selectors of the inner packets (inbound only): the source and
+       the destination prefixes per address family; a prefix of zero length
+       matches any address */
+    uint32_t sel_src4;
+    int sel_src4len;
+    uint32_t sel_dst4;
+    int sel_dst4len;
+    uint8_t sel_src6[16];
+    int sel_src6len;
+    uint8_t sel_dst6[16];
+    int sel_dst6len;
+};
+
+/*
+ * Statistics of an SA
+ */
+struct esp_stats {
+    uint64_t pkts;
+    uint64_t bytes;
+    /* Dropped: failed authentication, replayed, outside the traffic
+       selectors, and the others (malformed, too long, or the sequence number
+       exhausted) */
+    uint64_t auth_errors;
+    uint64_t replays;
+    uint64_t policy_errors;
+    uint64_t errors;
+};
+
+/*
+ * Anti-replay window (RFC 4303 Appendix A) shared by the tasks; the bitmap is
+ * a ring of the 32-bit words indexed by the sequence numbers, each tagged with
+ * the number of the word (seq / 32) in its upper 32 bits, so that a word is
+ * slid (cleared and retagged) and marked by a single compare-and-swap.  The
+ * tag of a slot only grows, so a sequence number is accepted at most once.
+ */
+struct esp_replay {
+    volatile uint32_t top;
+    volatile uint64_t words[ESP_REPLAY_WINDOW / 32];
+};
+
+/*
+ * Traffic selector of an address family: the prefixes and the masks of the
+ * source and the destination (network byte order)
+ */
+struct esp_sel4 {
+    uint32_t src;
+    uint32_t srcmask;
+    uint32_t dst;
+    uint32_t dstmask;
+};
+struct esp_sel6 {
+    uint64_t src[2];
+    uint64_t srcmask[2];
+    uint64_t dst[2];
+    uint64_t dstmask[2];
+};
+
+/*
+ * Context of an SA
+ */
+struct esp_ctx {
+    struct aesgcm_key key;
+    int dir;
+    /* SPI, and the tunnel end points (network byte order) */
+    uint32_t spi;
+    uint32_t saddr;
+    uint32_t daddr;
+    uint8_t salt[ESP_SALT_LEN];
+    /* Outbound: outer IPv4 header, the one's complement sum of it with zero
+       total length, TOS, identification, and checksum, and the sequence
+       numbers reserved
+       ([seq, seq_end)) */
+    struct ip tmpl;
+    uint32_t sum;
+    uint64_t seq;
+    uint64_t seq_end;
+    /* Inbound */
+    struct esp_sel4 sel4;
+    struct esp_sel6 sel6;
+    /* Anti-replay window of the SA (shared by the tasks) */
+    struct esp_replay *replay;
+    struct esp_stats stats;
+};
+
+/*
+ * Build the mask of an IPv6 prefix length, and the masked prefix
+ */
+static __inline__ void
+_esp_prefix6(uint64_t *prefix, uint64_t *mask, const uint8_t *addr, int len)
+{
+    uint8_t m[16];
+    int i;
+
+    for ( i = 0; i < 16; i++ ) {
+        if ( len >= 8 * (i + 1) ) {
+            m[i] = 0xff;
+        } else if ( len > 8 * i ) {
+            m[i] = 0xff << (8 * (i + 1) - len);
+        } else {
+            m[i] = 0;
+        }
+    }
+    memcpy(mask, m, 16);
+    memcpy(prefix, addr, 16);
+    prefix[0] &= mask[0];
+    prefix[1] &= mask[1];
+}
+
+/*
+ * Initialize the context of an SA; returns 0 on success, or -1
+ */
+static __inline__ int
+esp_ctx_init(struct esp_ctx *c, const struct esp_sa_config *cfg)
+{
+    const uint8_t *p;
+    int i;
+
+    memset(c, 0, sizeof(struct esp_ctx));
+    if ( aesgcm_init(&c->key, cfg->key, cfg->keylen) < 0 ) {
+        return -1;
+    }
+    c->dir = cfg->dir;
+    c->spi = htonl(cfg->spi);
+    c->saddr = htonl(cfg->src);
+    c->daddr = htonl(cfg->dst);
+    memcpy(c->salt, cfg->salt, ESP_SALT_LEN);
+
+    c->sel4.srcmask = htonl(cfg->sel_src4len
+                            ? 0xffffffffU << (32 - cfg->sel_src4len) : 0);
+    c->sel4.src = htonl(cfg->sel_src4) & c->sel4.srcmask;
+    c->sel4.dstmask = htonl(cfg->sel_dst4len
+                            ? 0xffffffffU << (32 - cfg->sel_dst4len) : 0);
+    c->sel4.dst = htonl(cfg->sel_dst4) & c->sel4.dstmask;
+    _esp_prefix6(c->sel6.src, c->sel6.srcmask, cfg->sel_src6,
+                 cfg->sel_src6len);
+    _esp_prefix6(c->sel6.dst, c->sel6.dstmask, cfg->sel_dst6,
+                 cfg->sel_dst6len);
+
+    c->tmpl.ip_vhl = (IPVERSION << 4) | (sizeof(struct ip) >> 2);
+    c->tmpl.ip_ttl = 64;
+    c->tmpl.ip_p = ESP_PROTO;
+    memcpy(&c->tmpl.ip_src, &c->saddr, 4);
+    memcpy(&c->tmpl.ip_dst, &c->daddr, 4);
+    p = (const uint8_t *)&c->tmpl;
+    for ( i = 0; i < (int)sizeof(struct ip); i += 2 ) {
+        c->sum += ((uint32_t)p[i] << 8) | p[i + 1];
+    }
+
+    return 0;
+}
+
+/*
+ * Whether a sequence number is in the window and not received yet (a hint
+ * before the authentication; esp_replay_update() decides)
+ */
+static __inline__ int
+esp_replay_check(const struct esp_replay *r, uint32_t seq)
+{
+    uint64_t v;
+    uint32_t top;
+
+    if ( 0 == seq ) {
+        return -1;
+    }
+    top = r->top;
+    if ( seq <= top && top / 32 - seq / 32 >= ESP_REPLAY_WINDOW / 32 ) {
+        /* Behind the window */
+        return -1;
+    }
+    v = r->words[(seq / 32) % (ESP_REPLAY_WINDOW / 32)];
+    if ( (v >> 32) > seq / 32
+         || ((v >> 32) == seq / 32 && (v & (1ULL << (seq % 32)))) ) {
+        /* Slid past it, or received */
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Mark a sequence number (authenticated) as received, and slide the window
+ * up to it; returns 0 on success, or -1 if it is behind the window or has
+ * been received (by any task)
+ */
+static __inline__ int
+esp_replay_update(struct esp_replay *r, uint32_t seq)
+{
+    volatile uint64_t *p;
+    uint64_t v;
+    uint64_t nv;
+    uint32_t top;
+
+    if ( esp_replay_check(r, seq) < 0 ) {
+        return -1;
+    }
+
+    /* Mark the bit; a word of an older word number (behind the window) is
+       cleared and retagged */
+    p = &r->words[(seq / 32) % (ESP_REPLAY_WINDOW / 32)];
+    do {
+        v = *p;
+        if ( (v >> 32) > seq / 32
+             || ((v >> 32) == seq / 32 && (v & (1ULL << (seq % 32)))) ) {
+            return -1;
+        }
+        if ( (v >> 32) < seq / 32 ) {
+            nv = ((uint64_t)(seq / 32) << 32) | (1ULL << (seq % 32));
+        } else {
+            nv = v | (1ULL << (seq % 32));
+        }
+    } while ( !__sync_bool_compare_and_swap(p, v, nv) );
+
+    /* Advance the top */
+    do {
+        top = r->top;
+        if ( seq <= top ) {
+            break;
+        }
+    } while ( !__sync_bool_compare_and_swap(&r->top, top, seq) );
+
+    return 0;
+}
+
+/*
+ * Encapsulate the inner IPv4 or IPv6 packet of a frame (len bytes) with the
+ * sequence number in place; the outer headers are written in the headroom in
+ * front of the IP header, and the trailer behind the packet.  The operation
+ * to encrypt it (with the nonce in nonce) is set to op.  Returns the head of
+ * the outer frame (with its length in olen; the Ethernet addresses are left
+ * to the caller), or NULL if the frame is not IP.
+ */
+static __inline__ uint8_t *
+esp_encap(struct esp_ctx *c, uint8_t *frame, int len, uint64_t seq,
+          struct aesgcm_op *op, uint8_t *nonce, int *olen)
+{
+    struct ether_header *eth;
+    struct ip *ip;
+    uint8_t *inner;
+    uint8_t *esp;
+    uint32_t sum;
+    uint32_t w;
+    uint8_t tos;
+    int plen;
+    int tlen;
+    int pad;
+    int nh;
+    int i;
+
+    eth = (struct ether_header *)frame;
+    inner = frame + sizeof(struct ether_header);
+    plen = len - sizeof(struct ether_header);
+    switch ( ntohs(eth->ether_type) ) {
+    case ETHERTYPE_IP:
+        nh = ESP_NH_IPV4;
+        tos = ((struct ip *)inner)->ip_tos;
+        break;
+    case ETHERTYPE_IPV6:
+        nh = ESP_NH_IPV6;
+        tos = ((inner[0] << 4) | (inner[1] >> 4)) & 0xff;
+        break;
+    default:
+        return NULL;
+    }
+
+    /* Trailer; the padding aligns it to four bytes */
+    pad = (4 - ((plen + 2) & 3)) & 3;
+    for ( i = 0; i < pad; i++ ) {
+        inner[plen + i] = i + 1;
+    }
+    inner[plen + pad] = pad;
+    inner[plen + pad + 1] = nh;
+    tlen = plen + pad + 2;
+
+    /* ESP header and IV */
+    esp = inner - ESP_IV_LEN - ESP_HDR_LEN;
+    memcpy(esp, &c->spi, 4);
+    w = htonl((uint32_t)seq);
+    memcpy(esp + 4, &w, 4);
+    w = htonl(seq >> 32);
+    memcpy(esp + ESP_HDR_LEN, &w, 4);
+    w = htonl((uint32_t)seq);
+    memcpy(esp + ESP_HDR_LEN + 4, &w, 4);
+    memcpy(nonce, c->salt, ESP_SALT_LEN);
+    memcpy(nonce + ESP_SALT_LEN, esp + ESP_HDR_LEN, ESP_IV_LEN);
+
+    /* Outer headers; the DSCP is copied from the inner packet (RFC 4301
+       Section 5.1.2.1), and the ECN is not */
+    ip = (struct ip *)(esp - sizeof(struct ip));
+    memcpy(ip, &c->tmpl, sizeof(struct ip));
+    tos &= 0xfc;
+    ip->ip_tos = tos;
+    *olen = sizeof(struct ip) + ESP_HDR_LEN + ESP_IV_LEN + tlen + ESP_ICV_LEN;
+    ip->ip_len = htons(*olen);
+    ip->ip_id = htons((uint16_t)seq);
+    sum = c->sum + tos + *olen + (uint16_t)seq;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    ip->ip_sum = htons(~sum);
+    eth = (struct ether_header *)((uint8_t *)ip - sizeof(struct ether_header));
+    eth->ether_type = htons(ETHERTYPE_IP);
+    *olen += sizeof(struct ether_header);
+
+    op->key = &c->key;
+    op->iv = nonce;
+    op->aad = esp;
+    op->aadlen = ESP_HDR_LEN;
+    op->buf = inner;
+    op->len = tlen;
+    op->tag = inner + tlen;
+
+    return (uint8_t *)eth;
+}
+
+/*
+ * Parse the ESP header of a frame (unfragmented IPv4); returns the offset of
+ * the ESP header with the SPI (network byte order), the sequence number, and
+ * the length to the end of the ICV, or -1 if it is not ESP
+ */
+static __inline__ int
+esp_parse(const uint8_t *frame, int len, uint32_t *spi, uint32_t *seq,
+          int *esplen)
+{
+    const struct ip *ip;
+    uint32_t w;
+    int off;
+
+    if ( len < (int)(sizeof(struct ether_header) + sizeof(struct ip)) ) {
+        return -1;
+    }
+    ip = (const struct ip *)(frame + sizeof(struct ether_header));
+    if ( ESP_PROTO != ip->ip_p
+         || (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) ) {
+        /* Fragments are not reassembled */
+        return -1;
+    }
+    /* The frame may be padded */
+    off = sizeof(struct ether_header) + IP_VHL_HL(ip->ip_vhl) * 4;
+    if ( IP_VHL_HL(ip->ip_vhl) < 5
+         || len < (int)sizeof(struct ether_header) + ntohs(ip->ip_len) ) {
+        return -1;
+    }
+    len = sizeof(struct ether_header) + ntohs(ip->ip_len);
+    if ( len < off + ESP_HDR_LEN + ESP_IV_LEN + 2 + ESP_ICV_LEN ) {
+        return -1;
+    }
+    *esplen = len - off;
+    memcpy(spi, frame + off, 4);
+    memcpy(&w, frame + off + 4, 4);
+    *seq = ntohl(w);
+
+    return off;
+}
+
+/*
+ * Set the operation to decrypt the ESP packet at esp (len bytes to the end of
+ * the ICV) to op, with the nonce in nonce
+ */
+static __inline__ void
+esp_decap(struct esp_ctx *c, uint8_t *esp, int len, struct aesgcm_op *op,
+          uint8_t *nonce)
+{
+    memcpy(nonce, c->salt, ESP_SALT_LEN);
+    memcpy(nonce + ESP_SALT_LEN, esp + ESP_HDR_LEN, ESP_IV_LEN);
+    op->key = &c->key;
+    op->iv = nonce;
+    op->aad = esp;
+    op->aadlen = ESP_HDR_LEN;
+    op->buf = esp + ESP_HDR_LEN + ESP_IV_LEN;
+    op->len = len - ESP_HDR_LEN - ESP_IV_LEN - ESP_ICV_LEN;
+    op->tag = op->buf + op->len;
+}
+
+/*
+ * Strip the trailer of a decrypted packet; returns the length of the inner
+ * packet with the next header, or -1 if malformed
+ */
+static __inline__ int
+esp_trailer(const struct aesgcm_op *op, int *nh)
+{
+    int pad;
+
+    if ( op->len < 2 ) {
+        return -1;
+    }
+    pad = op->buf[op->len - 2];
+    *nh = op->buf[op->len - 1];
+    if ( pad + 2 > op->len ) {
+        return -1;
+    }
+
+    return op->len - pad - 2;
+}
+
+/*
+ * Check the addresses of the decrypted inner packet (len bytes with the next
+ * header nh) against the traffic selectors; returns 0 if within them, or -1
+ */
+static __inline__ int
+esp_sel_check(const struct esp_ctx *c, const uint8_t *inner, int len, int nh)
+{
+    uint64_t a[2];
+    uint32_t w;
+
+    if ( ESP_NH_IPV4 == nh ) {
+        if ( len < (int)sizeof(struct ip) ) {
+            return -1;
+        }
+        memcpy(&w, &((const struct ip *)inner)->ip_src, 4);
+        if ( (w & c->sel4.srcmask) != c->sel4.src ) {
+            return -1;
+        }
+        memcpy(&w, &((const struct ip *)inner)->ip_dst, 4);
+        if ( (w & c->sel4.dstmask) != c->sel4.dst ) {
+            return -1;
+        }
+        return 0;
+    }
+    if ( len < (int)sizeof(struct ip6_hdr) ) {
+        return -1;
+    }
+    memcpy(a, ((const struct ip6_hdr *)inner)->ip6_src, 16);
+    if ( (a[0] & c->sel6.srcmask[0]) != c->sel6.src[0]
+         || (a[1] & c->sel6.srcmask[1]) != c->sel6.src[1] ) {
+        return -1;
+    }
+    memcpy(a, ((const struct ip6_hdr *)inner)->ip6_dst, 16);
+    if ( (a[0] & c->sel6.dstmask[0]) != c->sel6.dst[0]
+         || (a[1] & c->sel6.dstmask[1]) != c->sel6.dst[1] ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif /* _IPSEC_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <mki/driver.h>
+#include <sys/net/ethernet.h>
 #include "pci.h"
 #include "common.h"
 
@@ -70,6 +71,7 @@
     ? (0x1014 + 0x40 * (n)) : (0xd014 + 0x40 * ((n) - 64))
 #define IXGBE_REG_RSCCTL(n)     ((n) < 64) \
     ? (0x102c + 0x40 * (n)) : (0xd02c + 0x40 * ((n) - 64))
+#define IXGBE_REG_PSRTYPE(n)    (0xea00 + 4 * (n))
 #define IXGBE_REG_TDH(n)        (0x6010 + 0x40 * (n))
 #define IXGBE_REG_TDT(n)        (0x6018 + 0x40 * (n))
 #define IXGBE_REG_TDBAL(n)      (0x6000 + 0x40 * (n))
@@ -104,6 +106,7 @@
 #define IXGBE_REG_MCSTCTRL      0x5090
 
 #define IXGBE_REG_VFTA(n)       (0xa000 + 0x4 * (n))
+#define IXGBE_REG_VLNCTRL       0x05088
 
 /* RSS */
 #define IXGBE_REG_RETA(n)       (0x05c00 + 4 * (n))
@@ -117,6 +120,17 @@
 #define IXGBE_REG_DCA_ID        0x11070
 #define IXGBE_REG_DCA_CTRL      0x11074
 
+#define IXGBE_DCA_CTRL_DISABLE          (1 << 0)
+#define IXGBE_DCA_CTRL_MODE_CB2         (1 << 1)        /* DCA 1.0 */
+#define IXGBE_DCA_CPUID_SHIFT           24              /* Target (APIC ID) */
+#define IXGBE_DCA_RXCTRL_DESC_DCA_EN    (1 << 5)
+#define IXGBE_DCA_RXCTRL_HEAD_DCA_EN    (1 << 6)        /* Header buffer */
+#define IXGBE_DCA_RXCTRL_DATA_DCA_EN    (1 << 7)        /* Payload */
+#define IXGBE_DCA_RXCTRL_DESC_RRO_EN    (1 << 9)
+#define IXGBE_DCA_TXCTRL_DESC_DCA_EN    (1 << 5)
+#define IXGBE_DCA_TXCTRL_DESC_RRO_EN    (1 << 9)
+#define IXGBE_DCA_TXCTRL_DATA_RRO_EN    (1 << 13)
+
 #define IXGBE_REG_MAXFRS        0x04268
 
 #define IXGBE_CTRL_LRST (1<<3)  /* Link reset */
@@ -137,13 +151,56 @@
 #define IXGBE_SRRCTL_BSIZE_PKT16K       (16)
 #define IXGBE_SRRCTL_BSIZE_HDR256       (4<<8)
 #define IXGBE_SRRCTL_DESCTYPE_LEGACY    (0)
+#define IXGBE_SRRCTL_DESCTYPE_ADV       (1<<25) /* Advanced one buffer */
+#define IXGBE_SRRCTL_DESCTYPE_HSPLIT    (2<<25) /* Advanced header split */
+#define IXGBE_SRRCTL_DROP_EN            (1<<28)
+
+/* Headers split into the header buffer (the split point is after the
+   deepest header of these types) */
+#define IXGBE_PSRTYPE_TCPHDR    (1 << 4)
+#define IXGBE_PSRTYPE_UDPHDR    (1 << 5)
+#define IXGBE_PSRTYPE_IPV4HDR   (1 << 8)
+#define IXGBE_PSRTYPE_IPV6HDR   (1 << 9)
 
 #define IXGBE_RXDCTL_ENABLE     (1<<25)
 #define IXGBE_RXDCTL_VME        (1<<30)
 #define IXGBE_RXCTL_RXEN        1
 #define IXGBE_TXDCTL_ENABLE     (1<<25)
 #define IXGBE_DMATXCTL_TE       1
-#define IXGBE_DMATXCTL_VT       0x8100
+#define IXGBE_DMATXCTL_VT       (0x8100 << 16)  /* VLAN ether type */
+
+#define IXGBE_VLNCTRL_VET       0x8100          /* VLAN ether type */
+#define IXGBE_VLNCTRL_VFE       (1 << 30)       /* VLAN filter enable */
+
+#define IXGBE_RXD_STAT_VP       (1 << 3)        /* 802.1Q tag stripped */
+#define IXGBE_RXD_STAT_L4CS     (1 << 5)        /* L4 checksum checked */
+#define IXGBE_RXD_STAT_IPCS     (1 << 6)        /* IPv4 checksum checked */
+#define IXGBE_RXD_ERR_HBO       (1 << 23)       /* Header buffer overflow */
+#define IXGBE_RXD_ERR_TCPE      (1U << 30)      /* L4 checksum error */
+#define IXGBE_RXD_ERR_IPE       (1U << 31)      /* IPv4 checksum error */
+#define IXGBE_RXD_PKTTYPE_UDP   (1 << 9)        /* UDP (info0) */
+#define IXGBE_RXD_HDRLEN_SHIFT  21              /* Header length (info0) */
+#define IXGBE_RXD_HDRLEN_MASK   0x3ff
+#define IXGBE_RXD_SPH           (1U << 31)      /* Split header (info0) */
+
+#define IXGBE_TXD_DTYP_CTXT     (2 << 20)       /* Context descriptor */
+#define IXGBE_TXD_DEXT          (1 << 29)
+#define IXGBE_TXD_DCMD_VLE      (1 << 6)        /* VLAN insertion */
+#define IXGBE_TXD_CC            (1 << 7)        /* Check context */
+#define IXGBE_TXD_IDX(n)        ((n) << 4)      /* Context index */
+#define IXGBE_TXD_DCMD_TSE      (1 << 7)        /* TCP segmentation */
+#define IXGBE_TXD_POPTS_IXSM    (1 << 8)        /* Insert IPv4 checksum */
+#define IXGBE_TXD_POPTS_TXSM    (1 << 9)        /* Insert L4 checksum */
+#define IXGBE_TXD_TUCMD_IPV4    (1 << 10)
+#define IXGBE_TXD_TUCMD_L4T_TCP (1 << 11)       /* UDP if not set */
+#define IXGBE_TXD_MACLEN_SHIFT  9
+#define IXGBE_TXD_L4LEN_SHIFT   8
+#define IXGBE_TXD_MSS_SHIFT     16
+
+/* Context descriptor slots; the 802.1Q tag only, and the checksum/TSO
+   offloads (with the tag) */
+#define IXGBE_CTX_VLAN          0
+#define IXGBE_CTX_OFFLOAD       1
 
 #define IXGBE_HLREG0_TXCRCEN    1
 #define IXGBE_HLREG0_RXCRCSTRP  (1 << 1)
@@ -158,6 +215,9 @@
 #define IXGBE_EEC_AUTO_RD       (1 << 9)
 
 
+/* Size of a header buffer; headers longer than this are not split */
+#define IXGBE_RX_HDRSZ          256
+
 /* # of rings supported by 82599 */
 #define IXGBE_NRXQ              32
 #define IXGBE_NTXQ              256     /* 32 for 82598, 256 for 82599 */
@@ -207,6 +267,9 @@ union ixgbe_tx_desc {
 struct ixgbe_rx_ring {
     union ixgbe_rx_desc *descs;
     void **bufs;
+    /* Header buffers (one per descriptor) and the physical address */
+    uint8_t *hbufs;
+    uint64_t hbufs_pa;
     uint16_t tail;
     uint16_t head;
     uint16_t soft_head;
@@ -228,6 +291,12 @@ struct ixgbe_tx_ring {
     uint16_t len;
     /* Write-back */
     uint32_t *tdwba;
+    /* VLAN tag in the context descriptor last written; 0 for none */
+    uint16_t ctx_vlan;
+    /* The offload context descriptor last written (the first and the last
+       dwords of the context descriptor; zero for none) */
+    uint32_t ctx_ol_vml;
+    uint64_t ctx_ol_other;
     /* Queue information */
     uint16_t idx;               /* Queue index */
     void *mmio;                 /* MMIO */
@@ -501,10 +570,11 @@ ixgbe_setup_rx(struct ixgbe_device *dev)
     wr32(dev->mmio, IXGBE_REG_CTRL_EXT,
          rd32(dev->mmio, IXGBE_REG_CTRL_EXT) | (1 << 16));
 
-    /* Clear VLAN filter */
+    /* Clear VLAN filter (disabled until member VLANs are configured) */
     for ( i = 0; i < 128; i++ ) {
         wr32(dev->mmio, IXGBE_REG_VFTA(i), 0);
     }
+    wr32(dev->mmio, IXGBE_REG_VLNCTRL, IXGBE_VLNCTRL_VET);
 
     /* Clear RSC */
     for ( i = 0; i < 128; i++ ) {
@@ -533,6 +603,17 @@ ixgbe_enable_rx(struct ixgbe_device *dev)
     return 0;
 }
 
+/*
+ * Enable DCA (the target processors are set per queue)
+ */
+static __inline__ int
+ixgbe_enable_dca(struct ixgbe_device *dev)
+{
+    wr32(dev->mmio, IXGBE_REG_DCA_CTRL, IXGBE_DCA_CTRL_MODE_CB2);
+
+    return 0;
+}
+
 /*
  * Disable Rx
  */
@@ -580,6 +661,11 @@ ixgbe_setup_rx_ring(struct ixgbe_device *dev, struct ixgbe_rx_ring *rxring,
     rxring->descs = m;
     m += sizeof(union ixgbe_rx_desc) * qlen;
     rxring->bufs = m;
+    m += sizeof(void *) * qlen;
+    /* Header buffers are packed (and cache line aligned) so that the headers
+       of the packets in flight stay in the cache, apart from the payloads */
+    rxring->hbufs = (void *)(((uint64_t)m + 63) & ~63ULL);
+    rxring->hbufs_pa = (uint64_t)rxring->hbufs + v2poff;
 
     for ( i = 0; i < rxring->len; i++ ) {
         rxdesc = &rxring->descs[i];
@@ -593,12 +679,18 @@ ixgbe_setup_rx_ring(struct ixgbe_device *dev, struct ixgbe_rx_ring *rxring,
     wr32(rxring->mmio, IXGBE_REG_RDLEN(rxring->idx),
          rxring->len * sizeof(union ixgbe_rx_desc));
 
+    /* Split the L2-L4 headers of IPv4/IPv6 packets into the header buffers;
+       the other packets are placed entirely into the packet buffers */
     wr32(rxring->mmio, IXGBE_REG_SRRCTL(rxring->idx),
-         IXGBE_SRRCTL_BSIZE_PKT10K | (1 << 25) | (1 << 28) | (0 << 22));
+         IXGBE_SRRCTL_BSIZE_PKT10K | IXGBE_SRRCTL_BSIZE_HDR256
+         | IXGBE_SRRCTL_DESCTYPE_HSPLIT | IXGBE_SRRCTL_DROP_EN);
+    wr32(rxring->mmio, IXGBE_REG_PSRTYPE(rxring->idx),
+         IXGBE_PSRTYPE_TCPHDR | IXGBE_PSRTYPE_UDPHDR | IXGBE_PSRTYPE_IPV4HDR
+         | IXGBE_PSRTYPE_IPV6HDR);
 
-    /* Enable this queue */
+    /* Enable this queue with 802.1Q tag stripping */
     wr32(rxring->mmio, IXGBE_REG_RXDCTL(rxring->idx),
-         IXGBE_RXDCTL_ENABLE/* | IXGBE_RXDCTL_VME*/);
+         IXGBE_RXDCTL_ENABLE | IXGBE_RXDCTL_VME);
     for ( i = 0; i < 10; i++ ) {
         busywait(1);
         m32 = rd32(rxring->mmio, IXGBE_REG_RXDCTL(rxring->idx));
@@ -629,7 +721,7 @@ ixgbe_rx_refill(struct ixgbe_rx_ring *rxring, void *pkt, void *hdr)
     }
     rxdesc = &rxring->descs[rxring->tail];
     rxdesc->read.pkt_addr = (uint64_t)pkt;
-    rxdesc->read.hdr_addr = 0;
+    rxdesc->read.hdr_addr = rxring->hbufs_pa + IXGBE_RX_HDRSZ * rxring->tail;
     rxring->bufs[rxring->tail] = hdr;
     rxring->tail = new_tail;
 
@@ -643,9 +735,20 @@ ixgbe_rx_commit(struct ixgbe_rx_ring *rxring)
     wr32(rxring->mmio, IXGBE_REG_RDT(rxring->idx), rxring->tail);
 }
 
+/*
+ * Dequeue a packet; *vlan is set to the TCI of the stripped 802.1Q tag, or 0
+ * for an untagged packet, and *csum to the checksum status (RX_CSUM_*).  The
+ * returned length includes the *hlen bytes of the headers split into *hbuf
+ * (0 if not split), which precede the payload in the packet buffer.  The
+ * header buffer is valid until the descriptor is refilled.
+ */
 static __inline__ int
-ixgbe_rx_dequeue(struct ixgbe_rx_ring *rxring, void **hdr)
+ixgbe_rx_dequeue(struct ixgbe_rx_ring *rxring, void **hdr, uint16_t *vlan,
+                 uint8_t *csum, void **hbuf, uint16_t *hlen)
 {
+    union ixgbe_rx_desc *rxdesc;
+    uint32_t info0;
+    uint32_t staterr;
     uint16_t head;
     int len;
 
@@ -658,12 +761,114 @@ ixgbe_rx_dequeue(struct ixgbe_rx_ring *rxring, void **hdr)
     }
     head = rxring->soft_head + 1 < rxring->len ? rxring->soft_head + 1 : 0;
     *hdr = rxring->bufs[rxring->soft_head];
-    len = rxring->descs[rxring->soft_head].wb.length;
+    rxdesc = &rxring->descs[rxring->soft_head];
+    len = rxdesc->wb.length;
+    info0 = rxdesc->wb.info0;
+    staterr = rxdesc->wb.staterr;
+    *hbuf = NULL;
+    *hlen = 0;
+    if ( (info0 & IXGBE_RXD_SPH) && !(staterr & IXGBE_RXD_ERR_HBO) ) {
+        *hlen = (info0 >> IXGBE_RXD_HDRLEN_SHIFT) & IXGBE_RXD_HDRLEN_MASK;
+        *hbuf = rxring->hbufs + IXGBE_RX_HDRSZ * rxring->soft_head;
+        len += *hlen;
+    }
+    *vlan = (staterr & IXGBE_RXD_STAT_VP) ? rxdesc->wb.vlan : 0;
+    *csum = 0;
+    if ( staterr & IXGBE_RXD_STAT_IPCS ) {
+        *csum |= (staterr & IXGBE_RXD_ERR_IPE)
+            ? RX_CSUM_IP_BAD : RX_CSUM_IP_GOOD;
+    }
+    if ( staterr & IXGBE_RXD_STAT_L4CS ) {
+        if ( !(staterr & IXGBE_RXD_ERR_TCPE) ) {
+            *csum |= RX_CSUM_L4_GOOD;
+        } else if ( !(info0 & IXGBE_RXD_PKTTYPE_UDP) ) {
+            /* UDP without checksum (zero) may be reported as an error
+               (82599 erratum), then left unknown */
+            *csum |= RX_CSUM_L4_BAD;
+        }
+    }
     rxring->soft_head = head;
 
     return len;
 }
 
+/*
+ * Get the address of the descriptor to be written back next by the NIC, and
+ * the value it holds until then
+ */
+static __inline__ volatile uint64_t *
+ixgbe_rx_wait_addr(struct ixgbe_rx_ring *rxring, uint64_t *val)
+{
+    /* hdr_addr (the second quadword) holds the header buffer address set on
+       refill and is overwritten by the write-back (with DD set) */
+    *val = rxring->hbufs_pa + IXGBE_RX_HDRSZ * rxring->soft_head;
+    return (volatile uint64_t *)((void *)&rxring->descs[rxring->soft_head]
+                                 + sizeof(uint64_t));
+}
+
+/*
+ * Prefetch the descriptor and the header buffer of the k-th received packet
+ * from the next one to be dequeued; returns the pointer associated with the
+ * packet buffer, or NULL if it has not been received (as far as known)
+ */
+static __inline__ void *
+ixgbe_rx_prefetch(struct ixgbe_rx_ring *rxring, uint16_t k)
+{
+    uint16_t idx;
+    uint16_t avail;
+
+    avail = rxring->head >= rxring->soft_head
+        ? rxring->head - rxring->soft_head
+        : rxring->head + rxring->len - rxring->soft_head;
+    if ( k >= avail ) {
+        return NULL;
+    }
+    idx = rxring->soft_head + k < rxring->len
+        ? rxring->soft_head + k : rxring->soft_head + k - rxring->len;
+    __builtin_prefetch(&rxring->descs[idx]);
+    __builtin_prefetch(rxring->hbufs + IXGBE_RX_HDRSZ * idx);
+
+    return rxring->bufs[idx];
+}
+
+/*
+ * Direct the write-backs of the descriptors and the split headers of an Rx
+ * ring to the cache of the processor (APIC ID) polling it; payloads are left
+ * to memory so that they do not evict the working set
+ */
+static __inline__ void
+ixgbe_rx_set_dca(struct ixgbe_rx_ring *rxring, int cpu)
+{
+    wr32(rxring->mmio, IXGBE_REG_DCA_RXCTRL(rxring->idx),
+         ((uint32_t)cpu << IXGBE_DCA_CPUID_SHIFT)
+         | IXGBE_DCA_RXCTRL_DESC_DCA_EN | IXGBE_DCA_RXCTRL_HEAD_DCA_EN
+         | IXGBE_DCA_RXCTRL_DESC_RRO_EN);
+}
+
+/*
+ * Add (or remove) a VLAN to (from) the VLAN filter
+ */
+static __inline__ void
+ixgbe_set_vlan_filter(struct ixgbe_device *dev, uint16_t vid, int on)
+{
+    uint32_t m32;
+
+    m32 = rd32(dev->mmio, IXGBE_REG_VFTA(vid >> 5));
+    if ( on ) {
+        m32 |= 1 << (vid & 0x1f);
+    } else {
+        m32 &= ~(1 << (vid & 0x1f));
+    }
+    wr32(dev->mmio, IXGBE_REG_VFTA(vid >> 5), m32);
+
+    /* Drop tagged packets of non-member VLANs in hardware, but accept
+       priority-tagged packets (VID 0) */
+    wr32(dev->mmio, IXGBE_REG_VFTA(0),
+         rd32(dev->mmio, IXGBE_REG_VFTA(0)) | 1);
+    wr32(dev->mmio, IXGBE_REG_VLNCTRL,
+         rd32(dev->mmio, IXGBE_REG_VLNCTRL) | IXGBE_VLNCTRL_VFE);
+}
+
 /*
  * Setup Tx port
  */
@@ -727,6 +932,9 @@ ixgbe_setup_tx_ring(struct ixgbe_device *dev, struct ixgbe_tx_ring *txring,
     txring->head = 0;
     txring->soft_head = 0;
     txring->len = qlen;
+    txring->ctx_vlan = 0;
+    txring->ctx_ol_vml = 0;
+    txring->ctx_ol_other = 0;
 
     /* Allocate for descriptors */
     txring->descs = m;
@@ -777,24 +985,160 @@ ixgbe_setup_tx_ring(struct ixgbe_device *dev, struct ixgbe_tx_ring *txring,
     return 0;
 }
 
+/*
+ * Number of the free descriptors of a Tx ring (one is always left empty to
+ * tell a full ring from an empty one)
+ */
+static __inline__ int
+ixgbe_tx_avail(const struct ixgbe_tx_ring *txring)
+{
+    return (txring->soft_head + txring->len - txring->tail - 1) % txring->len;
+}
+
+/*
+ * Prepare a packet (at its virtual address) for the checksum/TSO offloads
+ * requested; the L4 checksum is initialized with the sum of the pseudo
+ * header (without the L4 length for TSO, as the NIC adds the length of each
+ * segment), and the IPv4 checksum with zero
+ */
+static __inline__ void
+ixgbe_tx_prepare(void *pkt, size_t length, const struct tx_offload *ol)
+{
+    struct ip *ip;
+    struct ip6_hdr *ip6;
+    uint8_t *l4;
+    uint32_t l4len;
+    uint16_t sum;
+
+    ip = pkt + ol->l2len;
+    if ( ol->flags & TX_OL_IP_CSUM ) {
+        ip->ip_sum = 0;
+    }
+    if ( ol->flags & TX_OL_TSO ) {
+        /* The lengths of the IP header are set by the NIC per segment */
+        if ( ol->flags & TX_OL_IPV6 ) {
+            ip6 = pkt + ol->l2len;
+            ip6->ip6_plen = 0;
+        } else {
+            ip->ip_len = 0;
+        }
+        l4len = 0;
+    } else {
+        l4len = length - ol->l2len - ol->l3len;
+    }
+    l4 = pkt + ol->l2len + ol->l3len;
+    if ( ol->flags & TX_OL_TCP_CSUM ) {
+        sum = htons(cksum_fold(tx_offload_pseudo(pkt, ol, IPPROTO_TCP,
+                                                 l4len)));
+        memcpy(l4 + TCP_CSUM_OFF, &sum, 2);
+    } else if ( ol->flags & TX_OL_UDP_CSUM ) {
+        sum = htons(cksum_fold(tx_offload_pseudo(pkt, ol, IPPROTO_UDP,
+                                                 l4len)));
+        memcpy(l4 + UDP_CSUM_OFF, &sum, 2);
+    }
+}
+
+/*
+ * Enqueue a packet; a non-zero vlan is the TCI of the 802.1Q tag inserted by
+ * the hardware, and ol is the offload request (or NULL) of the packet prepared
+ * by ixgbe_tx_prepare()
+ */
 static __inline__ int
 ixgbe_tx_enqueue(struct ixgbe_tx_ring *txring, void *pkt, void *hdr,
-                 size_t length)
+                 size_t length, uint16_t vlan, const struct tx_offload *ol)
 {
     union ixgbe_tx_desc *txdesc;
     uint16_t new_tail;
+    uint16_t ctx_tail;
+    uint32_t vml;
+    uint64_t other;
+    uint32_t olinfo;
+    int tso;
 
     new_tail = txring->tail + 1 < txring->len ? txring->tail + 1 : 0;
     if ( new_tail == txring->soft_head ) {
         /* Buffer is full */
         return 0;
     }
+    olinfo = 0;
+    tso = 0;
+    if ( NULL != ol && 0 != ol->flags ) {
+        /* Offload context (index 1) including the tag */
+        vml = ((uint32_t)vlan << 16) | (ol->l2len << IXGBE_TXD_MACLEN_SHIFT)
+            | ol->l3len;
+        other = IXGBE_TXD_DTYP_CTXT | IXGBE_TXD_DEXT;
+        if ( !(ol->flags & TX_OL_IPV6) ) {
+            other |= IXGBE_TXD_TUCMD_IPV4;
+        }
+        if ( ol->flags & TX_OL_TCP_CSUM ) {
+            other |= IXGBE_TXD_TUCMD_L4T_TCP;
+        }
+        other |= (uint64_t)IXGBE_TXD_IDX(IXGBE_CTX_OFFLOAD) << 32;
+        if ( ol->flags & TX_OL_TSO ) {
+            other |= ((uint64_t)ol->l4len << IXGBE_TXD_L4LEN_SHIFT
+                      | (uint64_t)ol->mss << IXGBE_TXD_MSS_SHIFT) << 32;
+            tso = 1;
+        }
+        if ( vml != txring->ctx_ol_vml || other != txring->ctx_ol_other ) {
+            ctx_tail = new_tail;
+            new_tail = ctx_tail + 1 < txring->len ? ctx_tail + 1 : 0;
+            if ( new_tail == txring->soft_head ) {
+                /* Buffer is full */
+                return 0;
+            }
+            txdesc = &txring->descs[txring->tail];
+            txdesc->ctx.vlan_maclen_iplen = vml;
+            txdesc->ctx.fcoef_ipsec_sa_idx = 0;
+            txdesc->ctx.other = other;
+            txring->bufs[txring->tail] = NULL;
+            txring->tail = ctx_tail;
+            txring->ctx_ol_vml = vml;
+            txring->ctx_ol_other = other;
+        }
+        olinfo = IXGBE_TXD_IDX(IXGBE_CTX_OFFLOAD) | IXGBE_TXD_CC;
+        if ( ol->flags & TX_OL_IP_CSUM ) {
+            olinfo |= IXGBE_TXD_POPTS_IXSM;
+        }
+        if ( ol->flags & (TX_OL_TCP_CSUM | TX_OL_UDP_CSUM) ) {
+            olinfo |= IXGBE_TXD_POPTS_TXSM;
+        }
+    } else if ( 0 != vlan && vlan != txring->ctx_vlan ) {
+        /* The tag is changed, then write a context descriptor (index 0)
+           before the data descriptor */
+        ctx_tail = new_tail;
+        new_tail = ctx_tail + 1 < txring->len ? ctx_tail + 1 : 0;
+        if ( new_tail == txring->soft_head ) {
+            /* Buffer is full */
+            return 0;
+        }
+        txdesc = &txring->descs[txring->tail];
+        txdesc->ctx.vlan_maclen_iplen
+            = ((uint32_t)vlan << 16) | (ETHER_HDR_LEN << 9);
+        txdesc->ctx.fcoef_ipsec_sa_idx = 0;
+        txdesc->ctx.other = IXGBE_TXD_DTYP_CTXT | IXGBE_TXD_DEXT;
+        txring->bufs[txring->tail] = NULL;
+        txring->tail = ctx_tail;
+        txring->ctx_vlan = vlan;
+    }
     txdesc = &txring->descs[txring->tail];
     txdesc->data.pkt_addr = (uint64_t)pkt;
     txdesc->data.length = length;
     txdesc->data.dtyp_mac = (3 << 4);
     txdesc->data.dcmd = (1 << 5) | (1 << 3) | (1 << 1) | 1; /* (1<<3): WB */
-    txdesc->data.paylen_popts_cc_idx_sta = ((uint64_t)length << 14);
+    if ( tso ) {
+        /* The payload length excludes the headers replicated */
+        txdesc->data.dcmd |= IXGBE_TXD_DCMD_TSE;
+        txdesc->data.paylen_popts_cc_idx_sta
+            = ((uint64_t)(length - ol->l2len - ol->l3len - ol->l4len) << 14)
+            | olinfo;
+    } else {
+        txdesc->data.paylen_popts_cc_idx_sta
+            = ((uint64_t)length << 14) | olinfo;
+    }
+    if ( 0 != vlan ) {
+        txdesc->data.dcmd |= IXGBE_TXD_DCMD_VLE;
+        txdesc->data.paylen_popts_cc_idx_sta |= IXGBE_TXD_CC;
+    }
     txring->bufs[txring->tail] = hdr;
     txring->tail = new_tail;
 
@@ -808,11 +1152,25 @@ ixgbe_tx_commit(struct ixgbe_tx_ring *txring)
     wr32(txring->mmio, IXGBE_REG_TDT(txring->idx), txring->tail);
 }
 
+/*
+ * Direct the head write-backs of a Tx ring to the cache of the processor
+ * (APIC ID) collecting the transmitted buffers
+ */
+static __inline__ void
+ixgbe_tx_set_dca(struct ixgbe_tx_ring *txring, int cpu)
+{
+    wr32(txring->mmio, IXGBE_REG_DCA_TXCTRL(txring->idx),
+         ((uint32_t)cpu << IXGBE_DCA_CPUID_SHIFT)
+         | IXGBE_DCA_TXCTRL_DESC_DCA_EN | IXGBE_DCA_TXCTRL_DESC_RRO_EN
+         | IXGBE_DCA_TXCTRL_DATA_RRO_EN);
+}
+
 static __inline__ int
 ixgbe_calc_rx_ring_memsize(struct ixgbe_rx_ring *rx, uint16_t qlen)
 {
     (void)rx;
-    return (sizeof(union ixgbe_rx_desc) + sizeof(void *)) * qlen;
+    return (sizeof(union ixgbe_rx_desc) + sizeof(void *) + IXGBE_RX_HDRSZ)
+        * qlen + 64;
 }
 static __inline__ int
 ixgbe_calc_tx_ring_memsize(struct ixgbe_tx_ring *tx, uint16_t qlen)
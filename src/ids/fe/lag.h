@@ -0,0 +1,453 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _LAG_H
+#define _LAG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/ip6.h>
+
+/*
+ * Link aggregation (IEEE 802.1AX, formerly 802.3ad)
+ *
+ * Member links of a link aggregation group (LAG) are bundled behind a logical
+ * port.  Packets are distributed to the links by a hash of the L2, L3 or L4
+ * headers, so that the packets of a flow stay on a link and are never
+ * reordered.  The links are negotiated with the partner by LACP (the Link
+ * Aggregation Control Protocol) in the active mode with the short timeout,
+ * and the collection and the distribution are coupled.
+ *
+ * The LACP state of a link is updated only by the tickful task (on LACPDUs
+ * received and by the timer); the links attached to the aggregator are
+ * selected per LAG by the caller.
+ */
+
+/* Hash policies of the distribution */
+#define LAG_HASH_L2             0       /* MAC addresses and the EtherType */
+#define LAG_HASH_L23            1       /* MAC and IP addresses */
+#define LAG_HASH_L34            2       /* IP addresses and TCP/UDP ports */
+
+/* Slow protocols */
+#define LACP_ETHERTYPE          0x8809
+#define LACP_SUBTYPE_LACP       1
+#define LACP_SUBTYPE_MARKER     2
+
+/* Actor/partner state */
+#define LACP_STATE_ACTIVITY     (1 << 0)
+#define LACP_STATE_TIMEOUT      (1 << 1)        /* Short timeout */
+#define LACP_STATE_AGGREGATION  (1 << 2)
+#define LACP_STATE_SYNC         (1 << 3)
+#define LACP_STATE_COLLECTING   (1 << 4)
+#define LACP_STATE_DISTRIBUTING (1 << 5)
+#define LACP_STATE_DEFAULTED    (1 << 6)
+#define LACP_STATE_EXPIRED      (1 << 7)
+
+/* Length of an LACPDU and a marker PDU (following the Ethernet header) */
+#define LACP_PDU_LEN            110
+/* TLVs */
+#define LACP_TLV_ACTOR          1
+#define LACP_TLV_PARTNER        2
+#define LACP_TLV_COLLECTOR      3
+#define LACP_TLV_INFO_LEN       20
+#define LACP_TLV_COLLECTOR_LEN  16
+#define LACP_TLV_MARKER_INFO    1
+#define LACP_TLV_MARKER_RESP    2
+
+/* Periodic transmission (fast and slow), and the short timeout (in
+   seconds) */
+#define LACP_FAST_PERIODIC      1
+#define LACP_SLOW_PERIODIC      30
+#define LACP_SHORT_TIMEOUT      3
+
+#define LACP_DEFAULT_PRIO       0x8000
+
+/*
+ * Actor or partner information (in host byte order)
+ */
+struct lacp_info {
+    uint16_t sys_prio;
+    uint8_t sys[ETHER_ADDR_LEN];
+    uint16_t key;
+    uint16_t port_prio;
+    uint16_t port;
+    uint8_t state;
+};
+
+/*
+ * Counters of a link
+ */
+struct lacp_stats {
+    uint64_t rx;
+    uint64_t tx;
+    uint64_t errors;
+};
+
+/*
+ * LACP state of a link
+ */
+struct lacp_port {
+    struct lacp_info actor;
+    struct lacp_info partner;
+    /* Attached to the aggregator (set by the caller) */
+    int selected;
+    /* Need to transmit, and the TSC of the last LACPDU received and
+       transmitted */
+    int ntt;
+    uint64_t rx_tsc;
+    uint64_t tx_tsc;
+    struct lacp_stats stats;
+};
+
+/*
+ * Initialize the state of a link (port is a non-zero port number)
+ */
+static __inline__ void
+lacp_port_init(struct lacp_port *lp, const uint8_t *sys, uint16_t key,
+               uint16_t port)
+{
+    memset(lp, 0, sizeof(struct lacp_port));
+    lp->actor.sys_prio = LACP_DEFAULT_PRIO;
+    memcpy(lp->actor.sys, sys, ETHER_ADDR_LEN);
+    lp->actor.key = key;
+    lp->actor.port_prio = LACP_DEFAULT_PRIO;
+    lp->actor.port = port;
+    lp->actor.state = LACP_STATE_ACTIVITY | LACP_STATE_TIMEOUT
+        | LACP_STATE_AGGREGATION | LACP_STATE_DEFAULTED;
+    lp->ntt = 1;
+}
+
+/*
+ * Check if two links are attached to the same partner aggregator
+ */
+static __inline__ int
+lacp_same_partner(const struct lacp_info *a, const struct lacp_info *b)
+{
+    return a->sys_prio == b->sys_prio && a->key == b->key
+        && 0 == memcmp(a->sys, b->sys, ETHER_ADDR_LEN);
+}
+
+/*
+ * Compare the information of a link
+ */
+static __inline__ int
+_lacp_info_eq(const struct lacp_info *a, const struct lacp_info *b)
+{
+    return lacp_same_partner(a, b) && a->port_prio == b->port_prio
+        && a->port == b->port && a->state == b->state;
+}
+
+/*
+ * Decode (encode) the information TLV
+ */
+static __inline__ void
+_lacp_get_info(struct lacp_info *info, const uint8_t *tlv)
+{
+    info->sys_prio = (tlv[2] << 8) | tlv[3];
+    memcpy(info->sys, tlv + 4, ETHER_ADDR_LEN);
+    info->key = (tlv[10] << 8) | tlv[11];
+    info->port_prio = (tlv[12] << 8) | tlv[13];
+    info->port = (tlv[14] << 8) | tlv[15];
+    info->state = tlv[16];
+}
+static __inline__ void
+_lacp_put_info(uint8_t *tlv, int type, const struct lacp_info *info)
+{
+    memset(tlv, 0, LACP_TLV_INFO_LEN);
+    tlv[0] = type;
+    tlv[1] = LACP_TLV_INFO_LEN;
+    tlv[2] = info->sys_prio >> 8;
+    tlv[3] = info->sys_prio;
+    memcpy(tlv + 4, info->sys, ETHER_ADDR_LEN);
+    tlv[10] = info->key >> 8;
+    tlv[11] = info->key;
+    tlv[12] = info->port_prio >> 8;
+    tlv[13] = info->port_prio;
+    tlv[14] = info->port >> 8;
+    tlv[15] = info->port;
+    tlv[16] = info->state;
+}
+
+/*
+ * Process an LACPDU received (the frame including the Ethernet header);
+ * returns 1 if the partner information has changed, 0 if not, or -1 if not a
+ * valid LACPDU
+ */
+static __inline__ int
+lacp_input(struct lacp_port *lp, const uint8_t *frame, int len, uint64_t tsc)
+{
+    const uint8_t *pdu;
+    struct lacp_info actor;
+    struct lacp_info partner;
+    int changed;
+
+    pdu = frame + sizeof(struct ether_header);
+    if ( len < (int)sizeof(struct ether_header) + LACP_PDU_LEN
+         || LACP_SUBTYPE_LACP != pdu[0] || pdu[1] < 1
+         || LACP_TLV_ACTOR != pdu[2] || LACP_TLV_INFO_LEN != pdu[3]
+         || LACP_TLV_PARTNER != pdu[22] || LACP_TLV_INFO_LEN != pdu[23] ) {
+        lp->stats.errors++;
+        return -1;
+    }
+    lp->stats.rx++;
+    _lacp_get_info(&actor, pdu + 2);
+    _lacp_get_info(&partner, pdu + 22);
+
+    /* Record the partner (the actor of the PDU) */
+    changed = !_lacp_info_eq(&lp->partner, &actor)
+        || (lp->actor.state & LACP_STATE_DEFAULTED);
+    lp->partner = actor;
+    lp->actor.state &= ~(LACP_STATE_DEFAULTED | LACP_STATE_EXPIRED);
+    lp->rx_tsc = tsc;
+
+    /* Tell the partner if its view of this link is out of date */
+    if ( !_lacp_info_eq(&partner, &lp->actor) ) {
+        lp->ntt = 1;
+    }
+
+    return changed;
+}
+
+/*
+ * Update the state of the link at the selection, and attach (detach) it to
+ * (from) the aggregator; returns 1 if the actor state has changed
+ */
+static __inline__ int
+lacp_mux(struct lacp_port *lp, int selected)
+{
+    uint8_t state;
+
+    lp->selected = selected;
+    state = lp->actor.state
+        & ~(LACP_STATE_SYNC | LACP_STATE_COLLECTING | LACP_STATE_DISTRIBUTING);
+    if ( selected ) {
+        state |= LACP_STATE_SYNC;
+        if ( lp->partner.state & LACP_STATE_SYNC ) {
+            /* Coupled control of the collection and the distribution */
+            state |= LACP_STATE_COLLECTING | LACP_STATE_DISTRIBUTING;
+        }
+    }
+    if ( state == lp->actor.state ) {
+        return 0;
+    }
+    lp->actor.state = state;
+    lp->ntt = 1;
+
+    return 1;
+}
+
+/*
+ * Check if the link collects and distributes frames
+ */
+static __inline__ int
+lacp_collecting(const struct lacp_port *lp)
+{
+    return (lp->actor.state & LACP_STATE_COLLECTING) ? 1 : 0;
+}
+static __inline__ int
+lacp_distributing(const struct lacp_port *lp)
+{
+    return (lp->actor.state & LACP_STATE_DISTRIBUTING)
+        && (lp->partner.state & LACP_STATE_COLLECTING);
+}
+
+/*
+ * Run the timers of a link (hz: the TSC frequency); returns 1 if the partner
+ * information has expired
+ */
+static __inline__ int
+lacp_timer(struct lacp_port *lp, uint64_t tsc, uint64_t hz)
+{
+    uint64_t period;
+    int expired;
+
+    expired = 0;
+    if ( !(lp->actor.state & LACP_STATE_DEFAULTED)
+         && tsc - lp->rx_tsc >= LACP_SHORT_TIMEOUT * hz ) {
+        /* No LACPDU received; fall back to the defaulted partner (none) */
+        memset(&lp->partner, 0, sizeof(struct lacp_info));
+        lp->actor.state |= LACP_STATE_DEFAULTED;
+        expired = 1;
+    }
+
+    /* Periodic transmission at the rate requested by the partner (fast
+       until a partner is found) */
+    period = (lp->partner.state & LACP_STATE_TIMEOUT)
+        || (lp->actor.state & LACP_STATE_DEFAULTED)
+        ? LACP_FAST_PERIODIC : LACP_SLOW_PERIODIC;
+    if ( tsc - lp->tx_tsc >= period * hz ) {
+        lp->ntt = 1;
+    }
+
+    return expired;
+}
+
+/*
+ * Build an LACPDU of the link into frame (with the source MAC address);
+ * returns the length of the frame
+ */
+static __inline__ int
+lacp_build(struct lacp_port *lp, uint8_t *frame, const uint8_t *src)
+{
+    static const uint8_t dst[ETHER_ADDR_LEN]
+        = { 0x01, 0x80, 0xc2, 0x00, 0x00, 0x02 };
+    struct ether_header *eth;
+    uint8_t *pdu;
+
+    eth = (struct ether_header *)frame;
+    memcpy(eth->ether_dhost, dst, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, src, ETHER_ADDR_LEN);
+    eth->ether_type = htons(LACP_ETHERTYPE);
+
+    pdu = frame + sizeof(struct ether_header);
+    memset(pdu, 0, LACP_PDU_LEN);
+    pdu[0] = LACP_SUBTYPE_LACP;
+    pdu[1] = 1;
+    _lacp_put_info(pdu + 2, LACP_TLV_ACTOR, &lp->actor);
+    _lacp_put_info(pdu + 22, LACP_TLV_PARTNER, &lp->partner);
+    pdu[42] = LACP_TLV_COLLECTOR;
+    pdu[43] = LACP_TLV_COLLECTOR_LEN;
+    /* Terminator and reserved octets are zero */
+
+    lp->ntt = 0;
+    lp->stats.tx++;
+
+    return sizeof(struct ether_header) + LACP_PDU_LEN;
+}
+
+/*
+ * Turn a marker PDU received (the frame including the Ethernet header) into
+ * the marker response in place (with the source MAC address); returns the
+ * length of the response, or -1 if not a marker PDU
+ */
+static __inline__ int
+lacp_marker_response(uint8_t *frame, int len, const uint8_t *src)
+{
+    struct ether_header *eth;
+    uint8_t *pdu;
+
+    pdu = frame + sizeof(struct ether_header);
+    if ( len < (int)sizeof(struct ether_header) + LACP_PDU_LEN
+         || LACP_SUBTYPE_MARKER != pdu[0]
+         || LACP_TLV_MARKER_INFO != pdu[2] ) {
+        return -1;
+    }
+    eth = (struct ether_header *)frame;
+    memcpy(eth->ether_shost, src, ETHER_ADDR_LEN);
+    pdu[2] = LACP_TLV_MARKER_RESP;
+
+    return sizeof(struct ether_header) + LACP_PDU_LEN;
+}
+
+/*
+ * Mix a word into the hash
+ */
+static __inline__ uint64_t
+_lag_mix(uint64_t h, uint64_t w)
+{
+    return (h ^ w) * 0x9e3779b97f4a7c15ULL;
+}
+
+/*
+ * Hash of the headers of a frame for the distribution; the frames of a flow
+ * have the same hash.  Non-IP frames (and IP fragments for the L4 ports) fall
+ * back to the lower layers.
+ */
+static __inline__ uint32_t
+lag_hash(const uint8_t *pkt, int len, int policy)
+{
+    const struct ether_header *eth;
+    const struct ip *ip;
+    const struct ip6_hdr *ip6;
+    const uint8_t *l4;
+    uint64_t h;
+    uint64_t w;
+    uint32_t ports;
+    int proto;
+    int l3;
+
+    eth = (const struct ether_header *)pkt;
+    h = 0;
+    l3 = 0;
+    l4 = NULL;
+    proto = 0;
+    if ( LAG_HASH_L2 != policy ) {
+        if ( ETHERTYPE_IP == ntohs(eth->ether_type)
+             && len >= (int)(sizeof(struct ether_header)
+                             + sizeof(struct ip)) ) {
+            ip = (const struct ip *)(pkt + sizeof(struct ether_header));
+            /* Source and destination addresses */
+            memcpy(&w, &ip->ip_src, 8);
+            h = _lag_mix(h, w);
+            proto = ip->ip_p;
+            if ( 0 == (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) ) {
+                l4 = (const uint8_t *)ip + IP_VHL_HL(ip->ip_vhl) * 4;
+            }
+            l3 = 1;
+        } else if ( ETHERTYPE_IPV6 == ntohs(eth->ether_type)
+                    && len >= (int)(sizeof(struct ether_header)
+                                    + sizeof(struct ip6_hdr)) ) {
+            ip6 = (const struct ip6_hdr *)(pkt + sizeof(struct ether_header));
+            memcpy(&w, ip6->ip6_src, 8);
+            h = _lag_mix(h, w);
+            memcpy(&w, ip6->ip6_src + 8, 8);
+            h = _lag_mix(h, w);
+            memcpy(&w, ip6->ip6_dst, 8);
+            h = _lag_mix(h, w);
+            memcpy(&w, ip6->ip6_dst + 8, 8);
+            h = _lag_mix(h, w);
+            /* Extension headers are not followed */
+            proto = ip6->ip6_nxt;
+            l4 = (const uint8_t *)ip6 + sizeof(struct ip6_hdr);
+            l3 = 1;
+        }
+    }
+    if ( l3 && LAG_HASH_L34 == policy && NULL != l4
+         && (IPPROTO_TCP == proto || IPPROTO_UDP == proto)
+         && l4 + 4 <= pkt + len ) {
+        /* Source and destination ports */
+        memcpy(&ports, l4, 4);
+        h = _lag_mix(h, ports ^ ((uint64_t)proto << 32));
+    } else if ( !l3 || LAG_HASH_L23 == policy ) {
+        /* MAC addresses and the EtherType */
+        memcpy(&w, pkt, 8);
+        h = _lag_mix(h, w);
+        memcpy(&w, pkt + 6, 8);
+        h = _lag_mix(h, w);
+    }
+
+    return h ^ (h >> 32);
+}
+
+#endif /* _LAG_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,333 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _MEMDRV_H
+#define _MEMDRV_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The memory-backed device takes the vendor ID of absent PCI functions so that
+   it is never enumerated on real hardware; it is supplied by host-side
+   harnesses (see tests/bench-fe.c) */
+#define MEMDRV_VENDOR_ID        0xffff
+#define MEMDRV_DEVICE_ID        0x0001
+
+/* # of Tx queues (enough for every exclusive processor to own one) */
+#define MEMDRV_NTXQ             64
+
+/*
+ * Frame of a trace replayed at the Rx rings
+ */
+struct memdrv_frame {
+    const uint8_t *data;
+    uint16_t len;
+    /* TCI of the 802.1Q tag stripped by the (emulated) hardware, or 0 */
+    uint16_t vlan;
+};
+
+/*
+ * Rx ring buffer; a frame of the trace is copied into the buffer at the head
+ * on every dequeue
+ */
+struct memdrv_rx_ring {
+    struct memdrv_device *dev;
+    void **pkts;
+    void **bufs;
+    uint16_t tail;
+    uint16_t head;
+    uint16_t len;
+    /* Queue index */
+    uint16_t idx;
+    /* Next frame of the trace, and # of frames left to be replayed */
+    uint64_t cursor;
+    volatile uint64_t budget;
+};
+
+/*
+ * Tx ring buffer; frames are transmitted (counted and discarded) when the
+ * tail is committed
+ */
+struct memdrv_tx_ring {
+    struct memdrv_device *dev;
+    void **bufs;
+    uint16_t tail;
+    uint16_t head;
+    uint16_t done;
+    uint16_t len;
+    /* Queue index */
+    uint16_t idx;
+    /* Statistics (written only by the owner task) */
+    volatile uint64_t npkts;
+    volatile uint64_t nbytes;
+    uint64_t pending_bytes;
+};
+
+/*
+ * Memory-backed device
+ */
+struct memdrv_device {
+    uint8_t macaddr[6];
+    /* Trace */
+    const struct memdrv_frame *frames;
+    uint64_t nframes;
+};
+
+/*
+ * Check if the device is the memory-backed device
+ */
+static __inline__ int
+memdrv_is_memdrv(uint16_t vendor_id, uint16_t device_id)
+{
+    return MEMDRV_VENDOR_ID == vendor_id && MEMDRV_DEVICE_ID == device_id;
+}
+
+/*
+ * Initialize a memory-backed device; the locally administered MAC address is
+ * derived from the PCI location
+ */
+static __inline__ struct memdrv_device *
+memdrv_init(uint16_t bus, uint16_t slot, uint16_t func)
+{
+    struct memdrv_device *dev;
+
+    dev = malloc(sizeof(struct memdrv_device));
+    if ( NULL == dev ) {
+        return NULL;
+    }
+    dev->macaddr[0] = 0x02;
+    dev->macaddr[1] = 0x00;
+    dev->macaddr[2] = 0x00;
+    dev->macaddr[3] = bus;
+    dev->macaddr[4] = slot;
+    dev->macaddr[5] = func;
+    dev->frames = NULL;
+    dev->nframes = 0;
+
+    return dev;
+}
+
+/*
+ * Set the trace replayed at the Rx rings of a device
+ */
+static __inline__ void
+memdrv_set_trace(struct memdrv_device *dev, const struct memdrv_frame *frames,
+                 uint64_t n)
+{
+    dev->frames = frames;
+    dev->nframes = n;
+}
+
+/*
+ * Get the maximum number of Tx queues
+ */
+static __inline__ int
+memdrv_max_tx_queues(struct memdrv_device *dev)
+{
+    (void)dev;
+    return MEMDRV_NTXQ;
+}
+
+/*
+ * Calculate the memory size for an Rx ring
+ */
+static __inline__ int
+memdrv_calc_rx_ring_memsize(struct memdrv_rx_ring *rxring, uint16_t qlen)
+{
+    (void)rxring;
+    return sizeof(void *) * 2 * qlen;
+}
+
+/*
+ * Calculate the memory size for a Tx ring
+ */
+static __inline__ int
+memdrv_calc_tx_ring_memsize(struct memdrv_tx_ring *txring, uint16_t qlen)
+{
+    (void)txring;
+    return sizeof(void *) * qlen;
+}
+
+/*
+ * Setup an Rx ring
+ */
+static __inline__ int
+memdrv_setup_rx_ring(struct memdrv_device *dev, struct memdrv_rx_ring *rxring,
+                     int idx, void *m, uint16_t qlen)
+{
+    rxring->dev = dev;
+    rxring->pkts = m;
+    rxring->bufs = m + sizeof(void *) * qlen;
+    rxring->tail = 0;
+    rxring->head = 0;
+    rxring->len = qlen;
+    rxring->idx = idx;
+    rxring->cursor = 0;
+    rxring->budget = 0;
+
+    return 0;
+}
+
+/*
+ * Setup a Tx ring
+ */
+static __inline__ int
+memdrv_setup_tx_ring(struct memdrv_device *dev, struct memdrv_tx_ring *txring,
+                     int idx, void *m, uint16_t qlen)
+{
+    txring->dev = dev;
+    txring->bufs = m;
+    txring->tail = 0;
+    txring->head = 0;
+    txring->done = 0;
+    txring->len = qlen;
+    txring->idx = idx;
+    txring->npkts = 0;
+    txring->nbytes = 0;
+    txring->pending_bytes = 0;
+
+    return 0;
+}
+
+/*
+ * Replay n more frames of the trace at an Rx ring
+ */
+static __inline__ void
+memdrv_rx_replay(struct memdrv_rx_ring *rxring, uint64_t n)
+{
+    __sync_fetch_and_add(&rxring->budget, n);
+}
+
+/*
+ * Attach a buffer (virtual address of the packet) to an Rx ring
+ */
+static __inline__ int
+memdrv_rx_refill(struct memdrv_rx_ring *rxring, void *pkt, void *hdr)
+{
+    uint16_t new_tail;
+
+    new_tail = rxring->tail + 1 < rxring->len ? rxring->tail + 1 : 0;
+    if ( new_tail == rxring->head ) {
+        /* Buffer is full */
+        return 0;
+    }
+    rxring->pkts[rxring->tail] = pkt;
+    rxring->bufs[rxring->tail] = hdr;
+    rxring->tail = new_tail;
+
+    return 1;
+}
+
+/*
+ * Receive the next frame of the trace into the buffer at the head; returns
+ * the length of the frame, or 0 if the budget is exhausted or no buffer is
+ * attached
+ */
+static __inline__ int
+memdrv_rx_dequeue(struct memdrv_rx_ring *rxring, void **hdr, uint16_t *vlan)
+{
+    const struct memdrv_frame *frame;
+
+    if ( rxring->head == rxring->tail || 0 == rxring->budget
+         || 0 == rxring->dev->nframes ) {
+        return 0;
+    }
+    frame = &rxring->dev->frames[rxring->cursor];
+    rxring->cursor = rxring->cursor + 1 < rxring->dev->nframes
+        ? rxring->cursor + 1 : 0;
+    __sync_fetch_and_sub(&rxring->budget, 1);
+
+    memcpy(rxring->pkts[rxring->head], frame->data, frame->len);
+    *hdr = rxring->bufs[rxring->head];
+    *vlan = frame->vlan;
+    rxring->head = rxring->head + 1 < rxring->len ? rxring->head + 1 : 0;
+
+    return frame->len;
+}
+
+/*
+ * Enqueue a frame to a Tx ring
+ */
+static __inline__ int
+memdrv_tx_enqueue(struct memdrv_tx_ring *txring, void *pkt, void *hdr,
+                  uint16_t length, uint16_t vlan)
+{
+    uint16_t new_tail;
+
+    (void)pkt;
+    (void)vlan;
+    new_tail = txring->tail + 1 < txring->len ? txring->tail + 1 : 0;
+    if ( new_tail == txring->head ) {
+        /* Buffer is full */
+        return 0;
+    }
+    txring->bufs[txring->tail] = hdr;
+    txring->tail = new_tail;
+    txring->pending_bytes += length;
+
+    return 1;
+}
+
+/*
+ * Transmit the frames enqueued so far
+ */
+static __inline__ void
+memdrv_tx_commit(struct memdrv_tx_ring *txring)
+{
+    uint16_t n;
+
+    n = txring->tail >= txring->done ? txring->tail - txring->done
+        : txring->len - txring->done + txring->tail;
+    txring->npkts += n;
+    txring->nbytes += txring->pending_bytes;
+    txring->pending_bytes = 0;
+    txring->done = txring->tail;
+}
+
+/*
+ * Collect a buffer of a transmitted frame
+ */
+static __inline__ int
+memdrv_collect_buffer(struct memdrv_tx_ring *txring, void **hdr)
+{
+    if ( txring->head == txring->done ) {
+        /* Not transmitted */
+        return 0;
+    }
+    *hdr = txring->bufs[txring->head];
+    txring->head = txring->head + 1 < txring->len ? txring->head + 1 : 0;
+
+    return 1;
+}
+
+#endif /* _MEMDRV_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
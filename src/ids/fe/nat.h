@@ -0,0 +1,520 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _NAT_H
+#define _NAT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+
+/*
+ * NAT44 (NAPT)
+ *
+ * The external port range is split into blocks, one per exclusive task, so
+ * that each task allocates ports from its own block without any lock.  A
+ * mapping is stored in the slot of its external port in the shard owning the
+ * port, and is found by the inside endpoint through a hash index local to the
+ * shard.  Mappings are endpoint-independent: returning packets from any
+ * remote endpoint are translated.
+ *
+ * Only the owner task writes the mappings of its shard.  Returning packets may
+ * be received by another task, which reads the slot of the destination port
+ * under the sequence counter of the mapping (odd while it is updated).
+ *
+ * Checksums are updated incrementally (RFC 1624).
+ */
+
+#define NAT_PROTOS              3
+#define NAT_PROTO_TCP           0
+#define NAT_PROTO_UDP           1
+#define NAT_PROTO_ICMP          2
+/* # of mappings scanned for expiry per call of nat_expire() */
+#define NAT_EXPIRE_BUDGET       16
+
+/* Timeouts (in ticks of ct_tick()) */
+#define NAT_TIMEOUT_TCP         4096
+#define NAT_TIMEOUT_UDP         512
+#define NAT_TIMEOUT_ICMP        128
+
+/* ICMP echo */
+#define NAT_ICMP_ECHOREPLY      0
+#define NAT_ICMP_ECHO           8
+
+/*
+ * Mapping (the slot of an external port)
+ */
+struct nat_map {
+    volatile uint32_t seq;
+    /* Inside address and port (network byte order) */
+    uint32_t iaddr;
+    uint16_t iport;
+    /* Non-zero if in use */
+    uint8_t used;
+    uint8_t rsvd;
+    /* Tick of the last packet */
+    volatile uint32_t last;
+};
+
+/*
+ * Shard of an exclusive task
+ */
+struct nat_shard {
+    /* First external port of the block and the # of ports (host byte
+       order) */
+    uint16_t base;
+    uint16_t nports;
+    /* Mappings (NAT_PROTOS * nports) */
+    struct nat_map *maps;
+    /* Hash index of the inside endpoints (slot of the mapping + 1, or 0) */
+    uint32_t *index;
+    uint32_t isize;
+    /* Stacks of free ports (offsets in the block) */
+    uint16_t *free[NAT_PROTOS];
+    uint32_t nfree[NAT_PROTOS];
+    /* Clock hand of the expiry scan */
+    uint32_t hand;
+
+    /* Statistics */
+    uint64_t translated;
+    uint64_t exhausted;
+    uint64_t drops;
+};
+
+/*
+ * Configuration
+ */
+struct nat {
+    /* External address, and the inside prefix (network byte order) */
+    uint32_t eaddr;
+    uint32_t prefix;
+    uint32_t mask;
+    /* External port range and the block size per shard (host byte order) */
+    uint16_t port_lo;
+    uint16_t blk;
+    int nshards;
+    struct nat_shard **shards;
+};
+
+/*
+ * Index of the protocol, or -1 if not translated
+ */
+static __inline__ int
+_nat_proto(uint8_t p)
+{
+    switch ( p ) {
+    case IPPROTO_TCP:
+        return NAT_PROTO_TCP;
+    case IPPROTO_UDP:
+        return NAT_PROTO_UDP;
+    case IPPROTO_ICMP:
+        return NAT_PROTO_ICMP;
+    default:
+        ;
+    }
+
+    return -1;
+}
+
+/*
+ * Size of the memory of a shard of nports ports
+ */
+static __inline__ size_t
+nat_shard_memsize(uint16_t nports)
+{
+    size_t isize;
+
+    for ( isize = 1; isize < (size_t)NAT_PROTOS * nports * 2; isize <<= 1 ) {
+    }
+
+    return sizeof(struct nat_shard)
+        + sizeof(struct nat_map) * NAT_PROTOS * nports
+        + sizeof(uint32_t) * isize
+        + sizeof(uint16_t) * NAT_PROTOS * nports;
+}
+
+/*
+ * Initialize a shard in the memory of nat_shard_memsize(nports)
+ */
+static __inline__ struct nat_shard *
+nat_shard_init(void *mem, uint16_t base, uint16_t nports)
+{
+    struct nat_shard *s;
+    ssize_t i;
+    int p;
+
+    s = mem;
+    s->base = base;
+    s->nports = nports;
+    s->maps = mem + sizeof(struct nat_shard);
+    for ( s->isize = 1; s->isize < (uint32_t)NAT_PROTOS * nports * 2;
+          s->isize <<= 1 ) {
+    }
+    s->index = (void *)(s->maps + NAT_PROTOS * nports);
+    memset(s->maps, 0, sizeof(struct nat_map) * NAT_PROTOS * nports);
+    memset(s->index, 0, sizeof(uint32_t) * s->isize);
+    for ( p = 0; p < NAT_PROTOS; p++ ) {
+        s->free[p] = (uint16_t *)(s->index + s->isize) + p * nports;
+        for ( i = 0; i < nports; i++ ) {
+            s->free[p][i] = nports - 1 - i;
+        }
+        s->nfree[p] = nports;
+    }
+    s->hand = 0;
+    s->translated = 0;
+    s->exhausted = 0;
+    s->drops = 0;
+
+    return s;
+}
+
+/*
+ * Hash of an inside endpoint
+ */
+static __inline__ uint32_t
+_nat_hash(int p, uint32_t addr, uint16_t port)
+{
+    uint64_t h;
+
+    h = ((uint64_t)addr << 32) | ((uint32_t)port << 8) | p;
+    h *= 0x9e3779b97f4a7c15ULL;
+
+    return h >> 32;
+}
+
+/*
+ * Look up the slot of the mapping of an inside endpoint (owner only); returns
+ * the position in the index
+ */
+static __inline__ uint32_t
+_nat_index_lookup(struct nat_shard *s, int p, uint32_t addr, uint16_t port,
+                  uint32_t *slot)
+{
+    struct nat_map *m;
+    uint32_t i;
+
+    i = _nat_hash(p, addr, port) & (s->isize - 1);
+    while ( 0 != s->index[i] ) {
+        m = &s->maps[s->index[i] - 1];
+        if ( (s->index[i] - 1) / s->nports == (uint32_t)p && m->iaddr == addr
+             && m->iport == port ) {
+            *slot = s->index[i] - 1;
+            return i;
+        }
+        i = (i + 1) & (s->isize - 1);
+    }
+    *slot = 0xffffffffU;
+
+    return i;
+}
+
+/*
+ * Delete the index entry at i by shifting the following entries back
+ */
+static __inline__ void
+_nat_index_delete(struct nat_shard *s, uint32_t i)
+{
+    struct nat_map *m;
+    uint32_t mask;
+    uint32_t j;
+    uint32_t home;
+
+    mask = s->isize - 1;
+    j = i;
+    for ( ;; ) {
+        j = (j + 1) & mask;
+        if ( 0 == s->index[j] ) {
+            break;
+        }
+        m = &s->maps[s->index[j] - 1];
+        home = _nat_hash((s->index[j] - 1) / s->nports, m->iaddr, m->iport)
+            & mask;
+        if ( ((j - home) & mask) < ((j - i) & mask) ) {
+            continue;
+        }
+        s->index[i] = s->index[j];
+        i = j;
+    }
+    s->index[i] = 0;
+}
+
+/*
+ * Incremental checksum update of a 16-bit word (RFC 1624, Eqn. 3)
+ */
+static __inline__ uint16_t
+nat_cksum_adjust(uint16_t sum, uint16_t old, uint16_t new)
+{
+    uint32_t s;
+
+    s = (uint16_t)~sum + (uint16_t)~old + new;
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+
+    return ~s;
+}
+
+/*
+ * Incremental checksum update of a 32-bit word
+ */
+static __inline__ uint16_t
+nat_cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new)
+{
+    sum = nat_cksum_adjust(sum, old >> 16, new >> 16);
+
+    return nat_cksum_adjust(sum, old & 0xffff, new & 0xffff);
+}
+
+/*
+ * Rewrite the address and the port (ICMP echo identifier) of a packet, and
+ * update the checksums; src selects the source or the destination
+ */
+static __inline__ void
+_nat_rewrite(struct ip *ip, uint8_t *l4, int p, int src, uint32_t addr,
+             uint16_t port)
+{
+    uint32_t *ap;
+    uint16_t *pp;
+    uint16_t *cp;
+    uint16_t c;
+
+    ap = (uint32_t *)((uint8_t *)ip + (src ? 12 : 16));
+    switch ( p ) {
+    case NAT_PROTO_TCP:
+        pp = (uint16_t *)(l4 + (src ? 0 : 2));
+        cp = (uint16_t *)(l4 + 16);
+        break;
+    case NAT_PROTO_UDP:
+        pp = (uint16_t *)(l4 + (src ? 0 : 2));
+        cp = (uint16_t *)(l4 + 6);
+        break;
+    default:
+        /* ICMP checksum does not cover the pseudo header */
+        pp = (uint16_t *)(l4 + 4);
+        cp = (uint16_t *)(l4 + 2);
+    }
+
+    /* Transport checksum (zero for UDP without checksum) */
+    memcpy(&c, cp, 2);
+    if ( NAT_PROTO_UDP != p || 0 != c ) {
+        if ( NAT_PROTO_ICMP != p ) {
+            c = nat_cksum_adjust32(c, *ap, addr);
+        }
+        c = nat_cksum_adjust(c, *pp, port);
+        if ( NAT_PROTO_UDP == p && 0 == c ) {
+            c = 0xffff;
+        }
+        memcpy(cp, &c, 2);
+    }
+    *pp = port;
+
+    /* IP header checksum */
+    ip->ip_sum = nat_cksum_adjust32(ip->ip_sum, *ap, addr);
+    *ap = addr;
+}
+
+/*
+ * Locate the transport header of a packet to be translated; returns the index
+ * of the protocol, or -1
+ */
+static __inline__ int
+_nat_l4(struct ip *ip, const void *end, uint8_t **l4)
+{
+    int p;
+
+    p = _nat_proto(ip->ip_p);
+    if ( p < 0 || (ntohs(ip->ip_off) & IP_OFFMASK) ) {
+        /* Not translatable, or a non-first fragment */
+        return -1;
+    }
+    *l4 = (uint8_t *)ip + IP_VHL_HL(ip->ip_vhl) * 4;
+    if ( (void *)*l4 + (NAT_PROTO_TCP == p ? 18 : 8) > end ) {
+        return -1;
+    }
+    if ( NAT_PROTO_ICMP == p && NAT_ICMP_ECHO != (*l4)[0]
+         && NAT_ICMP_ECHOREPLY != (*l4)[0] ) {
+        /* Only echo is translated */
+        return -1;
+    }
+
+    return p;
+}
+
+/*
+ * Translate an outbound packet (inside source) by the shard of the task;
+ * returns -1 if the packet is to be dropped
+ */
+static __inline__ int
+nat_outbound(struct nat *nat, struct nat_shard *s, struct ip *ip,
+             const void *end, uint32_t tick)
+{
+    struct nat_map *m;
+    uint8_t *l4;
+    uint32_t slot;
+    uint32_t i;
+    uint16_t iport;
+    int p;
+
+    p = _nat_l4(ip, end, &l4);
+    if ( p < 0 ) {
+        s->drops++;
+        return -1;
+    }
+    memcpy(&iport, l4 + (NAT_PROTO_ICMP == p ? 4 : 0), 2);
+
+    i = _nat_index_lookup(s, p, ip->ip_src, iport, &slot);
+    if ( 0xffffffffU == slot ) {
+        /* Allocate a port from the block of this task */
+        if ( 0 == s->nfree[p] ) {
+            s->exhausted++;
+            return -1;
+        }
+        slot = p * s->nports + s->free[p][--s->nfree[p]];
+        m = &s->maps[slot];
+        m->seq++;
+        __sync_synchronize();
+        m->iaddr = ip->ip_src;
+        m->iport = iport;
+        m->used = 1;
+        m->last = tick;
+        __sync_synchronize();
+        m->seq++;
+        s->index[i] = slot + 1;
+    }
+    m = &s->maps[slot];
+    m->last = tick;
+
+    _nat_rewrite(ip, l4, p, 1, nat->eaddr,
+                 htons(s->base + slot % s->nports));
+    s->translated++;
+
+    return 0;
+}
+
+/*
+ * Translate an inbound packet (to the external address) by the shard owning
+ * the destination port, which may be of another task; returns -1 if the
+ * packet is to be dropped
+ */
+static __inline__ int
+nat_inbound(struct nat *nat, struct ip *ip, const void *end, uint32_t tick)
+{
+    struct nat_shard *s;
+    struct nat_map *m;
+    uint8_t *l4;
+    uint16_t eport;
+    uint32_t seq;
+    uint32_t iaddr;
+    uint16_t iport;
+    uint8_t used;
+    int k;
+    int p;
+
+    p = _nat_l4(ip, end, &l4);
+    if ( p < 0 ) {
+        return -1;
+    }
+    memcpy(&eport, l4 + (NAT_PROTO_ICMP == p ? 4 : 2), 2);
+    eport = ntohs(eport);
+    if ( eport < nat->port_lo ) {
+        return -1;
+    }
+    k = (eport - nat->port_lo) / nat->blk;
+    if ( k >= nat->nshards ) {
+        return -1;
+    }
+    s = nat->shards[k];
+    if ( eport - s->base >= s->nports ) {
+        return -1;
+    }
+    m = &s->maps[p * s->nports + eport - s->base];
+
+    /* Read the mapping consistently (loads are not reordered with other
+       loads on x86) */
+    do {
+        seq = m->seq;
+        __asm__ __volatile__ ("" ::: "memory");
+        used = m->used;
+        iaddr = m->iaddr;
+        iport = m->iport;
+        __asm__ __volatile__ ("" ::: "memory");
+    } while ( (seq & 1) || seq != m->seq );
+    if ( !used ) {
+        return -1;
+    }
+    m->last = tick;
+
+    _nat_rewrite(ip, l4, p, 0, iaddr, iport);
+
+    return 0;
+}
+
+/*
+ * Release idle mappings of the shard, scanning a few slots per call (owner
+ * only)
+ */
+static __inline__ void
+nat_expire(struct nat_shard *s, uint32_t tick)
+{
+    static const uint32_t timeouts[NAT_PROTOS]
+        = { NAT_TIMEOUT_TCP, NAT_TIMEOUT_UDP, NAT_TIMEOUT_ICMP };
+    struct nat_map *m;
+    uint32_t slot;
+    uint32_t found;
+    uint32_t i;
+    int budget;
+    int p;
+
+    for ( budget = 0; budget < NAT_EXPIRE_BUDGET; budget++ ) {
+        slot = s->hand;
+        s->hand = s->hand + 1 < (uint32_t)NAT_PROTOS * s->nports
+            ? s->hand + 1 : 0;
+        m = &s->maps[slot];
+        p = slot / s->nports;
+        if ( !m->used || (int32_t)(tick - m->last) < (int32_t)timeouts[p] ) {
+            continue;
+        }
+        i = _nat_index_lookup(s, p, m->iaddr, m->iport, &found);
+        if ( found == slot ) {
+            _nat_index_delete(s, i);
+        }
+        m->seq++;
+        __sync_synchronize();
+        m->used = 0;
+        __sync_synchronize();
+        m->seq++;
+        s->free[p][s->nfree[p]++] = slot % s->nports;
+    }
+}
+
+#endif /* _NAT_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
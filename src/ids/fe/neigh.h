@@ -0,0 +1,294 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _NEIGH_H
+#define _NEIGH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/if_arp.h>
+#include <sys/net/ip6.h>
+#include <sys/net/icmp6.h>
+
+/*
+ * Neighbor resolution messages (ARP and IPv6 neighbor discovery), built and
+ * parsed by the slow path
+ */
+
+#define NEIGH_MIN_FRAME         (ETHER_MIN_LEN - ETHER_CRC_LEN)
+
+/*
+ * Parsed message
+ */
+struct neigh_msg {
+    /* 4 for ARP, 6 for neighbor discovery */
+    int af;
+    /* Non-zero for a solicitation (ARP request or NS) */
+    int solicit;
+    /* Sender protocol address, and the link-layer address if any */
+    uint8_t sender[16];
+    uint8_t sender_mac[ETHER_ADDR_LEN];
+    int has_sender_mac;
+    /* Target protocol address */
+    uint8_t target[16];
+};
+
+/*
+ * ICMPv6 checksum
+ */
+static __inline__ uint16_t
+neigh_icmp6_cksum(const uint8_t *src, const uint8_t *dst, const void *msg,
+                  size_t len)
+{
+    const uint8_t *p;
+    uint32_t sum;
+    size_t i;
+
+    sum = 0;
+    for ( i = 0; i < 16; i += 2 ) {
+        sum += ((uint32_t)src[i] << 8) | src[i + 1];
+        sum += ((uint32_t)dst[i] << 8) | dst[i + 1];
+    }
+    sum += len;
+    sum += IPPROTO_ICMPV6;
+    p = msg;
+    for ( i = 0; i + 1 < len; i += 2 ) {
+        sum += ((uint32_t)p[i] << 8) | p[i + 1];
+    }
+    if ( len & 1 ) {
+        sum += (uint32_t)p[len - 1] << 8;
+    }
+    while ( sum >> 16 ) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return htons(~sum & 0xffff);
+}
+
+/*
+ * Build an ARP packet; returns the frame length
+ */
+static __inline__ int
+neigh_arp_build(void *buf, int op, const uint8_t *dmac, const uint8_t *smac,
+                uint32_t spa, const uint8_t *tha, uint32_t tpa)
+{
+    struct ether_header *eth;
+    struct ether_arp *arp;
+
+    memset(buf, 0, NEIGH_MIN_FRAME);
+    eth = buf;
+    memcpy(eth->ether_dhost, dmac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, smac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ETHERTYPE_ARP);
+
+    arp = buf + sizeof(struct ether_header);
+    arp->ea_hdr.ar_hrd = htons(ARPHRD_ETHER);
+    arp->ea_hdr.ar_pro = htons(ETHERTYPE_IP);
+    arp->ea_hdr.ar_hln = ETHER_ADDR_LEN;
+    arp->ea_hdr.ar_pln = 4;
+    arp->ea_hdr.ar_op = htons(op);
+    memcpy(arp->arp_sha, smac, ETHER_ADDR_LEN);
+    spa = htonl(spa);
+    memcpy(arp->arp_spa, &spa, 4);
+    if ( NULL != tha ) {
+        memcpy(arp->arp_tha, tha, ETHER_ADDR_LEN);
+    }
+    tpa = htonl(tpa);
+    memcpy(arp->arp_tpa, &tpa, 4);
+
+    return NEIGH_MIN_FRAME;
+}
+
+/*
+ * Build an IPv6 neighbor solicitation (multicast to the solicited-node
+ * address if dmac is NULL) or advertisement with the link-layer address
+ * option; returns the frame length
+ */
+static __inline__ int
+neigh_nd_build(void *buf, int type, const uint8_t *dmac, const uint8_t *smac,
+               const uint8_t *src, const uint8_t *dst, const uint8_t *target,
+               uint32_t flags)
+{
+    static const uint8_t snm[16] = { 0xff, 0x02, 0, 0, 0, 0, 0, 0,
+                                     0, 0, 0, 1, 0xff, 0, 0, 0 };
+    struct ether_header *eth;
+    struct ip6_hdr *ip6;
+    struct nd_neighbor_solicit *ns;
+    struct nd_opt_hdr *opt;
+    size_t len;
+
+    len = sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr)
+        + ETHER_ADDR_LEN;
+    memset(buf, 0, sizeof(struct ether_header) + sizeof(struct ip6_hdr) + len);
+
+    eth = buf;
+    ip6 = buf + sizeof(struct ether_header);
+    if ( NULL == dmac ) {
+        /* Solicited-node multicast address */
+        memcpy(ip6->ip6_dst, snm, 13);
+        memcpy(ip6->ip6_dst + 13, target + 13, 3);
+        eth->ether_dhost[0] = 0x33;
+        eth->ether_dhost[1] = 0x33;
+        memcpy(eth->ether_dhost + 2, ip6->ip6_dst + 12, 4);
+    } else {
+        memcpy(ip6->ip6_dst, dst, 16);
+        memcpy(eth->ether_dhost, dmac, ETHER_ADDR_LEN);
+    }
+    memcpy(eth->ether_shost, smac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ETHERTYPE_IPV6);
+
+    ip6->ip6_flow = htonl(0x60000000);
+    ip6->ip6_plen = htons(len);
+    ip6->ip6_nxt = IPPROTO_ICMPV6;
+    ip6->ip6_hlim = 255;
+    memcpy(ip6->ip6_src, src, 16);
+
+    /* The layouts of solicitation and advertisement are the same */
+    ns = (void *)ip6 + sizeof(struct ip6_hdr);
+    ns->nd_ns_hdr.icmp6_type = type;
+    ns->nd_ns_hdr.icmp6_data32 = flags;
+    memcpy(ns->nd_ns_target, target, 16);
+    opt = (void *)ns + sizeof(struct nd_neighbor_solicit);
+    opt->nd_opt_type = ND_NEIGHBOR_SOLICIT == type
+        ? ND_OPT_SOURCE_LINKADDR : ND_OPT_TARGET_LINKADDR;
+    opt->nd_opt_len = 1;
+    memcpy((void *)opt + sizeof(struct nd_opt_hdr), smac, ETHER_ADDR_LEN);
+    ns->nd_ns_hdr.icmp6_cksum
+        = neigh_icmp6_cksum(ip6->ip6_src, ip6->ip6_dst, ns, len);
+
+    len += sizeof(struct ether_header) + sizeof(struct ip6_hdr);
+
+    return len < NEIGH_MIN_FRAME ? NEIGH_MIN_FRAME : len;
+}
+
+/*
+ * Check if a frame is a neighbor resolution message (called from the fast
+ * path)
+ */
+static __inline__ int
+neigh_is_msg(const void *pkt, int len)
+{
+    const struct ether_header *eth;
+    const struct ip6_hdr *ip6;
+    const struct icmp6_hdr *icmp6;
+
+    eth = pkt;
+    switch ( ntohs(eth->ether_type) ) {
+    case ETHERTYPE_ARP:
+        return 1;
+    case ETHERTYPE_IPV6:
+        if ( len < (int)(sizeof(struct ether_header) + sizeof(struct ip6_hdr)
+                         + sizeof(struct icmp6_hdr)) ) {
+            return 0;
+        }
+        ip6 = pkt + sizeof(struct ether_header);
+        if ( IPPROTO_ICMPV6 != ip6->ip6_nxt ) {
+            return 0;
+        }
+        icmp6 = (const void *)ip6 + sizeof(struct ip6_hdr);
+        return ND_NEIGHBOR_SOLICIT == icmp6->icmp6_type
+            || ND_NEIGHBOR_ADVERT == icmp6->icmp6_type;
+    default:
+        ;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse a neighbor resolution message
+ */
+static __inline__ int
+neigh_parse(const void *pkt, int len, struct neigh_msg *msg)
+{
+    const struct ether_header *eth;
+    const struct ether_arp *arp;
+    const struct ip6_hdr *ip6;
+    const struct nd_neighbor_solicit *ns;
+    const struct nd_opt_hdr *opt;
+    const void *end;
+
+    eth = pkt;
+    end = pkt + len;
+    memset(msg, 0, sizeof(struct neigh_msg));
+    if ( ETHERTYPE_ARP == ntohs(eth->ether_type) ) {
+        arp = pkt + sizeof(struct ether_header);
+        if ( (const void *)arp + sizeof(struct ether_arp) > end
+             || ARPHRD_ETHER != ntohs(arp->ea_hdr.ar_hrd)
+             || ETHERTYPE_IP != ntohs(arp->ea_hdr.ar_pro) ) {
+            return -1;
+        }
+        msg->af = 4;
+        msg->solicit = ARPOP_REQUEST == ntohs(arp->ea_hdr.ar_op);
+        memcpy(msg->sender, arp->arp_spa, 4);
+        memcpy(msg->sender_mac, arp->arp_sha, ETHER_ADDR_LEN);
+        msg->has_sender_mac = 1;
+        memcpy(msg->target, arp->arp_tpa, 4);
+        return 0;
+    }
+
+    if ( !neigh_is_msg(pkt, len) ) {
+        return -1;
+    }
+    ip6 = pkt + sizeof(struct ether_header);
+    ns = (const void *)ip6 + sizeof(struct ip6_hdr);
+    if ( (const void *)ns + sizeof(struct nd_neighbor_solicit) > end
+         || 255 != ip6->ip6_hlim ) {
+        return -1;
+    }
+    msg->af = 6;
+    msg->solicit = ND_NEIGHBOR_SOLICIT == ns->nd_ns_hdr.icmp6_type;
+    memcpy(msg->target, ns->nd_ns_target, 16);
+    /* The sender of an advertisement is the target */
+    memcpy(msg->sender, msg->solicit ? ip6->ip6_src : ns->nd_ns_target, 16);
+
+    /* Link-layer address option */
+    opt = (const void *)ns + sizeof(struct nd_neighbor_solicit);
+    while ( (const void *)opt + sizeof(struct nd_opt_hdr) <= end
+            && opt->nd_opt_len > 0 ) {
+        if ( (ND_OPT_SOURCE_LINKADDR == opt->nd_opt_type
+              || ND_OPT_TARGET_LINKADDR == opt->nd_opt_type)
+             && (const void *)opt + sizeof(struct nd_opt_hdr) + ETHER_ADDR_LEN
+             <= end ) {
+            memcpy(msg->sender_mac, (const void *)opt
+                   + sizeof(struct nd_opt_hdr), ETHER_ADDR_LEN);
+            msg->has_sender_mac = 1;
+        }
+        opt = (const void *)opt + opt->nd_opt_len * 8;
+    }
+
+    return 0;
+}
+
+#endif /* _NEIGH_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,366 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _PKTGEN_H
+#define _PKTGEN_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/udp.h>
+
+/*
+ * Packet generator
+ *
+ * Each exclusive task builds UDP frames from a template, varying the source
+ * address, the destination address, and the source port over the configured
+ * ranges (in this order, like an odometer), and stamps a sequence number and
+ * the TSC in the payload.  Only the headers and the stamp are written; the
+ * rest of the payload is left as is in the buffer.  The rate is paced per task
+ * in TSC.  At the receiving ports, the frames are counted and the latency is
+ * measured from the stamp; as the TSC is only comparable on the same machine,
+ * the latency is meaningful when the frames return to the generating box
+ * (e.g., through a device under test with a loop).
+ */
+
+#define PKTGEN_MAGIC            0x7067656eU     /* "pgen" */
+#define PKTGEN_MIN_SIZE         60
+#define PKTGEN_MAX_SIZE         9014
+#define PKTGEN_HDRLEN           (sizeof(struct ether_header) \
+                                 + sizeof(struct ip) + sizeof(struct udphdr))
+#define PKTGEN_LAT_BUCKETS      48
+/* Packets (not) sent behind the schedule are dropped from it after this many
+   TSC, to avoid a burst after a stall */
+#define PKTGEN_MAX_LAG_TSC      1000000
+
+/*
+ * Configuration (addresses and ports in host byte order)
+ */
+struct pktgen_config {
+    /* Ports to transmit, and to receive and count (bitmaps) */
+    uint64_t txports;
+    uint64_t rxports;
+    /* Frame size without FCS */
+    int size;
+    uint8_t dmac[ETHER_ADDR_LEN];
+    uint8_t smac[ETHER_ADDR_LEN];
+    /* VLAN ID to be tagged (0 for untagged) */
+    uint16_t vid;
+    /* Ranges of the addresses and the source port (the number of values) */
+    uint32_t src;
+    uint32_t nsrc;
+    uint32_t dst;
+    uint32_t ndst;
+    uint16_t sport;
+    uint16_t nsport;
+    uint16_t dport;
+    /* Total rate over all the tasks in packets per second (0 for line rate) */
+    uint64_t pps;
+};
+
+/*
+ * Stamp in the payload
+ */
+struct pktgen_stamp {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t tsc;
+} __attribute__ ((packed));
+
+/*
+ * Statistics
+ */
+struct pktgen_stats {
+    uint64_t tx_pkts;
+    uint64_t tx_bytes;
+    /* Packets not enqueued as the Tx ring was full or no buffer */
+    uint64_t tx_drops;
+    uint64_t rx_pkts;
+    uint64_t rx_bytes;
+    /* Received frames with the stamp, and the latency in TSC (sum, minimum,
+       maximum, and a histogram of log2) */
+    uint64_t rx_stamped;
+    uint64_t lat_sum;
+    uint64_t lat_min;
+    uint64_t lat_max;
+    uint64_t lat_hist[PKTGEN_LAT_BUCKETS];
+};
+
+/*
+ * Generator of a task
+ */
+struct pktgen {
+    /* Template of the headers */
+    uint8_t tmpl[PKTGEN_HDRLEN];
+    int size;
+    uint16_t vid;
+    uint32_t src;
+    uint32_t nsrc;
+    uint32_t dst;
+    uint32_t ndst;
+    uint16_t sport;
+    uint16_t nsport;
+    /* Generation of the configuration */
+    uint32_t gen;
+    /* Current indices of the ranges, and the sequence number */
+    uint32_t isrc;
+    uint32_t idst;
+    uint32_t isport;
+    uint32_t seq;
+
+    /* Pacing: TSC of the next packet, and the gap (16-bit fraction); zero
+       gap for line rate */
+    uint64_t next;
+    uint32_t frac;
+    uint64_t gap;
+
+    struct pktgen_stats stats;
+} __attribute__ ((aligned(64)));
+
+/*
+ * Checksum of an IPv4 header
+ */
+static __inline__ uint16_t
+_pktgen_cksum(const void *hdr)
+{
+    const uint16_t *p;
+    uint32_t sum;
+    int i;
+
+    p = hdr;
+    sum = 0;
+    for ( i = 0; i < (int)sizeof(struct ip) / 2; i++ ) {
+        sum += p[i];
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/*
+ * Validate a configuration; returns 0 if valid, or -1
+ */
+static __inline__ int
+pktgen_config_validate(const struct pktgen_config *cfg)
+{
+    if ( cfg->size < PKTGEN_MIN_SIZE || cfg->size > PKTGEN_MAX_SIZE ) {
+        return -1;
+    }
+    if ( 0 == cfg->nsrc || 0 == cfg->ndst || 0 == cfg->nsport
+         || cfg->vid >= 4095 ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Initialize a generator for a task that transmits pps packets per second
+ * (0 for line rate) with the TSC frequency hz
+ */
+static __inline__ void
+pktgen_init(struct pktgen *g, const struct pktgen_config *cfg, uint64_t pps,
+            uint64_t hz, uint64_t tsc)
+{
+    struct ether_header *eth;
+    struct ip *ip;
+    struct udphdr *udp;
+
+    memset(g, 0, sizeof(struct pktgen));
+    eth = (struct ether_header *)g->tmpl;
+    ip = (struct ip *)(eth + 1);
+    udp = (struct udphdr *)(ip + 1);
+    memcpy(eth->ether_dhost, cfg->dmac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, cfg->smac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+    ip->ip_vhl = (IPVERSION << 4) | (sizeof(struct ip) >> 2);
+    ip->ip_len = htons(cfg->size - sizeof(struct ether_header));
+    ip->ip_off = htons(IP_DF);
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_UDP;
+    udp->uh_dport = htons(cfg->dport);
+    udp->uh_ulen = htons(cfg->size - sizeof(struct ether_header)
+                         - sizeof(struct ip));
+
+    g->size = cfg->size;
+    g->vid = cfg->vid;
+    g->src = cfg->src;
+    g->nsrc = cfg->nsrc;
+    g->dst = cfg->dst;
+    g->ndst = cfg->ndst;
+    g->sport = cfg->sport;
+    g->nsport = cfg->nsport;
+    g->stats.lat_min = ~0ULL;
+
+    g->next = tsc;
+    g->gap = pps ? (hz << 16) / pps : 0;
+}
+
+/*
+ * The number of packets (up to max) due by tsc
+ */
+static __inline__ int
+pktgen_due(struct pktgen *g, uint64_t tsc, int max)
+{
+    int n;
+
+    if ( 0 == g->gap ) {
+        return max;
+    }
+    if ( (int64_t)(tsc - g->next) > PKTGEN_MAX_LAG_TSC ) {
+        /* Stalled; restart the schedule */
+        g->next = tsc;
+        g->frac = 0;
+    }
+    for ( n = 0; n < max && (int64_t)(tsc - g->next) >= 0; n++ ) {
+        g->frac += g->gap & 0xffff;
+        g->next += (g->gap >> 16) + (g->frac >> 16);
+        g->frac &= 0xffff;
+    }
+
+    return n;
+}
+
+/*
+ * Build the next frame in pkt; the IPv4 header checksum is left to the NIC if
+ * hwcsum is non-zero
+ */
+static __inline__ void
+pktgen_build(struct pktgen *g, void *pkt, uint64_t tsc, int hwcsum)
+{
+    struct ip *ip;
+    struct udphdr *udp;
+    struct pktgen_stamp *st;
+
+    memcpy(pkt, g->tmpl, PKTGEN_HDRLEN);
+    ip = (struct ip *)(pkt + sizeof(struct ether_header));
+    udp = (struct udphdr *)(ip + 1);
+    st = (struct pktgen_stamp *)(udp + 1);
+
+    ip->ip_id = htons(g->seq);
+    ip->ip_src = htonl(g->src + g->isrc);
+    ip->ip_dst = htonl(g->dst + g->idst);
+    if ( !hwcsum ) {
+        ip->ip_sum = _pktgen_cksum(ip);
+    }
+    udp->uh_sport = htons(g->sport + g->isport);
+    st->magic = htonl(PKTGEN_MAGIC);
+    st->seq = g->seq;
+    st->tsc = tsc;
+
+    /* Next flow */
+    g->seq++;
+    if ( ++g->isrc >= g->nsrc ) {
+        g->isrc = 0;
+        if ( ++g->idst >= g->ndst ) {
+            g->idst = 0;
+            if ( ++g->isport >= g->nsport ) {
+                g->isport = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Count a received frame, and measure the latency if stamped
+ */
+static __inline__ void
+pktgen_rx(struct pktgen *g, const void *pkt, int len, uint64_t tsc)
+{
+    const struct ether_header *eth;
+    const struct ip *ip;
+    const struct pktgen_stamp *st;
+    uint64_t lat;
+    int b;
+
+    g->stats.rx_pkts++;
+    g->stats.rx_bytes += len;
+
+    eth = pkt;
+    ip = (const struct ip *)(eth + 1);
+    st = pkt + PKTGEN_HDRLEN;
+    if ( len < (int)(PKTGEN_HDRLEN + sizeof(struct pktgen_stamp))
+         || ETHERTYPE_IP != ntohs(eth->ether_type)
+         || IPPROTO_UDP != ip->ip_p || htonl(PKTGEN_MAGIC) != st->magic ) {
+        return;
+    }
+    lat = tsc - st->tsc;
+    if ( (int64_t)lat < 0 ) {
+        /* Not from this machine */
+        return;
+    }
+    g->stats.rx_stamped++;
+    g->stats.lat_sum += lat;
+    if ( lat < g->stats.lat_min ) {
+        g->stats.lat_min = lat;
+    }
+    if ( lat > g->stats.lat_max ) {
+        g->stats.lat_max = lat;
+    }
+    b = lat ? 64 - __builtin_clzll(lat) : 0;
+    if ( b >= PKTGEN_LAT_BUCKETS ) {
+        b = PKTGEN_LAT_BUCKETS - 1;
+    }
+    g->stats.lat_hist[b]++;
+}
+
+/*
+ * Add the statistics of a generator to sum
+ */
+static __inline__ void
+pktgen_stats_add(struct pktgen_stats *sum, const struct pktgen_stats *s)
+{
+    int i;
+
+    sum->tx_pkts += s->tx_pkts;
+    sum->tx_bytes += s->tx_bytes;
+    sum->tx_drops += s->tx_drops;
+    sum->rx_pkts += s->rx_pkts;
+    sum->rx_bytes += s->rx_bytes;
+    sum->rx_stamped += s->rx_stamped;
+    sum->lat_sum += s->lat_sum;
+    if ( s->lat_min < sum->lat_min ) {
+        sum->lat_min = s->lat_min;
+    }
+    if ( s->lat_max > sum->lat_max ) {
+        sum->lat_max = s->lat_max;
+    }
+    for ( i = 0; i < PKTGEN_LAT_BUCKETS; i++ ) {
+        sum->lat_hist[i] += s->lat_hist[i];
+    }
+}
+
+#endif /* _PKTGEN_H */
+
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
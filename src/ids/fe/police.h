@@ -0,0 +1,341 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _POLICE_H
+#define _POLICE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/net/ethernet.h>
+#include "qos.h"
+
+/*
+ * Ingress policing and storm control
+ *
+ * Packets received at a port are classified into POLICE_NCLASSES classes by
+ * the DSCP or the 802.1Q priority (as the QoS scheduler does), and metered
+ * per class by a single rate three color marker (srTCM; RFC 2697) or a two
+ * rate three color marker (trTCM; RFC 2698) in the color-blind mode.  Red
+ * packets are dropped, and yellow ones are either passed or dropped.
+ * Broadcast, multicast and unknown unicast frames (the frames to be flooded)
+ * are limited in packets per second per port.
+ *
+ * The state of a port is updated only by the task polling the Rx ring of the
+ * port, and the buckets (the token buckets of the QoS scheduler, in bytes for
+ * the meters and in packets for storm control) are refilled by the TSC once
+ * per burst of packets.
+ */
+
+#define POLICE_NCLASSES         QOS_NCLASSES
+
+/* Meters */
+#define POLICE_NONE             0
+#define POLICE_SRTCM            1
+#define POLICE_TRTCM            2
+
+/* Colors */
+#define POLICE_GREEN            0
+#define POLICE_YELLOW           1
+#define POLICE_RED              2
+#define POLICE_NCOLORS          3
+
+/* Storm control */
+#define POLICE_STORM_BROADCAST  0
+#define POLICE_STORM_MULTICAST  1
+#define POLICE_STORM_UNKNOWN    2
+#define POLICE_NSTORMS          3
+
+/*
+ * Configuration of the meter of a class
+ */
+struct police_meter_config {
+    /* POLICE_NONE, POLICE_SRTCM or POLICE_TRTCM */
+    int mode;
+    /* Committed information rate (in bytes per second) and committed burst
+       size (in bytes) */
+    uint64_t cir;
+    uint32_t cbs;
+    /* Peak information rate (trTCM; ignored by srTCM) and the peak burst size
+       (trTCM) or the excess burst size (srTCM) */
+    uint64_t pir;
+    uint32_t pbs;
+    /* Non-zero to drop yellow packets */
+    int drop_yellow;
+};
+
+/*
+ * Configuration of a port
+ */
+struct police_config {
+    /* Class of each DSCP and of each 802.1Q priority */
+    uint8_t dscp[64];
+    uint8_t pcp[8];
+    struct police_meter_config classes[POLICE_NCLASSES];
+    /* Storm control rate (in packets per second; 0 if unlimited) and the
+       burst (in packets) of broadcast, multicast and unknown unicast */
+    struct {
+        uint64_t pps;
+        uint32_t burst;
+    } storm[POLICE_NSTORMS];
+};
+
+/*
+ * Meter of a class; the committed bucket, and the excess (srTCM) or the peak
+ * (trTCM) bucket
+ */
+struct police_meter {
+    int mode;
+    int drop_yellow;
+    struct qos_tb c;
+    struct qos_tb e;
+};
+
+/*
+ * Counters
+ */
+struct police_stats {
+    /* Packets of each class by color */
+    uint64_t pkts[POLICE_NCLASSES][POLICE_NCOLORS];
+    /* Frames dropped by storm control */
+    uint64_t storm_drops[POLICE_NSTORMS];
+};
+
+/*
+ * Policer of a port
+ */
+struct police {
+    /* Metered classes and limited storm types */
+    uint32_t meters;
+    uint32_t storms;
+    /* Classification */
+    uint8_t dscp[64];
+    uint8_t pcp[8];
+    struct police_meter classes[POLICE_NCLASSES];
+    struct qos_tb storm[POLICE_NSTORMS];
+    struct police_stats stats;
+};
+
+/*
+ * Initialize a policer with a configuration (hz for the TSC frequency)
+ */
+static __inline__ void
+police_init(struct police *p, const struct police_config *cfg, uint64_t hz,
+            uint64_t now)
+{
+    const struct police_meter_config *mc;
+    struct police_meter *m;
+    int i;
+
+    memset(p, 0, sizeof(struct police));
+    for ( i = 0; i < 64; i++ ) {
+        p->dscp[i] = cfg->dscp[i] % POLICE_NCLASSES;
+    }
+    for ( i = 0; i < 8; i++ ) {
+        p->pcp[i] = cfg->pcp[i] % POLICE_NCLASSES;
+    }
+    for ( i = 0; i < POLICE_NCLASSES; i++ ) {
+        mc = &cfg->classes[i];
+        m = &p->classes[i];
+        m->mode = mc->mode;
+        m->drop_yellow = mc->drop_yellow;
+        switch ( mc->mode ) {
+        case POLICE_SRTCM:
+            /* The excess bucket is filled by the overflow of the committed
+               one */
+            qos_tb_init(&m->c, mc->cir, mc->cbs, hz, now);
+            qos_tb_init(&m->e, mc->cir, mc->pbs, hz, now);
+            /* An idle interval is clipped only after it fills up both
+               buckets, so that the excess one is not under-filled (RFC
+               2697) */
+            m->c.max_delta = ((uint64_t)(m->c.burst + m->e.burst) << 32)
+                / m->c.rate + 1;
+            break;
+        case POLICE_TRTCM:
+            qos_tb_init(&m->c, mc->cir, mc->cbs, hz, now);
+            qos_tb_init(&m->e, mc->pir, mc->pbs, hz, now);
+            break;
+        default:
+            continue;
+        }
+        p->meters |= 1U << i;
+    }
+    for ( i = 0; i < POLICE_NSTORMS; i++ ) {
+        if ( 0 != cfg->storm[i].pps ) {
+            qos_tb_init(&p->storm[i], cfg->storm[i].pps, cfg->storm[i].burst,
+                        hz, now);
+            p->storms |= 1U << i;
+        }
+    }
+}
+
+/*
+ * Refill the buckets of a policer (once per burst)
+ */
+static __inline__ void
+police_refill(struct police *p, uint64_t now)
+{
+    struct police_meter *m;
+    uint32_t bits;
+    int64_t over;
+    int i;
+
+    bits = p->meters;
+    while ( 0 != bits ) {
+        i = __builtin_ctz(bits);
+        bits &= bits - 1;
+        m = &p->classes[i];
+        over = qos_tb_refill(&m->c, now);
+        if ( POLICE_SRTCM == m->mode ) {
+            if ( over > 0 ) {
+                m->e.tokens += over;
+                if ( m->e.tokens > m->e.burst ) {
+                    m->e.tokens = m->e.burst;
+                }
+            }
+        } else {
+            qos_tb_refill(&m->e, now);
+        }
+    }
+    bits = p->storms;
+    while ( 0 != bits ) {
+        i = __builtin_ctz(bits);
+        bits &= bits - 1;
+        qos_tb_refill(&p->storm[i], now);
+    }
+}
+
+/*
+ * Meter a packet of len bytes in a class; returns the color
+ */
+static __inline__ int
+police_meter(struct police *p, int cls, int len)
+{
+    struct police_meter *m;
+    int color;
+
+    m = &p->classes[cls];
+    switch ( m->mode ) {
+    case POLICE_SRTCM:
+        if ( m->c.tokens >= len ) {
+            m->c.tokens -= len;
+            color = POLICE_GREEN;
+        } else if ( m->e.tokens >= len ) {
+            m->e.tokens -= len;
+            color = POLICE_YELLOW;
+        } else {
+            color = POLICE_RED;
+        }
+        break;
+    case POLICE_TRTCM:
+        if ( m->e.tokens < len ) {
+            color = POLICE_RED;
+        } else if ( m->c.tokens < len ) {
+            m->e.tokens -= len;
+            color = POLICE_YELLOW;
+        } else {
+            m->e.tokens -= len;
+            m->c.tokens -= len;
+            color = POLICE_GREEN;
+        }
+        break;
+    default:
+        color = POLICE_GREEN;
+    }
+    p->stats.pkts[cls][color]++;
+
+    return color;
+}
+
+/*
+ * Check a packet received at a port against the policer; returns 0 if it is
+ * to be dropped
+ */
+static __inline__ int
+police_packet(struct police *p, const void *pkt, int len, uint16_t tci)
+{
+    int color;
+    int cls;
+
+    if ( 0 == p->meters ) {
+        return 1;
+    }
+    cls = qos_classify_map(p->dscp, p->pcp, pkt, len, tci);
+    if ( !(p->meters & (1U << cls)) ) {
+        return 1;
+    }
+    color = police_meter(p, cls, len);
+    if ( POLICE_RED == color ) {
+        return 0;
+    }
+    if ( POLICE_YELLOW == color && p->classes[cls].drop_yellow ) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Storm type of a frame to a multicast (or broadcast) destination address
+ */
+static __inline__ int
+police_storm_type(const uint8_t *dhost)
+{
+    static const uint8_t bcast[ETHER_ADDR_LEN] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+
+    return 0 == memcmp(dhost, bcast, ETHER_ADDR_LEN)
+        ? POLICE_STORM_BROADCAST : POLICE_STORM_MULTICAST;
+}
+
+/*
+ * Take a token of a storm type for a frame; returns 0 if it is to be dropped
+ */
+static __inline__ int
+police_storm(struct police *p, int type)
+{
+    struct qos_tb *tb;
+
+    if ( !(p->storms & (1U << type)) ) {
+        return 1;
+    }
+    tb = &p->storm[type];
+    if ( tb->tokens < 1 ) {
+        p->stats.storm_drops[type]++;
+        return 0;
+    }
+    tb->tokens--;
+
+    return 1;
+}
+
+#endif /* _POLICE_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
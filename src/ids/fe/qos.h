@@ -0,0 +1,569 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _QOS_H
+#define _QOS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/ip6.h>
+
+/*
+ * Hierarchical QoS Tx scheduler
+ *
+ * Packets to a port are classified into QOS_NCLASSES classes by the DSCP of
+ * IP packets, or by the priority (PCP) of the 802.1Q tag of other packets,
+ * and queued per class.  The scheduler moves packets from the class queues to
+ * the Tx ring of the port: strict-priority classes first (the lower class
+ * number, the higher priority), then the deficit round robin (DRR) classes in
+ * proportion to their quanta.  A class and the port are shaped by token
+ * buckets refilled by the TSC; a packet is sent while the buckets hold any
+ * token, and may take them negative.
+ *
+ * A scheduler is local to an exclusive task (one per port), while the
+ * shapers of a port are shared by the schedulers of all the tasks, so that a
+ * port is shaped once however its traffic is spread over the tasks.  Any
+ * task refills a shared bucket by advancing the TSC of its last refill with
+ * a compare-and-swap, and charges it with an atomic subtraction.
+ */
+
+#define QOS_NCLASSES            8
+/* Length of a class queue (power of 2) */
+#define QOS_QLEN                256
+/* Minimum DRR quantum (in bytes) */
+#define QOS_MIN_QUANTUM         256
+/* # of classes visited by the DRR without a packet to send before giving up
+   (the deficits are still growing) */
+#define QOS_DRR_MAX_VISITS      (QOS_NCLASSES * 64)
+
+/* Maximum depth of a token bucket (in bytes), and the maximum deficit of
+   tokens after a packet */
+#define QOS_TB_MAX_BURST        (1LL << 30)
+#define QOS_TB_MAX_DEFICIT      65536
+
+/* Modes of classes */
+#define QOS_STRICT              0
+#define QOS_DRR                 1
+
+/*
+ * Configuration of a class
+ */
+struct qos_class_config {
+    /* QOS_STRICT or QOS_DRR */
+    int mode;
+    /* DRR quantum (in bytes) */
+    uint32_t quantum;
+    /* Shaper rate (in bytes per second; 0 if unshaped) and depth (in
+       bytes) */
+    uint64_t rate;
+    uint32_t burst;
+};
+
+/*
+ * Configuration of the scheduler of a port
+ */
+struct qos_config {
+    /* Port shaper rate (in bytes per second; 0 if unshaped) and depth (in
+       bytes) */
+    uint64_t rate;
+    uint32_t burst;
+    /* Class of each DSCP and of each 802.1Q priority */
+    uint8_t dscp[64];
+    uint8_t pcp[8];
+    /* Classes */
+    struct qos_class_config classes[QOS_NCLASSES];
+};
+
+/*
+ * Token bucket (the fraction is unused if shared by tasks)
+ */
+struct qos_tb {
+    /* Tokens (in bytes) and the depth */
+    int64_t tokens;
+    int64_t burst;
+    /* Rate in bytes per TSC (32.32 fixed point; 0 if unshaped), and the
+       fraction of a byte carried over to the next refill */
+    uint64_t rate;
+    uint32_t frac;
+    /* TSC of the last refill, and the interval to fill up the bucket (a
+       longer one is clipped so that the product with the rate does not
+       overflow) */
+    uint64_t last;
+    uint64_t max_delta;
+};
+
+/*
+ * Queued packet
+ */
+struct qos_pkt {
+    void *hdr;
+    void *pkt;
+    uint16_t len;
+    uint16_t tag;
+};
+
+/*
+ * Class
+ */
+struct qos_class {
+    struct qos_pkt q[QOS_QLEN];
+    uint32_t head;
+    uint32_t tail;
+    /* DRR quantum and deficit (in bytes) */
+    int32_t quantum;
+    int32_t deficit;
+    struct qos_tb *tb;
+    /* # of packets dropped at the tail */
+    uint64_t drops;
+};
+
+/*
+ * Shapers of a port shared by the schedulers of the tasks
+ */
+struct qos_shaper {
+    struct qos_tb port;
+    struct qos_tb classes[QOS_NCLASSES];
+};
+
+/*
+ * Scheduler of a port
+ */
+struct qos_sched {
+    /* Port shaper */
+    struct qos_tb *tb;
+    /* Backlogged strict-priority and DRR classes */
+    uint32_t sp_active;
+    uint32_t drr_active;
+    /* DRR classes, and the class currently served by the DRR */
+    uint32_t drr;
+    int drr_cur;
+    /* Classification */
+    uint8_t dscp[64];
+    uint8_t pcp[8];
+    struct qos_class classes[QOS_NCLASSES];
+};
+
+/*
+ * Initialize a token bucket; rate in bytes per second is converted to bytes
+ * per TSC
+ */
+static __inline__ void
+qos_tb_init(struct qos_tb *tb, uint64_t rate, uint32_t burst, uint64_t hz,
+            uint64_t now)
+{
+    tb->rate = 0;
+    if ( 0 != rate && 0 != hz ) {
+        /* Full precision unless the rate overflows */
+        tb->rate = rate < (1ULL << 32) ? (rate << 32) / hz
+            : (rate << 20) / hz << 12;
+        if ( 0 == tb->rate ) {
+            tb->rate = 1;
+        }
+    }
+    tb->burst = burst;
+    if ( tb->burst < 1 ) {
+        tb->burst = 1;
+    } else if ( tb->burst > QOS_TB_MAX_BURST ) {
+        tb->burst = QOS_TB_MAX_BURST;
+    }
+    tb->tokens = tb->burst;
+    tb->frac = 0;
+    tb->last = now;
+    tb->max_delta = 0 != tb->rate
+        ? ((uint64_t)(tb->burst + QOS_TB_MAX_DEFICIT) << 32) / tb->rate + 1
+        : 0;
+}
+
+/*
+ * Refill a token bucket; returns the tokens overflowed from the full bucket
+ */
+static __inline__ int64_t
+qos_tb_refill(struct qos_tb *tb, uint64_t now)
+{
+    uint64_t delta;
+    uint64_t add;
+    int64_t over;
+
+    if ( 0 == tb->rate ) {
+        return 0;
+    }
+    delta = now - tb->last;
+    tb->last = now;
+    if ( delta > tb->max_delta ) {
+        delta = tb->max_delta;
+    }
+    add = delta * tb->rate + tb->frac;
+    tb->frac = (uint32_t)add;
+    tb->tokens += add >> 32;
+    over = tb->tokens - tb->burst;
+    if ( over > 0 ) {
+        tb->tokens = tb->burst;
+        tb->frac = 0;
+        return over;
+    }
+
+    return 0;
+}
+
+/*
+ * Refill a token bucket shared by tasks; only the task that advances the TSC
+ * of the last refill adds the tokens, and the fraction of a byte is left in
+ * the interval not accounted yet
+ */
+static __inline__ void
+qos_tb_refill_shared(struct qos_tb *tb, uint64_t now)
+{
+    uint64_t last;
+    uint64_t next;
+    uint64_t delta;
+    uint64_t add;
+    int64_t tokens;
+
+    if ( 0 == tb->rate ) {
+        return;
+    }
+    last = tb->last;
+    delta = now - last;
+    if ( (int64_t)delta <= 0 ) {
+        /* Refilled by another task meanwhile */
+        return;
+    }
+    if ( delta > tb->max_delta ) {
+        /* Fills up the bucket */
+        add = (tb->max_delta * tb->rate) >> 32;
+        next = now;
+    } else {
+        add = (delta * tb->rate) >> 32;
+        if ( 0 == add ) {
+            return;
+        }
+        next = last + ((add << 32) + tb->rate - 1) / tb->rate;
+    }
+    if ( !__sync_bool_compare_and_swap(&tb->last, last, next) ) {
+        return;
+    }
+    __sync_fetch_and_add(&tb->tokens, add);
+    while ( (tokens = tb->tokens) > tb->burst
+            && !__sync_bool_compare_and_swap(&tb->tokens, tokens,
+                                             tb->burst) ) {
+        continue;
+    }
+}
+
+/*
+ * Charge a token bucket shared by tasks
+ */
+static __inline__ void
+qos_tb_charge_shared(struct qos_tb *tb, int len)
+{
+    if ( 0 != tb->rate ) {
+        __sync_fetch_and_sub(&tb->tokens, len);
+    }
+}
+
+/*
+ * Initialize the shapers of a port with a configuration
+ */
+static __inline__ void
+qos_shaper_init(struct qos_shaper *sh, const struct qos_config *cfg,
+                uint64_t hz, uint64_t now)
+{
+    int i;
+
+    qos_tb_init(&sh->port, cfg->rate, cfg->burst, hz, now);
+    for ( i = 0; i < QOS_NCLASSES; i++ ) {
+        qos_tb_init(&sh->classes[i], cfg->classes[i].rate,
+                    cfg->classes[i].burst, hz, now);
+    }
+}
+
+/*
+ * Check if a token bucket allows sending
+ */
+static __inline__ int
+qos_tb_ok(const struct qos_tb *tb)
+{
+    return 0 == tb->rate || tb->tokens > 0;
+}
+
+/*
+ * Initialize a scheduler with a configuration and the shapers of the port;
+ * the queues must have been drained
+ */
+static __inline__ void
+qos_sched_init(struct qos_sched *s, const struct qos_config *cfg,
+               struct qos_shaper *sh)
+{
+    const struct qos_class_config *cc;
+    struct qos_class *c;
+    int i;
+
+    s->tb = &sh->port;
+    s->sp_active = 0;
+    s->drr_active = 0;
+    s->drr = 0;
+    s->drr_cur = 0;
+    for ( i = 0; i < 64; i++ ) {
+        s->dscp[i] = cfg->dscp[i] % QOS_NCLASSES;
+    }
+    for ( i = 0; i < 8; i++ ) {
+        s->pcp[i] = cfg->pcp[i] % QOS_NCLASSES;
+    }
+    for ( i = 0; i < QOS_NCLASSES; i++ ) {
+        cc = &cfg->classes[i];
+        c = &s->classes[i];
+        c->head = 0;
+        c->tail = 0;
+        c->quantum = cc->quantum < QOS_MIN_QUANTUM
+            ? QOS_MIN_QUANTUM : cc->quantum;
+        c->deficit = 0;
+        c->drops = 0;
+        c->tb = &sh->classes[i];
+        if ( QOS_DRR == cc->mode ) {
+            s->drr |= 1U << i;
+        }
+    }
+}
+
+/*
+ * Class of a packet by the class maps of the DSCP and the 802.1Q priority
+ * (with the TCI of the 802.1Q tag received)
+ */
+static __inline__ int
+qos_classify_map(const uint8_t *dscp, const uint8_t *pcp, const void *pkt,
+                 int len, uint16_t tci)
+{
+    const struct ether_header *eth;
+    const struct ip *ip;
+    const uint8_t *ip6;
+
+    eth = pkt;
+    switch ( ntohs(eth->ether_type) ) {
+    case ETHERTYPE_IP:
+        if ( len < (int)(sizeof(struct ether_header) + sizeof(struct ip)) ) {
+            break;
+        }
+        ip = pkt + sizeof(struct ether_header);
+        return dscp[ip->ip_tos >> 2];
+    case ETHERTYPE_IPV6:
+        if ( len < (int)(sizeof(struct ether_header)
+                         + sizeof(struct ip6_hdr)) ) {
+            break;
+        }
+        /* Traffic class */
+        ip6 = pkt + sizeof(struct ether_header);
+        return dscp[((ip6[0] & 0x0f) << 2) | (ip6[1] >> 6)];
+    default:
+        ;
+    }
+
+    return pcp[tci >> 13];
+}
+
+/*
+ * Classify a packet (with the TCI of the 802.1Q tag received)
+ */
+static __inline__ int
+qos_classify(const struct qos_sched *s, const void *pkt, int len, uint16_t tci)
+{
+    return qos_classify_map(s->dscp, s->pcp, pkt, len, tci);
+}
+
+/*
+ * Enqueue a packet to a class; returns 0 if dropped at the tail
+ */
+static __inline__ int
+qos_enqueue(struct qos_sched *s, int cls, void *hdr, void *pkt, int len,
+            uint16_t tag)
+{
+    struct qos_class *c;
+    struct qos_pkt *e;
+
+    c = &s->classes[cls];
+    if ( c->tail - c->head >= QOS_QLEN ) {
+        c->drops++;
+        return 0;
+    }
+    e = &c->q[c->tail & (QOS_QLEN - 1)];
+    e->hdr = hdr;
+    e->pkt = pkt;
+    e->len = len;
+    e->tag = tag;
+    c->tail++;
+    if ( s->drr & (1U << cls) ) {
+        s->drr_active |= 1U << cls;
+    } else {
+        s->sp_active |= 1U << cls;
+    }
+
+    return 1;
+}
+
+/*
+ * Refill the port and class shapers of a scheduler
+ */
+static __inline__ void
+qos_refill(struct qos_sched *s, uint64_t now)
+{
+    uint32_t active;
+    int i;
+
+    qos_tb_refill_shared(s->tb, now);
+    active = s->sp_active | s->drr_active;
+    while ( 0 != active ) {
+        i = __builtin_ctz(active);
+        active &= active - 1;
+        qos_tb_refill_shared(s->classes[i].tb, now);
+    }
+}
+
+/*
+ * The packet to be sent next (*cls for its class), or NULL if none is
+ * allowed by the shapers; the packet is removed by qos_pop()
+ */
+static __inline__ struct qos_pkt *
+qos_peek(struct qos_sched *s, int *cls)
+{
+    struct qos_class *c;
+    struct qos_pkt *e;
+    uint32_t active;
+    int visits;
+    int skips;
+    int i;
+
+    if ( !qos_tb_ok(s->tb) ) {
+        return NULL;
+    }
+
+    /* Strict priority */
+    active = s->sp_active;
+    while ( 0 != active ) {
+        i = __builtin_ctz(active);
+        active &= active - 1;
+        if ( qos_tb_ok(s->classes[i].tb) ) {
+            *cls = i;
+            c = &s->classes[i];
+            return &c->q[c->head & (QOS_QLEN - 1)];
+        }
+    }
+
+    /* Deficit round robin */
+    if ( 0 == s->drr_active ) {
+        return NULL;
+    }
+    i = s->drr_cur;
+    skips = 0;
+    for ( visits = 0; visits < QOS_DRR_MAX_VISITS; visits++ ) {
+        c = &s->classes[i];
+        if ( (s->drr_active & (1U << i)) && qos_tb_ok(c->tb) ) {
+            e = &c->q[c->head & (QOS_QLEN - 1)];
+            if ( e->len <= c->deficit ) {
+                s->drr_cur = i;
+                *cls = i;
+                return e;
+            }
+            /* The next round of this class */
+            c->deficit += c->quantum;
+            skips = 0;
+        } else if ( ++skips >= QOS_NCLASSES ) {
+            /* All the backlogged classes are shaped */
+            break;
+        }
+        i = (i + 1) % QOS_NCLASSES;
+        s->drr_cur = i;
+    }
+
+    return NULL;
+}
+
+/*
+ * Remove the packet returned by qos_peek() from its class, charging the
+ * shapers and the deficit
+ */
+static __inline__ void
+qos_pop(struct qos_sched *s, int cls)
+{
+    struct qos_class *c;
+    int len;
+
+    c = &s->classes[cls];
+    len = c->q[c->head & (QOS_QLEN - 1)].len;
+    c->head++;
+    qos_tb_charge_shared(s->tb, len);
+    qos_tb_charge_shared(c->tb, len);
+    if ( s->drr & (1U << cls) ) {
+        c->deficit -= len;
+        if ( c->head == c->tail ) {
+            /* An idle class does not keep its deficit */
+            c->deficit = 0;
+            s->drr_active &= ~(1U << cls);
+        }
+    } else if ( c->head == c->tail ) {
+        s->sp_active &= ~(1U << cls);
+    }
+}
+
+/*
+ * Check if any packet is queued
+ */
+static __inline__ int
+qos_backlogged(const struct qos_sched *s)
+{
+    return 0 != (s->sp_active | s->drr_active);
+}
+
+/*
+ * Remove any queued packet regardless of the scheduling (to release the
+ * buffers before the scheduler is reinitialized); returns NULL if empty
+ */
+static __inline__ struct qos_pkt *
+qos_drain(struct qos_sched *s)
+{
+    struct qos_class *c;
+    int i;
+
+    for ( i = 0; i < QOS_NCLASSES; i++ ) {
+        c = &s->classes[i];
+        if ( c->head != c->tail ) {
+            return &c->q[c->head++ & (QOS_QLEN - 1)];
+        }
+    }
+    s->sp_active = 0;
+    s->drr_active = 0;
+
+    return NULL;
+}
+
+#endif /* _QOS_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
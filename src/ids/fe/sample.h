@@ -0,0 +1,518 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SAMPLE_H
+#define _SAMPLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include "conntrack.h"
+
+/*
+ * Sampled flow export
+ *
+ * Each exclusive task samples 1-in-N packets with its own PRNG; the gap to
+ * the next sampled packet is drawn uniformly from [1, 2N - 1] so that the
+ * mean is N, and a burst not containing a sampled packet only decrements the
+ * gap.  The sampled packets are aggregated per flow in a small table of the
+ * task (linear probing bounded by SAMPLE_MAX_PROBES; a sample that does not
+ * fit is exported by itself), and the table is flushed as records to a
+ * single-producer, single-consumer ring drained by the tickful task every
+ * SAMPLE_FLUSH_TICKS.  The tickful task scales the counters by N and exports
+ * them (e.g., as IPFIX messages).
+ */
+
+/* Maximum rate (the gap to the next sample is drawn from [1, 2 * rate - 1]) */
+#define SAMPLE_MAX_RATE         (1U << 31)
+#define SAMPLE_KEY_SIZE         48
+#define SAMPLE_TABLE_SIZE       1024
+#define SAMPLE_MAX_PROBES       8
+#define SAMPLE_EXPORT_QLEN      2048
+/* Flush interval (in ticks of conntrack) */
+#define SAMPLE_FLUSH_TICKS      2
+
+/* IPFIX (RFC 7011) */
+#define SAMPLE_IPFIX_VERSION    10
+#define SAMPLE_IPFIX_TEMPLATE4  256
+#define SAMPLE_IPFIX_TEMPLATE6  257
+
+/*
+ * Flow key: the flow in the direction of the packet (the endpoint 0 is the
+ * source), and the ingress port and VLAN
+ */
+struct sample_key {
+    struct ct_key flow;
+    uint16_t vid;
+    uint8_t port;
+    uint8_t rsvd[5];
+} __attribute__ ((packed));
+
+/*
+ * Entry of the table, and record exported to the tickful task (sampled
+ * packets and bytes); the address family of the key is zero if empty
+ */
+struct sample_entry {
+    uint8_t key[SAMPLE_KEY_SIZE];
+    uint64_t pkts;
+    uint64_t bytes;
+} __attribute__ ((aligned(64)));
+
+/*
+ * Sampler of a task
+ */
+struct sample {
+    /* Sampling rate (1-in-rate), and the packets to the next sample */
+    uint32_t rate;
+    uint32_t next;
+    /* PRNG state (xorshift32) */
+    uint32_t rng;
+    /* Last flushed tick */
+    uint32_t flushed;
+
+    /* Flow table */
+    struct sample_entry *entries;
+    uint32_t count;
+
+    /* Export ring */
+    struct sample_entry *records;
+    volatile uint32_t rhead;
+    volatile uint32_t rtail;
+
+    /* Statistics: packets observed (the sample pool), samples, and records
+       not exported as the ring was full */
+    volatile uint64_t pool;
+    volatile uint64_t samples;
+    uint64_t rdrops;
+};
+
+/*
+ * IPFIX message being built
+ */
+struct sample_ipfix {
+    uint8_t *buf;
+    int len;
+    int max;
+    /* Offset of the header of the current set (0 if none), and its
+       template */
+    int set;
+    uint16_t tid;
+    /* The number of data records */
+    int nrecs;
+};
+
+/*
+ * Size of the memory of a sampler
+ */
+static __inline__ size_t
+sample_memsize(void)
+{
+    return ((sizeof(struct sample) + 63) & ~63ULL)
+        + sizeof(struct sample_entry) * SAMPLE_TABLE_SIZE
+        + sizeof(struct sample_entry) * SAMPLE_EXPORT_QLEN;
+}
+
+/*
+ * Initialize a sampler on mem with a seed of the PRNG
+ */
+static __inline__ struct sample *
+sample_init(void *mem, uint32_t seed)
+{
+    struct sample *s;
+
+    s = (struct sample *)mem;
+    memset(s, 0, sizeof(struct sample));
+    s->rng = seed ? seed : 0x2545f491U;
+    s->entries = mem + ((sizeof(struct sample) + 63) & ~63ULL);
+    s->records = s->entries + SAMPLE_TABLE_SIZE;
+    memset(s->entries, 0, sizeof(struct sample_entry) * SAMPLE_TABLE_SIZE);
+
+    return s;
+}
+
+/*
+ * Gap to the next sampled packet
+ */
+static __inline__ uint32_t
+_sample_gap(struct sample *s)
+{
+    uint32_t x;
+
+    if ( s->rate <= 1 ) {
+        return 1;
+    }
+    x = s->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s->rng = x;
+
+    return 1 + x % (2 * s->rate - 1);
+}
+
+/*
+ * Select the packets to be sampled from a burst of n packets at the rate;
+ * the indices are stored to idx.  Returns the number of them.
+ */
+static __inline__ int
+sample_select(struct sample *s, uint32_t rate, int n, int *idx)
+{
+    uint32_t i;
+    int m;
+
+    s->pool += n;
+    if ( rate != s->rate ) {
+        /* Rate changed */
+        s->rate = rate;
+        s->next = _sample_gap(s);
+    }
+    if ( s->next > (uint32_t)n ) {
+        /* Common case */
+        s->next -= n;
+        return 0;
+    }
+    m = 0;
+    for ( i = s->next - 1; i < (uint32_t)n; i += _sample_gap(s) ) {
+        idx[m++] = i;
+    }
+    s->next = i - n + 1;
+    s->samples += m;
+
+    return m;
+}
+
+/*
+ * Hash of a key
+ */
+static __inline__ uint32_t
+_sample_hash(const uint8_t *key)
+{
+    uint64_t h;
+    uint64_t w;
+    int i;
+
+    h = 0;
+    for ( i = 0; i < SAMPLE_KEY_SIZE; i += 8 ) {
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    return h ^ (h >> 32);
+}
+
+/*
+ * Push a record to the export ring
+ */
+static __inline__ void
+_sample_export(struct sample *s, const struct sample_entry *e)
+{
+    uint32_t tail;
+
+    tail = (s->rtail + 1) & (SAMPLE_EXPORT_QLEN - 1);
+    if ( tail == s->rhead ) {
+        s->rdrops++;
+        return;
+    }
+    memcpy(&s->records[s->rtail], e, sizeof(struct sample_entry));
+    __sync_synchronize();
+    s->rtail = tail;
+}
+
+/*
+ * Account a sampled packet received at a port in a VLAN; non-IP packets are
+ * not accounted
+ */
+static __inline__ void
+sample_add(struct sample *s, const void *pkt, int len, int port, uint16_t vid)
+{
+    struct sample_key key;
+    struct sample_entry *e;
+    struct sample_entry tmp;
+    uint8_t addr[16];
+    uint16_t sport;
+    uint8_t tcpflags;
+    uint32_t h;
+    int dir;
+    int i;
+
+    if ( ct_key_build(&key.flow, pkt, len, &dir, &tcpflags) < 0 ) {
+        return;
+    }
+    if ( dir ) {
+        /* In the direction of the packet */
+        memcpy(addr, key.flow.addr[0], 16);
+        memcpy(key.flow.addr[0], key.flow.addr[1], 16);
+        memcpy(key.flow.addr[1], addr, 16);
+        sport = key.flow.port[0];
+        key.flow.port[0] = key.flow.port[1];
+        key.flow.port[1] = sport;
+    }
+    key.vid = vid;
+    key.port = port;
+    memset(key.rsvd, 0, sizeof(key.rsvd));
+
+    h = _sample_hash((const uint8_t *)&key);
+    for ( i = 0; i < SAMPLE_MAX_PROBES; i++ ) {
+        e = &s->entries[(h + i) & (SAMPLE_TABLE_SIZE - 1)];
+        if ( 0 == ((struct sample_key *)e->key)->flow.af ) {
+            /* New flow */
+            memcpy(e->key, &key, SAMPLE_KEY_SIZE);
+            e->pkts = 1;
+            e->bytes = len;
+            s->count++;
+            return;
+        }
+        if ( 0 == memcmp(e->key, &key, SAMPLE_KEY_SIZE) ) {
+            e->pkts++;
+            e->bytes += len;
+            return;
+        }
+    }
+
+    /* No room; exported by itself */
+    memcpy(tmp.key, &key, SAMPLE_KEY_SIZE);
+    tmp.pkts = 1;
+    tmp.bytes = len;
+    _sample_export(s, &tmp);
+}
+
+/*
+ * Flush the table to the export ring every SAMPLE_FLUSH_TICKS
+ */
+static __inline__ void
+sample_flush(struct sample *s, uint32_t tick)
+{
+    struct sample_entry *e;
+    uint32_t i;
+
+    if ( tick - s->flushed < SAMPLE_FLUSH_TICKS ) {
+        return;
+    }
+    s->flushed = tick;
+    for ( i = 0; i < SAMPLE_TABLE_SIZE && s->count > 0; i++ ) {
+        e = &s->entries[i];
+        if ( 0 == ((struct sample_key *)e->key)->flow.af ) {
+            continue;
+        }
+        _sample_export(s, e);
+        ((struct sample_key *)e->key)->flow.af = 0;
+        s->count--;
+    }
+}
+
+/*
+ * Dequeue a record from the export ring (tickful task); returns 1 if
+ * dequeued, or 0 if empty
+ */
+static __inline__ int
+sample_export_dequeue(struct sample *s, struct sample_entry *r)
+{
+    if ( s->rhead == s->rtail ) {
+        return 0;
+    }
+    __sync_synchronize();
+    memcpy(r, &s->records[s->rhead], sizeof(struct sample_entry));
+    __sync_synchronize();
+    s->rhead = (s->rhead + 1) & (SAMPLE_EXPORT_QLEN - 1);
+
+    return 1;
+}
+
+/*
+ * Write a 16-bit or 32-bit field in network byte order
+ */
+static __inline__ void
+_sample_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+static __inline__ void
+_sample_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+static __inline__ void
+_sample_put64(uint8_t *p, uint64_t v)
+{
+    _sample_put32(p, v >> 32);
+    _sample_put32(p + 4, v);
+}
+
+/*
+ * Start an IPFIX message with the templates in buf of max bytes; returns -1
+ * if too small
+ */
+static __inline__ int
+sample_ipfix_init(struct sample_ipfix *x, uint8_t *buf, int max,
+                  uint32_t domain, uint32_t seq, uint32_t now)
+{
+    /* Information elements (ID and length) of the IPv4 and IPv6 flows */
+    static const uint16_t fields4[] = {
+        8, 4,           /* sourceIPv4Address */
+        12, 4,          /* destinationIPv4Address */
+        7, 2,           /* sourceTransportPort */
+        11, 2,          /* destinationTransportPort */
+        4, 1,           /* protocolIdentifier */
+        10, 4,          /* ingressInterface */
+        58, 2,          /* vlanId */
+        2, 8,           /* packetDeltaCount */
+        1, 8,           /* octetDeltaCount */
+        34, 4,          /* samplingInterval */
+    };
+    static const uint16_t fields6[] = {
+        27, 16,         /* sourceIPv6Address */
+        28, 16,         /* destinationIPv6Address */
+        7, 2, 11, 2, 4, 1, 10, 4, 58, 2, 2, 8, 1, 8, 34, 4,
+    };
+    int nf;
+    int i;
+    int p;
+
+    nf = sizeof(fields4) / sizeof(uint16_t) / 2;
+    if ( max < 16 + 4 + 2 * (4 + nf * 4) ) {
+        return -1;
+    }
+    x->buf = buf;
+    x->max = max;
+    x->set = 0;
+    x->tid = 0;
+    x->nrecs = 0;
+
+    /* Message header (the length is written at the end) */
+    _sample_put16(buf, SAMPLE_IPFIX_VERSION);
+    _sample_put32(buf + 4, now);
+    _sample_put32(buf + 8, seq);
+    _sample_put32(buf + 12, domain);
+
+    /* Template set */
+    p = 16;
+    _sample_put16(buf + p, 2);
+    _sample_put16(buf + p + 2, 4 + 2 * (4 + nf * 4));
+    p += 4;
+    _sample_put16(buf + p, SAMPLE_IPFIX_TEMPLATE4);
+    _sample_put16(buf + p + 2, nf);
+    p += 4;
+    for ( i = 0; i < nf * 2; i++, p += 2 ) {
+        _sample_put16(buf + p, fields4[i]);
+    }
+    _sample_put16(buf + p, SAMPLE_IPFIX_TEMPLATE6);
+    _sample_put16(buf + p + 2, nf);
+    p += 4;
+    for ( i = 0; i < nf * 2; i++, p += 2 ) {
+        _sample_put16(buf + p, fields6[i]);
+    }
+    x->len = p;
+
+    return 0;
+}
+
+/*
+ * Close the current data set
+ */
+static __inline__ void
+_sample_ipfix_close(struct sample_ipfix *x)
+{
+    if ( 0 != x->set ) {
+        _sample_put16(x->buf + x->set + 2, x->len - x->set);
+        x->set = 0;
+    }
+}
+
+/*
+ * Add a data record of a flow (the estimated counters) to the message;
+ * returns -1 if the message is full
+ */
+static __inline__ int
+sample_ipfix_add(struct sample_ipfix *x, const struct sample_key *key,
+                 uint64_t pkts, uint64_t bytes, uint32_t rate)
+{
+    uint16_t tid;
+    int alen;
+    int need;
+    uint8_t *p;
+
+    if ( 4 == key->flow.af ) {
+        tid = SAMPLE_IPFIX_TEMPLATE4;
+        alen = 4;
+    } else {
+        tid = SAMPLE_IPFIX_TEMPLATE6;
+        alen = 16;
+    }
+    need = 2 * alen + 31 + (tid != x->tid || 0 == x->set ? 4 : 0);
+    if ( x->len + need > x->max ) {
+        return -1;
+    }
+    if ( tid != x->tid || 0 == x->set ) {
+        /* New data set of the template */
+        _sample_ipfix_close(x);
+        x->set = x->len;
+        x->tid = tid;
+        _sample_put16(x->buf + x->len, tid);
+        x->len += 4;
+    }
+    p = x->buf + x->len;
+    memcpy(p, key->flow.addr[0], alen);
+    memcpy(p + alen, key->flow.addr[1], alen);
+    p += 2 * alen;
+    /* Ports in network byte order */
+    memcpy(p, &key->flow.port[0], 2);
+    memcpy(p + 2, &key->flow.port[1], 2);
+    p[4] = key->flow.proto;
+    _sample_put32(p + 5, key->port);
+    _sample_put16(p + 9, key->vid);
+    _sample_put64(p + 11, pkts);
+    _sample_put64(p + 19, bytes);
+    _sample_put32(p + 27, rate);
+    x->len += 2 * alen + 31;
+    x->nrecs++;
+
+    return 0;
+}
+
+/*
+ * Finish the message; returns its length
+ */
+static __inline__ int
+sample_ipfix_finish(struct sample_ipfix *x)
+{
+    _sample_ipfix_close(x);
+    _sample_put16(x->buf + 2, x->len);
+
+    return x->len;
+}
+
+#endif /* _SAMPLE_H */
+
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
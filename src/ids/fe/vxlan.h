@@ -0,0 +1,214 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _VXLAN_H
+#define _VXLAN_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/net/ethernet.h>
+#include <sys/net/ip.h>
+#include <sys/net/udp.h>
+
+/*
+ * VXLAN (RFC 7348)
+ *
+ * Ethernet frames of a segment (identified by a 24-bit VNI) are carried
+ * between VXLAN tunnel end points (VTEPs) in UDP over IPv4.  The outer
+ * headers to a remote VTEP are built once into a template, and copied in
+ * front of the inner frame on encapsulation; only the lengths, the IPv4
+ * header checksum (updated from the partial sum of the template), the UDP
+ * source port, and the VNI are written per packet.  The UDP checksum is zero
+ * (allowed over IPv4).
+ */
+
+#define VXLAN_PORT              4789
+#define VXLAN_FLAG_VNI          0x08    /* I flag: the VNI is valid */
+#define VXLAN_VNI_MAX           0xffffff
+
+/* Outer headers (Ethernet, IPv4 without options, UDP, and VXLAN) */
+#define VXLAN_HDRLEN            8
+#define VXLAN_ENCAP_LEN         (sizeof(struct ether_header) \
+                                 + sizeof(struct ip) + sizeof(struct udphdr) \
+                                 + VXLAN_HDRLEN)
+
+/* Range of the UDP source ports carrying the entropy of the inner flows
+   (the dynamic ports) */
+#define VXLAN_SPORT_BASE        0xc000
+#define VXLAN_SPORT_MASK        0x3fff
+
+/*
+ * VXLAN header
+ */
+struct vxlan_hdr {
+    uint8_t flags;
+    uint8_t reserved1[3];
+    /* VNI in the upper 24 bits (the lower 8 bits are reserved) */
+    uint32_t vni;
+} __attribute__ ((packed));
+
+/*
+ * Outer headers to a remote VTEP
+ */
+struct vxlan_tmpl {
+    uint8_t hdr[VXLAN_ENCAP_LEN];
+    /* One's complement sum of the IPv4 header with zero total length and
+       checksum */
+    uint32_t sum;
+};
+
+/*
+ * Build the template of the outer headers from the local address saddr to the
+ * remote address daddr (network byte order); the destination MAC address is
+ * written per packet from the adjacency of the next hop
+ */
+static __inline__ void
+vxlan_tmpl_build(struct vxlan_tmpl *tmpl, const uint8_t *smac, uint32_t saddr,
+                 uint32_t daddr)
+{
+    struct ether_header *eth;
+    struct ip *ip;
+    struct udphdr *udp;
+    struct vxlan_hdr *vx;
+    const uint8_t *p;
+    int i;
+
+    memset(tmpl, 0, sizeof(struct vxlan_tmpl));
+    eth = (struct ether_header *)tmpl->hdr;
+    ip = (struct ip *)(eth + 1);
+    udp = (struct udphdr *)(ip + 1);
+    vx = (struct vxlan_hdr *)(udp + 1);
+    memcpy(eth->ether_shost, smac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+    /* Not fragmented by the routers in the underlay (RFC 7348 Section 4.3) */
+    ip->ip_vhl = (IPVERSION << 4) | (sizeof(struct ip) >> 2);
+    ip->ip_off = htons(IP_DF);
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_UDP;
+    memcpy(&ip->ip_src, &saddr, 4);
+    memcpy(&ip->ip_dst, &daddr, 4);
+    udp->uh_dport = htons(VXLAN_PORT);
+    vx->flags = VXLAN_FLAG_VNI;
+
+    p = (const uint8_t *)ip;
+    for ( i = 0; i < (int)sizeof(struct ip); i += 2 ) {
+        tmpl->sum += ((uint32_t)p[i] << 8) | p[i + 1];
+    }
+}
+
+/*
+ * Encapsulate the inner frame at pkt (len bytes) with the VNI in the headroom
+ * in front of it; the UDP source port is taken from the hash of the inner
+ * flow.  Returns the head of the outer frame (VXLAN_ENCAP_LEN bytes longer).
+ */
+static __inline__ uint8_t *
+vxlan_encap(const struct vxlan_tmpl *tmpl, uint8_t *pkt, int len,
+            uint32_t vni, uint32_t hash)
+{
+    uint8_t *outer;
+    struct ip *ip;
+    struct udphdr *udp;
+    struct vxlan_hdr *vx;
+    uint32_t sum;
+    int iplen;
+
+    outer = pkt - VXLAN_ENCAP_LEN;
+    memcpy(outer, tmpl->hdr, VXLAN_ENCAP_LEN);
+    ip = (struct ip *)(outer + sizeof(struct ether_header));
+    udp = (struct udphdr *)(ip + 1);
+    vx = (struct vxlan_hdr *)(udp + 1);
+
+    iplen = len + VXLAN_ENCAP_LEN - sizeof(struct ether_header);
+    ip->ip_len = htons(iplen);
+    sum = tmpl->sum + iplen;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    ip->ip_sum = htons(~sum);
+    udp->uh_sport = htons(VXLAN_SPORT_BASE | (hash & VXLAN_SPORT_MASK));
+    udp->uh_ulen = htons(iplen - sizeof(struct ip));
+    vx->vni = htonl(vni << 8);
+
+    return outer;
+}
+
+/*
+ * Parse a frame destined for the local VTEP address laddr (network byte
+ * order); returns the offset of the inner frame with the VNI and the source
+ * address of the remote VTEP (network byte order), 0 if the frame is not
+ * VXLAN to laddr, or -1 if malformed
+ */
+static __inline__ int
+vxlan_decap(const uint8_t *pkt, int len, uint32_t laddr, uint32_t *vni,
+            uint32_t *raddr)
+{
+    const struct ether_header *eth;
+    const struct ip *ip;
+    const struct udphdr *udp;
+    const struct vxlan_hdr *vx;
+    int hlen;
+    int off;
+
+    eth = (const struct ether_header *)pkt;
+    if ( ETHERTYPE_IP != ntohs(eth->ether_type)
+         || len < (int)(sizeof(struct ether_header) + sizeof(struct ip)) ) {
+        return 0;
+    }
+    ip = (const struct ip *)(eth + 1);
+    if ( 0 != memcmp(&ip->ip_dst, &laddr, 4) || IPPROTO_UDP != ip->ip_p
+         || (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) ) {
+        /* Fragments are not reassembled */
+        return 0;
+    }
+    hlen = IP_VHL_HL(ip->ip_vhl) * 4;
+    off = sizeof(struct ether_header) + hlen + sizeof(struct udphdr);
+    if ( hlen < (int)sizeof(struct ip) || len < off ) {
+        return 0;
+    }
+    udp = (const struct udphdr *)((const uint8_t *)ip + hlen);
+    if ( VXLAN_PORT != ntohs(udp->uh_dport) ) {
+        return 0;
+    }
+
+    vx = (const struct vxlan_hdr *)(udp + 1);
+    off += VXLAN_HDRLEN;
+    if ( len < off + (int)sizeof(struct ether_header)
+         || !(vx->flags & VXLAN_FLAG_VNI) ) {
+        return -1;
+    }
+    *vni = ntohl(vx->vni) >> 8;
+    memcpy(raddr, &ip->ip_src, 4);
+
+    return off;
+}
+
+#endif /* _VXLAN_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
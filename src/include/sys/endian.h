@@ -0,0 +1,72 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SYS_ENDIAN_H
+#define _SYS_ENDIAN_H
+
+#include <stdint.h>
+
+/*
+ * Byte swapping
+ */
+static __inline__ uint16_t
+bswap16(uint16_t x)
+{
+    return __builtin_bswap16(x);
+}
+static __inline__ uint32_t
+bswap32(uint32_t x)
+{
+    return __builtin_bswap32(x);
+}
+static __inline__ uint64_t
+bswap64(uint64_t x)
+{
+    return __builtin_bswap64(x);
+}
+
+/*
+ * Conversion between the host (little endian) and the network byte order
+ */
+#define htobe16(x)      bswap16((x))
+#define htobe32(x)      bswap32((x))
+#define htobe64(x)      bswap64((x))
+#define be16toh(x)      bswap16((x))
+#define be32toh(x)      bswap32((x))
+#define be64toh(x)      bswap64((x))
+
+#define htons(x)        htobe16((x))
+#define htonl(x)        htobe32((x))
+#define ntohs(x)        be16toh((x))
+#define ntohl(x)        be32toh((x))
+
+#endif /* _SYS_ENDIAN_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -34,6 +34,12 @@
 
 #define ETHER_VLAN_ENCAP_LEN    4
 
+/* Ether types */
+#define ETHERTYPE_IP            0x0800
+#define ETHERTYPE_ARP           0x0806
+#define ETHERTYPE_VLAN          0x8100
+#define ETHERTYPE_IPV6          0x86dd
+
 #include <stdint.h>
 
 /*
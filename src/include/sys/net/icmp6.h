@@ -0,0 +1,80 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SYS_NET_ICMP6_H
+#define _SYS_NET_ICMP6_H
+
+#include <stdint.h>
+
+/*
+ * ICMPv6 header
+ */
+struct icmp6_hdr {
+    uint8_t     icmp6_type;
+    uint8_t     icmp6_code;
+    uint16_t    icmp6_cksum;
+    uint32_t    icmp6_data32;
+} __attribute__ ((packed));
+
+/* Neighbor discovery */
+#define ND_NEIGHBOR_SOLICIT     135
+#define ND_NEIGHBOR_ADVERT      136
+
+/* Flags of neighbor advertisement (in network byte order) */
+#define ND_NA_FLAG_ROUTER       0x00000080
+#define ND_NA_FLAG_SOLICITED    0x00000040
+#define ND_NA_FLAG_OVERRIDE     0x00000020
+
+/*
+ * Neighbor solicitation/advertisement
+ */
+struct nd_neighbor_solicit {
+    struct icmp6_hdr nd_ns_hdr;
+    uint8_t     nd_ns_target[16];
+} __attribute__ ((packed));
+struct nd_neighbor_advert {
+    struct icmp6_hdr nd_na_hdr;
+    uint8_t     nd_na_target[16];
+} __attribute__ ((packed));
+
+/*
+ * Neighbor discovery option
+ */
+struct nd_opt_hdr {
+    uint8_t     nd_opt_type;
+    uint8_t     nd_opt_len;     /* in 8 octets */
+} __attribute__ ((packed));
+
+#define ND_OPT_SOURCE_LINKADDR  1
+#define ND_OPT_TARGET_LINKADDR  2
+
+#endif /* _SYS_NET_ICMP6_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
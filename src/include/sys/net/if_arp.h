@@ -0,0 +1,65 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SYS_NET_IF_ARP_H
+#define _SYS_NET_IF_ARP_H
+
+#include <stdint.h>
+
+#define ARPHRD_ETHER    1
+
+#define ARPOP_REQUEST   1
+#define ARPOP_REPLY     2
+
+/*
+ * ARP header
+ */
+struct arphdr {
+    uint16_t    ar_hrd;         /* Hardware type */
+    uint16_t    ar_pro;         /* Protocol type */
+    uint8_t     ar_hln;         /* Hardware address length */
+    uint8_t     ar_pln;         /* Protocol address length */
+    uint16_t    ar_op;
+} __attribute__ ((packed));
+
+/*
+ * ARP packet for IPv4 over Ethernet
+ */
+struct ether_arp {
+    struct arphdr ea_hdr;
+    uint8_t     arp_sha[6];     /* Sender hardware address */
+    uint8_t     arp_spa[4];     /* Sender protocol address */
+    uint8_t     arp_tha[6];     /* Target hardware address */
+    uint8_t     arp_tpa[4];     /* Target protocol address */
+} __attribute__ ((packed));
+
+#endif /* _SYS_NET_IF_ARP_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,70 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SYS_NET_IP_H
+#define _SYS_NET_IP_H
+
+#include <stdint.h>
+
+#define IPVERSION       4
+#define IP_MAXTTL       255
+
+/* Protocols */
+#define IPPROTO_ICMP    1
+#define IPPROTO_TCP     6
+#define IPPROTO_UDP     17
+
+/*
+ * IPv4 header
+ */
+struct ip {
+    uint8_t     ip_vhl;         /* Version and header length (4 bits each) */
+    uint8_t     ip_tos;
+    uint16_t    ip_len;
+    uint16_t    ip_id;
+    uint16_t    ip_off;
+    uint8_t     ip_ttl;
+    uint8_t     ip_p;
+    uint16_t    ip_sum;
+    uint32_t    ip_src;
+    uint32_t    ip_dst;
+} __attribute__ ((packed));
+
+#define IP_VHL_V(vhl)   ((vhl) >> 4)
+#define IP_VHL_HL(vhl)  ((vhl) & 0x0f)  /* in 32-bit words */
+
+/* Fragment flags and offset (ip_off in host byte order) */
+#define IP_DF           0x4000
+#define IP_MF           0x2000
+#define IP_OFFMASK      0x1fff
+
+#endif /* _SYS_NET_IP_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
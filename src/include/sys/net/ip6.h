@@ -0,0 +1,56 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SYS_NET_IP6_H
+#define _SYS_NET_IP6_H
+
+#include <stdint.h>
+
+#define IPPROTO_ICMPV6      58
+
+/*
+ * IPv6 header
+ */
+struct ip6_hdr {
+    uint32_t    ip6_flow;       /* Version (4 bits), traffic class (8 bits),
+                                   and flow label (20 bits) */
+    uint16_t    ip6_plen;       /* Payload length */
+    uint8_t     ip6_nxt;        /* Next header */
+    uint8_t     ip6_hlim;       /* Hop limit */
+    uint8_t     ip6_src[16];
+    uint8_t     ip6_dst[16];
+} __attribute__ ((packed));
+
+#define IPV6_VERSION        0x60
+#define IPV6_VERSION_MASK   0xf0
+
+#endif /* _SYS_NET_IP6_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
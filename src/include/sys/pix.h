@@ -30,6 +30,8 @@
 
 /* Must be consistent with MAX_PROCSSORS in kernel.h */
 #define PIX_MAX_CPU             256
+/* Must be consistent with PMEM_NUMA_MAX_DOMAINS in kernel.h */
+#define PIX_MAX_DOMAINS         16
 
 #define PIX_PKT_SIZE            (10240 + 128)
 #define PIX_PKT_HDROFF          512
@@ -82,6 +84,7 @@ struct syspix_cpu_table {
 
 /* Prototype declarations */
 int pix_ldcpuconf(struct syspix_cpu_table *);
+int pix_pci_domain(int, int, int);
 struct pix_buffer_pool * pix_create_buffer_pool(size_t);
 void *pix_malloc(size_t);
 
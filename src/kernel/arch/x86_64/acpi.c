@@ -655,6 +655,61 @@ acpi_memory_prox_domain(struct acpi *acpi, u64 m, u64 *rbase, u64 *rlen)
     return -1;
 }
 
+/*
+ * Resolve the proximity domain of a PCI device from the Generic Initiator
+ * Affinity Structures
+ */
+int
+acpi_pci_prox_domain(struct acpi *acpi, int segment, int bus, int slot,
+                     int func)
+{
+    u64 addr;
+    struct acpi_sdt_srat_common *srat;
+    struct acpi_sdt_srat_generic_initiator *srat_gi;
+    u32 len;
+    u16 bdf;
+
+    /* Check the pointer to the SRAT */
+    if ( NULL == acpi->srat ) {
+        return -1;
+    }
+
+    /* Bus[15:8], device[7:3], and function[2:0] */
+    bdf = ((bus & 0xff) << 8) | ((slot & 0x1f) << 3) | (func & 0x7);
+
+    len = 0;
+    addr = (u64)acpi->srat;
+    len += sizeof(struct acpi_sdt_hdr) + sizeof(struct acpi_sdt_srat_hdr);
+
+    while ( len < acpi->srat->length ) {
+        srat = (struct acpi_sdt_srat_common *)(addr + len);
+        if ( len + srat->length > acpi->srat->length ) {
+            /* Oversized */
+            break;
+        }
+        switch ( srat->type ) {
+        case 5:
+            /* Generic Initiator */
+            srat_gi = (struct acpi_sdt_srat_generic_initiator *)srat;
+            if ( 1 == srat_gi->device_handle_type
+                 && (srat_gi->flags & 1)
+                 && srat_gi->pci_segment == segment
+                 && srat_gi->pci_bdf == bdf ) {
+                return srat_gi->proximity_domain;
+            }
+            break;
+        default:
+            /* Other or unknown */
+            ;
+        }
+
+        /* Next entry */
+        len += srat->length;
+    }
+
+    return -1;
+}
+
 /*
  * Count the number of entries of memory domains from ACPI SRAT
  */
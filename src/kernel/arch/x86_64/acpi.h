@@ -231,6 +231,19 @@ struct acpi_sdt_srat_lapicx2 {
     u32 clock_domain;
     u32 reserved2;
 } __attribute__ ((packed));
+struct acpi_sdt_srat_generic_initiator {
+    u8 type;                    /* 5: Generic Initiator */
+    u8 length;                  /* 32 */
+    u8 reserved1;
+    u8 device_handle_type;      /* 0: ACPI, 1: PCI */
+    u32 proximity_domain;
+    /* PCI device handle: segment, BDF, and reserved[12] */
+    u16 pci_segment;
+    u16 pci_bdf;
+    u8 reserved2[12];
+    u32 flags;
+    u32 reserved3;
+} __attribute__ ((packed));
 struct acpi_sdt_srat_hdr {
     /* acpi_sdt_hdr */
     u8 reserved1[4];
@@ -264,6 +277,7 @@ u64 acpi_get_timer_hz(void);
 int acpi_is_numa(struct acpi *);
 int acpi_lapic_prox_domain(struct acpi *, int);
 int acpi_memory_prox_domain(struct acpi *, u64, u64 *, u64 *);
+int acpi_pci_prox_domain(struct acpi *, int, int, int, int);
 int acpi_memory_count_entries(struct acpi *);
 
 int acpi_poweroff(struct acpi *);
@@ -215,12 +215,20 @@ lapic_estimate_freq(void)
 }
 
 /*
- * Start local APIC timer (oneshot)
+ * Start local APIC timer (oneshot in milliseconds)
  */
 void
 lapic_oneshot_timer(u64 msec, u8 vec)
 {
-    /* Estimate frequency first */
+    lapic_oneshot_timer_usec(msec * 1000, vec);
+}
+
+/*
+ * Start local APIC timer (oneshot in microseconds)
+ */
+void
+lapic_oneshot_timer_usec(u64 usec, u8 vec)
+{
     u64 busfreq;
     struct cpu_data *pdata;
     u64 apic_base;
@@ -234,7 +242,7 @@ lapic_oneshot_timer(u64 msec, u8 vec)
     /* Set counter */
     mfwrite32(apic_base + APIC_LVT_TMR, APIC_LVT_ONESHOT | (u32)vec);
     mfwrite32(apic_base + APIC_TMRDIV, APIC_TMRDIV_X16);
-    mfwrite32(apic_base + APIC_INITTMR, msec * (busfreq >> 4) / 1000);
+    mfwrite32(apic_base + APIC_INITTMR, usec * (busfreq >> 4) / 1000000);
 }
 
 /*
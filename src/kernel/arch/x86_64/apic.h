@@ -63,6 +63,7 @@ int lapic_id(void);
 u64 lapic_estimate_freq(void);
 void lapic_start_timer(u64, u8);
 void lapic_oneshot_timer(u64, u8);
+void lapic_oneshot_timer_usec(u64, u8);
 void lapic_stop_timer(void);
 void ioapic_init(void);
 void ioapic_map_intr(u64, u64, u64);
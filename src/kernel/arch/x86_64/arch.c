@@ -657,6 +657,54 @@ arch_pix_task(int id, struct ktask *t)
     lapic_send_fixed_ipi(id, IV_PIXIPI);
 }
 
+/*
+ * Sleep an exclusive processor
+ *
+ * If addr is specified and the processor supports MONITOR/MWAIT, the processor
+ * waits for a write to the cache line of addr (e.g., a descriptor written back
+ * by a NIC) as long as *addr equals val.  Otherwise, it halts until the next
+ * interrupt.  If usec is non-zero, the one-shot local APIC timer bounds the
+ * sleep.  This must be called with interrupts disabled.  A tickful processor
+ * does not sleep here, since its local APIC timer drives the scheduler.
+ */
+void
+arch_xpsleep(volatile u64 *addr, u64 val, u64 usec)
+{
+    static int mwait = -1;
+    struct cpu_data *pdata;
+    u64 rcx;
+    u64 rdx;
+
+    pdata = this_cpu();
+    if ( pdata->flags & (1 << 1) ) {
+        /* Tickful */
+        return;
+    }
+
+    if ( mwait < 0 ) {
+        /* CPUID.01H:ECX.MONITOR[bit 3] */
+        cpuid(1, &rcx, &rdx);
+        mwait = (rcx & (1 << 3)) ? 1 : 0;
+    }
+
+    if ( usec > 0 ) {
+        lapic_oneshot_timer_usec(usec, IV_LOC_TMR_XP);
+    }
+
+    if ( NULL != addr && mwait ) {
+        monitor(addr);
+        if ( *addr == val ) {
+            sti_mwait();
+        }
+    } else {
+        halt();
+    }
+
+    if ( usec > 0 ) {
+        lapic_stop_timer();
+    }
+}
+
 /*
  * Load CPU table
  */
@@ -691,6 +739,15 @@ arch_load_cpu_table(struct syspix_cpu_table *cputable)
     return n;
 }
 
+/*
+ * Resolve the NUMA domain of a PCI device
+ */
+int
+arch_pci_domain(int bus, int slot, int func)
+{
+    return acpi_pci_prox_domain(&arch_acpi, 0, bus, slot, func);
+}
+
 /*
  * Store (Set) CPU table
  */
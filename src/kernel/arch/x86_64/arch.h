@@ -403,6 +403,8 @@ void intr_crash(void);
 void task_restart(void);
 void task_replace(void *);
 void pause(void);
+void monitor(volatile void *);
+void sti_mwait(void);
 u8 inb(u16);
 u16 inw(u16);
 u32 inl(u16);
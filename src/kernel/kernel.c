@@ -73,6 +73,7 @@ kinit(void)
     g_syscall_table[SYS_pix_cpu_table] = sys_pix_cpu_table;
     g_syscall_table[SYS_pix_create_job] = sys_pix_create_job;
     g_syscall_table[SYS_pix_malloc] = sys_pix_malloc;
+    g_syscall_table[SYS_pix_pci_domain] = sys_pix_pci_domain;
     /* Others */
     g_syscall_table[SYS_xpsleep] = sys_xpsleep;
     g_syscall_table[SYS_debug] = sys_debug;
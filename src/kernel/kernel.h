@@ -834,9 +834,10 @@ int sys_gettimeofday(struct timeval *__restrict__, void *__restrict__);
 /* PIX-specific system calls */
 int sys_pix_cpu_table(int, struct syspix_cpu_table *);
 int sys_pix_create_job(int, void *(*)(void *), void *);
-int sys_pix_malloc(size_t, void **, void **);
+int sys_pix_malloc(size_t, void **, void **, int);
+int sys_pix_pci_domain(int, int, int);
 /* Others */
-void sys_xpsleep(void);
+void sys_xpsleep(volatile u64 *, u64, u64);
 void sys_debug(int);
 int sys_driver(int, void *);
 int sys_sysarch(int, void *);
@@ -867,8 +868,10 @@ void arch_switch_page_table(struct vmem_space *);
 
 int arch_load_cpu_table(struct syspix_cpu_table *);
 int arch_store_cpu_table(struct syspix_cpu_table *);
+int arch_pci_domain(int, int, int);
 
 u64 arch_usec_since_boot(void);
+void arch_xpsleep(volatile u64 *, u64, u64);
 
 #endif /* _KERNEL_H */
 
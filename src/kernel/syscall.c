@@ -1031,11 +1031,25 @@ sys_reboot(int howto)
 
 /*
  * Sleep this exclusive processor
+ *
+ * SYNOPSIS
+ *      void
+ *      sys_xpsleep(volatile u64 *addr, u64 val, u64 usec);
+ *
+ * DESCRIPTION
+ *      The sys_xpsleep() function puts the calling exclusive processor into a
+ *      low-power state.  If addr is not NULL, the processor is woken up by a
+ *      write to the cache line containing addr (MONITOR/MWAIT) unless *addr
+ *      already differs from val.  If usec is not zero, the processor is woken
+ *      up after usec microseconds at the latest.
+ *
+ * RETURN VALUES
+ *      The sys_xpsleep() function does not return a value.
  */
 void
-sys_xpsleep(void)
+sys_xpsleep(volatile u64 *addr, u64 val, u64 usec)
 {
-    __asm__ __volatile__ ("sti;hlt");
+    arch_xpsleep(addr, val, usec);
 }
 
 /*
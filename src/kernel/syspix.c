@@ -27,10 +27,12 @@
 #include "kernel.h"
 
 /*
- * Allocate mapped and contiguous memory region for packet buffers etc
+ * Allocate mapped and contiguous memory region for packet buffers etc from the
+ * NUMA domain specified by domain (or from the low memory if domain is
+ * negative or the domain has no memory available)
  */
 int
-sys_pix_malloc(size_t len, void **pa, void **va)
+sys_pix_malloc(size_t len, void **pa, void **va, int domain)
 {
     struct ktask *t;
     struct proc *proc;
@@ -60,7 +62,13 @@ sys_pix_malloc(size_t len, void **pa, void **va)
     }
 
     /* Allocate physical memory */
-    paddr = pmem_prim_alloc_pages(PMEM_ZONE_LOWMEM, order);
+    paddr = NULL;
+    if ( domain >= 0 && domain < PMEM_NUMA_MAX_DOMAINS ) {
+        paddr = pmem_prim_alloc_pages(PMEM_ZONE_NUMA(domain), order);
+    }
+    if ( NULL == paddr ) {
+        paddr = pmem_prim_alloc_pages(PMEM_ZONE_LOWMEM, order);
+    }
     if ( NULL == paddr ) {
         /* Could not allocate physical memory */
         vmem_free_pages(proc->vmem, vaddr);
@@ -86,6 +94,15 @@ sys_pix_malloc(size_t len, void **pa, void **va)
     return 0;
 }
 
+/*
+ * Resolve the NUMA domain of a PCI device
+ */
+int
+sys_pix_pci_domain(int bus, int slot, int func)
+{
+    return arch_pci_domain(bus, slot, func);
+}
+
 /*
  * Get/Set CPU configuration table
  */
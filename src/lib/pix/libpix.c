@@ -42,6 +42,15 @@ pix_ldcpuconf(struct syspix_cpu_table *cputable)
     return n;
 }
 
+/*
+ * Resolve the NUMA domain of a PCI device (or -1 if unknown)
+ */
+int
+pix_pci_domain(int bus, int slot, int func)
+{
+    return syscall(SYS_pix_pci_domain, bus, slot, func);
+}
+
 /*
  * Create a buffer pool
  */
@@ -67,7 +76,7 @@ pix_create_buffer_pool(size_t len)
 
     /* Calculate the memory size to be allocated */
     sz = PIX_PKT_SIZE * len;
-    ret = syscall(SYS_pix_malloc, sz, &paddr, &vaddr);
+    ret = syscall(SYS_pix_malloc, sz, &paddr, &vaddr, -1);
     if ( ret < 0 ) {
         free(pool);
         return NULL;
@@ -0,0 +1,789 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Host-side benchmark of the fast path of the forwarding engine: ids/fe/fe.c
+ * is built as a Linux userspace program with the system calls of the kernel
+ * emulated below, and memory-backed devices replay synthetic (or pcap)
+ * traffic through fe_fpp_poll() at full speed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* System calls of the kernel (must be consistent with sys/syscall.h) */
+#define SYS_pix_cpu_table       801
+#define SYS_pix_create_job      802
+#define SYS_pix_malloc          803
+#define SYS_pix_pci_domain      804
+#define SYS_xpsleep             1020
+
+/* Build the forwarding engine against the emulated system calls */
+#define syscall fe_host_syscall
+#define main    fe_main
+#include "../ids/fe/fe.c"
+#undef main
+#undef syscall
+
+#define BENCH_MAX_SAMPLES       (1 << 20)
+#define BENCH_WARMUP_FRAMES     4096
+#define BENCH_FLOWS             256
+#define BENCH_PCAP_MAGIC        0xa1b2c3d4
+#define BENCH_PCAP_MAGIC_NS     0xa1b23c4d
+
+/* Emulated CPU table and PCI devices */
+static int bench_ntasks = 1;
+static int bench_nports = 2;
+
+/*
+ * Benchmark mode
+ */
+enum bench_mode {
+    BENCH_BRIDGE,
+    BENCH_ROUTE4,
+    BENCH_PCAP,
+};
+
+/*
+ * Per-task measurement
+ */
+struct bench_task {
+    struct fe_task *t;
+    pthread_t th;
+    /* Cycles of the polls that received packets, and their packets */
+    uint64_t *cycles;
+    uint64_t nsamples;
+    uint64_t npkts;
+};
+
+/*
+ * Emulated system calls
+ */
+unsigned long long
+fe_host_syscall(int nr, ...)
+{
+    va_list ap;
+    struct syspix_cpu_table *cputable;
+    pthread_t th;
+    void *(*func)(void *);
+    void *args;
+    void **pa;
+    void **va;
+    size_t len;
+    void *m;
+    int i;
+    int ret;
+
+    ret = -1;
+    va_start(ap, nr);
+    switch ( nr ) {
+    case SYS_pix_cpu_table:
+        /* One tickful processor followed by the exclusive processors */
+        (void)va_arg(ap, int);
+        cputable = va_arg(ap, struct syspix_cpu_table *);
+        memset(cputable, 0, sizeof(struct syspix_cpu_table));
+        for ( i = 0; i <= bench_ntasks; i++ ) {
+            cputable->cpus[i].present = 1;
+            cputable->cpus[i].type
+                = 0 == i ? SYSPIX_CPU_TICKFUL : SYSPIX_CPU_EXCLUSIVE;
+            cputable->cpus[i].domain = 0;
+        }
+        ret = bench_ntasks + 1;
+        break;
+    case SYS_pix_create_job:
+        (void)va_arg(ap, int);
+        func = va_arg(ap, void *);
+        args = va_arg(ap, void *);
+        ret = pthread_create(&th, NULL, func, args);
+        break;
+    case SYS_pix_malloc:
+        /* The physical address is the virtual address */
+        len = va_arg(ap, size_t);
+        pa = va_arg(ap, void **);
+        va = va_arg(ap, void **);
+        m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( MAP_FAILED == m ) {
+            break;
+        }
+        *pa = m;
+        *va = m;
+        ret = 0;
+        break;
+    case SYS_pix_pci_domain:
+        ret = -1;
+        break;
+    case SYS_xpsleep:
+        (void)va_arg(ap, void *);
+        (void)va_arg(ap, int);
+        usleep(va_arg(ap, int));
+        ret = 0;
+        break;
+    default:
+        ;
+    }
+    va_end(ap);
+
+    return ret;
+}
+
+/*
+ * Library functions of the kernel referred to by the hardware drivers (never
+ * called for memory-backed devices)
+ */
+int
+pix_ldcpuconf(struct syspix_cpu_table *cputable)
+{
+    return fe_host_syscall(SYS_pix_cpu_table, SYSPIX_LDCTBL, cputable);
+}
+int
+pix_pci_domain(int bus, int slot, int func)
+{
+    return fe_host_syscall(SYS_pix_pci_domain, bus, slot, func);
+}
+void *
+driver_mmap(void *addr, size_t length)
+{
+    (void)addr;
+    (void)length;
+    return NULL;
+}
+uint16_t
+pci_read_config(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset)
+{
+    (void)bus;
+    (void)slot;
+    (void)func;
+    (void)offset;
+    return 0xffff;
+}
+void
+pci_write_config(uint16_t bus, uint16_t slot, uint16_t func, uint16_t offset,
+                 uint16_t data)
+{
+    (void)bus;
+    (void)slot;
+    (void)func;
+    (void)offset;
+    (void)data;
+}
+uint64_t
+pci_read_mmio(uint8_t bus, uint8_t slot, uint8_t func)
+{
+    (void)bus;
+    (void)slot;
+    (void)func;
+    return 0;
+}
+
+/*
+ * Enumerate the memory-backed devices as PCI devices
+ */
+struct pci_dev *
+pci_init(void)
+{
+    struct pci_dev *head;
+    struct pci_dev **pp;
+    int i;
+
+    head = NULL;
+    pp = &head;
+    for ( i = 0; i < bench_nports; i++ ) {
+        *pp = malloc(sizeof(struct pci_dev));
+        if ( NULL == *pp ) {
+            return NULL;
+        }
+        (*pp)->device = malloc(sizeof(struct pci_dev_conf));
+        if ( NULL == (*pp)->device ) {
+            return NULL;
+        }
+        memset((*pp)->device, 0, sizeof(struct pci_dev_conf));
+        (*pp)->device->slot = i + 1;
+        (*pp)->device->vendor_id = MEMDRV_VENDOR_ID;
+        (*pp)->device->device_id = MEMDRV_DEVICE_ID;
+        (*pp)->next = NULL;
+        pp = &(*pp)->next;
+    }
+
+    return head;
+}
+void
+pci_release(struct pci_dev *pci)
+{
+    struct pci_dev *next;
+
+    while ( NULL != pci ) {
+        next = pci->next;
+        free(pci->device);
+        free(pci);
+        pci = next;
+    }
+}
+
+/*
+ * Build a UDP/IPv4 frame
+ */
+static uint8_t *
+bench_udp4(const uint8_t *dmac, const uint8_t *smac, uint32_t saddr,
+           uint32_t daddr, int size)
+{
+    uint8_t *frame;
+    struct ether_header *eth;
+    struct ip *ip;
+    struct udphdr *udp;
+
+    frame = malloc(size);
+    if ( NULL == frame ) {
+        return NULL;
+    }
+    memset(frame, 0, size);
+    eth = (struct ether_header *)frame;
+    memcpy(eth->ether_dhost, dmac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, smac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+    ip = (struct ip *)(frame + sizeof(struct ether_header));
+    ip->ip_vhl = (IPVERSION << 4) | (sizeof(struct ip) >> 2);
+    ip->ip_len = htons(size - sizeof(struct ether_header));
+    ip->ip_ttl = 64;
+    ip->ip_p = IPPROTO_UDP;
+    ip->ip_src = htonl(saddr);
+    ip->ip_dst = htonl(daddr);
+    ip->ip_sum = _ip_cksum(ip, sizeof(struct ip));
+    udp = (struct udphdr *)(frame + sizeof(struct ether_header)
+                            + sizeof(struct ip));
+    udp->uh_sport = htons(10000 + (saddr & 0xff));
+    udp->uh_dport = htons(20000);
+    udp->uh_ulen = htons(size - sizeof(struct ether_header)
+                         - sizeof(struct ip));
+
+    return frame;
+}
+
+/*
+ * Synthetic trace of a port; in the bridging mode, BENCH_FLOWS hosts behind
+ * the port send frames to the hosts behind the next port, and in the routing
+ * mode, frames to the router are routed to the next port.  The hosts send
+ * broadcast frames instead if storm is non-zero.
+ */
+static struct memdrv_frame *
+bench_synth(struct fe *fe, enum bench_mode mode, int port, int size,
+            int storm)
+{
+    struct memdrv_frame *frames;
+    uint8_t smac[ETHER_ADDR_LEN];
+    uint8_t dmac[ETHER_ADDR_LEN];
+    int next;
+    int i;
+
+    frames = malloc(sizeof(struct memdrv_frame) * BENCH_FLOWS);
+    if ( NULL == frames ) {
+        return NULL;
+    }
+    next = (port + 1) % fe->nports;
+    for ( i = 0; i < BENCH_FLOWS; i++ ) {
+        smac[0] = 0x02;
+        smac[1] = 0x10;
+        smac[2] = 0;
+        smac[3] = port;
+        smac[4] = i >> 8;
+        smac[5] = i;
+        if ( storm ) {
+            memset(dmac, 0xff, ETHER_ADDR_LEN);
+        } else if ( BENCH_ROUTE4 == mode ) {
+            memcpy(dmac, fe->router_mac, ETHER_ADDR_LEN);
+        } else {
+            memcpy(dmac, smac, ETHER_ADDR_LEN);
+            dmac[3] = next;
+        }
+        frames[i].data = bench_udp4(dmac, smac, 0x0a000000 | (port << 16) | i,
+                                    0x0a000000 | (next << 16) | i, size);
+        if ( NULL == frames[i].data ) {
+            return NULL;
+        }
+        frames[i].len = size;
+        frames[i].vlan = 0;
+    }
+
+    return frames;
+}
+
+/*
+ * Read the frames of a pcap file
+ */
+static struct memdrv_frame *
+bench_pcap(const char *fname, uint64_t *n)
+{
+    FILE *fp;
+    uint32_t ghdr[6];
+    uint32_t rhdr[4];
+    struct memdrv_frame *frames;
+    struct memdrv_frame *nframes;
+    uint8_t *data;
+    uint64_t sz;
+
+    fp = fopen(fname, "r");
+    if ( NULL == fp ) {
+        return NULL;
+    }
+    if ( 1 != fread(ghdr, sizeof(ghdr), 1, fp)
+         || (BENCH_PCAP_MAGIC != ghdr[0] && BENCH_PCAP_MAGIC_NS != ghdr[0])
+         || 1 != ghdr[5] ) {
+        /* Only native-endian Ethernet captures */
+        fclose(fp);
+        return NULL;
+    }
+    frames = NULL;
+    sz = 0;
+    *n = 0;
+    while ( 1 == fread(rhdr, sizeof(rhdr), 1, fp) ) {
+        if ( rhdr[2] > FE_PKTSZ - FE_PKT_HDROFF ) {
+            break;
+        }
+        data = malloc(rhdr[2]);
+        if ( NULL == data || 1 != fread(data, rhdr[2], 1, fp) ) {
+            free(data);
+            break;
+        }
+        if ( rhdr[2] < sizeof(struct ether_header) ) {
+            free(data);
+            continue;
+        }
+        if ( *n == sz ) {
+            sz = sz ? sz * 2 : 1024;
+            nframes = realloc(frames, sizeof(struct memdrv_frame) * sz);
+            if ( NULL == nframes ) {
+                break;
+            }
+            frames = nframes;
+        }
+        frames[*n].data = data;
+        frames[*n].len = rhdr[2];
+        frames[*n].vlan = 0;
+        (*n)++;
+    }
+    fclose(fp);
+
+    return frames;
+}
+
+/*
+ * Replay frames at all the Rx rings
+ */
+static void
+bench_replay(struct fe *fe, uint64_t n)
+{
+    struct fe_task *t;
+    int i;
+
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        for ( i = 0; i < t->rx.n; i++ ) {
+            memdrv_rx_replay(&t->rx.rings[i]->u.mem, n);
+        }
+    }
+}
+
+/*
+ * Check if the Rx rings of a task are drained
+ */
+static int
+bench_drained(struct fe_task *t)
+{
+    int i;
+
+    for ( i = 0; i < t->rx.n; i++ ) {
+        if ( t->rx.rings[i]->u.mem.budget > 0 ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * # of frames transmitted from all the Tx rings
+ */
+static uint64_t
+bench_txpkts(struct fe *fe, uint64_t *nbytes)
+{
+    struct fe_task *t;
+    uint64_t n;
+    int i;
+
+    n = 0;
+    *nbytes = 0;
+    for ( t = fe->extasks; NULL != t; t = t->next ) {
+        for ( i = 0; i < (int)fe->nports; i++ ) {
+            n += t->tx.rings[i].u.mem.npkts;
+            *nbytes += t->tx.rings[i].u.mem.nbytes;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Exclusive task polling until its Rx rings are drained
+ */
+static void *
+bench_task(void *args)
+{
+    struct bench_task *b;
+    uint64_t tsc;
+    int nrx;
+
+    b = args;
+    while ( !bench_drained(b->t) ) {
+        tsc = fdb_rdtsc();
+        nrx = fe_fpp_poll(b->t);
+        tsc = fdb_rdtsc() - tsc;
+        if ( nrx > 0 ) {
+            if ( b->nsamples < BENCH_MAX_SAMPLES ) {
+                b->cycles[b->nsamples++] = tsc;
+            }
+            b->npkts += nrx;
+        }
+    }
+    /* Collect the remaining buffers */
+    fe_fpp_poll(b->t);
+
+    return NULL;
+}
+
+/*
+ * Tickful task
+ */
+static void *
+bench_tickful(void *args)
+{
+    fe_process(args);
+
+    return NULL;
+}
+
+/*
+ * Compare cycles
+ */
+static int
+bench_cmp(const void *a, const void *b)
+{
+    uint64_t x;
+    uint64_t y;
+
+    x = *(const uint64_t *)a;
+    y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Per-mille percentile of the sorted cycles (in nanoseconds)
+ */
+static unsigned long long
+bench_percentile(const uint64_t *cycles, uint64_t n, int pm, uint64_t hz)
+{
+    if ( 0 == n ) {
+        return 0;
+    }
+
+    return cycles[n * pm / 1000] * 1000000000ULL / hz;
+}
+
+/*
+ * Usage
+ */
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m bridge|route4] [-r pcap] [-p ports] "
+            "[-c tasks] [-n frames] [-s size] [-q] [-b] [-S pps] [-t]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Main routine
+ */
+int
+main(int argc, char *argv[])
+{
+    struct fe fe;
+    struct bench_task *b;
+    struct memdrv_frame *frames;
+    struct fe_task *t;
+    pthread_t th;
+    enum bench_mode mode;
+    const char *pcap;
+    uint64_t nframes;
+    uint64_t n;
+    uint64_t npkts;
+    uint64_t txpkts;
+    uint64_t txbytes;
+    uint64_t tx0;
+    uint64_t txb0;
+    uint64_t *cycles;
+    uint64_t hz;
+    uint64_t tsc0;
+    uint64_t tsc1;
+    uint8_t mac[ETHER_ADDR_LEN];
+    struct qos_config qcfg;
+    struct police_config pcfg;
+    uint64_t storm_pps;
+    double sec;
+    int qos;
+    int storm;
+    int track;
+    int size;
+    int ch;
+    int i;
+    int ret;
+
+    mode = BENCH_BRIDGE;
+    pcap = NULL;
+    n = 10000000;
+    size = 64;
+    qos = 0;
+    storm = 0;
+    storm_pps = 0;
+    track = 0;
+    while ( -1 != (ch = getopt(argc, argv, "m:r:p:c:n:s:qbS:t")) ) {
+        switch ( ch ) {
+        case 'm':
+            if ( 0 == strcmp("bridge", optarg) ) {
+                mode = BENCH_BRIDGE;
+            } else if ( 0 == strcmp("route4", optarg) ) {
+                mode = BENCH_ROUTE4;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            mode = BENCH_PCAP;
+            pcap = optarg;
+            break;
+        case 'p':
+            bench_nports = atoi(optarg);
+            break;
+        case 'c':
+            bench_ntasks = atoi(optarg);
+            break;
+        case 'n':
+            n = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'q':
+            qos = 1;
+            break;
+        case 'b':
+            storm = 1;
+            break;
+        case 'S':
+            storm_pps = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            track = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ( bench_nports < 1 || bench_nports > FE_MAX_PORTS || bench_ntasks < 1
+         || bench_ntasks > MEMDRV_NTXQ - 1
+         || size < (int)(sizeof(struct ether_header) + sizeof(struct ip)
+                         + sizeof(struct udphdr))
+         || size > FE_PKTSZ - FE_PKT_HDROFF ) {
+        usage(argv[0]);
+    }
+
+    /* Initialize the forwarding engine with the memory-backed devices */
+    ret = fe_init(&fe);
+    if ( ret < 0 ) {
+        fprintf(stderr, "Failed to initialize the forwarding engine.\n");
+        return EXIT_FAILURE;
+    }
+    hz = _tsc_hz();
+
+    /* Routes to the hosts behind each port */
+    if ( BENCH_ROUTE4 == mode ) {
+        for ( i = 0; i < (int)fe.nports; i++ ) {
+            mac[0] = 0x02;
+            mac[1] = 0x20;
+            mac[2] = 0;
+            mac[3] = i;
+            mac[4] = 0;
+            mac[5] = 1;
+            if ( fe_nexthop_set(&fe, i + 1, i, FE_VLAN_DEFAULT, mac) < 0
+                 || fe_route4_add(&fe, 0x0a000000 | (i << 16), 16, i + 1)
+                 < 0 ) {
+                fprintf(stderr, "Failed to add a route.\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* Unshaped Tx scheduler on every port (the class selector of the DSCP or
+       the PCP picks the class; class 0 is strict priority) */
+    if ( qos ) {
+        memset(&qcfg, 0, sizeof(struct qos_config));
+        for ( i = 0; i < 64; i++ ) {
+            qcfg.dscp[i] = i >> 3;
+        }
+        for ( i = 0; i < QOS_NCLASSES; i++ ) {
+            qcfg.pcp[i] = i;
+            qcfg.classes[i].mode = 0 == i ? QOS_STRICT : QOS_DRR;
+            qcfg.classes[i].quantum = 1514;
+        }
+        for ( i = 0; i < (int)fe.nports; i++ ) {
+            if ( fe_qos_set(&fe, i, &qcfg) < 0 ) {
+                fprintf(stderr, "Failed to configure the scheduler.\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* Storm control of broadcast and multicast on every port (not unknown
+       unicast; the hosts may not have been learned yet) */
+    if ( 0 != storm_pps ) {
+        memset(&pcfg, 0, sizeof(struct police_config));
+        pcfg.storm[POLICE_STORM_BROADCAST].pps = storm_pps;
+        pcfg.storm[POLICE_STORM_BROADCAST].burst = FE_RX_BURST;
+        pcfg.storm[POLICE_STORM_MULTICAST].pps = storm_pps;
+        pcfg.storm[POLICE_STORM_MULTICAST].burst = FE_RX_BURST;
+        for ( i = 0; i < (int)fe.nports; i++ ) {
+            if ( fe_police_set(&fe, i, &pcfg) < 0 ) {
+                fprintf(stderr, "Failed to configure storm control.\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* Connection tracking of the routed packets */
+    if ( track && fe_conntrack_enable(&fe, 1) < 0 ) {
+        fprintf(stderr, "Failed to enable connection tracking.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Traces (a broadcast storm from the first port if storm is set) */
+    for ( i = 0; i < (int)fe.nports; i++ ) {
+        if ( BENCH_PCAP == mode ) {
+            frames = bench_pcap(pcap, &nframes);
+        } else {
+            frames = bench_synth(&fe, mode, i, size, storm && 0 == i);
+            nframes = BENCH_FLOWS;
+        }
+        if ( NULL == frames || 0 == nframes ) {
+            fprintf(stderr, "Failed to build the trace.\n");
+            return EXIT_FAILURE;
+        }
+        memdrv_set_trace(fe.ports[i]->u.mem, frames, nframes);
+    }
+
+    /* Tickful task */
+    ret = pthread_create(&th, NULL, bench_tickful, &fe);
+    if ( 0 != ret ) {
+        return EXIT_FAILURE;
+    }
+
+    /* Warm up (the FDB learns the hosts, and the FIB is published) */
+    b = malloc(sizeof(struct bench_task) * bench_ntasks);
+    cycles = malloc(sizeof(uint64_t) * BENCH_MAX_SAMPLES * bench_ntasks);
+    if ( NULL == b || NULL == cycles ) {
+        return EXIT_FAILURE;
+    }
+    bench_replay(&fe, BENCH_WARMUP_FRAMES);
+    for ( t = fe.extasks; NULL != t; t = t->next ) {
+        while ( !bench_drained(t) ) {
+            fe_fpp_poll(t);
+        }
+    }
+    usleep(100000);
+    tx0 = bench_txpkts(&fe, &txb0);
+
+    /* Run the exclusive tasks */
+    bench_replay(&fe, n);
+    tsc0 = fdb_rdtsc();
+    for ( i = 0, t = fe.extasks; NULL != t; i++, t = t->next ) {
+        b[i].t = t;
+        b[i].cycles = cycles + (uint64_t)BENCH_MAX_SAMPLES * i;
+        b[i].nsamples = 0;
+        b[i].npkts = 0;
+        ret = pthread_create(&b[i].th, NULL, bench_task, &b[i]);
+        if ( 0 != ret ) {
+            return EXIT_FAILURE;
+        }
+    }
+    npkts = 0;
+    for ( i = 0; i < bench_ntasks; i++ ) {
+        pthread_join(b[i].th, NULL);
+        npkts += b[i].npkts;
+    }
+    tsc1 = fdb_rdtsc();
+    txpkts = bench_txpkts(&fe, &txbytes) - tx0;
+    txbytes -= txb0;
+
+    /* Latency of the polls (merged across the tasks) */
+    nframes = 0;
+    for ( i = 0; i < bench_ntasks; i++ ) {
+        memmove(cycles + nframes, b[i].cycles,
+                sizeof(uint64_t) * b[i].nsamples);
+        nframes += b[i].nsamples;
+    }
+    qsort(cycles, nframes, sizeof(uint64_t), bench_cmp);
+
+    if ( 0 == hz ) {
+        fprintf(stderr, "Failed to calibrate the TSC.\n");
+        return EXIT_FAILURE;
+    }
+    sec = (double)(tsc1 - tsc0) / hz;
+    printf("mode=%s ports=%d tasks=%d size=%d qos=%d storm=%d storm_pps=%llu "
+           "track=%d "
+           "rx_pkts=%llu tx_pkts=%llu "
+           "sec=%.6f rx_mpps=%.3f tx_mpps=%.3f tx_gbps=%.3f "
+           "poll_p50_ns=%llu poll_p99_ns=%llu poll_p999_ns=%llu\n",
+           BENCH_BRIDGE == mode ? "bridge"
+           : BENCH_ROUTE4 == mode ? "route4" : "pcap",
+           bench_nports, bench_ntasks, BENCH_PCAP == mode ? 0 : size, qos,
+           storm, (unsigned long long)storm_pps, track,
+           (unsigned long long)npkts, (unsigned long long)txpkts, sec,
+           npkts / sec / 1e6, txpkts / sec / 1e6, txbytes * 8 / sec / 1e9,
+           bench_percentile(cycles, nframes, 500, hz),
+           bench_percentile(cycles, nframes, 990, hz),
+           bench_percentile(cycles, nframes, 999, hz));
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
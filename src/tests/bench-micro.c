@@ -0,0 +1,678 @@
+/*_
+ * Copyright (c) 2016 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Host-side microbenchmarks of the data structures of the forwarding engine:
+ * the hopscotch hash table, the FDB, the kernel ring (across two threads),
+ * and the buffer pool.  Each case prints a line of key=value pairs with the
+ * percentiles of the cycles (TSC) per operation measured in batches.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../ids/fe/fe.h"
+
+/* # of operations per sample (amortizes the cost of reading the TSC) */
+#define BENCH_BATCH             64
+/* # of rounds of each case */
+#define BENCH_ROUNDS            8
+/* Size of the hash table (log2 of the # of buckets) */
+#define BENCH_HT_PFACTOR        16
+/* # of messages transferred through the kernel ring, and # of spins before
+   yielding the processor (to the other thread if it shares the processor) */
+#define BENCH_RING_MSGS         (1 << 20)
+#define BENCH_RING_SPINS        1024
+
+/* All benchmarks are run unless any is specified */
+#define _BENCH_SELECTED(name)   (all || _bench_selected(argc, argv, name))
+
+/*
+ * Samples of a case
+ */
+struct bench_stat {
+    uint64_t *samples;
+    uint64_t n;
+    uint64_t cap;
+    /* # of operations per sample */
+    uint64_t ops;
+    /* # of failed operations */
+    uint64_t fails;
+};
+
+/*
+ * Kernel ring benchmark shared by the producer and the consumer
+ */
+struct bench_ring {
+    struct fe_kernel_ring ring;
+    struct fe_pkt_buf_hdr *hdrs;
+    uint64_t n;
+    struct bench_stat lat;
+    uint64_t cycles;
+};
+
+static uint64_t bench_seed = 88172645463325252ULL;
+
+/*
+ * Pseudo random number (xorshift64)
+ */
+static __inline__ uint64_t
+bench_rand(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+
+    return bench_seed;
+}
+
+/*
+ * Check if a benchmark is specified in the arguments
+ */
+static int
+_bench_selected(int argc, char *argv[], const char *name)
+{
+    int i;
+
+    for ( i = 1; i < argc; i++ ) {
+        if ( 0 == strcmp(name, argv[i]) ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Initialize samples
+ */
+static int
+stat_init(struct bench_stat *st, uint64_t cap, uint64_t ops)
+{
+    st->samples = malloc(sizeof(uint64_t) * cap);
+    if ( NULL == st->samples ) {
+        return -1;
+    }
+    st->n = 0;
+    st->cap = cap;
+    st->ops = ops;
+    st->fails = 0;
+
+    return 0;
+}
+
+/*
+ * Add a sample of cycles for st->ops operations
+ */
+static __inline__ void
+stat_add(struct bench_stat *st, uint64_t cycles)
+{
+    if ( st->n < st->cap ) {
+        st->samples[st->n++] = cycles;
+    }
+}
+
+/*
+ * Compare samples
+ */
+static int
+stat_cmp(const void *a, const void *b)
+{
+    uint64_t x;
+    uint64_t y;
+
+    x = *(const uint64_t *)a;
+    y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Per-mille percentile of the sorted samples per operation
+ */
+static double
+stat_pct(struct bench_stat *st, int pm)
+{
+    return (double)st->samples[st->n * pm / 1000] / st->ops;
+}
+
+/*
+ * Print the statistics of a case as a line of key=value pairs, and release
+ * the samples
+ */
+static void
+stat_print(struct bench_stat *st, const char *bench, const char *op,
+           const char *params)
+{
+    uint64_t sum;
+    uint64_t i;
+
+    if ( 0 == st->n ) {
+        free(st->samples);
+        return;
+    }
+    qsort(st->samples, st->n, sizeof(uint64_t), stat_cmp);
+    sum = 0;
+    for ( i = 0; i < st->n; i++ ) {
+        sum += st->samples[i];
+    }
+    printf("bench=%s op=%s %s samples=%llu ops_per_sample=%llu fails=%llu "
+           "mean=%.1f p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f "
+           "unit=cycles\n", bench, op, params, (unsigned long long)st->n,
+           (unsigned long long)st->ops, (unsigned long long)st->fails,
+           (double)sum / st->n / st->ops, stat_pct(st, 500), stat_pct(st, 900),
+           stat_pct(st, 990), stat_pct(st, 999),
+           (double)st->samples[st->n - 1] / st->ops);
+    free(st->samples);
+}
+
+/*
+ * Random 8-byte keys
+ */
+static uint8_t *
+bench_keys(uint64_t n)
+{
+    uint64_t *keys;
+    uint64_t i;
+
+    keys = malloc(sizeof(uint64_t) * n);
+    if ( NULL == keys ) {
+        return NULL;
+    }
+    for ( i = 0; i < n; i++ ) {
+        keys[i] = bench_rand();
+    }
+
+    return (uint8_t *)keys;
+}
+
+/*
+ * hopscotch_insert/lookup/remove at a load factor (in percent)
+ */
+static int
+bench_hopscotch(int load)
+{
+    struct hopscotch_hash_table ht;
+    struct bench_stat ins;
+    struct bench_stat hit;
+    struct bench_stat miss;
+    struct bench_stat rem;
+    uint8_t *keys;
+    uint8_t *others;
+    uint64_t n;
+    uint64_t i;
+    uint64_t j;
+    uint64_t tsc;
+    uint64_t cap;
+    char params[64];
+    int r;
+
+    n = (1ULL << BENCH_HT_PFACTOR) * load / 100;
+    n -= n % BENCH_BATCH;
+    cap = (n / BENCH_BATCH + 1) * BENCH_ROUNDS;
+    if ( stat_init(&ins, cap, BENCH_BATCH) < 0
+         || stat_init(&hit, cap, BENCH_BATCH) < 0
+         || stat_init(&miss, cap, BENCH_BATCH) < 0
+         || stat_init(&rem, cap, BENCH_BATCH) < 0 ) {
+        return -1;
+    }
+
+    for ( r = 0; r < BENCH_ROUNDS; r++ ) {
+        keys = bench_keys(n);
+        others = bench_keys(n);
+        if ( NULL == keys || NULL == others
+             || NULL == hopscotch_init(&ht, sizeof(uint64_t))
+             || hopscotch_resize(&ht, BENCH_HT_PFACTOR - ht.pfactor) < 0 ) {
+            return -1;
+        }
+
+        /* Insert (up to the load) */
+        for ( i = 0; i + BENCH_BATCH <= n; i += BENCH_BATCH ) {
+            tsc = fdb_rdtsc();
+            for ( j = i; j < i + BENCH_BATCH; j++ ) {
+                if ( hopscotch_insert(&ht, keys + j * 8, keys + j * 8) < 0 ) {
+                    ins.fails++;
+                }
+            }
+            stat_add(&ins, fdb_rdtsc() - tsc);
+        }
+        /* Successful and unsuccessful lookup in random order */
+        for ( i = 0; i + BENCH_BATCH <= n; i += BENCH_BATCH ) {
+            tsc = fdb_rdtsc();
+            for ( j = 0; j < BENCH_BATCH; j++ ) {
+                if ( NULL == hopscotch_lookup(&ht,
+                                              keys + bench_rand() % n * 8) ) {
+                    hit.fails++;
+                }
+            }
+            stat_add(&hit, fdb_rdtsc() - tsc);
+            tsc = fdb_rdtsc();
+            for ( j = i; j < i + BENCH_BATCH; j++ ) {
+                if ( NULL != hopscotch_lookup(&ht, others + j * 8) ) {
+                    miss.fails++;
+                }
+            }
+            stat_add(&miss, fdb_rdtsc() - tsc);
+        }
+        /* Remove */
+        for ( i = 0; i + BENCH_BATCH <= n; i += BENCH_BATCH ) {
+            tsc = fdb_rdtsc();
+            for ( j = i; j < i + BENCH_BATCH; j++ ) {
+                if ( NULL == hopscotch_remove(&ht, keys + j * 8) ) {
+                    rem.fails++;
+                }
+            }
+            stat_add(&rem, fdb_rdtsc() - tsc);
+        }
+
+        hopscotch_release(&ht);
+        free(keys);
+        free(others);
+    }
+
+    snprintf(params, sizeof(params), "buckets=%llu load=%d",
+             1ULL << BENCH_HT_PFACTOR, load);
+    stat_print(&ins, "hopscotch", "insert", params);
+    stat_print(&hit, "hopscotch", "lookup_hit", params);
+    stat_print(&miss, "hopscotch", "lookup_miss", params);
+    stat_print(&rem, "hopscotch", "remove", params);
+
+    return 0;
+}
+
+/*
+ * fdb_update (new and refreshed entries), fdb_lookup, and fdb_gc (with no
+ * and all entries expired) with n entries; the entries failed to be learned
+ * are counted, and neither refreshed nor looked up
+ */
+static int
+bench_fdb(int n)
+{
+    struct fdb *fdb;
+    struct fdb_entry *e;
+    struct bench_stat add;
+    struct bench_stat upd;
+    struct bench_stat lkup;
+    struct bench_stat gc;
+    struct bench_stat gcx;
+    uint8_t *keys;
+    uint8_t key[FDB_KEY_SIZE];
+    uint64_t tsc;
+    uint64_t cap;
+    char params[64];
+    int batch;
+    int nl;
+    int i;
+    int j;
+    int r;
+
+    batch = n < BENCH_BATCH ? n : BENCH_BATCH;
+    cap = (n / batch + 1) * BENCH_ROUNDS;
+    if ( stat_init(&add, cap, batch) < 0 || stat_init(&upd, cap, batch) < 0
+         || stat_init(&lkup, cap, batch) < 0
+         || stat_init(&gc, BENCH_ROUNDS, 1) < 0
+         || stat_init(&gcx, BENCH_ROUNDS, 1) < 0 ) {
+        return -1;
+    }
+
+    for ( r = 0; r < BENCH_ROUNDS; r++ ) {
+        keys = bench_keys(n);
+        fdb = fdb_init();
+        if ( NULL == keys || NULL == fdb ) {
+            return -1;
+        }
+        /* MAC addresses of VLAN 1 */
+        for ( i = 0; i < n; i++ ) {
+            fdb_key(keys + i * 8, keys + i * 8, FE_VLAN_DEFAULT);
+        }
+
+        /* Learn new addresses; the learned ones are moved to the front */
+        nl = 0;
+        for ( i = 0; i + batch <= n; i += batch ) {
+            tsc = fdb_rdtsc();
+            for ( j = i; j < i + batch; j++ ) {
+                if ( fdb_update(fdb, keys + j * 8, j & 0x3f) < 0 ) {
+                    add.fails++;
+                    continue;
+                }
+                memmove(keys + nl * 8, keys + j * 8, 8);
+                nl++;
+            }
+            stat_add(&add, fdb_rdtsc() - tsc);
+        }
+        /* Refresh the learned addresses, and look them up (hits only) */
+        for ( i = 0; nl > 0 && i + batch <= n; i += batch ) {
+            tsc = fdb_rdtsc();
+            for ( j = 0; j < batch; j++ ) {
+                memcpy(key, keys + bench_rand() % nl * 8, FDB_KEY_SIZE);
+                if ( fdb_update(fdb, key, 0) < 0 ) {
+                    upd.fails++;
+                }
+            }
+            stat_add(&upd, fdb_rdtsc() - tsc);
+            tsc = fdb_rdtsc();
+            for ( j = 0; j < batch; j++ ) {
+                if ( NULL == fdb_lookup(fdb, keys + bench_rand() % nl * 8) ) {
+                    lkup.fails++;
+                }
+            }
+            stat_add(&lkup, fdb_rdtsc() - tsc);
+        }
+
+        /* Garbage collection scanning the live entries */
+        tsc = fdb_rdtsc();
+        fdb_gc(fdb);
+        stat_add(&gc, fdb_rdtsc() - tsc);
+        /* Garbage collection removing all the entries */
+        for ( e = fdb->entries; NULL != e; e = e->next ) {
+            e->aging = 0;
+        }
+        tsc = fdb_rdtsc();
+        fdb_gc(fdb);
+        stat_add(&gcx, fdb_rdtsc() - tsc);
+
+        fdb_release(fdb);
+        free(keys);
+    }
+
+    snprintf(params, sizeof(params), "entries=%d", n);
+    stat_print(&add, "fdb", "update_new", params);
+    stat_print(&upd, "fdb", "update_refresh", params);
+    stat_print(&lkup, "fdb", "lookup", params);
+    stat_print(&gc, "fdb", "gc_live", params);
+    stat_print(&gcx, "fdb", "gc_expired", params);
+
+    return 0;
+}
+
+/*
+ * Bind the calling thread to a processor (if it exists)
+ */
+static void
+bench_bind(int cpu)
+{
+    cpu_set_t set;
+
+    if ( cpu < sysconf(_SC_NPROCESSORS_ONLN) ) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        (void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+}
+
+/*
+ * Wait for the other thread
+ */
+static __inline__ void
+bench_spin(int *spins)
+{
+    if ( ++(*spins) < BENCH_RING_SPINS ) {
+        __asm__ __volatile__ ("pause");
+    } else {
+        sched_yield();
+        *spins = 0;
+    }
+}
+
+/*
+ * Producer of the kernel ring (exclusive task); the TSC at the enqueue is
+ * carried in the descriptor
+ */
+static void *
+bench_ring_producer(void *args)
+{
+    struct bench_ring *b;
+    struct fe_pkt_buf_hdr *hdr;
+    uint64_t i;
+    int spins;
+
+    b = args;
+    bench_bind(1);
+    spins = 0;
+    for ( i = 0; i < b->n; i++ ) {
+        while ( fe_kernel_tx_enqueue(&b->ring, 0, (void *)fdb_rdtsc(),
+                                     &b->hdrs[i % b->ring.len], 64, 0)
+                <= 0 ) {
+            /* Full until the buffers released by the consumer are
+               collected */
+            if ( fe_kernel_collect_buffer(&b->ring, (void **)&hdr) <= 0 ) {
+                bench_spin(&spins);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Consumer of the kernel ring (tickful task)
+ */
+static void *
+bench_ring_consumer(void *args)
+{
+    struct bench_ring *b;
+    struct fe_pkt_buf_hdr *hdr;
+    struct fe_kernel_desc desc;
+    void *pkt;
+    uint64_t tsc0;
+    uint64_t i;
+    int spins;
+
+    b = args;
+    bench_bind(0);
+    tsc0 = 0;
+    spins = 0;
+    for ( i = 0; i < b->n; i++ ) {
+        while ( fe_kernel_rx_dequeue(&b->ring, &hdr, &pkt, &desc) < 0 ) {
+            bench_spin(&spins);
+        }
+        if ( 0 == i ) {
+            tsc0 = fdb_rdtsc();
+        }
+        stat_add(&b->lat, fdb_rdtsc() - (uint64_t)pkt);
+        fe_kernel_rx_release(&b->ring);
+    }
+    b->cycles = fdb_rdtsc() - tsc0;
+
+    return NULL;
+}
+
+/*
+ * Enqueue/dequeue of the kernel ring across two threads (on different
+ * processors if available)
+ */
+static int
+bench_kernel_ring(int qlen)
+{
+    struct bench_ring b;
+    struct bench_stat xfer;
+    pthread_t prod;
+    pthread_t cons;
+    char params[64];
+
+    memset(&b.ring, 0, sizeof(struct fe_kernel_ring));
+    b.ring.len = qlen;
+    b.ring.descs = malloc(sizeof(struct fe_kernel_desc) * qlen);
+    b.ring.bufs = malloc(sizeof(struct fe_pkt_buf_hdr *) * qlen);
+    b.hdrs = malloc(sizeof(struct fe_pkt_buf_hdr) * qlen);
+    b.n = BENCH_RING_MSGS;
+    if ( NULL == b.ring.descs || NULL == b.ring.bufs || NULL == b.hdrs
+         || stat_init(&b.lat, b.n, 1) < 0
+         || stat_init(&xfer, 1, b.n - 1) < 0 ) {
+        return -1;
+    }
+
+    if ( 0 != pthread_create(&cons, NULL, bench_ring_consumer, &b)
+         || 0 != pthread_create(&prod, NULL, bench_ring_producer, &b) ) {
+        return -1;
+    }
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    stat_add(&xfer, b.cycles);
+
+    snprintf(params, sizeof(params), "qlen=%d", qlen);
+    stat_print(&b.lat, "kernel_ring", "latency", params);
+    stat_print(&xfer, "kernel_ring", "throughput", params);
+    free(b.ring.descs);
+    free(b.ring.bufs);
+    free(b.hdrs);
+
+    return 0;
+}
+
+/*
+ * fe_get_buffer/fe_release_buffer one at a time, and in bursts of
+ * BENCH_BATCH buffers
+ */
+static int
+bench_buffer_pool(void)
+{
+    struct fe_task t;
+    struct fe_pkt_buf_hdr *hdrs[BENCH_BATCH];
+    struct bench_stat pair;
+    struct bench_stat get;
+    struct bench_stat rel;
+    uint8_t *pool;
+    uint64_t tsc;
+    int i;
+    int j;
+
+    pool = malloc((size_t)FE_PKTSZ * FE_BUFFER_POOL_SIZE);
+    if ( NULL == pool ) {
+        return -1;
+    }
+    t.pool.head = NULL;
+    for ( i = 0; i < FE_BUFFER_POOL_SIZE; i++ ) {
+        fe_release_buffer(&t, (struct fe_pkt_buf_hdr *)(pool + (size_t)i
+                                                        * FE_PKTSZ));
+    }
+
+    if ( stat_init(&pair, 1 << 16, BENCH_BATCH) < 0
+         || stat_init(&get, 1 << 16, BENCH_BATCH) < 0
+         || stat_init(&rel, 1 << 16, BENCH_BATCH) < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 1 << 16; i++ ) {
+        /* A buffer is taken and returned (e.g., Rx refill and Tx collection
+           of a packet) */
+        tsc = fdb_rdtsc();
+        for ( j = 0; j < BENCH_BATCH; j++ ) {
+            hdrs[0] = fe_get_buffer(&t);
+            fe_release_buffer(&t, hdrs[0]);
+        }
+        stat_add(&pair, fdb_rdtsc() - tsc);
+
+        /* Burst */
+        tsc = fdb_rdtsc();
+        for ( j = 0; j < BENCH_BATCH; j++ ) {
+            hdrs[j] = fe_get_buffer(&t);
+        }
+        stat_add(&get, fdb_rdtsc() - tsc);
+        tsc = fdb_rdtsc();
+        for ( j = BENCH_BATCH - 1; j >= 0; j-- ) {
+            fe_release_buffer(&t, hdrs[j]);
+        }
+        stat_add(&rel, fdb_rdtsc() - tsc);
+
+        /* Rotate the pool so that the next round touches other buffers */
+        hdrs[0] = fe_get_buffer(&t);
+        for ( j = 0; j < i % BENCH_BATCH; j++ ) {
+            hdrs[1] = fe_get_buffer(&t);
+            fe_release_buffer(&t, hdrs[1]);
+        }
+        fe_release_buffer(&t, hdrs[0]);
+    }
+    stat_print(&pair, "buffer_pool", "get_release", "burst=1");
+    stat_print(&get, "buffer_pool", "get", "burst=64");
+    stat_print(&rel, "buffer_pool", "release", "burst=64");
+    free(pool);
+
+    return 0;
+}
+
+/*
+ * Usage
+ */
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [hopscotch|fdb|ring|pool ...]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Main routine; runs the specified (or all) benchmarks
+ */
+int
+main(int argc, char *argv[])
+{
+    static const int loads[] = { 10, 25, 50, 75, 90 };
+    static const int scales[] = { 64, 256, 1024, FDB_MAX_ENTRIES };
+    static const int qlens[] = { 64, FE_QLEN };
+    int all;
+    int ret;
+    int i;
+
+    all = argc < 2;
+    ret = 0;
+    for ( i = 1; i < argc; i++ ) {
+        if ( 0 != strcmp("hopscotch", argv[i]) && 0 != strcmp("fdb", argv[i])
+             && 0 != strcmp("ring", argv[i]) && 0 != strcmp("pool", argv[i]) ) {
+            usage(argv[0]);
+        }
+    }
+
+    if ( _BENCH_SELECTED("hopscotch") ) {
+        for ( i = 0; i < (int)(sizeof(loads) / sizeof(loads[0])); i++ ) {
+            ret |= bench_hopscotch(loads[i]);
+        }
+    }
+    if ( _BENCH_SELECTED("fdb") ) {
+        for ( i = 0; i < (int)(sizeof(scales) / sizeof(scales[0])); i++ ) {
+            ret |= bench_fdb(scales[i]);
+        }
+    }
+    if ( _BENCH_SELECTED("ring") ) {
+        for ( i = 0; i < (int)(sizeof(qlens) / sizeof(qlens[0])); i++ ) {
+            ret |= bench_kernel_ring(qlens[i]);
+        }
+    }
+    if ( _BENCH_SELECTED("pool") ) {
+        ret |= bench_buffer_pool();
+    }
+
+    return ret < 0 ? EXIT_FAILURE : 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */